@@ -746,7 +746,9 @@ static InlineX void ZYWRLE_YUVRGB(int* pBuf, PIXEL_T* data, int width, int heigh
 #endif
 
 #ifdef ZYWRLE_ENCODE
-PIXEL_T* ZYWRLE_ANALYZE(PIXEL_T* dst, PIXEL_T* src, int w, int h, int scanline, int level, int* pBuf) {
+/* wavelet gives what Wavelet() gives, see libvncserver/zywrlescantemplate.c */
+PIXEL_T* ZYWRLE_ANALYZE(PIXEL_T* dst, PIXEL_T* src, int w, int h, int scanline, int level, int* pBuf,
+                        void (*wavelet)(int*, int, int, int, const signed char* (*)[3])) {
 	int l;
 	int uw = w;
 	int uh = h;
@@ -767,7 +769,7 @@ PIXEL_T* ZYWRLE_ANALYZE(PIXEL_T* dst, PIXEL_T* src, int w, int h, int scanline,
 	pData = dst;
 	ZYWRLE_LOAD_UNALIGN(src,*(PIXEL_T*)pTop=*pData;)
 	ZYWRLE_RGBYUV(pBuf, src, w, h, scanline);
-	Wavelet(pBuf, w, h, level);
+	wavelet(pBuf, w, h, level, zywrleParam[level-1]);
 	for (l = 0; l < level; l++) {
 		ZYWRLE_PACK_COEFF(pBuf, dst, 3, w, h, scanline, l);
 		ZYWRLE_PACK_COEFF(pBuf, dst, 2, w, h, scanline, l);
@@ -0,0 +1,386 @@
+/*
+ * adapt.c
+ *
+ * Encoding controller. When rfbScreenInfo.adaptEncoding is set, every rect
+ * of an update gets its own encoding, zlib level and JPEG quality instead of
+ * the first encoding the client listed and the levels it asked for.
+ *
+ * Two things drive the choice:
+ *
+ * - The pressure on the client link, from 0 when it keeps up to
+ *   RFB_ADAPT_LEVELS - 1. Every push is timed; a pusher that blocks on a
+ *   full socket shows up as time spent inside it. Each period the bytes
+ *   pushed and the share of time blocked are smoothed, a link that blocks
+ *   or carries more than rfbScreenInfo.adaptRateLimit gets one level more,
+ *   one that stays calm for a while one level less. Pushers that queue
+ *   instead of blocking never show time spent, hosts using them report
+ *   what is queued with rfbClientBacklog(), over half of
+ *   rfbScreenInfo.maxClientBacklog counts as blocked, or set adaptRateLimit.
+ *
+ * - The content of the rect, from a grid of samples: solid, a few colours
+ *   as for text and widgets, or many colours as for pictures.
+ *
+ * Low pressure favours cheap encoders and levels, high pressure spends CPU
+ * on ZRLE and Tight, higher zlib levels and lower JPEG quality. Only encodings the
+ * client listed in SetEncodings are picked, JPEG only when it sent a
+ * quality level, and never a better quality than it asked for.
+ *
+ * Picks are made while the rects of the update are counted and replayed
+ * while they are sent, so the count in the header always matches what the
+ * encoders produce. The client settings are put back after every update.
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#include <stdlib.h>
+#include <time.h>
+#include <rfb/rfbproto.h>
+
+#define ADAPT_PERIOD      250000   /* usec between pressure updates */
+#define ADAPT_CALM        4        /* Calm periods before easing off */
+#define ADAPT_BLOCKED_HI  250      /* Per mille in the pusher that means congested */
+#define ADAPT_BLOCKED_LO  50
+#define ADAPT_GRID        16       /* Samples per side when classifying */
+#define ADAPT_FEW_COLOURS 24
+
+enum
+{ ADAPT_SOLID
+, ADAPT_FEW
+, ADAPT_PHOTO
+, ADAPT_CLASSES
+};
+
+#define ADAPT_CHOICES 5
+
+/* Encodings tried in order, per content class, for low and high pressure.
+   When the client allows JPEG, Tight goes first for pictures, and under
+   pressure for anything but solid areas. */
+static const int adaptOrder[ ADAPT_CLASSES ][ 2 ][ ADAPT_CHOICES ]=
+{{{ rfbEncodingTight,   rfbEncodingRRE,     rfbEncodingHextile, rfbEncodingZRLE,  -1 }
+ ,{ rfbEncodingTight,   rfbEncodingRRE,     rfbEncodingZRLE,    rfbEncodingHextile, -1 }}
+,{{ rfbEncodingHextile, rfbEncodingZRLE,    rfbEncodingTight,   rfbEncodingZlib,  -1 }
+ ,{ rfbEncodingZRLE,    rfbEncodingTight,   rfbEncodingHextile, rfbEncodingZlib,  -1 }}
+,{{ rfbEncodingZRLE,    rfbEncodingTight,   rfbEncodingZlib,    -1,               -1 }
+ ,{ rfbEncodingZRLE,    rfbEncodingTight,   rfbEncodingZlib,    -1,               -1 }}
+};
+
+static const int adaptZlibLevel [ RFB_ADAPT_LEVELS ]= { 1, 3, 6, 9 };
+static const int adaptTightLevel[ RFB_ADAPT_LEVELS ]= { 1, 1, 2, 9 };
+static const int adaptQuality   [ RFB_ADAPT_LEVELS ]= { 100, 80, 60, 40 };
+
+static uint64_t rfbAdaptNow( void )
+{ struct timespec ts;
+
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return( (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000 );
+}
+
+/**
+ *  Bit of rfbAdaptState.encodings standing for encoding, 0 for the ones never
+ * picked or not built in.
+ */
+static uint32_t rfbAdaptBit( int encoding )
+{ switch( encoding )
+  { case rfbEncodingRaw:     return( 1 << 0 );
+    case rfbEncodingRRE:     return( 1 << 1 );
+    case rfbEncodingHextile: return( 1 << 2 );
+#ifdef HAVE_LIBZ
+    case rfbEncodingZlib:    return( 1 << 3 );
+    case rfbEncodingZRLE:    return( 1 << 4 );
+#ifdef HAVE_LIBJPEG
+    case rfbEncodingTight:   return( 1 << 5 );
+#endif
+#endif
+  }
+
+  return( 0 );
+}
+
+void rfbAdaptStart( rfbClient * cl )
+{ cl->adapt.encodings  = 0;
+  cl->adapt.pressure   = 1;      /* Until something is measured */
+  cl->adapt.calm       = 0;
+  cl->adapt.rate       = 0;
+  cl->adapt.blocked    = 0;
+  cl->adapt.periodStart= 0;
+  cl->adapt.periodBytes= 0;
+  cl->adapt.periodBlocked= 0;
+  cl->adapt.active     = FALSE;
+  cl->adapt.pick       = NULL;
+  cl->adapt.picks      = cl->adapt.pickSize= 0;
+}
+
+/**
+ *  Called for every encoding of a SetEncodings message
+ */
+void rfbAdaptListEncoding( rfbClient * cl, int encoding )
+{ cl->adapt.encodings |= rfbAdaptBit( encoding );
+}
+
+/**
+ *  Start time of a push, 0 when the screen does not adapt
+ */
+uint64_t rfbAdaptClock( rfbClient * cl )
+{ return( cl->screen->adaptEncoding ? rfbAdaptNow() : 0 );
+}
+
+/**
+ *  Closes the period when it is over and moves the pressure
+ */
+static void rfbAdaptPeriod( rfbClient * cl, uint64_t now )
+{ rfbAdaptState * a= &cl->adapt;
+  unsigned long limit= cl->screen->adaptRateLimit;
+  size_t backlog= cl->screen->maxClientBacklog / 2;
+  rfbBool queued= backlog && cl->backlog > backlog;
+  uint64_t elapsed= now - a->periodStart;
+
+  if ( !a->periodStart )
+  { a->periodStart= now;
+    return;
+  }
+
+  if ( elapsed < ADAPT_PERIOD )
+  { return;
+  }
+
+  a->rate   = ( a->rate * 3 + (unsigned long)( a->periodBytes * 1000000ULL / elapsed )) / 4;
+  a->blocked= ( a->blocked * 3 + (int)( a->periodBlocked * 1000 / elapsed )) / 4;
+
+  if ( a->blocked > ADAPT_BLOCKED_HI
+    || queued
+    || ( limit && a->rate > limit ))
+  { a->calm= 0;
+    if ( a->pressure < RFB_ADAPT_LEVELS - 1 )
+    { a->pressure++;
+  } }
+
+  else if ( a->blocked < ADAPT_BLOCKED_LO
+         && ( !backlog || cl->backlog <= backlog / 2 )
+         && ( !limit || a->rate < limit / 2 ))
+  { if ( ++a->calm >= ADAPT_CALM && a->pressure > 0 )
+    { a->pressure--;
+      a->calm= 0;
+  } }
+
+  else
+  { a->calm= 0;
+  }
+
+  a->periodStart  = now;
+  a->periodBytes  = 0;
+  a->periodBlocked= 0;
+}
+
+/**
+ *  Accounts sz bytes pushed from start on
+ */
+void rfbAdaptPushed( rfbClient * cl, size_t sz, uint64_t start )
+{ uint64_t now;
+
+  if ( !start )
+  { return;
+  }
+
+  now= rfbAdaptNow();
+  cl->adapt.periodBytes  += sz;
+  cl->adapt.periodBlocked+= now - start;
+  rfbAdaptPeriod( cl, now );
+}
+
+/**
+ *  Saves the client settings before picks override them and makes room
+ * for rects picks, FALSE when the screen does not adapt.
+ */
+rfbBool rfbAdaptBegin( rfbClient * cl, int rects )
+{ rfbAdaptState * a= &cl->adapt;
+
+  if ( !cl->screen->adaptEncoding )
+  { return( FALSE );
+  }
+
+  if ( rects > a->pickSize )
+  { rfbAdaptPick * grown= (rfbAdaptPick *)realloc( a->pick, rects * sizeof( *grown ));
+
+    if ( !grown )                  /* Send with the client settings */
+    { return( FALSE );
+    }
+    a->pick    = grown;
+    a->pickSize= rects;
+  }
+
+  rfbAdaptPeriod( cl, rfbAdaptNow());
+
+  a->active           = TRUE;
+  a->picks            = 0;
+  a->preferredEncoding= cl->preferredEncoding;
+#ifdef HAVE_LIBZ
+  a->zlibCompressLevel= cl->zlibCompressLevel;
+#ifdef HAVE_LIBJPEG
+  a->compressLevel    = cl->tightCompressLevel;
+  a->qualityLevel     = cl->turboQualityLevel;
+#endif
+#endif
+
+  return( TRUE );
+}
+
+/**
+ *  Content class of the rect from a grid of samples
+ */
+static int rfbAdaptClassify( rfbClient * cl, int x, int y, int w, int h )
+{ ScreenAtom * atom= cl->scaledScreen;
+  int bpp= atom->bitsPerPixel / 8;
+  int nx= w < ADAPT_GRID ? w : ADAPT_GRID;
+  int ny= h < ADAPT_GRID ? h : ADAPT_GRID;
+  uint32_t seen[ ADAPT_FEW_COLOURS ];
+  int colours= 0, i, j, k;
+
+  if ( bpp != 1 && bpp != 2 && bpp != 4 )
+  { return( ADAPT_FEW );
+  }
+
+  for( j= 0; j < ny; j++ )
+  { const char * row= atom->frameBuffer
+                    + ( y + j * h / ny ) * atom->paddedWidthInBytes;
+
+    for( i= 0; i < nx; i++ )
+    { const char * p= row + ( x + i * w / nx ) * bpp;
+      uint32_t c= bpp == 4 ? *(const uint32_t *)p
+                : bpp == 2 ? *(const uint16_t *)p
+                :            *(const uint8_t  *)p;
+
+      for( k= 0; k < colours && seen[ k ] != c; k++ );
+
+      if ( k == colours )
+      { if ( colours == ADAPT_FEW_COLOURS )
+        { return( ADAPT_PHOTO );
+        }
+        seen[ colours++ ]= c;
+  } } }
+
+  return( colours == 1 ? ADAPT_SOLID : ADAPT_FEW );
+}
+
+/**
+ *  Sets the client up as the pick says, levels of the other encodings stay
+ * as the client asked.
+ */
+static void rfbAdaptUse( rfbClient * cl, const rfbAdaptPick * pick )
+{ rfbAdaptState * a= &cl->adapt;
+
+  cl->preferredEncoding= pick->encoding;
+
+#ifdef HAVE_LIBZ
+  cl->zlibCompressLevel= pick->encoding == rfbEncodingZlib
+                       ? pick->compressLevel : a->zlibCompressLevel;
+
+#ifdef HAVE_LIBJPEG
+  if ( pick->encoding == rfbEncodingTight )
+  { cl->tightCompressLevel= pick->compressLevel;
+    cl->turboQualityLevel = pick->qualityLevel;
+  }
+  else
+  { cl->tightCompressLevel= a->compressLevel;
+    cl->turboQualityLevel = a->qualityLevel;
+  }
+#endif
+#endif
+}
+
+/**
+ *  Picks encoding and levels for the next rect of the update and sets the
+ * client up for it. Rects are given in the order they will be sent.
+ */
+void rfbAdaptRect( rfbClient * cl, int x, int y, int w, int h )
+{ rfbAdaptState * a= &cl->adapt;
+  int order= a->pressure > 0;
+  rfbAdaptPick * pick;
+  int content, k;
+
+  if ( !a->active || a->picks == a->pickSize )
+  { return;
+  }
+
+  content= rfbAdaptClassify( cl, x, y, w, h );
+  pick= a->pick + a->picks++;
+  pick->encoding     = a->preferredEncoding;
+  pick->compressLevel= 0;
+  pick->qualityLevel = -1;
+
+#if defined(HAVE_LIBZ) && defined(HAVE_LIBJPEG)
+  pick->qualityLevel= a->qualityLevel;
+
+  if (( content == ADAPT_PHOTO || ( content == ADAPT_FEW && order ))
+    && a->qualityLevel != -1
+    && ( a->encodings & rfbAdaptBit( rfbEncodingTight )))
+  { pick->encoding= rfbEncodingTight;
+  }
+  else
+#endif
+  { for( k= 0
+       ; k < ADAPT_CHOICES && adaptOrder[ content ][ order ][ k ] != -1
+       ; k++ )
+    { if ( a->encodings & rfbAdaptBit( adaptOrder[ content ][ order ][ k ] ))
+      { pick->encoding= adaptOrder[ content ][ order ][ k ];
+        break;
+  } } }
+
+#ifdef HAVE_LIBZ
+  if ( pick->encoding == rfbEncodingZlib )
+  { pick->compressLevel= adaptZlibLevel[ a->pressure ];
+  }
+
+#ifdef HAVE_LIBJPEG
+  if ( pick->encoding == rfbEncodingTight )
+  { pick->compressLevel= adaptTightLevel[ a->pressure ];
+
+    if ( pick->qualityLevel > adaptQuality[ a->pressure ])
+    { pick->qualityLevel= adaptQuality[ a->pressure ];
+  } }
+#endif
+#endif
+
+  rfbAdaptUse( cl, pick );
+}
+
+/**
+ *  Sets the client up for rect n of the update, as picked while counting
+ */
+void rfbAdaptApply( rfbClient * cl, int n )
+{ if ( cl->adapt.active && n < cl->adapt.picks )
+  { rfbAdaptUse( cl, cl->adapt.pick + n );
+} }
+
+/**
+ *  Puts the client settings back once the update is sent
+ */
+void rfbAdaptEnd( rfbClient * cl )
+{ rfbAdaptState * a= &cl->adapt;
+
+  cl->preferredEncoding= a->preferredEncoding;
+#ifdef HAVE_LIBZ
+  cl->zlibCompressLevel= a->zlibCompressLevel;
+#ifdef HAVE_LIBJPEG
+  cl->tightCompressLevel= a->compressLevel;
+  cl->turboQualityLevel = a->qualityLevel;
+#endif
+#endif
+
+  a->active= FALSE;
+  a->picks = 0;
+}
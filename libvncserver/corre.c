@@ -131,7 +131,7 @@ static rfbBool rfbSendSmallRectEncodingCoRRE( rfbClient * cl
                            , sz_rfbFramebufferUpdateRectHeader + w * h * (cl->format.bitsPerPixel / 8));
 
   if (cl->ublen + sz_rfbFramebufferUpdateRectHeader + sz_rfbRREHeader
-      > UPDATE_BUF_SIZE)
+      > cl->ubsize)
   { if (!rfbSendUpdateBuf(cl))
     { return FALSE; }
   }
@@ -154,7 +154,7 @@ static rfbBool rfbSendSmallRectEncodingCoRRE( rfbClient * cl
   for (i = 0; i < cl->afterEncBufLen;)
   {
 
-    int bytesToCopy = UPDATE_BUF_SIZE - cl->ublen;
+    int bytesToCopy = cl->ubsize - cl->ublen;
 
     if (i + bytesToCopy > cl->afterEncBufLen)
     { bytesToCopy = cl->afterEncBufLen - i;
@@ -165,7 +165,7 @@ static rfbBool rfbSendSmallRectEncodingCoRRE( rfbClient * cl
     cl->ublen += bytesToCopy;
     i += bytesToCopy;
 
-    if (cl->ublen == UPDATE_BUF_SIZE)
+    if (cl->ublen == cl->ubsize)
     { if (!rfbSendUpdateBuf(cl))
       { return FALSE;
   } } }
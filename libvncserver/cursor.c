@@ -74,7 +74,7 @@ rfbBool rfbSendCursorShape(rfbClient * cl)
   }
 
   if ( !pCursor )
-  { if (cl->ublen + sz_rfbFramebufferUpdateRectHeader > UPDATE_BUF_SIZE )
+  { if (cl->ublen + sz_rfbFramebufferUpdateRectHeader > cl->ubsize )
     { if (!rfbSendUpdateBuf(cl))
       { return FALSE; }
     }
@@ -101,13 +101,13 @@ rfbBool rfbSendCursorShape(rfbClient * cl)
   /* Send buffer contents if needed. */
 
   if ( cl->ublen + sz_rfbFramebufferUpdateRectHeader +
-       sz_rfbXCursorColors + maskBytes + dataBytes > UPDATE_BUF_SIZE )
+       sz_rfbXCursorColors + maskBytes + dataBytes > cl->ubsize )
   { if (!rfbSendUpdateBuf(cl))
     { return FALSE; }
   }
 
   if ( cl->ublen + sz_rfbFramebufferUpdateRectHeader +
-       sz_rfbXCursorColors + maskBytes + dataBytes > UPDATE_BUF_SIZE )
+       sz_rfbXCursorColors + maskBytes + dataBytes > cl->ubsize )
   { return FALSE;   /* FIXME. */
   }
 
@@ -187,7 +187,7 @@ rfbBool rfbSendCursorShape(rfbClient * cl)
 rfbBool rfbSendCursorPos(rfbClient * cl)
 { rfbFramebufferUpdateRectHeader rect;
 
-  if (cl->ublen + sz_rfbFramebufferUpdateRectHeader > UPDATE_BUF_SIZE)
+  if (cl->ublen + sz_rfbFramebufferUpdateRectHeader > cl->ubsize)
   { if (!rfbSendUpdateBuf(cl))
     { return FALSE; }
   }
@@ -770,16 +770,13 @@ static void rfbPrintXCursor( rfbCursorPtr cursor )
 
 void rfbSetCursor( rfbScreenInfo * rfbScreen
                  , rfbCursorPtr c)
-{ rfbClientIteratorPtr iterator;
+{ rfbClientIteratorRec iterator;
   rfbClient * cl;
 
   if(rfbScreen->cursor)
-  { iterator= rfbGetClientIterator( &rfbScreen->window );
-
-    while((cl=rfbClientIteratorNext(iterator)))
+  { rfbForEachClient( iterator, &rfbScreen->window, cl )
       if(!cl->enableCursorShapeUpdates)
       { rfbRedrawAfterHideCursor(cl,NULL); }
-    rfbReleaseClientIterator(iterator);
 
     if(rfbScreen->cursor->cleanup)
     { rfbFreeCursor(rfbScreen->cursor);
@@ -787,14 +784,13 @@ void rfbSetCursor( rfbScreenInfo * rfbScreen
 
   rfbScreen->cursor = c;
 
-  iterator=rfbGetClientIterator( &rfbScreen->window );
-  while((cl=rfbClientIteratorNext(iterator)))
+  rfbForEachClient( iterator, &rfbScreen->window, cl )
   { cl->cursorWasChanged = TRUE;
 
     if(!cl->enableCursorShapeUpdates)
     { rfbRedrawAfterHideCursor(cl,NULL);
   } }
 
-  rfbReleaseClientIterator(iterator);
+  rfbWakeClients( &rfbScreen->window );
 }
 
@@ -0,0 +1,568 @@
+/*
+ * damage.c
+ *
+ * Tiled damage tracking. When ScreenAtom.damageTileShift is set, marking a
+ * rect as modified only stamps the tiles it touches with the current
+ * damage generation instead of merging a region into every client. Each
+ * client remembers the generation it last looked at and turns the tiles
+ * stamped after it into modifiedRegion when an update is built, so marking
+ * costs the same whatever the number of clients and a single pixel is one
+ * store.
+ *
+ * Marks are rounded out to whole tiles, small tiles track fine drawing more
+ * closely, big ones make for cheaper scans.
+ *
+ * With ScreenAtom.damageDiff also set, marks only flag tiles as suspect.
+ * Before damage is collected the suspect tiles are compared with a shadow
+ * copy of the framebuffer and only those that really differ get stamped,
+ * so producers marking the whole screen do not make every encoder redo
+ * identical pixels.
+ *
+ * ScreenAtom.damageScroll, on top of damageDiff, looks for content that
+ * moved up or down before comparing. Rows of the suspect area are hashed
+ * in the shadow and in the framebuffer, a tile column at a time, matching
+ * rows vote for a displacement and the runs of rows that moved by the
+ * winning one are scheduled as a CopyRect.
+ *
+ * Threads other than the one running the library hand their damage to
+ * rfbQueueRectAsModified(). It goes into a bounded lock-free queue per
+ * ScreenAtom, each slot carrying a sequence number producers claim it by
+ * and publish it with, and is merged as ordinary marks when the next pass
+ * starts. Pixels drawn before queueing are seen by the encoders. When
+ * producers outrun the passes and the queue is full the whole screen
+ * counts as damaged, damageDiff then sorts out what really changed.
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <rfb/rfbproto.h>
+#include <rfb/rfbregion.h>
+
+/**
+ *  Tile map matching the current framebuffer size, along with the shadow
+ * copy when diffing. Sets *fresh when they were just made.
+ */
+static rfbBool rfbDamageTiles( ScreenAtom * atom, rfbBool * fresh )
+{ int shift= atom->damageTileShift;
+  int cols = ( atom->width  + ( 1 << shift ) - 1 ) >> shift;
+  int rows = ( atom->height + ( 1 << shift ) - 1 ) >> shift;
+  size_t fbSize= (size_t)atom->paddedWidthInBytes * atom->height;
+
+  *fresh= FALSE;
+
+  if ( atom->damageTiles
+    && atom->damageCols == cols
+    && atom->damageRows == rows
+    && ( !atom->damageDiff || atom->damageShadow ))
+  { return( TRUE );
+  }
+
+  rfbDamageFree( atom );
+
+  if ( !( atom->damageTiles= (uint64_t *)calloc( cols * rows, sizeof( uint64_t )))
+    || ( atom->damageDiff
+      && ( !( atom->damageSuspect= (unsigned char *)calloc( cols * rows, 1 ))
+        || !( atom->damageShadow= (char *)malloc( fbSize )))))
+  { rfbErr("rfbDamageTiles: no memory for %dx%d tiles\n", cols, rows );
+    rfbDamageFree( atom );
+    return( FALSE );
+  }
+
+  if ( atom->damageShadow )
+  { memcpy( atom->damageShadow, atom->frameBuffer, fbSize );
+  }
+
+  atom->damageCols= cols;
+  atom->damageRows= rows;
+  *fresh= TRUE;
+  return( TRUE );
+}
+
+/**
+ *  Stamps the tiles under a rect already clipped to the screen. Returns
+ * FALSE when tiles are not in use, the caller marks the clients then.
+ */
+rfbBool rfbDamageMarkRect( ScreenAtom * atom, int x1, int y1, int x2, int y2 )
+{ int shift= atom->damageTileShift;
+  rfbBool fresh, suspect;
+  uint64_t gen;
+  int tx, ty;
+
+  if ( !shift || !rfbDamageTiles( atom, &fresh ))
+  { return( FALSE );
+  }
+
+  if ( !atom->damageGeneration )     /* Nobody collected yet */
+  { atom->damageGeneration= 1;
+  }
+
+  gen= atom->damageGeneration;
+  suspect= atom->damageShadow && !fresh;   /* A new shadow already holds the change */
+  x2= ( x2 - 1 ) >> shift;
+  y2= ( y2 - 1 ) >> shift;
+
+  for( ty= y1 >> shift; ty <= y2; ty++ )
+  { int row= ty * atom->damageCols;
+
+    for( tx= x1 >> shift; tx <= x2; tx++ )
+    { if ( suspect )
+      { atom->damageSuspect[ row + tx ]= 1;
+      }
+      else
+      { atom->damageTiles[ row + tx ]= gen;
+  } } }
+
+  if ( suspect )
+  { atom->damageSuspects= TRUE;
+  }
+  else
+  { atom->damageMarked= gen;
+    atom->fbGeneration++;
+  }
+
+  return( TRUE );
+}
+
+#define SCROLL_MIN_ROWS  16          /* Shortest run worth a CopyRect */
+#define SCROLL_MIN_VOTES  8
+
+static uint64_t rfbRowHash( const char * p, int len )
+{ uint64_t h= 0xcbf29ce484222325ULL;
+  uint64_t w;
+
+  for( ; len >= 8; p += 8, len -= 8 )
+  { memcpy( &w, p, 8 );
+    h= ( h ^ w ) * 0x100000001b3ULL;
+    h ^= h >> 29;
+  }
+
+  for( ; len > 0; p++, len-- )
+  { h= ( h ^ (unsigned char)*p ) * 0x100000001b3ULL;
+  }
+
+  return( h );
+}
+
+/**
+ *  Hashes one tile column of rows y1 to y2, of the shadow and of the
+ * framebuffer.
+ */
+static void rfbHashColumn( ScreenAtom * atom, int x1, int len, int y1, int y2
+                         , uint64_t * was, uint64_t * now )
+{ size_t at= (size_t)y1 * atom->paddedWidthInBytes + x1;
+  int y;
+
+  for( y= y1; y < y2; y++, at += atom->paddedWidthInBytes )
+  { was[ y - y1 ]= rfbRowHash( atom->damageShadow + at, len );
+    now[ y - y1 ]= rfbRowHash( atom->frameBuffer  + at, len );
+} }
+
+/**
+ *  Looks for a vertical scroll inside the suspect tiles and schedules it
+ * as a CopyRect.
+ */
+static void rfbDamageScroll( ScreenAtom * atom )
+{ int shift= atom->damageTileShift;
+  int bpp  = atom->bitsPerPixel / 8;
+  int tx1= atom->damageCols, tx2= -1, ty1= atom->damageRows, ty2= -1;
+  int x2, y1, y2, h, tableSize, tx, y, dy, best, bestDy;
+  uint64_t * was, * now;
+  int * table, * votes;
+  char * repeated;
+  sraRegionPtr copy;
+
+  for( y= 0; y < atom->damageRows; y++ )      /* Suspect bounding box */
+  { for( tx= 0; tx < atom->damageCols; tx++ )
+    { if ( atom->damageSuspect[ y * atom->damageCols + tx ] )
+      { if ( tx < tx1 ) tx1= tx;
+        if ( tx > tx2 ) tx2= tx;
+        if ( y  < ty1 ) ty1= y;
+        if ( y  > ty2 ) ty2= y;
+  } } }
+
+  y1= ty1 << shift;
+  x2= ( tx2 + 1 ) << shift < atom->width  ? ( tx2 + 1 ) << shift : atom->width;
+  y2= ( ty2 + 1 ) << shift < atom->height ? ( ty2 + 1 ) << shift : atom->height;
+  h = y2 - y1;
+
+  if ( tx2 < 0 || h < 2 * SCROLL_MIN_ROWS )
+  { return;
+  }
+
+  for( tableSize= 64; tableSize < 2 * h; tableSize <<= 1 );
+
+  was  = (uint64_t *)malloc( h * sizeof( uint64_t ));
+  now  = (uint64_t *)malloc( h * sizeof( uint64_t ));
+  table= (int *)malloc( tableSize * sizeof( int ));
+  votes= (int *)calloc( 2 * h, sizeof( int ));
+  repeated= (char *)malloc( h );
+  copy = sraRgnCreate();
+
+  if ( !was || !now || !table || !votes || !repeated || !copy )
+  { goto done;
+  }
+
+  for( tx= tx1; tx <= tx2; tx++ )              /* Vote for displacements */
+  { int cx= tx << shift;
+    int len= (( cx + ( 1 << shift ) < x2 ? cx + ( 1 << shift ) : x2 ) - cx ) * bpp;
+
+    rfbHashColumn( atom, cx * bpp, len, y1, y2, was, now );
+
+    for( y= 0; y < tableSize; y++ )
+    { table[ y ]= -1;
+    }
+
+    for( y= 0; y < h; y++ )                    /* Old rows by hash */
+    { int slot= (int)( was[ y ] & ( tableSize - 1 ));
+
+      while( table[ slot ] >= 0 && was[ table[ slot ]] != was[ y ] )
+      { slot= ( slot + 1 ) & ( tableSize - 1 );
+      }
+
+      if ( table[ slot ] >= 0 )
+      { repeated[ table[ slot ]]= 1;           /* Blank lines and such say nothing */
+      }
+      else
+      { table[ slot ]= y;
+        repeated[ y ]= 0;
+    } }
+
+    for( y= 0; y < h; y++ )
+    { int slot= (int)( now[ y ] & ( tableSize - 1 ));
+
+      if ( now[ y ] == was[ y ] )
+      { continue;
+      }
+
+      while( table[ slot ] >= 0 && was[ table[ slot ]] != now[ y ] )
+      { slot= ( slot + 1 ) & ( tableSize - 1 );
+      }
+
+      if ( table[ slot ] >= 0 && !repeated[ table[ slot ]] )
+      { votes[ y - table[ slot ] + h ]++;
+  } } }
+
+  for( best= 0, bestDy= 0, dy= 0; dy < 2 * h; dy++ )
+  { if ( votes[ dy ] > best )
+    { best  = votes[ dy ];
+      bestDy= dy - h;
+  } }
+
+  if ( best < SCROLL_MIN_VOTES )
+  { goto done;
+  }
+
+  for( tx= tx1; tx <= tx2; tx++ )              /* Runs that moved by bestDy */
+  { int cx= tx << shift;
+    int len= (( cx + ( 1 << shift ) < x2 ? cx + ( 1 << shift ) : x2 ) - cx ) * bpp;
+    int from= bestDy > 0 ? bestDy : 0;
+    int to  = bestDy < 0 ? h + bestDy : h;
+    int run = -1;
+
+    rfbHashColumn( atom, cx * bpp, len, y1, y2, was, now );
+
+    for( y= from; y <= to; y++ )
+    { rfbBool moved= y < to && now[ y ] == was[ y - bestDy ];
+
+      if ( moved && run < 0 )
+      { run= y;
+      }
+      else if ( !moved && run >= 0 )
+      { if ( y - run >= SCROLL_MIN_ROWS )
+        { size_t at= (size_t)( y1 + run ) * atom->paddedWidthInBytes + cx * bpp;
+          size_t off= (size_t)bestDy * atom->paddedWidthInBytes;
+          int r;
+
+          for( r= run; r < y; r++, at += atom->paddedWidthInBytes )  /* Hashes can lie */
+          { if ( memcmp( atom->frameBuffer + at, atom->damageShadow + at - off, len ))
+            { break;
+          } }
+
+          if ( r - run >= SCROLL_MIN_ROWS )
+          { sraRegionPtr rect= sraRgnCreateRect( cx, y1 + run
+                                               , cx + len / bpp, y1 + r );
+            sraRgnOr( copy, rect );
+            sraRgnDestroy( rect );
+        } }
+        run= -1;
+  } } }
+
+  if ( !sraRgnEmpty( copy ))
+  { rfbScheduleCopyRegion( atom, copy, 0, bestDy );
+  }
+
+done:
+  FREE( was );
+  FREE( now );
+  FREE( table );
+  FREE( votes );
+  FREE( repeated );
+  if ( copy )
+  { sraRgnDestroy( copy );
+} }
+
+/**
+ *  Compares the suspect tiles with the shadow copy, stamps the ones that
+ * changed and brings the shadow up to date.
+ */
+static void rfbDamageDiff( ScreenAtom * atom )
+{ int shift= atom->damageTileShift;
+  int bpp  = atom->bitsPerPixel / 8;
+  int stride= atom->paddedWidthInBytes;
+  uint64_t gen= atom->damageGeneration;
+  rfbBool changed= FALSE;
+  int tx, ty;
+
+  atom->damageSuspects= FALSE;       /* Before a copy gets scheduled */
+
+  if ( atom->damageScroll )
+  { rfbDamageScroll( atom );
+  }
+
+  for( ty= 0; ty < atom->damageRows; ty++ )
+  { int y1= ty << shift;
+    int y2= ( ty + 1 ) << shift < atom->height ? ( ty + 1 ) << shift : atom->height;
+
+    for( tx= 0; tx < atom->damageCols; tx++ )
+    { unsigned char * suspect= atom->damageSuspect + ty * atom->damageCols + tx;
+      int x1= tx << shift;
+      int len= (( x1 + ( 1 << shift ) < atom->width ? x1 + ( 1 << shift ) : atom->width ) - x1 ) * bpp;
+      size_t at;
+      int y;
+
+      if ( !*suspect )
+      { continue;
+      }
+
+      *suspect= 0;
+
+      for( y= y1, at= (size_t)y1 * stride + x1 * bpp   /* memcmp goes vector wide */
+         ; y < y2 && !memcmp( atom->frameBuffer + at, atom->damageShadow + at, len )
+         ; y++, at += stride );
+
+      if ( y == y2 )
+      { continue;
+      }
+
+      for( ; y < y2; y++, at += stride )
+      { memcpy( atom->damageShadow + at, atom->frameBuffer + at, len );
+      }
+
+      atom->damageTiles[ ty * atom->damageCols + tx ]= gen;
+      changed= TRUE;
+  } }
+
+  if ( changed )
+  { atom->damageMarked= gen;
+    atom->fbGeneration++;
+} }
+
+/**
+ *  Copies what a region now shows into the shadow. Changes that reach the
+ * clients without being marked, like copies, must come through here or a
+ * later mark restoring the old pixels would not be seen.
+ */
+void rfbDamageSync( ScreenAtom * atom, sraRegionPtr region )
+{ int bpp  = atom->bitsPerPixel / 8;
+  int stride= atom->paddedWidthInBytes;
+  sraRectangleIterator * i;
+  sraRect rect;
+
+  if ( !atom->damageShadow )
+  { return;
+  }
+
+  if ( atom->damageSuspects )        /* Judge them against the old pixels */
+  { rfbDamageDiff( atom );
+  }
+
+  i= sraRgnGetIterator( region );
+  while( sraRgnIteratorNext( i, &rect ))
+  { int y;
+
+    if ( !sraClipRect2( &rect.x1, &rect.y1, &rect.x2, &rect.y2
+                      , 0, 0, atom->width, atom->height ))
+    { continue;
+    }
+
+    for( y= rect.y1; y < rect.y2; y++ )
+    { size_t at= (size_t)y * stride + rect.x1 * bpp;
+
+      memcpy( atom->damageShadow + at, atom->frameBuffer + at
+            , ( rect.x2 - rect.x1 ) * bpp );
+  } }
+  sraRgnReleaseIterator( i );
+}
+
+rfbBool rfbDamageMarkRegion( ScreenAtom * atom, sraRegionPtr region )
+{ sraRectangleIterator * i;
+  sraRect rect;
+
+  if ( !atom->damageTileShift )
+  { return( FALSE );
+  }
+
+  i= sraRgnGetIterator( region );
+  while( sraRgnIteratorNext( i, &rect ))
+  { if ( !rfbDamageMarkRect( atom, rect.x1, rect.y1, rect.x2, rect.y2 ))
+    { break;                         /* No tiles, nothing got marked */
+  } }
+  sraRgnReleaseIterator( i );
+
+  return( atom->damageTiles != NULL );
+}
+
+/**
+ *  Everything marked from now on is news to this client. Only the window
+ * has tiles, scaled viewers take its damage like any other.
+ */
+void rfbDamageStart( rfbClient * cl )
+{ ScreenAtom * atom= &cl->screen->window;
+
+  cl->damageSeen= atom->damageGeneration++;
+}
+
+/**
+ *  Adds the tiles marked since the client last looked to its
+ * modifiedRegion, in window coordinates as all of it.
+ */
+void rfbDamageCollect( rfbClient * cl )
+{ ScreenAtom * atom= &cl->screen->window;
+  int shift= atom->damageTileShift;
+  uint64_t seen= cl->damageSeen;
+  int tx, ty;
+
+  if ( atom->damageSuspects )
+  { rfbDamageDiff( atom );
+  }
+
+  if ( atom->damageMarked <= seen )
+  { return;
+  }
+
+  rfbDamageStart( cl );
+
+  for( ty= 0; ty < atom->damageRows; ty++ )
+  { const uint64_t * tile= atom->damageTiles + ty * atom->damageCols;
+
+    for( tx= 0; tx < atom->damageCols; tx++ )
+    { if ( tile[ tx ] > seen )
+      { int run= tx;
+        sraRegionPtr rect;
+
+        while( tx < atom->damageCols && tile[ tx ] > seen )
+        { tx++;
+        }
+
+        rect= sraRgnCreateRect( run << shift, ty << shift   /* Edge tiles are cut */
+                              , tx << shift < atom->width ? tx << shift : atom->width
+                              , ( ty + 1 ) << shift < atom->height ? ( ty + 1 ) << shift : atom->height );
+        sraRgnOr( cl->modifiedRegion, rect );
+        sraRgnDestroy( rect );
+} } } }
+
+/**
+ *  Drops the tile map and shadow, new ones are made on the next mark
+ */
+void rfbDamageFree( ScreenAtom * atom )
+{ FREE( atom->damageTiles );
+  FREE( atom->damageSuspect );
+  FREE( atom->damageShadow );
+  atom->damageSuspects= FALSE;
+  atom->damageCols=
+  atom->damageRows= 0;
+}
+
+/**
+ *  Marks a rect from any thread, without locking. Only the thread running
+ * the library touches the clients, when it drains the queue.
+ */
+void rfbQueueRectAsModified( ScreenAtom * atom, int x1, int y1, int x2, int y2 )
+{ uint32_t pos= __atomic_load_n( &atom->damageQueueHead, __ATOMIC_RELAXED );
+  rfbDamageCell * cell;
+
+  for( ;; )
+  { uint32_t slot= pos & ( RFB_DAMAGE_QUEUE - 1 );
+    int32_t  dif;
+
+    cell= atom->damageQueue + slot;
+    dif = (int32_t)( __atomic_load_n( &cell->seq, __ATOMIC_ACQUIRE ) + slot - pos );
+
+    if ( !dif )                      /* Free, claim it */
+    { if ( __atomic_compare_exchange_n( &atom->damageQueueHead, &pos, pos + 1
+                                      , TRUE, __ATOMIC_RELAXED, __ATOMIC_RELAXED ))
+      { break;
+    } }
+
+    else if ( dif < 0 )              /* Full, not merged yet */
+    { __atomic_store_n( &atom->damageQueueLost, TRUE, __ATOMIC_RELEASE );
+      return;
+    }
+
+    else
+    { pos= __atomic_load_n( &atom->damageQueueHead, __ATOMIC_RELAXED );
+  } }
+
+  cell->x1= x1;
+  cell->y1= y1;
+  cell->x2= x2;
+  cell->y2= y2;
+  __atomic_store_n( &cell->seq, pos + 1 - ( pos & ( RFB_DAMAGE_QUEUE - 1 )), __ATOMIC_RELEASE );
+}
+
+/**
+ *  Whether some thread queued damage not merged yet
+ */
+rfbBool rfbDamageQueued( ScreenAtom * atom )
+{ uint32_t pos = atom->damageQueueTail;
+  uint32_t slot= pos & ( RFB_DAMAGE_QUEUE - 1 );
+
+  return( __atomic_load_n( &atom->damageQueueLost, __ATOMIC_ACQUIRE )
+       || __atomic_load_n( &atom->damageQueue[ slot ].seq, __ATOMIC_ACQUIRE ) + slot == pos + 1 );
+}
+
+/**
+ *  Merges what the producers queued, on the thread running the library
+ */
+void rfbDamageDrain( ScreenAtom * atom )
+{ uint32_t pos= atom->damageQueueTail;
+
+  for( ;; )
+  { uint32_t slot= pos & ( RFB_DAMAGE_QUEUE - 1 );
+    rfbDamageCell * cell= atom->damageQueue + slot;
+    int x1, y1, x2, y2;
+
+    if ( __atomic_load_n( &cell->seq, __ATOMIC_ACQUIRE ) + slot != pos + 1 )
+    { break;                         /* Not published yet */
+    }
+
+    x1= cell->x1;
+    y1= cell->y1;
+    x2= cell->x2;
+    y2= cell->y2;
+    __atomic_store_n( &cell->seq, pos + RFB_DAMAGE_QUEUE - slot, __ATOMIC_RELEASE );
+    atom->damageQueueTail= ++pos;
+
+    rfbMarkRectAsModified( atom, x1, y1, x2, y2 );
+  }
+
+  if ( __atomic_exchange_n( &atom->damageQueueLost, FALSE, __ATOMIC_ACQ_REL ))
+  { rfbMarkRectAsModified( atom, 0, 0, atom->width, atom->height );
+} }
@@ -0,0 +1,270 @@
+/*
+ * enccache.c
+ *
+ * Shares encoded rects between clients. When several viewers watch the
+ * same screen with the same pixel format and encoding, the first one to
+ * send a rect leaves the bytes here and the others copy them instead of
+ * running the encoder again. Entries only live while the framebuffer
+ * stays as it was: any change bumps fbGeneration of the window and the
+ * whole cache is dropped on the next lookup. Scaled screens are made from
+ * the window, so their entries go with it.
+ *
+ * Only stateless encodings can be shared this way. Zlib, ZRLE and the zlib
+ * parts of Tight depend on the per client deflate stream and are always
+ * encoded for each client.
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <rfb/rfbproto.h>
+
+/**
+ *  Sharing only pays off with more than one client and is only safe when
+ * the cursor is not painted into the framebuffer for this client.
+ */
+rfbBool rfbEncCacheUsable( rfbClient * cl )
+{ rfbScreenInfo * screen= cl->screen;
+
+  if ( !screen->encCacheLimit
+    || cl->tileOwner                   /* Encoding threads keep off */
+    || !cl->enableCursorShapeUpdates
+    || !cl->format.trueColour )
+  { return( FALSE );
+  }
+
+  return( screen->window.clientHead
+       && screen->window.clientHead->next );
+}
+
+/**
+ *  Frees every entry
+ */
+void rfbEncCacheFlush( rfbScreenInfo * screen )
+{ while( screen->encCache )
+  { rfbEncCacheEntry * entry= screen->encCache;
+
+    screen->encCache= entry->next;
+    free( entry );
+  }
+
+  screen->encCacheBytes= 0;
+}
+
+/**
+ *  Drops the entries when the framebuffer changed since they were made
+ */
+static void rfbEncCacheCheck( rfbClient * cl )
+{ rfbScreenInfo * screen= cl->screen;
+
+  if ( screen->encCacheGeneration != screen->window.fbGeneration )
+  { rfbEncCacheFlush( screen );
+    screen->encCacheGeneration= screen->window.fbGeneration;
+} }
+
+rfbEncCacheEntry * rfbEncCacheLookup( rfbClient * cl
+                                    , int encoding, int param
+                                    , const rfbPixelFormat * format
+                                    , int x, int y, int w, int h )
+{ rfbScreenInfo * screen= cl->screen;
+  rfbEncCacheEntry ** link, * entry;
+
+  rfbEncCacheCheck( cl );
+
+  for( link= &screen->encCache
+     ; ( entry= *link )
+     ; link= &entry->next )
+  { if ( entry->x == x && entry->y == y
+      && entry->w == w && entry->h == h
+      && entry->encoding == encoding
+      && entry->param    == param
+      && entry->atom     == cl->scaledScreen
+      && !memcmp( &entry->format, format, sizeof( *format )))
+    { *link= entry->next;              /* Move to front */
+      entry->next= screen->encCache;
+      screen->encCache= entry;
+      return( entry );
+  } }
+
+  return( NULL );
+}
+
+void rfbEncCacheInsert( rfbClient * cl
+                      , int encoding, int param
+                      , const rfbPixelFormat * format
+                      , int x, int y, int w, int h
+                      , const char * data, int len )
+{ rfbScreenInfo * screen= cl->screen;
+  rfbEncCacheEntry ** link, * entry;
+  size_t size= offsetof( rfbEncCacheEntry, data ) + len;
+
+  if ( size > screen->encCacheLimit / 4 )  /* Not worth evicting everything */
+  { return;
+  }
+
+  rfbEncCacheCheck( cl );
+
+  if ( !( entry= (rfbEncCacheEntry *)malloc( size )))
+  { return;
+  }
+
+  entry->atom    = cl->scaledScreen;
+  entry->x       = x;
+  entry->y       = y;
+  entry->w       = w;
+  entry->h       = h;
+  entry->encoding= encoding;
+  entry->param   = param;
+  entry->format  = *format;
+  entry->len     = len;
+  memcpy( entry->data, data, len );
+
+  entry->next= screen->encCache;
+  screen->encCache= entry;
+  screen->encCacheBytes += size;
+
+  if ( screen->encCacheBytes > screen->encCacheLimit )  /* Trim least used */
+  { size_t kept= 0;
+
+    for( link= &screen->encCache
+       ; ( entry= *link )
+       ; link= &entry->next )
+    { kept += offsetof( rfbEncCacheEntry, data ) + entry->len;
+
+      if ( kept > screen->encCacheLimit )
+      { break;
+    } }
+
+    while(( entry= *link ))
+    { *link= entry->next;
+      screen->encCacheBytes -= offsetof( rfbEncCacheEntry, data ) + entry->len;
+      free( entry );
+} } }
+
+/**
+ *  Keeps the bytes of the rect being encoded. Called right before
+ * updateBuf is emptied and once more when the rect is done.
+ */
+void rfbEncCacheTee( rfbClient * cl )
+{ int len= cl->ublen - cl->teeFrom;
+
+  if ( cl->teeLen < 0 || len <= 0 )
+  { cl->teeFrom= 0;
+    return;
+  }
+
+  if ( cl->teeLen + len > cl->teeSize )
+  { int size= cl->teeSize ? cl->teeSize : UPDATE_BUF_SIZE;
+    char * buf;
+
+    while( size < cl->teeLen + len )
+    { size <<= 1;
+    }
+
+    if ( (size_t)size > cl->screen->encCacheLimit / 4
+      || !( buf= (char *)realloc( cl->teeBuf, size )))
+    { cl->teeLen = -1;       /* Too big to be shared, let it go */
+      cl->teeFrom= 0;
+      return;
+    }
+
+    cl->teeBuf = buf;
+    cl->teeSize= size;
+  }
+
+  memcpy( cl->teeBuf + cl->teeLen, cl->updateBuf + cl->teeFrom, len );
+  cl->teeLen += len;
+  cl->teeFrom = 0;
+}
+
+/**
+ *  Copies an entry into the output, flushing as it fills up
+ */
+static rfbBool rfbSendCachedRect( rfbClient * cl, rfbEncCacheEntry * entry )
+{ const char * data= entry->data;
+  int left= entry->len;
+
+  while( left )
+  { int portion;
+
+    if ( cl->ublen == cl->ubsize && !rfbSendUpdateBuf( cl ))
+    { return( FALSE );
+    }
+
+    portion= cl->ubsize - cl->ublen;
+    if ( portion > left )
+    { portion= left;
+    }
+
+    memcpy( cl->updateBuf + cl->ublen, data, portion );
+    cl->ublen += portion;
+    data += portion;
+    left -= portion;
+  }
+
+  rfbStatRecordEncodingSent( cl, entry->encoding, entry->len
+                           , sz_rfbFramebufferUpdateRectHeader
+                           + entry->w * entry->h * ( cl->format.bitsPerPixel / 8 ));
+  return( TRUE );
+}
+
+/**
+ *  Sends a rect with a stateless encoder, reusing what another client
+ * already produced for it when possible.
+ */
+rfbBool rfbSendRectCached( rfbClient * cl
+                         , int x, int y, int w, int h
+                         , rfbSendRectProcPtr encoder )
+{ rfbEncCacheEntry * entry;
+  int encoding= cl->preferredEncoding < 0 ? rfbEncodingRaw : cl->preferredEncoding;
+  int param   = encoding == rfbEncodingCoRRE
+              ? cl->correMaxWidth << 16 | cl->correMaxHeight
+              : 0;
+
+  if ( !rfbEncCacheUsable( cl )
+    || ( encoding == rfbEncodingRaw           /* Sent from the framebuffer */
+      && cl->translateFn == rfbTranslateNone ))
+  { return( rfbSendRectTiled( cl, x, y, w, h, encoder ));
+  }
+
+  if (( entry= rfbEncCacheLookup( cl, encoding, param, &cl->format, x, y, w, h )))
+  { return( rfbSendCachedRect( cl, entry ));
+  }
+
+  cl->teeing = TRUE;
+  cl->teeFrom= cl->ublen;
+  cl->teeLen = 0;
+
+  if ( !encoder( cl, x, y, w, h ))
+  { cl->teeing= FALSE;
+    return( FALSE );
+  }
+
+  rfbEncCacheTee( cl );
+  cl->teeing= FALSE;
+
+  if ( cl->teeLen > 0 )
+  { rfbEncCacheInsert( cl, encoding, param, &cl->format
+                     , x, y, w, h
+                     , cl->teeBuf, cl->teeLen );
+  }
+
+  return( TRUE );
+}
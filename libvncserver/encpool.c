@@ -0,0 +1,613 @@
+/*
+ * encpool.c
+ *
+ * Encodes the big rects of an update on several threads. A rect is cut in
+ * horizontal bands, band k goes to worker k % workers and each worker
+ * encodes its bands on a private copy of the client, gathering the output
+ * as chunk segments. When every band is done the segments are handed to the
+ * real client in band order, so the viewer sees plain consecutive rects.
+ *
+ * Only encoders with no state between rects, or whose state can be split,
+ * take part: Hextile, and Tight / TightPng. Tight has four zlib streams per
+ * client, so Tight is limited to four workers and worker t sends all its
+ * zlib data on stream t; every stream is then fed by a single thread, in
+ * the same order the viewer inflates it.
+ *
+ * Encoders keeping a single stream can still hand pieces of work to the
+ * same threads with rfbRunEncodeJobs(), see zlib.c and zrle.c.
+ *
+ * Worker 0 is the calling thread, rfbScreenInfo.encodeThreads - 1 threads
+ * are started the first time they are needed.
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#include <string.h>
+#include <rfb/rfbproto.h>
+#include <rfb/rfbregion.h>
+#include "private.h"
+
+#ifdef HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif
+
+#define TILE_MIN_AREA    ( 128 * 128 )  /* Smaller rects are not worth it */
+#define TILE_MIN_HEIGHT  16             /* Keeps the hextile grid */
+#define TILE_MAX_BANDS   64
+#define TILE_MAX_TIGHT   4              /* Tight zlib streams */
+
+/**
+ *  Workers to use for this client, 1 keeps it on the calling thread
+ */
+static int rfbTileWorkers( rfbClient * cl )
+{ int threads= cl->screen->encodeThreads;
+
+#ifndef HAVE_LIBPTHREAD
+  threads= 1;
+#endif
+
+  if ( threads < 2 || cl->tileOwner )
+  { return( 1 );
+  }
+
+  if ( threads > TILE_MAX_BANDS / 2 )
+  { threads= TILE_MAX_BANDS / 2;
+  }
+
+  switch( cl->preferredEncoding )
+  { case rfbEncodingHextile:
+      return( rfbEncCacheUsable( cl ) ? 1 : threads );  /* Sharing beats splitting */
+
+#ifdef HAVE_LIBJPEG
+    case rfbEncodingTight:
+    case rfbEncodingTightPng:
+      return( threads > TILE_MAX_TIGHT ? TILE_MAX_TIGHT : threads );
+#endif
+  }
+
+  return( 1 );
+}
+
+/**
+ *  Workers rfbRunEncodeJobs() may spread jobs over, 1 keeps them on the
+ * calling thread
+ */
+int rfbEncodeJobWorkers( rfbClient * cl )
+{ int threads= cl->screen->encodeThreads;
+
+#ifndef HAVE_LIBPTHREAD
+  threads= 1;
+#endif
+
+  if ( threads < 2 || cl->tileOwner )
+  { return( 1 );
+  }
+
+  return( threads > TILE_MAX_BANDS / 2 ? TILE_MAX_BANDS / 2 : threads );
+}
+
+/**
+ *  Cuts a rect in bands, about two per worker to even out the load.
+ */
+static int rfbTileRect( rfbClient * cl
+                      , int x, int y, int w, int h
+                      , sraRect * band )
+{ int workers= rfbTileWorkers( cl );
+  int bands= 1, bh= h, i;
+
+  if ( workers > 1 && w * h >= TILE_MIN_AREA )
+  { bands= workers * 2;
+    bh= ( h + bands - 1 ) / bands;
+    bh= ( bh + TILE_MIN_HEIGHT - 1 ) / TILE_MIN_HEIGHT * TILE_MIN_HEIGHT;
+    bands= ( h + bh - 1 ) / bh;
+  }
+
+  for( i= 0
+     ; i < bands
+     ; i++ )
+  { band[ i ].x1= x;
+    band[ i ].x2= x + w;
+    band[ i ].y1= y + i * bh;
+    band[ i ].y2= i == bands - 1 ? y + h : y + ( i + 1 ) * bh;
+  }
+
+  return( bands );
+}
+
+/**
+ *  Rects sent for one update rect, as rfbSendRectTiled will send it
+ */
+int rfbNumTiledRects( rfbClient * cl, int x, int y, int w, int h )
+{ sraRect band[ TILE_MAX_BANDS ];
+  int bands= rfbTileRect( cl, x, y, w, h, band );
+  int i, n, total= 0;
+
+  for( i= 0
+     ; i < bands
+     ; i++ )
+  { switch( cl->preferredEncoding )
+    {
+#ifdef HAVE_LIBJPEG
+      case rfbEncodingTight:
+      case rfbEncodingTightPng:
+        if ( !( n= rfbNumCodedRectsTight( cl, band[ i ].x1, band[ i ].y1
+                                            , band[ i ].x2 - band[ i ].x1
+                                            , band[ i ].y2 - band[ i ].y1 )))
+        { return( 0 );          /* LastRect marker used */
+        }
+        break;
+#endif
+
+      default:
+        n= 1;
+    }
+    total += n;
+  }
+
+  return( total );
+}
+
+#ifdef HAVE_LIBPTHREAD
+
+typedef struct _rfbEncodeWorker
+{ struct _rfbEncodePool * pool;
+  pthread_t thread;
+  int index;
+  rfbClient copy;             /* Client the bands are encoded on */
+  rfbSegment * seg;           /* Kept between updates */
+  int segSize;
+} rfbEncodeWorker;
+
+typedef struct _rfbEncodePool
+{ pthread_mutex_t lock;
+  pthread_cond_t  wake, done;
+  pthread_mutex_t bufLock;    /* Guards the screen chunk pool */
+  int threads, started;
+  int running;                /* Threads not done with the batch yet */
+  unsigned batch;             /* Bumped to start a batch */
+  rfbBool quit;
+
+  rfbSendRectProcPtr encoder; /* Batch being encoded */
+  rfbEncodeJobProcPtr job;    /* Or jobs being run, when set */
+  void * jobArg;
+  int jobs;
+  sraRect * band;
+  int bands, workers;
+  int segEnd[ TILE_MAX_BANDS ];    /* outSegs of the copy when band is done */
+  rfbBool ok[ TILE_MAX_BANDS ];
+
+  rfbEncodeWorker worker[ 1 ];
+} rfbEncodePool;
+
+/**
+ *  Encodes the bands of worker t, in order
+ */
+static void rfbEncodeShare( rfbEncodePool * pool, int t )
+{ rfbEncodeWorker * worker= &pool->worker[ t ];
+  int k;
+
+  if ( pool->job )
+  { for( k= t
+       ; k < pool->jobs
+       ; k += pool->workers )
+    { pool->job( pool->jobArg, k, t );
+    }
+    return;
+  }
+
+  for( k= t
+     ; k < pool->bands
+     ; k += pool->workers )
+  { sraRect * band= &pool->band[ k ];
+
+    pool->ok[ k ]= pool->encoder( &worker->copy
+                                , band->x1, band->y1
+                                , band->x2 - band->x1
+                                , band->y2 - band->y1 )
+                && rfbSendUpdateBuf( &worker->copy );   /* Ends on a segment */
+    pool->segEnd[ k ]= worker->copy.outSegs;
+
+    if ( !pool->ok[ k ] )
+    { break;
+} } }
+
+static void * rfbEncodeThread( void * arg )
+{ rfbEncodeWorker * worker= (rfbEncodeWorker *)arg;
+  rfbEncodePool * pool= worker->pool;
+  unsigned seen= 0;
+
+  pthread_mutex_lock( &pool->lock );
+
+  while( 1 )
+  { while( pool->batch == seen && !pool->quit )
+    { pthread_cond_wait( &pool->wake, &pool->lock );
+    }
+
+    if ( pool->quit )
+    { break;
+    }
+
+    seen= pool->batch;
+    pthread_mutex_unlock( &pool->lock );
+
+    if ( worker->index < pool->workers )
+    { rfbEncodeShare( pool, worker->index );
+    }
+
+    pthread_mutex_lock( &pool->lock );
+    if ( !--pool->running )
+    { pthread_cond_signal( &pool->done );
+  } }
+
+  pthread_mutex_unlock( &pool->lock );
+
+  return( NULL );
+}
+
+void rfbFreeEncodePool( rfbScreenInfo * screen )
+{ rfbEncodePool * pool= screen->encodePool;
+  int t;
+
+  if ( !pool )
+  { return;
+  }
+
+  pthread_mutex_lock( &pool->lock );
+  pool->quit= TRUE;
+  pthread_cond_broadcast( &pool->wake );
+  pthread_mutex_unlock( &pool->lock );
+
+  for( t= 1
+     ; t < pool->started
+     ; t++ )
+  { pthread_join( pool->worker[ t ].thread, NULL );
+  }
+
+  for( t= 0
+     ; t < pool->threads
+     ; t++ )
+  { FREE( pool->worker[ t ].seg );
+  }
+
+  pthread_mutex_destroy( &pool->lock );
+  pthread_mutex_destroy( &pool->bufLock );
+  pthread_cond_destroy( &pool->wake );
+  pthread_cond_destroy( &pool->done );
+
+  screen->encodePool= NULL;
+  free( pool );
+}
+
+/**
+ *  Pool matching encodeThreads, (re)started as needed
+ */
+static rfbEncodePool * rfbGetEncodePool( rfbScreenInfo * screen )
+{ rfbEncodePool * pool= screen->encodePool;
+  int t, threads= screen->encodeThreads;
+
+  if ( pool && pool->threads == threads )
+  { return( pool );
+  }
+
+  rfbFreeEncodePool( screen );
+
+  if ( !( pool= (rfbEncodePool *)calloc( 1, sizeof( *pool )
+                                       + ( threads - 1 ) * sizeof( rfbEncodeWorker ))))
+  { return( NULL );
+  }
+
+  pthread_mutex_init( &pool->lock, NULL );
+  pthread_mutex_init( &pool->bufLock, NULL );
+  pthread_cond_init( &pool->wake, NULL );
+  pthread_cond_init( &pool->done, NULL );
+  pool->threads= threads;
+  pool->worker[ 0 ].pool= pool;
+  pool->worker[ 0 ].copy.screen= screen;
+
+  for( pool->started= 1
+     ; pool->started < threads
+     ; pool->started++ )
+  { rfbEncodeWorker * worker= &pool->worker[ pool->started ];
+
+    worker->pool = pool;
+    worker->index= pool->started;
+
+    if ( pthread_create( &worker->thread, NULL, rfbEncodeThread, worker ))
+    { rfbErr( "rfbGetEncodePool: only %d encoding threads\n", pool->started );
+      break;
+  } }
+
+  for( t= pool->started
+     ; t < threads
+     ; t++ )
+  { pool->worker[ t ].index= -1;
+  }
+
+  screen->encodePool= pool;
+  return( pool );
+}
+
+/**
+ *  Client copy whose output is gathered apart from the real one
+ */
+static void rfbTileClient( rfbEncodeWorker * worker, rfbClient * cl, int t )
+{ rfbClient * copy= &worker->copy;
+
+  memcpy( copy, cl, sizeof( *copy ));
+
+  copy->tileOwner   = cl;
+  copy->tileStream  = t;
+  copy->ubChunk     = NULL;
+  copy->updateBuf   = NULL;
+  copy->ublen       = copy->ubsize= 0;
+  copy->gathering   = TRUE;
+  copy->outSeg      = worker->seg;
+  copy->outSegSize  = worker->segSize;
+  copy->outSegs     = 0;
+  copy->outChunks   = NULL;
+  copy->teeing      = FALSE;
+  copy->teeBuf      = NULL;
+  copy->teeSize     = 0;
+  copy->statEncList = NULL;
+  copy->statMsgList = NULL;
+  copy->beforeEncBuf= NULL;
+  copy->afterEncBuf = NULL;
+  copy->beforeEncBufSize= copy->afterEncBufSize= 0;
+  copy->recvBuf     = NULL;
+  copy->tightCtx    = NULL;     /* Takes its own from the screen pool */
+}
+
+static rfbBool rfbEncodeBands( rfbClient * cl
+                             , sraRect * band, int bands
+                             , rfbSendRectProcPtr encoder )
+{ rfbEncodePool * pool= rfbGetEncodePool( cl->screen );
+  int from[ TILE_MAX_BANDS ];
+  rfbBool result= TRUE;
+  int t, k;
+
+  if ( !pool || pool->started < 2 )
+  { return( FALSE );
+  }
+
+  pool->encoder= encoder;
+  pool->job    = NULL;
+  pool->band   = band;
+  pool->bands  = bands;
+  pool->workers= rfbTileWorkers( cl );
+
+  if ( pool->workers > pool->started )
+  { pool->workers= pool->started;
+  }
+
+  for( t= 0
+     ; t < pool->workers
+     ; t++ )
+  { rfbTileClient( &pool->worker[ t ], cl, t );
+    from[ t ]= 0;
+  }
+
+  for( k= 0
+     ; k < bands
+     ; k++ )
+  { pool->ok[ k ]= FALSE;
+    pool->segEnd[ k ]= 0;
+  }
+
+  pthread_mutex_lock( &pool->lock );
+  pool->running= pool->started - 1;
+  pool->batch++;
+  pthread_cond_broadcast( &pool->wake );
+  pthread_mutex_unlock( &pool->lock );
+
+  rfbEncodeShare( pool, 0 );
+
+  pthread_mutex_lock( &pool->lock );
+  while( pool->running )
+  { pthread_cond_wait( &pool->done, &pool->lock );
+  }
+  pthread_mutex_unlock( &pool->lock );
+
+  for( k= 0                        /* Send in band order */
+     ; k < bands
+     ; k++ )
+  { rfbClient * copy= &pool->worker[ t= k % pool->workers ].copy;
+
+    if ( !pool->ok[ k ]
+      || !rfbSendClientSegments( cl, copy->outSeg + from[ t ]
+                                   , pool->segEnd[ k ] - from[ t ] ))
+    { result= FALSE;
+      break;
+    }
+
+    from[ t ]= pool->segEnd[ k ];
+  }
+
+  for( t= 0
+     ; t < pool->workers
+     ; t++ )
+  { rfbEncodeWorker * worker= &pool->worker[ t ];
+
+    rfbStatMerge( cl, &worker->copy );
+    rfbTakeClientChunks( cl, &worker->copy );
+    worker->seg    = worker->copy.outSeg;
+    worker->segSize= worker->copy.outSegSize;
+    FREE( worker->copy.beforeEncBuf );
+    FREE( worker->copy.afterEncBuf );
+  }
+
+  return( result ? TRUE : FALSE );
+}
+
+/**
+ *  Runs jobs on the workers, job k on worker k % workers. Returns once all
+ * are done, FALSE when they have to run on the calling thread instead.
+ */
+static rfbBool rfbEncodeJobs( rfbClient * cl, int jobs
+                            , rfbEncodeJobProcPtr job, void * arg )
+{ rfbEncodePool * pool= rfbGetEncodePool( cl->screen );
+
+  if ( !pool || pool->started < 2 )
+  { return( FALSE );
+  }
+
+  pool->job    = job;
+  pool->jobArg = arg;
+  pool->jobs   = jobs;
+  pool->workers= rfbEncodeJobWorkers( cl );
+
+  if ( pool->workers > pool->started )
+  { pool->workers= pool->started;
+  }
+
+  if ( pool->workers > jobs )
+  { pool->workers= jobs;
+  }
+
+  pthread_mutex_lock( &pool->lock );
+  pool->running= pool->started - 1;
+  pool->batch++;
+  pthread_cond_broadcast( &pool->wake );
+  pthread_mutex_unlock( &pool->lock );
+
+  rfbEncodeShare( pool, 0 );
+
+  pthread_mutex_lock( &pool->lock );
+  while( pool->running )
+  { pthread_cond_wait( &pool->done, &pool->lock );
+  }
+  pthread_mutex_unlock( &pool->lock );
+
+  pool->job= NULL;
+
+  return( TRUE );
+}
+
+void rfbLockBufPool( rfbScreenInfo * screen )
+{ if ( screen->encodePool )
+  { pthread_mutex_lock( &screen->encodePool->bufLock );
+} }
+
+void rfbUnlockBufPool( rfbScreenInfo * screen )
+{ if ( screen->encodePool )
+  { pthread_mutex_unlock( &screen->encodePool->bufLock );
+} }
+
+/**
+ *  The scratch pools are shared by every thread encoding for the screen,
+ * encoding threads or not, so unlike the chunk pool they are always locked.
+ */
+typedef struct _rfbScratchLock
+{ pthread_mutex_t mutex;
+} rfbScratchLock;
+
+rfbBool rfbInitScratchLock( rfbScreenInfo * screen )
+{ if ( !( screen->scratchLock= (rfbScratchLock *)malloc( sizeof( rfbScratchLock ))))
+  { return( FALSE );
+  }
+
+  pthread_mutex_init( &screen->scratchLock->mutex, NULL );
+
+  return( TRUE );
+}
+
+void rfbFreeScratchLock( rfbScreenInfo * screen )
+{ if ( screen->scratchLock )
+  { pthread_mutex_destroy( &screen->scratchLock->mutex );
+    FREE( screen->scratchLock );
+} }
+
+void rfbLockScratchPools( rfbScreenInfo * screen )
+{ pthread_mutex_lock( &screen->scratchLock->mutex );
+}
+
+void rfbUnlockScratchPools( rfbScreenInfo * screen )
+{ pthread_mutex_unlock( &screen->scratchLock->mutex );
+}
+
+#else
+
+void rfbFreeEncodePool( rfbScreenInfo * screen ) {}
+void rfbLockBufPool(    rfbScreenInfo * screen ) {}
+void rfbUnlockBufPool(  rfbScreenInfo * screen ) {}
+
+rfbBool rfbInitScratchLock(    rfbScreenInfo * screen ) { return( TRUE ); }
+void    rfbFreeScratchLock(    rfbScreenInfo * screen ) {}
+void    rfbLockScratchPools(   rfbScreenInfo * screen ) {}
+void    rfbUnlockScratchPools( rfbScreenInfo * screen ) {}
+
+#endif
+
+/**
+ *  Runs job( arg, k, worker ) for every k below jobs, on the worker threads
+ * when there are some. worker stays below rfbEncodeJobWorkers().
+ */
+void rfbRunEncodeJobs( rfbClient * cl, int jobs
+                     , rfbEncodeJobProcPtr job, void * arg )
+{ int k;
+
+#ifdef HAVE_LIBPTHREAD
+  if ( jobs > 1
+    && rfbEncodeJobWorkers( cl ) > 1
+    && rfbEncodeJobs( cl, jobs, job, arg ))
+  { return;
+  }
+#endif
+
+  for( k= 0
+     ; k < jobs
+     ; k++ )
+  { job( arg, k, 0 );
+} }
+
+/**
+ *  Sends a rect, in bands encoded by the worker threads when it is big
+ * enough. Without threads the bands are encoded here, in order.
+ */
+rfbBool rfbSendRectTiled( rfbClient * cl
+                        , int x, int y, int w, int h
+                        , rfbSendRectProcPtr encoder )
+{ sraRect band[ TILE_MAX_BANDS ];
+  int bands= rfbTileRect( cl, x, y, w, h, band );
+  int k;
+
+  if ( bands < 2 )
+  { return( encoder( cl, x, y, w, h ));
+  }
+
+#ifdef HAVE_LIBPTHREAD
+  if ( rfbEncodeBands( cl, band, bands, encoder ))
+  { return( TRUE );
+  }
+
+  if ( cl->screen->encodePool                /* Failed, not just missing */
+    && cl->screen->encodePool->started > 1 )
+  { return( FALSE );
+  }
+#endif
+
+  for( k= 0
+     ; k < bands
+     ; k++ )
+  { if ( !encoder( cl, band[ k ].x1, band[ k ].y1
+                 , band[ k ].x2 - band[ k ].x1
+                 , band[ k ].y2 - band[ k ].y1 ))
+    { return( FALSE );
+  } }
+
+  return( TRUE );
+}
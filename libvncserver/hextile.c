@@ -27,10 +27,90 @@
 
 #include <string.h>
 #include <rfb/rfbproto.h>
+#include "scanbuild.h"
 
-static rfbBool sendHextiles8(  rfbClient * cl, int x, int y, int w, int h);
-static rfbBool sendHextiles16( rfbClient * cl, int x, int y, int w, int h);
-static rfbBool sendHextiles32( rfbClient * cl, int x, int y, int w, int h);
+/* Tile scans, built as scanbuild.h describes */
+
+rfbBool rfbHextileVectorScan = TRUE;
+
+#define SCAN_SUFFIX Scalar
+#define SCAN_TARGET SCAN_SCALAR
+#define BPP 8
+#include "hextilescantemplate.c"
+#undef BPP
+#define BPP 16
+#include "hextilescantemplate.c"
+#undef BPP
+#define BPP 32
+#include "hextilescantemplate.c"
+#undef BPP
+#undef SCAN_SUFFIX
+#undef SCAN_TARGET
+
+#define SCAN_SUFFIX Vec
+#define SCAN_TARGET SCAN_VECTORIZE
+#define BPP 8
+#include "hextilescantemplate.c"
+#undef BPP
+#define BPP 16
+#include "hextilescantemplate.c"
+#undef BPP
+#define BPP 32
+#include "hextilescantemplate.c"
+#undef BPP
+#undef SCAN_SUFFIX
+#undef SCAN_TARGET
+
+#ifdef SCAN_AVX2
+#define SCAN_SUFFIX Avx2
+#define SCAN_TARGET SCAN_AVX2_TARGET
+#define BPP 8
+#include "hextilescantemplate.c"
+#undef BPP
+#define BPP 16
+#include "hextilescantemplate.c"
+#undef BPP
+#define BPP 32
+#include "hextilescantemplate.c"
+#undef BPP
+#undef SCAN_SUFFIX
+#undef SCAN_TARGET
+#endif
+
+typedef struct HEXTILE_SCAN_s
+{ int (*classify8 )(const uint8_t *,  int, int, int, uint8_t *,  uint8_t *);
+  int (*corners8  )(const uint8_t *,  int, int, int, uint8_t);
+  int (*classify16)(const uint16_t *, int, int, int, uint16_t *, uint16_t *);
+  int (*corners16 )(const uint16_t *, int, int, int, uint16_t);
+  int (*classify32)(const uint32_t *, int, int, int, uint32_t *, uint32_t *);
+  int (*corners32 )(const uint32_t *, int, int, int, uint32_t);
+} HEXTILE_SCAN;
+
+#define HEXTILE_SCAN_SET( s ) { HextileClassify8##s,  HextileCorners8##s        \
+                              , HextileClassify16##s, HextileCorners16##s       \
+                              , HextileClassify32##s, HextileCorners32##s }
+
+static const HEXTILE_SCAN hextileScanScalar= HEXTILE_SCAN_SET( Scalar );
+static const HEXTILE_SCAN hextileScanVec   = HEXTILE_SCAN_SET( Vec );
+#ifdef SCAN_AVX2
+static const HEXTILE_SCAN hextileScanAvx2  = HEXTILE_SCAN_SET( Avx2 );
+#endif
+
+static const HEXTILE_SCAN * PickHextileScan( void )
+{ switch( rfbPickScanBuild( rfbHextileVectorScan ))
+  { case rfbScanScalar:
+      return( &hextileScanScalar );
+#ifdef SCAN_AVX2
+    case rfbScanAvx2:
+      return( &hextileScanAvx2 );
+#endif
+    default:
+      return( &hextileScanVec );
+} }
+
+static rfbBool sendHextiles8(  rfbClient * cl, const HEXTILE_SCAN * scan, int x, int y, int w, int h);
+static rfbBool sendHextiles16( rfbClient * cl, const HEXTILE_SCAN * scan, int x, int y, int w, int h);
+static rfbBool sendHextiles32( rfbClient * cl, const HEXTILE_SCAN * scan, int x, int y, int w, int h);
 
 
 /**
@@ -41,8 +121,9 @@ rfbBool rfbSendRectEncodingHextile( rfbClient * cl
                                     , int x, int y
                                     , int w, int h )
 { rfbFramebufferUpdateRectHeader rect;
+  const HEXTILE_SCAN * scan= PickHextileScan();
 
-  if (cl->ublen + sz_rfbFramebufferUpdateRectHeader > UPDATE_BUF_SIZE)
+  if (cl->ublen + sz_rfbFramebufferUpdateRectHeader > cl->ubsize)
   { if (!rfbSendUpdateBuf(cl))
     { return FALSE;
   } }
@@ -62,9 +143,9 @@ rfbBool rfbSendRectEncodingHextile( rfbClient * cl
                             sz_rfbFramebufferUpdateRectHeader + w * (cl->format.bitsPerPixel / 8) * h);
 
   switch (cl->format.bitsPerPixel)
-  { case 8:      return sendHextiles8(cl, x, y, w, h);
-    case 16:      return sendHextiles16(cl, x, y, w, h);
-    case 32:      return sendHextiles32(cl, x, y, w, h);
+  { case 8:      return sendHextiles8(cl, scan, x, y, w, h);
+    case 16:      return sendHextiles16(cl, scan, x, y, w, h);
+    case 32:      return sendHextiles32(cl, scan, x, y, w, h);
   }
 
   rfbLog("rfbSendRectEncodingHextile: bpp %d?\n", cl->format.bitsPerPixel);
@@ -86,103 +167,126 @@ rfbBool rfbSendRectEncodingHextile( rfbClient * cl
 #define DEFINE_SEND_HEXTILES(bpp)                                               \
                                                                                 \
                                                                                 \
-static rfbBool subrectEncode##bpp(rfbClient * cli, uint##bpp##_t *data,        \
-    int w, int h, uint##bpp##_t bg, uint##bpp##_t fg, rfbBool mono);\
-static void testColours##bpp(uint##bpp##_t *data, int size, rfbBool *mono,      \
-                  rfbBool *solid, uint##bpp##_t *bg, uint##bpp##_t *fg);        \
-                                                                                \
+static rfbBool subrectEncode##bpp(rfbClient * cli, uint##bpp##_t *data,         \
+    int w, int h, uint##bpp##_t bg, uint##bpp##_t fg, rfbBool mono);            \
                                                                                 \
 /*                                                                              \
    rfbSendHextiles                                                              \
-*/                                                                             \
-                                                                                \
-static rfbBool                                                                  \
-sendHextiles##bpp(rfbClient * cl, int rx, int ry, int rw, int rh) {            \
-    int x, y, w, h;                                                             \
-    int startUblen;                                                             \
-    char *fbptr;                                                                \
-    uint##bpp##_t bg = 0, fg = 0, newBg, newFg;                                 \
-    rfbBool mono, solid;                                                        \
-    rfbBool validBg = FALSE;                                                    \
-    rfbBool validFg = FALSE;                                                    \
-    uint##bpp##_t clientPixelData[16*16*(bpp/8)];                               \
-                                                                                \
-    for (y = ry; y < ry+rh; y += 16) {                                          \
-        for (x = rx; x < rx+rw; x += 16) {                                      \
-            w = h = 16;                                                         \
-            if (rx+rw - x < 16)                                                 \
-                w = rx+rw - x;                                                  \
-            if (ry+rh - y < 16)                                                 \
-                h = ry+rh - y;                                                  \
-                                                                                \
-            if ((cl->ublen + 1 + (2 + 16 * 16) * (bpp/8)) >                     \
-                UPDATE_BUF_SIZE) {                                              \
-                if (!rfbSendUpdateBuf(cl))                                      \
-                    return FALSE;                                               \
-            }                                                                   \
-                                                                                \
-            fbptr = (cl->scaledScreen->frameBuffer + (cl->scaledScreen->paddedWidthInBytes * y)   \
-                     + (x * (cl->scaledScreen->bitsPerPixel / 8)));                   \
-                                                                                \
-            (*cl->translateFn)(cl->translateLookupTable, &(cl->screen->window.serverFormat),      \
-                               &cl->format, fbptr, (char *)clientPixelData,     \
-                               cl->scaledScreen->paddedWidthInBytes, w, h);           \
-                                                                                \
-            startUblen = cl->ublen;                                             \
-            cl->updateBuf[startUblen] = 0;                                      \
-            cl->ublen++;                                                        \
-            rfbStatRecordEncodingSentAdd(cl, rfbEncodingHextile, 1);            \
-                                                                                \
-            testColours##bpp(clientPixelData, w * h,                            \
-                             &mono, &solid, &newBg, &newFg);                    \
-                                                                                \
-            if (!validBg || (newBg != bg)) {                                    \
-                validBg = TRUE;                                                 \
-                bg = newBg;                                                     \
-                cl->updateBuf[startUblen] |= rfbHextileBackgroundSpecified;     \
-                PUT_PIXEL##bpp(bg);                                             \
-            }                                                                   \
-                                                                                \
-            if (solid) {                                                        \
-                continue;                                                       \
-            }                                                                   \
                                                                                 \
-            cl->updateBuf[startUblen] |= rfbHextileAnySubrects;                 \
+   Tiles are read straight from the framebuffer when the client takes the       \
+   server format, else translated once into tile. One scan tells solid,         \
+   mono and coloured tiles apart. A coloured tile with more subrects to         \
+   come than raw would take goes raw at once, and raw copies the pixels         \
+   already at hand; subrects are searched on a copy of the tile.                \
+*/                                                                              \
                                                                                 \
-            if (mono) {                                                         \
-                if (!validFg || (newFg != fg)) {                                \
-                    validFg = TRUE;                                             \
-                    fg = newFg;                                                 \
-                    cl->updateBuf[startUblen] |= rfbHextileForegroundSpecified; \
-                    PUT_PIXEL##bpp(fg);                                         \
-                }                                                               \
-            } else {                                                            \
-                validFg = FALSE;                                                \
-                cl->updateBuf[startUblen] |= rfbHextileSubrectsColoured;        \
-            }                                                                   \
-                                                                                \
-            if (!subrectEncode##bpp(cl, clientPixelData, w, h, bg, fg, mono)) { \
-                /* encoding was too large, use raw */                           \
-                validBg = FALSE;                                                \
-                validFg = FALSE;                                                \
-                cl->ublen = startUblen;                                         \
-                cl->updateBuf[cl->ublen++] = rfbHextileRaw;                     \
-                (*cl->translateFn)(cl->translateLookupTable,                    \
-                                   &(cl->screen->window.serverFormat), &cl->format, fbptr,        \
-                                   (char *)clientPixelData,                     \
-                                   cl->scaledScreen->paddedWidthInBytes, w, h); \
-                                                                                \
-                memcpy(&cl->updateBuf[cl->ublen], (char *)clientPixelData,      \
-                       w * h * (bpp/8));                                        \
-                                                                                \
-                cl->ublen += w * h * (bpp/8);                                   \
-                rfbStatRecordEncodingSentAdd(cl, rfbEncodingHextile,            \
-                             w * h * (bpp/8));                                  \
-            }                                                                   \
+static rfbBool                                                                  \
+sendHextiles##bpp(rfbClient * cl, const HEXTILE_SCAN * scan, int rx, int ry, int rw, int rh) \
+{ int x, y, w, h, j;                                                            \
+  int startUblen, pitch;                                                        \
+  char *fbptr;                                                                  \
+  uint##bpp##_t bg = 0, fg = 0, newBg, newFg;                                   \
+  int colours;                                                                  \
+  rfbBool direct = cl->translateFn == rfbTranslateNone;                         \
+  rfbBool validBg = FALSE;                                                      \
+  rfbBool validFg = FALSE;                                                      \
+  const uint##bpp##_t *pix;                                                     \
+  uint##bpp##_t tile[16*16];                                                    \
+  uint##bpp##_t work[16*16+1];   /* The subrect search reads one past a row */  \
+                                                                                \
+  for (y = ry; y < ry+rh; y += 16)                                              \
+  { for (x = rx; x < rx+rw; x += 16)                                            \
+    { w = h = 16;                                                               \
+      if (rx+rw - x < 16)                                                       \
+        w = rx+rw - x;                                                          \
+      if (ry+rh - y < 16)                                                       \
+        h = ry+rh - y;                                                          \
+                                                                                \
+      if ((cl->ublen + 1 + (2 + 16 * 16) * (bpp/8)) >                           \
+          cl->ubsize)                                                           \
+      { if (!rfbSendUpdateBuf(cl))                                              \
+          return FALSE;                                                         \
+      }                                                                         \
+                                                                                \
+      fbptr = (cl->scaledScreen->frameBuffer + (cl->scaledScreen->paddedWidthInBytes * y) \
+               + (x * (cl->scaledScreen->bitsPerPixel / 8)));                   \
+                                                                                \
+      if (direct)                                                               \
+      { pix   = (const uint##bpp##_t *)fbptr;                                   \
+        pitch = cl->scaledScreen->paddedWidthInBytes / (bpp/8);                 \
+      }                                                                         \
+      else                                                                      \
+      { (*cl->translateFn)(cl->translateLookupTable, &(cl->screen->window.serverFormat), \
+                           &cl->format, fbptr, (char *)tile,                    \
+                           cl->scaledScreen->paddedWidthInBytes, w, h);         \
+        pix   = tile;                                                           \
+        pitch = w;                                                              \
+      }                                                                         \
+                                                                                \
+      startUblen = cl->ublen;                                                   \
+      cl->updateBuf[startUblen] = 0;                                            \
+      cl->ublen++;                                                              \
+      rfbStatRecordEncodingSentAdd(cl, rfbEncodingHextile, 1);                  \
+                                                                                \
+      colours = scan->classify##bpp(pix, w, h, pitch, &newBg, &newFg);          \
+                                                                                \
+      if (!validBg || (newBg != bg))                                            \
+      { validBg = TRUE;                                                         \
+        bg = newBg;                                                             \
+        cl->updateBuf[startUblen] |= rfbHextileBackgroundSpecified;             \
+        PUT_PIXEL##bpp(bg);                                                     \
+      }                                                                         \
+                                                                                \
+      if (colours == 1)                                                         \
+      { continue;                                                               \
+      }                                                                         \
+                                                                                \
+      if (colours == 3                                                          \
+        && 1 + scan->corners##bpp(pix, w, h, pitch, bg) * (2 + bpp/8)           \
+           > w * h * (bpp/8))                                                   \
+      { goto sendRaw;                                                           \
+      }                                                                         \
+                                                                                \
+      cl->updateBuf[startUblen] |= rfbHextileAnySubrects;                       \
+                                                                                \
+      if (colours == 2)                                                         \
+      { if (!validFg || (newFg != fg))                                          \
+        { validFg = TRUE;                                                       \
+          fg = newFg;                                                           \
+          cl->updateBuf[startUblen] |= rfbHextileForegroundSpecified;           \
+          PUT_PIXEL##bpp(fg);                                                   \
         }                                                                       \
-    }                                                                           \
-                                                                                \
-    return TRUE;                                                                \
+      }                                                                         \
+      else                                                                      \
+      { validFg = FALSE;                                                        \
+        cl->updateBuf[startUblen] |= rfbHextileSubrectsColoured;                \
+      }                                                                         \
+                                                                                \
+      for (j = 0; j < h; j++)                                                   \
+      { memcpy(work + j * w, pix + j * pitch, w * (bpp/8));                     \
+      }                                                                         \
+                                                                                \
+      if (subrectEncode##bpp(cl, work, w, h, bg, fg, colours == 2))             \
+      { continue;                                                               \
+      }                                                                         \
+                                                                                \
+sendRaw:                          /* encoding was too large, use raw */         \
+      validBg = FALSE;                                                          \
+      validFg = FALSE;                                                          \
+      cl->ublen = startUblen;                                                   \
+      cl->updateBuf[cl->ublen++] = rfbHextileRaw;                               \
+                                                                                \
+      for (j = 0; j < h; j++)                                                   \
+      { memcpy(&cl->updateBuf[cl->ublen], (const char *)(pix + j * pitch),      \
+               w * (bpp/8));                                                    \
+        cl->ublen += w * (bpp/8);                                               \
+      }                                                                         \
+                                                                                \
+      rfbStatRecordEncodingSentAdd(cl, rfbEncodingHextile,                      \
+                                   w * h * (bpp/8));                            \
+  } }                                                                           \
+                                                                                \
+  return TRUE;                                                                  \
 }                                                                               \
                                                                                 \
                                                                                 \
@@ -282,54 +386,6 @@ subrectEncode##bpp(rfbClient * cl, uint##bpp##_t *data, int w, int h,          \
                                                                                 \
     return TRUE;                                                                \
 }                                                                               \
-                                                                                \
-                                                                                \
-/*                                                                              \
-   testColours() tests if there are one (solid), two (mono) or more             \
-   colours in a tile and gets a reasonable guess at the best background         \
-   pixel, and the foreground pixel for mono.                                    \
-*/                                                                             \
-                                                                                \
-static void                                                                     \
-testColours##bpp(uint##bpp##_t *data, int size, rfbBool *mono, rfbBool *solid,  \
-                 uint##bpp##_t *bg, uint##bpp##_t *fg) {                        \
-    uint##bpp##_t colour1 = 0, colour2 = 0;                                     \
-    int n1 = 0, n2 = 0;                                                         \
-    *mono = TRUE;                                                               \
-    *solid = TRUE;                                                              \
-                                                                                \
-    for (; size > 0; size--, data++) {                                          \
-                                                                                \
-        if (n1 == 0)                                                            \
-            colour1 = *data;                                                    \
-                                                                                \
-        if (*data == colour1) {                                                 \
-            n1++;                                                               \
-            continue;                                                           \
-        }                                                                       \
-                                                                                \
-        if (n2 == 0) {                                                          \
-            *solid = FALSE;                                                     \
-            colour2 = *data;                                                    \
-        }                                                                       \
-                                                                                \
-        if (*data == colour2) {                                                 \
-            n2++;                                                               \
-            continue;                                                           \
-        }                                                                       \
-                                                                                \
-        *mono = FALSE;                                                          \
-        break;                                                                  \
-    }                                                                           \
-                                                                                \
-    if (n1 > n2) {                                                              \
-        *bg = colour1;                                                          \
-        *fg = colour2;                                                          \
-    } else {                                                                    \
-        *bg = colour2;                                                          \
-        *fg = colour1;                                                          \
-    }                                                                           \
-}
 
 DEFINE_SEND_HEXTILES(  8 )
 DEFINE_SEND_HEXTILES( 16 )
@@ -0,0 +1,145 @@
+/*
+ * hextilescantemplate.c - template for the tile scans of the Hextile encoder.
+ *
+ * This file shouldn't be compiled.  It is included multiple times by
+ * hextile.c, each time with a different definition of the macro BPP and of
+ * SCAN_SUFFIX / SCAN_TARGET, which name the build as in tightscantemplate.c.
+ *
+ * Tiles are at most 16 pixels wide, so a whole row is compared at once
+ * with no early exit; only a row bringing something new is looked at pixel
+ * by pixel.
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#if !defined(BPP) || !defined(SCAN_SUFFIX) || !defined(SCAN_TARGET)
+#error "This file shouldn't be compiled."
+#error "It is included as part of hextile.c"
+#endif
+
+#define PIX_T CONCAT3E(uint,BPP,_t)
+#define HextileClassifyBPP CONCAT3E(HextileClassify,BPP,SCAN_SUFFIX)
+#define HextileCornersBPP  CONCAT3E(HextileCorners,BPP,SCAN_SUFFIX)
+
+/*
+   HextileClassifyBPP returns 1, 2 or 3 for a solid, mono or coloured tile
+   of w x h pixels at p, rows pitch pixels apart. Background and foreground
+   are the two colours met first, the background being the one seen more
+   often before a third colour turns up, ties going to the second.
+*/
+
+SCAN_TARGET static int
+HextileClassifyBPP( const PIX_T * p, int w, int h, int pitch
+                  , PIX_T * bg, PIX_T * fg )
+{ PIX_T c1= p[ 0 ], c2= 0;
+  int n1= 0, n2= 0, colours= 1;
+  int x, y, k;
+
+  for( y= 0
+     ; y < h && colours < 3
+     ; y++, p += pitch )
+  { if ( colours == 1 )
+    { PIX_T diff= 0;
+
+      for( k= 0; k < w; k++ )
+      { diff |= p[ k ] ^ c1;
+      }
+
+      if ( !diff )
+      { n1 += w;
+        continue;
+    } }
+
+    else
+    { int other= 0, same= 0;
+
+      for( k= 0; k < w; k++ )
+      { other |= ( p[ k ] != c1 ) & ( p[ k ] != c2 );
+        same  += p[ k ] == c1;
+      }
+
+      if ( !other )
+      { n1 += same;
+        n2 += w - same;
+        continue;
+    } }
+
+    for( x= 0
+       ; x < w
+       ; x++ )
+    { if ( p[ x ] == c1 )
+      { n1++;
+      }
+      else if ( colours == 1 )
+      { c2= p[ x ];
+        colours= 2;
+        n2++;
+      }
+      else if ( p[ x ] == c2 )
+      { n2++;
+      }
+      else
+      { colours= 3;
+        break;
+  } } }
+
+  if ( n1 > n2 )
+  { *bg= c1;
+    *fg= c2;
+  }
+  else
+  { *bg= c2;
+    *fg= c1;
+  }
+
+  return( colours );
+}
+
+/*
+   HextileCornersBPP counts the pixels of the tile that are not bg and
+   differ from their left and upper neighbours. No subrect can cover such a
+   pixel but the one it starts, so the tile needs at least that many.
+*/
+
+SCAN_TARGET static int
+HextileCornersBPP( const PIX_T * p, int w, int h, int pitch, PIX_T bg )
+{ const PIX_T * up;
+  int n= p[ 0 ] != bg;
+  int x, y;
+
+  for( x= 1; x < w; x++ )
+  { n += ( p[ x ] != bg ) & ( p[ x ] != p[ x - 1 ] );
+  }
+
+  for( y= 1
+     ; y < h
+     ; y++ )
+  { up= p;
+    p += pitch;
+    n += ( p[ 0 ] != bg ) & ( p[ 0 ] != up[ 0 ] );
+
+    for( x= 1; x < w; x++ )
+    { n += ( p[ x ] != bg ) & ( p[ x ] != p[ x - 1 ] ) & ( p[ x ] != up[ x ] );
+  } }
+
+  return( n );
+}
+
+#undef HextileCornersBPP
+#undef HextileClassifyBPP
+#undef PIX_T
@@ -225,13 +225,17 @@ rfbLogProc rfbErr=rfbDefaultLog;
 void rfbScheduleCopyRegion( ScreenAtom * rfbScreen
                           , sraRegionPtr copyRegion
                           , int dx,int dy )
-{ rfbClientIteratorPtr iterator;
+{ rfbClientIteratorRec iterator;
   rfbClient * cl;
 
-  iterator=rfbGetClientIterator( rfbScreen );
+  rfbScreen->fbGeneration++;
+  rfbWakeClients( rfbScreen );
+  rfbDamageSync( rfbScreen, copyRegion );
 
-  while((cl=rfbClientIteratorNext(iterator)))
-  { if(cl->useCopyRect)
+  rfbForEachClient( iterator, rfbScreen, cl )
+  { rfbDamageCollect(cl);  /* Earlier damage has to move with the copy */
+
+    if(cl->useCopyRect)
     { sraRegionPtr modifiedRegionBackup;
       if(!sraRgnEmpty(cl->copyRegion))
       { if(cl->copyDX!=dx || cl->copyDY!=dy)
@@ -307,11 +311,7 @@ void rfbScheduleCopyRegion( ScreenAtom * rfbScreen
     }
     else
     { sraRgnOr(cl->modifiedRegion,copyRegion);
-    }
-  }
-
-  rfbReleaseClientIterator(iterator);
-}
+} } }
 
 void rfbDoCopyRegion( ScreenAtom * screen
                     , sraRegionPtr copyRegion
@@ -362,18 +362,21 @@ void rfbScheduleCopyRect( ScreenAtom * screen,int x1,int y1,int x2,int y2,int dx
 
 void rfbMarkRegionAsModified( ScreenAtom * screen
                             , sraRegionPtr modRegion )
-{ rfbClientIteratorPtr iterator;
+{ rfbClientIteratorRec iterator;
   rfbClient * cl;
 
-  iterator= rfbGetClientIterator( screen );
+  rfbWakeClients( screen );
 
-  while(( cl= rfbClientIteratorNext( iterator ) ))
-  { sraRgnOr( cl->modifiedRegion
-              , modRegion);
+  if ( rfbDamageMarkRegion( screen, modRegion ))
+  { return;
   }
 
-  rfbReleaseClientIterator( iterator );
-}
+  screen->fbGeneration++;
+
+  rfbForEachClient( iterator, screen, cl )
+  { sraRgnOr( cl->modifiedRegion
+              , modRegion);
+} }
 
 void rfbScaledScreenUpdate( ScreenAtom * screen
                           , int x1, int y1
@@ -418,6 +421,11 @@ void rfbMarkRectAsModified( ScreenAtom * screen
 
   /* update scaled copies for this rectangle */
   rfbScaledScreenUpdate(screen,x1,y1,x2,y2);
+  rfbWakeClients( screen );
+
+  if ( rfbDamageMarkRect( screen,x1,y1,x2,y2 ))
+  { return;
+  }
 
   region = sraRgnCreateRect(x1,y1,x2,y2);
   rfbMarkRegionAsModified( screen,region);
@@ -426,6 +434,7 @@ void rfbMarkRectAsModified( ScreenAtom * screen
 
 void rfbStartOnHoldClient(rfbClient * cl)
 { cl->onHold = FALSE;
+  rfbClientReady(cl);
 }
 
 
@@ -441,7 +450,7 @@ static void rfbDefaultKbdAddEvent(rfbBool down, rfbKeySym keySym, rfbClient * cl
 void rfbDefaultPtrAddEvent( int buttonMask
                           , int x, int y
                           , rfbClient * cl )
-{ rfbClientIteratorPtr iterator;
+{ rfbClientIteratorRec iterator;
   rfbClient * other_client;
   ScreenAtom * s = &cl->screen->window;
 
@@ -455,13 +464,12 @@ void rfbDefaultPtrAddEvent( int buttonMask
 
     /* But inform all remaining clients about this cursor movement.
     */
-    iterator = rfbGetClientIterator( s );
-    while ((other_client = rfbClientIteratorNext(iterator)) != NULL)
+    rfbForEachClient( iterator, s, other_client )
     { if (other_client != cl && other_client->enableCursorPosUpdates)
       { other_client->cursorWasMoved = TRUE;
     } }
 
-    rfbReleaseClientIterator(iterator);
+    rfbWakeClients( s );
 } }
 
 static void rfbDefaultSetXCutText(char* text, int len, rfbClient * cl)
@@ -673,6 +681,16 @@ int setVncEvents( struct _rfbScreenInfo * screen
   return( 1 );
 }
 
+int setVncVecPusher( struct _rfbScreenInfo * screen
+                   , VncPushVecFun pusher )
+{ if ( screen )
+  { screen->streamVecPusher= pusher;
+    return( 0 );
+  }
+
+  return( 1 );
+}
+
 int setVncAuth( rfbScreenInfo * screen
               , const char * name             // desktop name
               , const char * pass
@@ -706,6 +724,11 @@ rfbScreenInfo * rfbGetScreen( void * frameBuffer
                             , int bytesPerPixel )
 { rfbScreenInfo * screen= calloc(sizeof(rfbScreenInfo),1);
 
+  if ( !rfbInitScratchLock( screen ))
+  { FREE( screen );
+    return( NULL );
+  }
+
   if ( width & 3 )
   { rfbErr("WARNING: Width (%d) is not a multiple of 4. VncViewer has problems with that.\n",width);
   }
@@ -735,6 +758,8 @@ rfbScreenInfo * rfbGetScreen( void * frameBuffer
   screen->progressiveSliceHeight = 0; /* disable progressive updating per default */
   screen->deferUpdateTime= 5;
   screen->maxRectsPerUpdate= 50;
+  screen->encCacheLimit= 8 << 20;
+  screen->maxClientBacklog= 1 << 20;
 
   screen->handleEventsEagerly = FALSE;
 
@@ -814,7 +839,7 @@ void rfbNewFramebuffer( rfbScreenInfo * screen, char *framebuffer
                       , int bytesPerPixel )
 { rfbPixelFormat old_format;
   rfbBool format_changed = FALSE;
-  rfbClientIteratorPtr iterator;
+  rfbClientIteratorRec iterator;
   rfbClient * cl;
 
   /* Update information in the screenInfo structure */
@@ -837,6 +862,8 @@ void rfbNewFramebuffer( rfbScreenInfo * screen, char *framebuffer
   }
 
   screen->window.frameBuffer= framebuffer;
+  screen->window.fbGeneration++;
+  rfbDamageFree(&screen->window);
 
   /* Adjust pointer position if necessary */
 
@@ -849,9 +876,7 @@ void rfbNewFramebuffer( rfbScreenInfo * screen, char *framebuffer
   }
 
   /* For each client: */
-  iterator = rfbGetClientIterator( &screen->window );
-
-  while ((cl = rfbClientIteratorNext(iterator)))
+  rfbForEachClient( iterator, &screen->window, cl )
   { if (format_changed) /* Re-install color translation tables if necessary */
     { screen->setTranslateFunction(cl);
     }
@@ -869,22 +894,24 @@ void rfbNewFramebuffer( rfbScreenInfo * screen, char *framebuffer
       cl->newFBSizePending = TRUE;
 
   }
-  rfbReleaseClientIterator(iterator);
+  rfbWakeClients( &screen->window );
 }
 
 /* hang up on all clients and free all reserved memory */
 
 void rfbScreenCleanup(rfbScreenInfo * screen)
-{ rfbClientIteratorPtr i=rfbGetClientIterator( &screen->window );
-  rfbClient * cl
-  , * cl1= rfbClientIteratorNext(i);
-
-  while(cl1)
-  { cl=rfbClientIteratorNext(i);
-    rfbClientConnectionGone(cl1);
-    cl1=cl;
+{ rfbClientIteratorRec i;
+  rfbClient * cl;
+
+  rfbForEachClient( i, &screen->window, cl )
+  { rfbClientConnectionGone(cl);
   }
-  rfbReleaseClientIterator(i);
+
+  rfbReclaimClients(&screen->window);  /* Threads holding clients are done by now */
+  rfbFreeEncodePool(screen);
+  rfbFreeBufPool(screen);
+  rfbEncCacheFlush(screen);
+  rfbDamageFree(&screen->window);
 
 #define FREE_IF(x) if(screen->x) free(screen->x)
   FREE_IF( colourMap.data.bytes);
@@ -908,6 +935,7 @@ void rfbScreenCleanup(rfbScreenInfo * screen)
   }
 
 #endif
+  rfbFreeScratchLock(screen);
   FREE( screen );
 }
 
@@ -921,20 +949,12 @@ void rfbInitServer(rfbScreenInfo * screen)
 
 void rfbShutdownServer(rfbScreenInfo * screen,rfbBool disconnectClients)
 { if(disconnectClients)
-  { rfbClientIteratorPtr iter= rfbGetClientIterator( &screen->window );
-    rfbClient * nextCl
-    , * currentCl = rfbClientIteratorNext(iter);
-
-    while(currentCl)
-    { nextCl = rfbClientIteratorNext(iter);
+  { rfbClientIteratorRec iter;
+    rfbClient * currentCl;
 
-      rfbClientConnectionGone(currentCl);
-
-      currentCl = nextCl;
-    }
-
-    rfbReleaseClientIterator(iter);
-  }
+    rfbForEachClient( iter, &screen->window, currentCl )
+    { rfbClientConnectionGone(currentCl);
+  } }
 
 //  rfbShutdownSockets(screen);
 // rfbHttpShutdownSockets(screen);
@@ -959,104 +979,282 @@ int  gettimeofday123( struct timeval*  tv,char *  dummy )
 
 #endif
 
-extern rfbClientIteratorPtr rfbGetClientIteratorWithClosed(rfbScreenInfo * rfbScreen);
-// JACS
-rfbBool rfbUpdateClients( rfbScreenInfo * screen )
-{ //rfbClient * clPrev;
-  rfbClientIteratorPtr i= rfbGetClientIteratorWithClosed(screen);
-  rfbClient * cl= rfbClientIteratorHead(i);
-  rfbBool result=FALSE;
+static rfbBool rfbUpdateClientAt( rfbClient * cl, uint64_t now );
+static void    rfbClientSettle(   rfbClient * cl );
 
-  while(cl)
-  { result = rfbUpdateClient(cl);
-    //clPrev=cl;
-    cl=rfbClientIteratorNext(i);
+/*
+   Clients with a request out sit on one of two lists of their screen.
+   Those on the ready list may have something to send and are the only
+   ones rfbProcessEvents() looks at, those on the waiting list have
+   nothing until damage comes, which moves them all over at once. Idle
+   viewers thus cost nothing per pass, whatever their number.
+*/
+
+static void rfbReadyLink( rfbClient * cl, rfbClient ** head, int state )
+{ cl->readyNext= *head;
+  if ( cl->readyNext )
+  { cl->readyNext->readyLink= &cl->readyNext;
   }
-  rfbReleaseClientIterator(i);
-  return( result );
+  *head         = cl;
+  cl->readyLink = head;
+  cl->readyState= state;
 }
 
+static void rfbReadyUnlink( rfbClient * cl )
+{ if ( cl->readyLink )
+  { *cl->readyLink= cl->readyNext;
+    if ( cl->readyNext )
+    { cl->readyNext->readyLink= cl->readyLink;
+    }
+    cl->readyLink = NULL;
+    cl->readyState= RFB_READY_IDLE;
+} }
+
 /**
+ *  Puts cl on the ready list, to be looked at on the next pass. Hosts
+ * changing client state themselves call it too.
  */
-rfbBool rfbProcessEvents( rfbScreenInfo * screen
-                        , rfbLong usec)
-{ rfbClientIteratorPtr i;
+void rfbClientReady( rfbClient * cl )
+{ if ( cl->readyState == RFB_READY_GONE
+    || cl->readyState == RFB_READY_LISTED )
+  { return;
+  }
+
+  rfbReadyUnlink( cl );
+  rfbReadyLink( cl, &cl->screen->window.readyHead, RFB_READY_LISTED );
+}
+
+/**
+ *  Damage came, every waiting client may have something to send now
+ */
+void rfbWakeClients( ScreenAtom * atom )
+{ rfbClient * cl;
+
+  while(( cl= atom->waitHead ))
+  { rfbReadyUnlink( cl );
+    rfbReadyLink( cl, &atom->readyHead, RFB_READY_LISTED );
+} }
+
+/**
+ *  Updates the clients on the ready list, reading the clock once for all
+ * of them. The list is taken over first, settling puts back those still
+ * ready for the next pass. Each client is held while it is updated, one
+ * the pusher reports gone meanwhile is released by the next
+ * rfbReclaimClients().
+ */
+static rfbBool rfbUpdateClientsAt( rfbScreenInfo * screen, uint64_t now )
+{ rfbClient * pass= NULL;
   rfbClient * cl;
   rfbBool result=FALSE;
 
-  if( usec < 0 )
+  rfbReclaimClients( &screen->window );
+  rfbDamageDrain( &screen->window );
+  rfbTimerExpire( &screen->timers, now );
+
+  while(( cl= screen->window.readyHead ))
+  { rfbReadyUnlink( cl );
+    rfbReadyLink( cl, &pass, RFB_READY_LISTED );
+  }
+
+  while(( cl= pass ))
+  { rfbReadyUnlink( cl );
+    rfbIncrClientRef( cl );
+    if ( rfbUpdateClientAt( cl, now ))
+    { result= TRUE;
+    }
+    rfbClientSettle( cl );
+    rfbDecrClientRef( cl );
+  }
+
+  return result;
+}
+
+// JACS
+rfbBool rfbUpdateClients( rfbScreenInfo * screen )
+{ return( rfbUpdateClientsAt( screen, rfbTimerNow() ));
+}
+
+/**
+ */
+rfbBool rfbProcessEvents( rfbScreenInfo * screen
+                        , rfbLong usec)
+{ if( usec < 0 )
   { usec= screen->deferUpdateTime * 1000;
   }
 
-  i = rfbGetClientIteratorWithClosed(screen);
-  cl=rfbClientIteratorHead(i);
+  return( rfbUpdateClientsAt( screen, rfbTimerNow() ));
+}
 
-  while(cl)
-  { result = rfbUpdateClient(cl);
-   // clPrev=cl;
-    cl=rfbClientIteratorNext(i);
+/**
+ *  Microseconds the host may wait before calling rfbProcessEvents() again,
+ * 0 when something is due and -1 when nothing waits on a timer. Input,
+ * requests and damage arriving meanwhile need a call of their own.
+ */
+rfbLong rfbNextDeadline( rfbScreenInfo * screen )
+{ if ( screen->window.readyHead
+    || rfbDamageQueued( &screen->window ))
+  { return( 0 );
   }
-  rfbReleaseClientIterator(i);
 
-  return result;
+  return( rfbTimerNext( &screen->timers, rfbTimerNow() ));
 }
 
 /**
+ *  Tells how many bytes the host still has queued for cl, call whenever it
+ *  changes, also from inside the pusher. Hosts that never call it are
+ *  never held back.
  */
-rfbBool rfbUpdateClient( rfbClient * cl )
-{ struct timeval tv;
+void rfbClientBacklog( rfbClient * cl, size_t queued )
+{ size_t limit= cl->screen->maxClientBacklog;
+
+  if ( limit && cl->backlog > limit && queued <= limit )
+  { rfbClientReady( cl );            /* Drained, what piled up can go */
+  }
+
+  cl->backlog= queued;
+}
+
+/**
+ *  Whether cl has more queued than the screen allows, updates wait then
+ */
+static rfbBool rfbClientCongested( rfbClient * cl )
+{ size_t limit= cl->screen->maxClientBacklog;
+
+  return( limit && cl->backlog > limit );
+}
+
+/**
+ *  Whether an update for cl may go out now
+ */
+static rfbBool rfbClientWantsUpdate( rfbClient * cl )
+{ return( !cl->onHold
+       && FB_UPDATE_PENDING(cl)
+       && !sraRgnEmpty(cl->requestedRegion)
+       && !rfbClientCongested( cl ));
+}
+
+/**
+ *  Defer timer expired, sends what piled up meanwhile
+ */
+static void rfbDeferredUpdate( rfbTimer * t, void * data )
+{ rfbClient * cl= (rfbClient *)data;
+
+  rfbIncrClientRef( cl );
+  if ( rfbClientWantsUpdate( cl ))
+  { rfbSendFramebufferUpdate( cl, cl->modifiedRegion );
+  }
+
+  rfbClientSettle( cl );
+  rfbDecrClientRef( cl );
+}
+
+/**
+ *  Pointer timer expired, hands over the last position moved to
+ */
+static void rfbDeferredPointer( rfbTimer * t, void * data )
+{ rfbClient * cl= (rfbClient *)data;
+
+  if ( !cl->viewOnly && cl->lastPtrX >= 0 )
+  { rfbIncrClientRef( cl );          /* The hook may hang up on it */
+    cl->screen->ptrAddEvent( cl->lastPtrButtons
+                           , cl->lastPtrX
+                           , cl->lastPtrY, cl );
+    cl->lastPtrX = -1;
+    rfbDecrClientRef( cl );
+} }
+
+/**
+ *  Takes cl off the ready list after it was looked at, unless it was made
+ * ready again meanwhile. With a request still out it waits for the next
+ * damage or message, what it could do right now was done, damage outside
+ * the request included.
+ */
+static void rfbClientSettle( rfbClient * cl )
+{ if ( cl->readyState == RFB_READY_GONE
+    || cl->readyState == RFB_READY_LISTED )
+  { return;
+  }
+
+  rfbReadyUnlink( cl );
+
+  if ( !sraRgnEmpty( cl->requestedRegion )
+    && !rfbTimerRunning( &cl->deferTimer ))   /* Else it comes back when that fires */
+  { rfbReadyLink( cl, &cl->screen->window.waitHead, RFB_READY_WAITING );
+} }
+
+void rfbInitClientScheduling( rfbClient * cl )
+{ rfbTimerInit( &cl->deferTimer, rfbDeferredUpdate,  cl );
+  rfbTimerInit( &cl->ptrTimer,   rfbDeferredPointer, cl );
+  cl->readyNext = NULL;
+  cl->readyLink = NULL;
+  cl->readyState= RFB_READY_IDLE;
+}
+
+void rfbStopClientScheduling( rfbClient * cl )
+{ rfbTimerStop( &cl->screen->timers, &cl->deferTimer );
+  rfbTimerStop( &cl->screen->timers, &cl->ptrTimer   );
+  rfbReadyUnlink( cl );
+  cl->readyState= RFB_READY_GONE;
+}
+
+/**
+ *  Sends the update or pointer event that is due, starts the timers for
+ * those that have to wait
+ */
+static rfbBool rfbUpdateClientAt( rfbClient * cl, uint64_t now )
+{ rfbScreenInfo * screen = cl->screen;
   rfbBool result=FALSE;
-  rfbScreenInfo * screen = cl->screen;
 
   if ( !cl->onHold
        && FB_UPDATE_PENDING(cl)
        && !sraRgnEmpty(cl->requestedRegion))
   { result=TRUE;
-    if ( screen->deferUpdateTime == 0)
+    if ( rfbClientCongested( cl ))
+    { /* Damage keeps coalescing, the latest state goes once it drains */
+    }
+
+    else if ( screen->deferUpdateTime == 0)
     { rfbSendFramebufferUpdate(cl,cl->modifiedRegion);
     }
 
-    else if(cl->startDeferring.tv_usec == 0)
-    { gettimeofday(&cl->startDeferring,NULL);
-      if(cl->startDeferring.tv_usec == 0)
-        cl->startDeferring.tv_usec++;
+    else if ( !rfbTimerRunning( &cl->deferTimer ))
+    { rfbTimerStart( &screen->timers, &cl->deferTimer
+                   , now + (uint64_t)screen->deferUpdateTime * 1000 );
     }
 
-    else
-    { gettimeofday(&tv,NULL);
-      if ( tv.tv_sec < cl->startDeferring.tv_sec /* at midnight */
-           || ((tv.tv_sec-cl->startDeferring.tv_sec)*1000
-               +(tv.tv_usec-cl->startDeferring.tv_usec)/1000)
-           > screen->deferUpdateTime)
-      { cl->startDeferring.tv_usec = 0;
-        rfbSendFramebufferUpdate( cl,cl->modifiedRegion );
-  } } }
+    else if ( cl->deferTimer.deadline <= now )
+    { rfbTimerStop( &screen->timers, &cl->deferTimer );
+      rfbSendFramebufferUpdate( cl,cl->modifiedRegion );
+  } }
 
   if (!cl->viewOnly && cl->lastPtrX >= 0)
-  { if( cl->startPtrDeferring.tv_usec == 0)
-    { gettimeofday(&cl->startPtrDeferring,NULL);
-
-      if(cl->startPtrDeferring.tv_usec == 0)
-        cl->startPtrDeferring.tv_usec++;
+  { if ( !rfbTimerRunning( &cl->ptrTimer ))
+    { rfbTimerStart( &screen->timers, &cl->ptrTimer
+                   , now + (uint64_t)screen->deferPtrUpdateTime * 1000 );
     }
 
-    else
-    { struct timeval tv;
-      gettimeofday(&tv,NULL);
-      if(tv.tv_sec < cl->startPtrDeferring.tv_sec /* at midnight */
-          || ((tv.tv_sec-cl->startPtrDeferring.tv_sec)*1000
-              +(tv.tv_usec-cl->startPtrDeferring.tv_usec)/1000)
-          > cl->screen->deferPtrUpdateTime)
-      { cl->startPtrDeferring.tv_usec = 0;
-        cl->screen->ptrAddEvent(cl->lastPtrButtons,
-                                cl->lastPtrX,
-                                cl->lastPtrY, cl);
-        cl->lastPtrX = -1;
-  } } }
+    else if ( cl->ptrTimer.deadline <= now )
+    { rfbTimerStop( &screen->timers, &cl->ptrTimer );
+      rfbDeferredPointer( &cl->ptrTimer, cl );
+  } }
 
   return result;
 }
 
+/**
+ */
+rfbBool rfbUpdateClient( rfbClient * cl )
+{ rfbBool result;
+
+  rfbDamageDrain( &cl->screen->window );
+  rfbIncrClientRef( cl );
+  result= rfbUpdateClientAt( cl, rfbTimerNow() );
+
+  rfbClientSettle( cl );
+  rfbDecrClientRef( cl );
+  return( result );
+}
+
 rfbBool rfbIsActive(rfbScreenInfo * screenInfo)
 { return( screenInfo->window.clientHead != NULL );
 }
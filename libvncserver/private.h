@@ -10,6 +10,8 @@ void rfbRedrawAfterHideCursor(rfbClient * cl,sraRegionPtr updateRegion);
 /* from main.c */
 
 rfbClient * rfbClientIteratorHead(rfbClientIteratorPtr i);
+void rfbInitClientScheduling(rfbClient * cl);
+void rfbStopClientScheduling(rfbClient * cl);
 
 /* from tight.c */
 
@@ -19,7 +21,13 @@ extern void rfbTightCleanup(rfbScreenInfo * screen);
 #endif
 
 /* from zlib.c */
+#define RFB_SCRATCH_ROUND 4096  /* Scratch buffers grow and shrink by this much */
+
+extern rfbBool rfbScratchReserve(char ** buf, int * size, int need, int * peak);
+extern void rfbScratchShrink(char ** buf, int * size, int peak);
 extern void rfbZlibCleanup(rfbScreenInfo * screen);
+extern int rfbZlibDeflateRows(z_stream * zs, const char * rows,
+                              int bytesPerLine, int stride, int h);
 
 /* from zrle.c */
 void rfbFreeZrleData(rfbClient * cl);
@@ -3,807 +3,743 @@
 
    A general purpose region clipping library
    Only deals with rectangular regions, though.
+
+   Regions are kept as a sorted array of horizontal bands, each one
+   pointing to a run of sorted, non touching x spans in a second array
+   (the X11 / pixman layout). Boolean operations sweep both regions top to
+   bottom and build the result in one pass, so there is one allocation per
+   array instead of one per span, and copies are two memcpy's.
 */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
 #include <rfb/rfbproto.h>
 #include <rfb/rfbregion.h>
 
-/* -=- Internal Span structure */
-
-struct sraRegion;
+/* -=- Internal structures */
 
 typedef struct sraSpan
-{ struct sraSpan *_next;
-  struct sraSpan *_prev;
-  int start;
-  int end;
-  struct sraRegion *subspan;
+{ int x1, x2;
 } sraSpan;
 
-typedef struct sraRegion
-{ sraSpan front;
-  sraSpan back;
-} sraSpanList;
+typedef struct sraBand
+{ int y1, y2;
+  int first, count;                  /* Run of spans belonging to the band */
+} sraBand;
 
-/* -=- Span routines */
+struct sraRegion
+{ sraBand * bands;
+  int nBands, maxBands;
+  sraSpan * spans;
+  int nSpans, maxSpans;              /* nSpans may include holes left by PopRect */
+  sraBand * bandStore;               /* Storage we must not free */
+  sraSpan * spanStore;
+  sraBand band1;                     /* That storage for a single rect */
+  sraSpan span1;
+};
 
-sraSpanList *sraSpanListDup(const sraSpanList *src);
-void sraSpanListDestroy(sraSpanList *list);
+enum { SRA_OR, SRA_AND, SRA_SUB };
 
-static sraSpan *
-sraSpanCreate(int start, int end, const sraSpanList *subspan)
-{ sraSpan *item = (sraSpan*)malloc(sizeof(sraSpan));
-  item->_next = item->_prev = NULL;
-  item->start = start;
-  item->end = end;
-  item->subspan = sraSpanListDup(subspan);
-  return item;
-}
+/* Stack room for the result of an operation, grows into the heap */
+#define SRA_SCRATCH_BANDS  64
+#define SRA_SCRATCH_SPANS 256
 
-static sraSpan *
-sraSpanDup(const sraSpan *src)
-{ sraSpan *span;
-  if (!src) return NULL;
-  span = sraSpanCreate(src->start, src->end, src->subspan);
-  return span;
-}
+/* -=- Storage routines */
 
-static void sraSpanInsertAfter(sraSpan *newspan, sraSpan *after)
-{ newspan->_next = after->_next;
-  newspan->_prev = after;
-  after->_next->_prev = newspan;
-  after->_next = newspan;
+static void sraRgnInit( sraRegion * rgn
+                      , sraBand * bands, int maxBands
+                      , sraSpan * spans, int maxSpans )
+{ rgn->bands= rgn->bandStore= bands;
+  rgn->spans= rgn->spanStore= spans;
+  rgn->maxBands= maxBands;
+  rgn->maxSpans= maxSpans;
+  rgn->nBands= rgn->nSpans= 0;
 }
 
-static void sraSpanInsertBefore(sraSpan *newspan, sraSpan *before)
-{ newspan->_next = before;
-  newspan->_prev = before->_prev;
-  before->_prev->_next = newspan;
-  before->_prev = newspan;
-}
+static void sraRgnFreeArrays( sraRegion * rgn )
+{ if ( rgn->bands != rgn->bandStore )
+  { free( rgn->bands );
+  }
 
-static void sraSpanRemove(sraSpan *span)
-{ span->_prev->_next = span->_next;
-  span->_next->_prev = span->_prev;
-}
+  if ( rgn->spans != rgn->spanStore )
+  { free( rgn->spans );
+} }
 
-static void sraSpanDestroy(sraSpan *span)
-{ if ( span )
-  { if ( span->subspan )
-    { sraSpanListDestroy(span->subspan);
-    }
-    FREE( span );
+/**
+ *  Makes room for need elements of size sz, moving out of the fixed
+ * storage the first time it grows.
+ */
+static rfbBool sraGrow( void ** array, int * max
+                      , void * store, int used
+                      , int need, size_t sz )
+{ int size= *max;
+  void * grown;
+
+  if ( need <= size )
+  { return( TRUE );
   }
-}
 
-#ifdef DEBUG
-static void
-sraSpanCheck(const sraSpan *span, const char *text)
-{ /* Check the span is valid! */
-  if (span->start == span->end)
-  { printf(text);
-    printf(":%d-%d\n", span->start, span->end);
+  while( size < need )
+  { size= size < 8 ? 8 : size << 1;
   }
+
+  if ( *array == store )
+  { if (( grown= malloc( size * sz )))
+    { memcpy( grown, *array, used * sz );
+  } }
+  else
+  { grown= realloc( *array, size * sz );
+  }
+
+  if ( !grown )
+  { rfbErr("sraGrow: out of memory (%d elements)\n", size );
+    return( FALSE );
+  }
+
+  *array= grown;
+  *max  = size;
+  return( TRUE );
 }
-#endif
 
-/* -=- SpanList routines */
+#define sraGrowBands( rgn, need )                                \
+  ( (need) <= (rgn)->maxBands                                    \
+ || sraGrow( (void **)&(rgn)->bands, &(rgn)->maxBands            \
+           , (rgn)->bandStore, (rgn)->nBands, need, sizeof( sraBand )))
 
-static void sraSpanPrint(const sraSpan *s);
+#define sraGrowSpans( rgn, need )                                \
+  ( (need) <= (rgn)->maxSpans                                    \
+ || sraGrow( (void **)&(rgn)->spans, &(rgn)->maxSpans            \
+           , (rgn)->spanStore, (rgn)->nSpans, need, sizeof( sraSpan )))
 
-static void
-sraSpanListPrint(const sraSpanList *l)
-{ sraSpan *curr;
-  if (!l)
-  { printf("NULL");
-    return;
+/**
+ *  Copies src into dst packing the spans, dst must be empty
+ */
+static rfbBool sraRgnCopy( sraRegion * dst, const sraRegion * src )
+{ int b, n= 0;
+
+  for( b= 0; b < src->nBands; b++ )
+  { n += src->bands[ b ].count;
   }
-  curr = l->front._next;
-  printf("[");
-  while (curr != &(l->back))
-  { sraSpanPrint(curr);
-    curr = curr->_next;
+
+  if ( !sraGrowBands( dst, src->nBands )
+    || !sraGrowSpans( dst, n ))
+  { return( FALSE );
   }
-  printf("]");
-}
 
-void
-sraSpanPrint(const sraSpan *s)
-{ printf("(%d-%d)", (s->start), (s->end));
-  if (s->subspan)
-    sraSpanListPrint(s->subspan);
-}
+  for( b= 0, n= 0; b < src->nBands; b++ )
+  { const sraBand * band= src->bands + b;
+
+    dst->bands[ b ]= *band;
+    dst->bands[ b ].first= n;
+    memcpy( dst->spans + n, src->spans + band->first, band->count * sizeof( sraSpan ));
+    n += band->count;
+  }
 
-static sraSpanList *
-sraSpanListCreate(void)
-{ sraSpanList *item = (sraSpanList*)malloc(sizeof(sraSpanList));
-  item->front._next = &(item->back);
-  item->front._prev = NULL;
-  item->back._prev = &(item->front);
-  item->back._next = NULL;
-  return item;
+  dst->nBands= src->nBands;
+  dst->nSpans= n;
+  return( TRUE );
 }
 
-sraSpanList *
-sraSpanListDup(const sraSpanList *src)
-{ sraSpanList *newlist;
-  sraSpan *newspan, *curr;
+/**
+ *  Replaces bands lo to hi of dst with the ones in out
+ */
+static rfbBool sraSplice( sraRegion * dst, int lo, int hi, const sraRegion * out )
+{ int head = lo < dst->nBands ? dst->bands[ lo ].first : dst->nSpans;
+  int tail = hi < dst->nBands ? dst->bands[ hi ].first : dst->nSpans;
+  int nTail= dst->nBands - hi;
+  int nSpans= head + out->nSpans + dst->nSpans - tail;
+  int nBands= lo + out->nBands + nTail;
+  int b;
 
-  if (!src) return NULL;
-  newlist = sraSpanListCreate();
-  curr = src->front._next;
-  while (curr != &(src->back))
-  { newspan = sraSpanDup(curr);
-    sraSpanInsertBefore(newspan, &(newlist->back));
-    curr = curr->_next;
+  if ( !sraGrowSpans( dst, nSpans )
+    || !sraGrowBands( dst, nBands ))
+  { return( FALSE );
   }
 
-  return newlist;
-}
+  memmove( dst->spans + head + out->nSpans, dst->spans + tail
+         , ( dst->nSpans - tail ) * sizeof( sraSpan ));
+  memcpy( dst->spans + head, out->spans, out->nSpans * sizeof( sraSpan ));
 
-void sraSpanListDestroy(sraSpanList *list)
-{ sraSpan *curr, *next;
+  memmove( dst->bands + lo + out->nBands, dst->bands + hi, nTail * sizeof( sraBand ));
+  for( b= 0; b < out->nBands; b++ )
+  { dst->bands[ lo + b ]= out->bands[ b ];
+    dst->bands[ lo + b ].first += head;
+  }
 
-  while (list->front._next != &(list->back))
-  { curr = list->front._next;
-    next = curr->_next;
-    sraSpanRemove(curr);
-    sraSpanDestroy(curr);
-    curr = next;
+  for( b= lo + out->nBands; b < nBands; b++ )
+  { dst->bands[ b ].first += head + out->nSpans - tail;
   }
 
-  FREE( list );
+  dst->nBands= nBands;
+  dst->nSpans= nBands ? nSpans : 0;
+  return( TRUE );
 }
 
-static void
-sraSpanListMakeEmpty(sraSpanList *list)
-{ sraSpan *curr, *next;
-  while (list->front._next != &(list->back))
-  { curr = list->front._next;
-    next = curr->_next;
-    sraSpanRemove(curr);
-    sraSpanDestroy(curr);
-    curr = next;
-  }
-  list->front._next = &(list->back);
-  list->front._prev = NULL;
-  list->back._prev = &(list->front);
-  list->back._next = NULL;
-}
+/**
+ *  First band ending below y
+ */
+static int sraBandEndingBelow( const sraRegion * rgn, int y )
+{ int lo= 0, hi= rgn->nBands;
 
-static rfbBool
-sraSpanListEqual(const sraSpanList *s1, const sraSpanList *s2)
-{ sraSpan *sp1, *sp2;
+  while( lo < hi )
+  { int mid= ( lo + hi ) >> 1;
 
-  if (!s1)
-  { if (!s2)
-    { return 1;
-    }
-    else
-    { rfbErr("sraSpanListEqual:incompatible spans (only one NULL!)\n");
-      return FALSE;
-    }
+    if ( rgn->bands[ mid ].y2 <= y ) lo= mid + 1; else hi= mid;
   }
 
-  sp1 = s1->front._next;
-  sp2 = s2->front._next;
-  while ((sp1 != &(s1->back)) &&
-         (sp2 != &(s2->back)))
-  { if ((sp1->start != sp2->start) ||
-        (sp1->end != sp2->end) ||
-        (!sraSpanListEqual(sp1->subspan, sp2->subspan)))
-    { return 0;
-    }
-    sp1 = sp1->_next;
-    sp2 = sp2->_next;
-  }
+  return( lo );
+}
 
-  if ((sp1 == &(s1->back)) && (sp2 == &(s2->back)))
-  { return 1;
-  }
-  else
-  { return 0;
+/**
+ *  First band starting at y or below
+ */
+static int sraBandStartingAt( const sraRegion * rgn, int y )
+{ int lo= 0, hi= rgn->nBands;
+
+  while( lo < hi )
+  { int mid= ( lo + hi ) >> 1;
+
+    if ( rgn->bands[ mid ].y1 < y ) lo= mid + 1; else hi= mid;
   }
-}
 
-static rfbBool
-sraSpanListEmpty(const sraSpanList *list)
-{ return (list->front._next == &(list->back));
+  return( lo );
 }
 
-static rfbDword
-sraSpanListCount(const sraSpanList *list)
-{ sraSpan *curr = list->front._next;
+/**
+ *  Merges band b into the one above when they touch and have the same
+ * spans. Its spans are left as a hole.
+ */
+static void sraMergeBand( sraRegion * rgn, int b )
+{ sraBand * band= rgn->bands + b;
+  sraBand * prev= band - 1;
 
-  rfbDword count = 0;
-  while (curr != &(list->back))
-  { if (curr->subspan)
-    { count += sraSpanListCount(curr->subspan);
-    }
-    else
-    { count += 1;
-    }
-    curr = curr->_next;
+  if ( b > 0 && b < rgn->nBands
+    && prev->y2 == band->y1
+    && prev->count == band->count
+    && !memcmp( rgn->spans + prev->first
+              , rgn->spans + band->first
+              , band->count * sizeof( sraSpan )))
+  { prev->y2= band->y2;
+    memmove( band, band + 1, ( rgn->nBands - b - 1 ) * sizeof( sraBand ));
+    rgn->nBands--;
+} }
+
+/* -=- Result building */
+
+static rfbBool sraOpenBand( sraRegion * rgn, int y1, int y2 )
+{ sraBand * band;
+
+  if ( !sraGrowBands( rgn, rgn->nBands + 1 ))
+  { return( FALSE );
   }
-  return count;
+
+  band= rgn->bands + rgn->nBands++;
+  band->y1= y1;
+  band->y2= y2;
+  band->first= rgn->nSpans;
+  band->count= 0;
+  return( TRUE );
 }
 
-static void
-sraSpanMergePrevious(sraSpan *dest)
-{ sraSpan *prev = dest->_prev;
-
-  while ((prev->_prev) &&
-         (prev->end == dest->start) &&
-         (sraSpanListEqual(prev->subspan, dest->subspan)))
-  { /*
-      printf("merge_prev:");
-      sraSpanPrint(prev);
-      printf(" & ");
-      sraSpanPrint(dest);
-      printf("\n");
-    */
-    dest->start = prev->start;
-    sraSpanRemove(prev);
-    sraSpanDestroy(prev);
-    prev = dest->_prev;
+/**
+ *  Adds a span to the last band, joining it to the previous one when they
+ * touch. Spans must come in x1 order.
+ */
+static rfbBool sraAddSpan( sraRegion * rgn, int x1, int x2 )
+{ sraBand * band= rgn->bands + rgn->nBands - 1;
+  sraSpan * last;
+
+  if ( x1 >= x2 )
+  { return( TRUE );
   }
-}
 
-static void
-sraSpanMergeNext(sraSpan *dest)
-{ sraSpan *next = dest->_next;
-  while ((next->_next) &&
-         (next->start == dest->end) &&
-         (sraSpanListEqual(next->subspan, dest->subspan)))
-  { /*
-        printf("merge_next:");
-        sraSpanPrint(dest);
-        printf(" & ");
-        sraSpanPrint(next);
-        printf("\n");
-    */
-    dest->end = next->end;
-    sraSpanRemove(next);
-    sraSpanDestroy(next);
-    next = dest->_next;
+  if ( band->count )
+  { last= rgn->spans + rgn->nSpans - 1;
+
+    if ( x1 <= last->x2 )
+    { if ( x2 > last->x2 )
+      { last->x2= x2;
+      }
+      return( TRUE );
+  } }
+
+  if ( !sraGrowSpans( rgn, rgn->nSpans + 1 ))
+  { return( FALSE );
   }
+
+  last= rgn->spans + rgn->nSpans++;
+  last->x1= x1;
+  last->x2= x2;
+  band->count++;
+  return( TRUE );
 }
 
-static void
-sraSpanListOr(sraSpanList *dest, const sraSpanList *src)
-{ sraSpan *d_curr, *s_curr;
-  int s_start, s_end;
+/**
+ *  Drops the last band if it got no spans and merges it into the one above
+ * when they touch and have the same spans.
+ */
+static void sraCloseBand( sraRegion * rgn )
+{ sraBand * band= rgn->bands + rgn->nBands - 1;
+  sraBand * prev;
 
-  if (!dest)
-  { if (!src)
-    { return;
-    }
-    else
-    { rfbErr("sraSpanListOr:incompatible spans (only one NULL!)\n");
-      return;
-    }
+  if ( !band->count )
+  { rgn->nBands--;
+    return;
   }
 
-  d_curr = dest->front._next;
-  s_curr = src->front._next;
-  s_start = s_curr->start;
-  s_end = s_curr->end;
-  while (s_curr != &(src->back))
-  {
-
-    /* - If we are at end of destination list OR
-       If the new span comes before the next destination one */
-    if ((d_curr == &(dest->back)) ||
-        (d_curr->start >= s_end))
-    { /* - Add the span */
-      sraSpanInsertBefore(sraSpanCreate(s_start, s_end,
-                                        s_curr->subspan),
-                          d_curr);
-      if (d_curr != &(dest->back))
-        sraSpanMergePrevious(d_curr);
-      s_curr = s_curr->_next;
-      s_start = s_curr->start;
-      s_end = s_curr->end;
-    }
-    else
-    {
-
-      /* - If the new span overlaps the existing one */
-      if ((s_start < d_curr->end) &&
-          (s_end > d_curr->start))
-      {
-
-        /* - Insert new span before the existing destination one? */
-        if (s_start < d_curr->start)
-        { sraSpanInsertBefore(sraSpanCreate(s_start,
-                                            d_curr->start,
-                                            s_curr->subspan),
-                              d_curr);
-          sraSpanMergePrevious(d_curr);
-        }
+  if ( rgn->nBands < 2 )
+  { return;
+  }
 
-        /* Split the existing span if necessary */
-        if (s_end < d_curr->end)
-        { sraSpanInsertAfter(sraSpanCreate(s_end,
-                                           d_curr->end,
-                                           d_curr->subspan),
-                             d_curr);
-          d_curr->end = s_end;
-        }
-        if (s_start > d_curr->start)
-        { sraSpanInsertBefore(sraSpanCreate(d_curr->start,
-                                            s_start,
-                                            d_curr->subspan),
-                              d_curr);
-          d_curr->start = s_start;
+  prev= band - 1;
+
+  if ( prev->y2 == band->y1
+    && prev->count == band->count
+    && !memcmp( rgn->spans + prev->first
+              , rgn->spans + band->first
+              , band->count * sizeof( sraSpan )))
+  { prev->y2= band->y2;
+    rgn->nSpans -= band->count;
+    rgn->nBands--;
+} }
+
+/**
+ *  Combines the spans of one band of each operand
+ */
+static rfbBool sraSpansOp( sraRegion * rgn
+                         , const sraSpan * a, int na
+                         , const sraSpan * b, int nb
+                         , int op )
+{ const sraSpan * aEnd= a + na;
+  const sraSpan * bEnd= b + nb;
+
+  switch( op )
+  { case SRA_OR:
+      while( a < aEnd || b < bEnd )
+      { const sraSpan * s= ( b == bEnd || ( a < aEnd && a->x1 <= b->x1 )) ? a++ : b++;
+
+        if ( !sraAddSpan( rgn, s->x1, s->x2 ))
+        { return( FALSE );
+      } }
+    break;
+
+    case SRA_AND:
+      while( a < aEnd && b < bEnd )
+      { int x1= a->x1 > b->x1 ? a->x1 : b->x1;
+        int x2= a->x2 < b->x2 ? a->x2 : b->x2;
+
+        if ( x1 < x2 && !sraAddSpan( rgn, x1, x2 ))
+        { return( FALSE );
         }
 
-        /* Recursively OR subspans */
-        sraSpanListOr(d_curr->subspan, s_curr->subspan);
+        if ( a->x2 < b->x2 ) a++; else b++;
+      }
+    break;
 
-        /* Merge this span with previous or next? */
-        if (d_curr->_prev != &(dest->front))
-          sraSpanMergePrevious(d_curr);
-        if (d_curr->_next != &(dest->back))
-          sraSpanMergeNext(d_curr);
+    case SRA_SUB:
+      for( ; a < aEnd; a++ )
+      { int x1= a->x1;
 
-        /* Move onto the next pair to compare */
-        if (s_end > d_curr->end)
-        { s_start = d_curr->end;
-          d_curr = d_curr->_next;
+        while( b < bEnd && b->x2 <= x1 )
+        { b++;
         }
-        else
-        { s_curr = s_curr->_next;
-          s_start = s_curr->start;
-          s_end = s_curr->end;
-        }
-      }
-      else
-      { /* - No overlap.  Move to the next destination span */
-        d_curr = d_curr->_next;
-      }
-    }
+
+        for( ; b < bEnd && b->x1 < a->x2; b++ )
+        { if ( b->x1 > x1 && !sraAddSpan( rgn, x1, b->x1 ))
+          { return( FALSE );
+          }
+
+          x1= b->x2;
+          if ( x1 >= a->x2 )
+          { break;
+        } }
+
+        if ( x1 < a->x2 && !sraAddSpan( rgn, x1, a->x2 ))
+        { return( FALSE );
+      } }
+    break;
   }
+
+  return( TRUE );
 }
 
-static rfbBool
-sraSpanListAnd(sraSpanList *dest, const sraSpanList *src)
-{ sraSpan *d_curr, *s_curr, *d_next;
+/**
+ *  Sweeps bands lo to hi of dst and all of src top to bottom, cutting them
+ * where any band starts or ends and combining the spans of every piece.
+ */
+static rfbBool sraSweep( sraRegion * out
+                       , const sraRegion * dst, int lo, int hi
+                       , const sraRegion * src, int op )
+{ const sraBand * a= dst->bands + lo, * aEnd= dst->bands + hi;
+  const sraBand * b= src->bands,      * bEnd= b + src->nBands;
+  int y;
 
-  if (!dest)
-  { if (!src)
-    { return 1;
-    }
-    else
-    { rfbErr("sraSpanListAnd:incompatible spans (only one NULL!)\n");
-      return FALSE;
-    }
+  y= a < aEnd ? a->y1 : INT_MAX;
+  if ( b < bEnd && b->y1 < y )
+  { y= b->y1;
   }
 
-  d_curr = dest->front._next;
-  s_curr = src->front._next;
-  while ((s_curr != &(src->back)) && (d_curr != &(dest->back)))
-  {
+  while( a < aEnd || b < bEnd )
+  { rfbBool aIn= a < aEnd && a->y1 <= y;
+    rfbBool bIn= b < bEnd && b->y1 <= y;
+    int bottom= INT_MAX;
 
-    /* - If we haven't reached a destination span yet then move on */
-    if (d_curr->start >= s_curr->end)
-    { s_curr = s_curr->_next;
-      continue;
+    if ( op != SRA_OR && a == aEnd )  /* Nothing else can come out */
+    { break;
     }
 
-    /* - If we are beyond the current destination span then remove it */
-    if (d_curr->end <= s_curr->start)
-    { sraSpan *next = d_curr->_next;
-      sraSpanRemove(d_curr);
-      sraSpanDestroy(d_curr);
-      d_curr = next;
-      continue;
+    if ( a < aEnd )
+    { bottom= aIn ? a->y2 : a->y1;
     }
 
-    /* - If we partially overlap a span then split it up or remove bits */
-    if (s_curr->start > d_curr->start)
-    { /* - The top bit of the span does not match */
-      d_curr->start = s_curr->start;
-    }
-    if (s_curr->end < d_curr->end)
-    { /* - The end of the span does not match */
-      sraSpanInsertAfter(sraSpanCreate(s_curr->end,
-                                       d_curr->end,
-                                       d_curr->subspan),
-                         d_curr);
-      d_curr->end = s_curr->end;
-    }
+    if ( b < bEnd )
+    { int yb= bIn ? b->y2 : b->y1;
+      if ( yb < bottom )
+      { bottom= yb;
+    } }
 
-    /* - Now recursively process the affected span */
-    if (!sraSpanListAnd(d_curr->subspan, s_curr->subspan))
-    { /* - The destination subspan is now empty, so we should remove it */
-      sraSpan *next = d_curr->_next;
-      sraSpanRemove(d_curr);
-      sraSpanDestroy(d_curr);
-      d_curr = next;
-    }
-    else
-    { /* Merge this span with previous or next? */
-      if (d_curr->_prev != &(dest->front))
-        sraSpanMergePrevious(d_curr);
-
-      /* - Move on to the next span */
-      d_next = d_curr;
-      if (s_curr->end >= d_curr->end)
-      { d_next = d_curr->_next;
+    if ( aIn && ( bIn || op != SRA_AND ))
+    { if ( !sraOpenBand( out, y, bottom )
+        || !sraSpansOp( out
+                      , dst->spans + a->first, a->count
+                      , bIn ? src->spans + b->first : NULL, bIn ? b->count : 0
+                      , op ))
+      { return( FALSE );
       }
-      if (s_curr->end <= d_curr->end)
-      { s_curr = s_curr->_next;
+      sraCloseBand( out );
+    }
+    else if ( bIn && op == SRA_OR )
+    { if ( !sraOpenBand( out, y, bottom )
+        || !sraSpansOp( out, NULL, 0, src->spans + b->first, b->count, op ))
+      { return( FALSE );
       }
-      d_curr = d_next;
+      sraCloseBand( out );
     }
-  }
 
-  while (d_curr != &(dest->back))
-  { sraSpan *next = d_curr->_next;
-    sraSpanRemove(d_curr);
-    sraSpanDestroy(d_curr);
-    d_curr=next;
+    y= bottom;
+
+    if ( a < aEnd && a->y2 <= y ) a++;
+    if ( b < bEnd && b->y2 <= y ) b++;
   }
 
-  return !sraSpanListEmpty(dest);
+  return( TRUE );
 }
 
-static rfbBool
-sraSpanListSubtract(sraSpanList *dest, const sraSpanList *src)
-{ sraSpan *d_curr, *s_curr;
+/**
+ *  Or and Subtract only rebuild the bands of dst that src overlaps and then
+ * try to merge the new ones with their neighbours. And rebuilds everything.
+ */
+static rfbBool sraRgnOp( sraRegion * dst, const sraRegion * src, int op )
+{ sraBand bandBuf[ SRA_SCRATCH_BANDS ];
+  sraSpan spanBuf[ SRA_SCRATCH_SPANS ];
+  sraRegion out;
+  int lo= 0, hi= dst->nBands;
+  rfbBool done;
 
-  if (!dest)
-  { if (!src)
-    { return 1;
-    }
-    else
-    { rfbErr("sraSpanListSubtract:incompatible spans (only one NULL!)\n");
-      return FALSE;
-    }
+  if ( op != SRA_AND )
+  { lo= sraBandEndingBelow( dst, src->bands[ 0 ].y1 );
+    hi= sraBandStartingAt ( dst, src->bands[ src->nBands - 1 ].y2 );
   }
 
-  d_curr = dest->front._next;
-  s_curr = src->front._next;
-  while ((s_curr != &(src->back)) && (d_curr != &(dest->back)))
-  {
+  sraRgnInit( &out, bandBuf, SRA_SCRATCH_BANDS, spanBuf, SRA_SCRATCH_SPANS );
 
-    /* - If we haven't reached a destination span yet then move on */
-    if (d_curr->start >= s_curr->end)
-    { s_curr = s_curr->_next;
-      continue;
-    }
+  done= sraSweep( &out, dst, lo, hi, src, op )
+     && sraSplice( dst, lo, hi, &out );
 
-    /* - If we are beyond the current destination span then skip it */
-    if (d_curr->end <= s_curr->start)
-    { d_curr = d_curr->_next;
-      continue;
-    }
+  if ( done && op != SRA_AND )
+  { sraMergeBand( dst, lo + out.nBands );  /* Bottom first, it does not move lo */
+    sraMergeBand( dst, lo );
+  }
 
-    /* - If we partially overlap the current span then split it up */
-    if (s_curr->start > d_curr->start)
-    { sraSpanInsertBefore(sraSpanCreate(d_curr->start,
-                                        s_curr->start,
-                                        d_curr->subspan),
-                          d_curr);
-      d_curr->start = s_curr->start;
-    }
-    if (s_curr->end < d_curr->end)
-    { sraSpanInsertAfter(sraSpanCreate(s_curr->end,
-                                       d_curr->end,
-                                       d_curr->subspan),
-                         d_curr);
-      d_curr->end = s_curr->end;
-    }
+  sraRgnFreeArrays( &out );
+  return( done );
+}
 
-    /* - Now recursively process the affected span */
-    if ((!d_curr->subspan) || !sraSpanListSubtract(d_curr->subspan, s_curr->subspan))
-    { /* - The destination subspan is now empty, so we should remove it */
-      sraSpan *next = d_curr->_next;
-      sraSpanRemove(d_curr);
-      sraSpanDestroy(d_curr);
-      d_curr = next;
-    }
-    else
-    { /* Merge this span with previous or next? */
-      if (d_curr->_prev != &(dest->front))
-        sraSpanMergePrevious(d_curr);
-      if (d_curr->_next != &(dest->back))
-        sraSpanMergeNext(d_curr);
-
-      /* - Move on to the next span */
-      if (s_curr->end > d_curr->end)
-      { d_curr = d_curr->_next;
-      }
-      else
-      { s_curr = s_curr->_next;
-      }
-    }
+/**
+ *  True when src is a single rect covering all of dst
+ */
+static rfbBool sraRgnCovers( const sraRegion * src, const sraRegion * dst )
+{ const sraSpan * rect= src->spans + src->bands[ 0 ].first;
+  int b;
+
+  if ( src->nBands != 1 || src->bands[ 0 ].count != 1
+    || src->bands[ 0 ].y1 > dst->bands[ 0 ].y1
+    || src->bands[ 0 ].y2 < dst->bands[ dst->nBands - 1 ].y2 )
+  { return( FALSE );
   }
 
-  return !sraSpanListEmpty(dest);
+  for( b= 0; b < dst->nBands; b++ )
+  { const sraBand * band= dst->bands + b;
+
+    if ( dst->spans[ band->first ].x1 < rect->x1
+      || dst->spans[ band->first + band->count - 1 ].x2 > rect->x2 )
+    { return( FALSE );
+  } }
+
+  return( TRUE );
 }
 
 /* -=- Region routines */
 
 sraRegion *
 sraRgnCreate(void)
-{ return (sraRegion*)sraSpanListCreate();
+{ sraRegion * rgn= (sraRegion *)malloc( sizeof( sraRegion ));
+
+  if ( rgn )
+  { sraRgnInit( rgn, &rgn->band1, 1, &rgn->span1, 1 );
+  }
+
+  return( rgn );
 }
 
 sraRegion *
 sraRgnCreateRect(int x1, int y1, int x2, int y2)
-{ sraSpanList *vlist, *hlist;
-  sraSpan *vspan, *hspan;
-
-  /* - Build the horizontal portion of the span */
-  hlist = sraSpanListCreate();
-  hspan = sraSpanCreate(x1, x2, NULL);
-  sraSpanInsertAfter(hspan, &(hlist->front));
+{ sraRegion * rgn= sraRgnCreate();
 
-  /* - Build the vertical portion of the span */
-  vlist = sraSpanListCreate();
-  vspan = sraSpanCreate(y1, y2, hlist);
-  sraSpanInsertAfter(vspan, &(vlist->front));
-
-  sraSpanListDestroy(hlist);
+  if ( rgn && x1 < x2 && y1 < y2 )
+  { rgn->band1.y1= y1;
+    rgn->band1.y2= y2;
+    rgn->band1.first= 0;
+    rgn->band1.count= 1;
+    rgn->span1.x1= x1;
+    rgn->span1.x2= x2;
+    rgn->nBands= rgn->nSpans= 1;
+  }
 
-  return (sraRegion*)vlist;
+  return( rgn );
 }
 
 sraRegion *
 sraRgnCreateRgn(const sraRegion *src)
-{ return (sraRegion*)sraSpanListDup((sraSpanList*)src);
+{ sraRegion * rgn= sraRgnCreate();
+
+  if ( rgn && src && !sraRgnCopy( rgn, src ))
+  { sraRgnDestroy( rgn );
+    return( NULL );
+  }
+
+  return( rgn );
 }
 
 void
 sraRgnDestroy(sraRegion *rgn)
-{ sraSpanListDestroy((sraSpanList*)rgn);
-}
+{ if ( rgn )
+  { sraRgnFreeArrays( rgn );
+    free( rgn );
+} }
 
 void
 sraRgnMakeEmpty(sraRegion *rgn)
-{ sraSpanListMakeEmpty((sraSpanList*)rgn);
+{ rgn->nBands= rgn->nSpans= 0;       /* Keeps the arrays for reuse */
 }
 
 /* -=- Boolean Region ops */
 
 rfbBool
 sraRgnAnd(sraRegion *dst, const sraRegion *src)
-{ return sraSpanListAnd((sraSpanList*)dst, (sraSpanList*)src);
+{ if ( !dst->nBands || !src->nBands
+    || dst->bands[ 0 ].y1 >= src->bands[ src->nBands - 1 ].y2
+    || src->bands[ 0 ].y1 >= dst->bands[ dst->nBands - 1 ].y2 )
+  { sraRgnMakeEmpty( dst );
+    return( FALSE );
+  }
+
+  if ( !sraRgnCovers( src, dst ))
+  { sraRgnOp( dst, src, SRA_AND );
+  }
+  return( dst->nBands > 0 );
 }
 
 void
 sraRgnOr(sraRegion *dst, const sraRegion *src)
-{ sraSpanListOr((sraSpanList*)dst, (sraSpanList*)src);
+{ if ( !src->nBands )
+  { return;
+  }
+
+  if ( !dst->nBands )
+  { sraRgnCopy( dst, src );
+    return;
+  }
+
+  sraRgnOp( dst, src, SRA_OR );
 }
 
 rfbBool
 sraRgnSubtract(sraRegion *dst, const sraRegion *src)
-{ return sraSpanListSubtract((sraSpanList*)dst, (sraSpanList*)src);
+{ if ( !dst->nBands || !src->nBands
+    || dst->bands[ 0 ].y1 >= src->bands[ src->nBands - 1 ].y2
+    || src->bands[ 0 ].y1 >= dst->bands[ dst->nBands - 1 ].y2 )
+  { return( dst->nBands > 0 );
+  }
+
+  sraRgnOp( dst, src, SRA_SUB );
+  return( dst->nBands > 0 );
 }
 
 void
 sraRgnOffset(sraRegion *dst, int dx, int dy)
-{ sraSpan *vcurr, *hcurr;
-
-  vcurr = ((sraSpanList*)dst)->front._next;
-  while (vcurr != &(((sraSpanList*)dst)->back))
-  { vcurr->start += dy;
-    vcurr->end += dy;
-
-    hcurr = vcurr->subspan->front._next;
-    while (hcurr != &(vcurr->subspan->back))
-    { hcurr->start += dx;
-      hcurr->end += dx;
-      hcurr = hcurr->_next;
-    }
+{ int i;
 
-    vcurr = vcurr->_next;
+  for( i= 0; i < dst->nBands; i++ )
+  { dst->bands[ i ].y1 += dy;
+    dst->bands[ i ].y2 += dy;
   }
-}
+
+  for( i= 0; i < dst->nSpans; i++ )
+  { dst->spans[ i ].x1 += dx;
+    dst->spans[ i ].x2 += dx;
+} }
 
 sraRegion *sraRgnBBox(const sraRegion *src)
-{ int xmin=((unsigned int)(int)-1)>>1,ymin=xmin,xmax=1-xmin,ymax=xmax;
-  sraSpan *vcurr, *hcurr;
-
-  if(!src)
-    return sraRgnCreate();
-
-  vcurr = ((sraSpanList*)src)->front._next;
-  while (vcurr != &(((sraSpanList*)src)->back))
-  { if(vcurr->start<ymin)
-      ymin=vcurr->start;
-    if(vcurr->end>ymax)
-      ymax=vcurr->end;
-
-    hcurr = vcurr->subspan->front._next;
-    while (hcurr != &(vcurr->subspan->back))
-    { if(hcurr->start<xmin)
-        xmin=hcurr->start;
-      if(hcurr->end>xmax)
-        xmax=hcurr->end;
-      hcurr = hcurr->_next;
-    }
+{ int xmin= INT_MAX, xmax= INT_MIN;
+  int b;
 
-    vcurr = vcurr->_next;
+  if ( !src || !src->nBands )
+  { return( sraRgnCreate());
   }
 
-  if(xmax<xmin || ymax<ymin)
-    return sraRgnCreate();
+  for( b= 0; b < src->nBands; b++ )
+  { const sraBand * band= src->bands + b;
+
+    if ( src->spans[ band->first ].x1 < xmin )
+    { xmin= src->spans[ band->first ].x1;
+    }
+
+    if ( src->spans[ band->first + band->count - 1 ].x2 > xmax )
+    { xmax= src->spans[ band->first + band->count - 1 ].x2;
+  } }
 
-  return sraRgnCreateRect(xmin,ymin,xmax,ymax);
+  return( sraRgnCreateRect( xmin, src->bands[ 0 ].y1
+                          , xmax, src->bands[ src->nBands - 1 ].y2 ));
 }
 
 rfbBool
 sraRgnPopRect( sraRegion *rgn
              , sraRect   *rect
              , rfbDword flags)
-{ sraSpan *vcurr, *hcurr;
-  sraSpan *vend, *hend;
-  rfbBool right2left = (flags & 2) == 2;
+{ rfbBool right2left = (flags & 2) == 2;
   rfbBool bottom2top = (flags & 1) == 1;
+  sraBand * band;
+  sraSpan * span;
 
-  /* - Pick correct order */
-  if (bottom2top)
-  { vcurr = ((sraSpanList*)rgn)->back._prev;
-    vend = &(((sraSpanList*)rgn)->front);
+  if ( !rgn->nBands )
+  { return( FALSE );
   }
-  else
-  { vcurr = ((sraSpanList*)rgn)->front._next;
-    vend = &(((sraSpanList*)rgn)->back);
-  }
-
-  if (vcurr != vend)
-  { rect->y1 = vcurr->start;
-    rect->y2 = vcurr->end;
 
-    /* - Pick correct order */
-    if (right2left)
-    { hcurr = vcurr->subspan->back._prev;
-      hend = &(vcurr->subspan->front);
-    }
-    else
-    { hcurr = vcurr->subspan->front._next;
-      hend = &(vcurr->subspan->back);
-    }
+  band= bottom2top ? rgn->bands + rgn->nBands - 1 : rgn->bands;
+  span= rgn->spans + band->first + ( right2left ? band->count - 1 : 0 );
 
-    if (hcurr != hend)
-    { rect->x1 = hcurr->start;
-      rect->x2 = hcurr->end;
+  rect->x1= span->x1;
+  rect->y1= band->y1;
+  rect->x2= span->x2;
+  rect->y2= band->y2;
 
-      sraSpanRemove(hcurr);
-      sraSpanDestroy(hcurr);
-
-      if (sraSpanListEmpty(vcurr->subspan))
-      { sraSpanRemove(vcurr);
-        sraSpanDestroy(vcurr);
-      }
+  if ( !right2left )                 /* Leaves a hole in spans */
+  { band->first++;
+  }
 
-#if 0
-      printf("poprect:(%dx%d)-(%dx%d)\n",
-             rect->x1, rect->y1, rect->x2, rect->y2);
-#endif
-      return 1;
+  if ( !--band->count )
+  { if ( !bottom2top )
+    { memmove( rgn->bands, rgn->bands + 1, ( rgn->nBands - 1 ) * sizeof( sraBand ));
     }
-  }
 
-  return 0;
+    if ( !--rgn->nBands )
+    { rgn->nSpans= 0;
+  } }
+
+  return( TRUE );
 }
 
 rfbDword
 sraRgnCountRects(const sraRegion *rgn)
-{ rfbDword count = sraSpanListCount((sraSpanList*)rgn);
-  return count;
+{ rfbDword count= 0;
+  int b;
+
+  for( b= 0; b < rgn->nBands; b++ )
+  { count += rgn->bands[ b ].count;
+  }
+
+  return( count );
 }
 
 rfbBool
 sraRgnEmpty(const sraRegion *rgn)
-{ return sraSpanListEmpty((sraSpanList*)rgn);
+{ return( !rgn->nBands );
 }
 
 /* iterator stuff */
 sraRectangleIterator *sraRgnGetIterator(sraRegion *s)
-{ /* these values have to be multiples of 4 */
-#define DEFSIZE 4
-#define DEFSTEP 8
-  sraRectangleIterator *i =
-    (sraRectangleIterator*)malloc(sizeof(sraRectangleIterator));
-  if(!i)
-    return NULL;
-
-  /* we have to recurse eventually. So, the first sPtr is the pointer to
-     the sraSpan in the first level. the second sPtr is the pointer to
-     the sraRegion.back. The third and fourth sPtr are for the second
-     recursion level and so on. */
-  i->sPtrs = (sraSpan**)malloc(sizeof(sraSpan*)*DEFSIZE);
-
-  if( !i->sPtrs )
-  { FREE( i );
-    return NULL;
-  }
-
-  i->ptrSize = DEFSIZE;
-  i->sPtrs[0] = &(s->front);
-  i->sPtrs[1] = &(s->back);
-  i->ptrPos = 0;
-  i->reverseX = 0;
-  i->reverseY = 0;
-  return i;
+{ return( sraRgnGetReverseIterator( s, FALSE, FALSE ));
 }
 
 sraRectangleIterator *sraRgnGetReverseIterator(sraRegion *s,rfbBool reverseX,rfbBool reverseY)
-{ sraRectangleIterator *i = sraRgnGetIterator(s);
-  if(reverseY)
-  { i->sPtrs[1] = &(s->front);
-    i->sPtrs[0] = &(s->back);
-  }
-  i->reverseX = reverseX;
-  i->reverseY = reverseY;
-  return(i);
-}
+{ sraRectangleIterator *i =
+    (sraRectangleIterator*)malloc(sizeof(sraRectangleIterator));
 
-static rfbBool sraReverse(sraRectangleIterator *i)
-{ return( ((i->ptrPos&2) && i->reverseX) ||
-          (!(i->ptrPos&2) && i->reverseY));
-}
+  if ( i )
+  { i->reverseX= reverseX;
+    i->reverseY= reverseY;
+    i->rgn = s;
+    i->band= 0;
+    i->span= 0;
+  }
 
-static sraSpan* sraNextSpan(sraRectangleIterator *i)
-{ if(sraReverse(i))
-    return(i->sPtrs[i->ptrPos]->_prev);
-  else
-    return(i->sPtrs[i->ptrPos]->_next);
+  return( i );
 }
 
 rfbBool sraRgnIteratorNext(sraRectangleIterator* i,sraRect* r)
-{ /* is the subspan finished? */
-  while(sraNextSpan(i) == i->sPtrs[i->ptrPos+1])
-  { i->ptrPos -= 2;
-    if(i->ptrPos < 0) /* the end */
-      return(0);
-  }
-
-  i->sPtrs[i->ptrPos] = sraNextSpan(i);
+{ const sraBand * band;
+  const sraSpan * span;
 
-  /* is this a new subspan? */
-  while(i->sPtrs[i->ptrPos]->subspan)
-  { if(i->ptrPos+2 > i->ptrSize)   /* array is too small */
-    { i->ptrSize += DEFSTEP;
-      i->sPtrs = (sraSpan**)realloc(i->sPtrs, sizeof(sraSpan*)*i->ptrSize);
+  for(;;)
+  { if ( i->band >= i->rgn->nBands )
+    { return( FALSE );
     }
-    i->ptrPos += 2;
-    if(sraReverse(i))
-    { i->sPtrs[i->ptrPos]   =   i->sPtrs[i->ptrPos-2]->subspan->back._prev;
-      i->sPtrs[i->ptrPos+1] = &(i->sPtrs[i->ptrPos-2]->subspan->front);
+
+    band= i->rgn->bands + ( i->reverseY ? i->rgn->nBands - 1 - i->band : i->band );
+
+    if ( i->span < band->count )
+    { break;
     }
-    else
-    { i->sPtrs[i->ptrPos]   =   i->sPtrs[i->ptrPos-2]->subspan->front._next;
-      i->sPtrs[i->ptrPos+1] = &(i->sPtrs[i->ptrPos-2]->subspan->back);
-  } }
 
-  if((i->ptrPos%4)!=2)
-  { rfbErr("sraRgnIteratorNext: offset is wrong (%d%%4!=2)\n",i->ptrPos);
-    return FALSE;
+    i->band++;
+    i->span= 0;
   }
 
-  r->y1 = i->sPtrs[i->ptrPos-2]->start;
-  r->y2 = i->sPtrs[i->ptrPos-2]->end;
-  r->x1 = i->sPtrs[i->ptrPos]->start;
-  r->x2 = i->sPtrs[i->ptrPos]->end;
+  span= i->rgn->spans + band->first
+      + ( i->reverseX ? band->count - 1 - i->span : i->span );
+  i->span++;
+
+  r->x1= span->x1;
+  r->y1= band->y1;
+  r->x2= span->x2;
+  r->y2= band->y2;
 
-  return(-1);
+  return( TRUE );
 }
 
 void sraRgnReleaseIterator(sraRectangleIterator* i)
-{ if ( i )
-  { FREE( i->sPtrs );
-    FREE( i        );
-} }
+{ FREE( i );
+}
 
 void
 sraRgnPrint(const sraRegion *rgn)
-{ sraSpanListPrint((sraSpanList*)rgn);
+{ int b, s;
+
+  printf("[");
+  for( b= 0; b < rgn->nBands; b++ )
+  { const sraBand * band= rgn->bands + b;
+
+    printf("(%d-%d)[", band->y1, band->y2 );
+    for( s= 0; s < band->count; s++ )
+    { printf("(%d-%d)", rgn->spans[ band->first + s ].x1
+                      , rgn->spans[ band->first + s ].x2 );
+    }
+    printf("]");
+  }
+  printf("]");
 }
 
 rfbBool sraClipRect( int *x, int *y
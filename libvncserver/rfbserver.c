@@ -29,6 +29,7 @@
 
 
 #include <stdio.h>
+#include <stddef.h>
 #include <string.h>
 
 #include <rfb/rfbproto.h>
@@ -109,15 +110,45 @@ static const int tight2turbo_subsamp[10] =
 static void rfbProcessClientProtocolVersion( rfbClient * );
 static void rfbProcessClientNormalMessage(   rfbClient * );
 static void rfbProcessClientInitMessage(     rfbClient * );
+static void rfbDropClientSegments(           rfbClient * );
 
-void rfbIncrClientRef(rfbClient * cl) {}
-void rfbDecrClientRef(rfbClient * cl) {}
+static void rfbReleaseClient(                rfbClient * );
 
-struct rfbClientIterator
-{ rfbClient  * next;
-  ScreenAtom * screen;
-  rfbBool closedToo;
-};
+/**
+ *  Keeps cl, its buffers and encoder state alive, from any thread, even
+ * when it goes meanwhile
+ */
+void rfbIncrClientRef( rfbClient * cl )
+{ __atomic_add_fetch( &cl->refCount, 1, __ATOMIC_ACQ_REL );
+}
+
+/**
+ *  Drops a reference, a gone client is released by the next
+ * rfbReclaimClients() once none is left
+ */
+void rfbDecrClientRef( rfbClient * cl )
+{ __atomic_sub_fetch( &cl->refCount, 1, __ATOMIC_ACQ_REL );
+}
+
+static rfbBool rfbClientUnused( rfbClient * cl )
+{ return( __atomic_load_n( &cl->refCount, __ATOMIC_ACQUIRE ) == 0 );
+}
+
+/**
+ *  Releases the gone clients nobody holds any more, on the thread running
+ * the library
+ */
+void rfbReclaimClients( ScreenAtom * rfbScreen )
+{ rfbClient * cl= rfbScreen->clientHead;
+  rfbClient * next;
+
+  while( cl && rfbScreen->goneClients )
+  { next= cl->next;
+    if ( cl->gone && rfbClientUnused( cl ))
+    { rfbReleaseClient( cl );
+    }
+    cl= next;
+} }
 
 /**
  *
@@ -130,15 +161,32 @@ void rfbClientListInit( ScreenAtom * rfbScreen )
   }
 
   rfbScreen->clientHead = NULL;
+  rfbScreen->liveClients= 0;
+}
+
+/**
+ *  Clients linked to the screen and not gone, without walking the list
+ */
+int rfbClientCount( ScreenAtom * rfbScreen )
+{ return( rfbScreen->liveClients );
+}
+
+/**
+ *  Sets up an iterator standing on no client, gone ones are visited too
+ * with closedToo
+ */
+void rfbInitClientIterator( rfbClientIteratorPtr i
+                          , ScreenAtom * rfbScreen, rfbBool closedToo )
+{ i->next     = NULL;
+  i->screen   = rfbScreen;
+  i->closedToo= closedToo;
 }
 
-rfbClientIteratorPtr rfbGetClientIterator( ScreenAtom * rfbScreen)
+rfbClientIteratorPtr rfbGetClientIterator( ScreenAtom * rfbScreen )
 { rfbClientIteratorPtr i=
     (rfbClientIteratorPtr)calloc(sizeof(struct rfbClientIterator), 1 );
 
-  i->next     = NULL;
-  i->screen   = rfbScreen;
-  i->closedToo= FALSE;
+  rfbInitClientIterator( i, rfbScreen, FALSE );
   return i;
 }
 
@@ -149,42 +197,70 @@ rfbClientIteratorPtr rfbGetClientIteratorWithClosed( ScreenAtom * rfbScreen)
 { rfbClientIteratorPtr i =
     (rfbClientIteratorPtr)calloc(sizeof(struct rfbClientIterator),1);
 
-  i->next     = NULL;
-  i->screen   = rfbScreen;
-  i->closedToo= TRUE;
+  rfbInitClientIterator( i, rfbScreen, TRUE );
   return i;
 }
 
 /**
- *
+ *  Lets go of the client an iterator stood on, releasing it when it went
+ * meanwhile and nobody else holds it
  */
-rfbClient * rfbClientIteratorHead(rfbClientIteratorPtr i)
-{ i->next = i->screen->clientHead;
-  return i->next;
-}
+static void rfbIteratorLeave( rfbClient * cl )
+{ if ( cl )
+  { rfbDecrClientRef( cl );
+    if ( cl->gone && rfbClientUnused( cl ))
+    { rfbReleaseClient( cl );
+} } }
 
 /**
- *
+ *  Moves the iterator to the next client, from the head when it stands on
+ * none. It holds a reference on the client it stands on.
  */
-rfbClient * rfbClientIteratorNext(rfbClientIteratorPtr i)
-{ if(i->next == 0)
-  { i->next = i->screen->clientHead;
+rfbClient * rfbClientIteratorNext( rfbClientIteratorPtr i )
+{ rfbClient * prev= i->next;
+  rfbClient * cl  = prev ? prev->next : i->screen->clientHead;
+
+  while( cl && cl->gone && !i->closedToo )
+  { cl= cl->next;
   }
-  else
-  { rfbClient * cl = i->next;
-    i->next = i->next->next;
-    rfbDecrClientRef(cl);
+
+  if ( cl )
+  { rfbIncrClientRef( cl );
   }
+  i->next= cl;
+  rfbIteratorLeave( prev );
 
-  return i->next;
+  return( cl );
+}
+
+/**
+ *  Restarts the iterator from the first client
+ */
+rfbClient * rfbClientIteratorHead( rfbClientIteratorPtr i )
+{ rfbClient * prev= i->next;
+
+  i->next= NULL;
+  rfbIteratorLeave( prev );
+
+  return( rfbClientIteratorNext( i ));
+}
+
+/**
+ *  Lets go of the client the iterator stands on, it may be set up again
+ */
+void rfbFinishClientIterator( rfbClientIteratorPtr i )
+{ rfbClient * cl= i->next;
+
+  i->next= NULL;
+  rfbIteratorLeave( cl );
 }
 
 /**
  *
  */
-void rfbReleaseClientIterator(rfbClientIteratorPtr iterator)
+void rfbReleaseClientIterator( rfbClientIteratorPtr iterator )
 { if ( iterator )
-  { if(iterator->next) rfbDecrClientRef(iterator->next);
+  { rfbFinishClientIterator( iterator );
     FREE( iterator );
 } }
 
@@ -221,15 +297,21 @@ rfbSetProtocolVersion(rfbScreenInfo * rfbScreen, int major_, int minor_)
 rfbClient * rfbNewStreamClient( rfbScreenInfo * rfbScreen
                               , rfbClient * cl, int handler )
 { if ( cl )
-  { size_t otherClientsCount = 0;
-
-    rfbProtocolVersionMsg pv;
-    rfbClientIteratorPtr iterator;
-    rfbClient * cl_;
+  { rfbProtocolVersionMsg pv;
     rfbProtocolExtension* extension;
     cl->fd      = handler;  // JACS
+    cl->recvBuf = NULL;
+    cl->recvLen = cl->recvNeed= cl->recvSize= cl->recvShort= 0;
+    cl->ubChunk  = NULL;
+    cl->updateBuf= NULL;
+    cl->ublen    = cl->ubsize= 0;
+    cl->gathering= FALSE;
+    cl->outSeg   = NULL;
+    cl->outChunks= NULL;
+    cl->outSegs  = cl->outSegSize= 0;
     cl->screen  = rfbScreen;
     cl->viewOnly= FALSE;
+    rfbInitClientScheduling( cl );
 
     cl->clientFramebufferUpdateRequestHook= NULL;
 
@@ -242,14 +324,7 @@ rfbClient * rfbNewStreamClient( rfbScreenInfo * rfbScreen
     cl->clientData = NULL;
     cl->clientGoneHook = rfbDoNothingWithClient;
 
-    iterator= rfbGetClientIterator( &rfbScreen->window );
-
-    while ( (cl_ = rfbClientIteratorNext(iterator)) )
-    { ++otherClientsCount;
-    }
-
-    rfbReleaseClientIterator(iterator);
-    rfbLog("  %lu other clients\n", (rfbDword) otherClientsCount);
+    rfbLog("  %d other clients\n", rfbClientCount( &rfbScreen->window ));
 
     cl->state = RFB_PROTOCOL_VERSION;
 
@@ -271,12 +346,16 @@ rfbClient * rfbNewStreamClient( rfbScreenInfo * rfbScreen
     cl->modifiedRegion =  sraRgnCreateRect( 0,0
                                           , rfbScreen->window.width
                                           , rfbScreen->window.height);
+    rfbDamageStart( cl );
+    rfbAdaptStart( cl );
+    cl->backlog        = 0;
     cl->requestedRegion= sraRgnCreate();
     cl->format         = cl->screen->window.serverFormat;
     cl->translateFn    = rfbTranslateNone;
     cl->translateLookupTable = NULL;
 
-    // cl->refCount = 0;
+    cl->refCount= 0;
+    cl->gone    = FALSE;
     cl->next = rfbScreen->window.clientHead;
     cl->prev = NULL;
 
@@ -285,6 +364,7 @@ rfbClient * rfbNewStreamClient( rfbScreenInfo * rfbScreen
     }
 
     rfbScreen->window.clientHead = cl;
+    rfbScreen->window.liveClients++;
 
 #if defined( HAVE_LIBZ ) || defined( HAVE_LIBPNG )
     cl->tightQualityLevel = -1;
@@ -382,14 +462,41 @@ rfbClient * rfbNewStreamClient( rfbScreenInfo * rfbScreen
 
 /**
  *  rfbClientConnectionGone is called from sockets.c just after a connection
- *  has gone away.
+ *  has gone away. Nothing is sent or scheduled for the client any more,
+ *  it is released right away unless some thread or iterator still holds
+ *  it, else by rfbReclaimClients() once the last one let go. The library
+ *  holds it itself while updating it or handling its messages, so hosts
+ *  may call this from the pusher or a hook. clientGoneHook tells when the
+ *  client is released, its memory may be freed from there on.
  */
 void rfbClientConnectionGone( rfbClient * cl )
+{ if ( cl->gone )
+  { return;
+  }
+
+  cl->gone= TRUE;
+  cl->screen->window.goneClients++;
+  cl->screen->window.liveClients--;
+  rfbStopClientScheduling(cl);
+
+  if (cl->screen->pointerClient == cl)
+    cl->screen->pointerClient = NULL;
+
+  if ( rfbClientUnused( cl ))
+  { rfbReleaseClient( cl );
+} }
+
+/**
+ *  Unlinks a gone client nobody holds and frees what it used
+ */
+static void rfbReleaseClient( rfbClient * cl )
 {
 #if defined(HAVE_LIBZ) && defined(HAVE_LIBJPEG)
   int i;
 #endif
 
+  cl->screen->window.goneClients--;
+
   if (cl->prev)
   { cl->prev->next = cl->next;
   }
@@ -415,8 +522,16 @@ void rfbClientConnectionGone( rfbClient * cl )
   /* free buffers holding pixel data before and after encoding */
   FREE( cl->beforeEncBuf );
   FREE( cl->afterEncBuf  );
-
-  cl->clientGoneHook(cl);
+  FREE( cl->recvBuf );
+  cl->recvLen= cl->recvSize= 0;
+  rfbDropClientSegments( cl );
+  rfbReleaseUpdateBuf( cl );
+  FREE( cl->outSeg );
+  cl->outSegSize= 0;
+  FREE( cl->teeBuf );
+  cl->teeSize= 0;
+  FREE( cl->adapt.pick );
+  cl->adapt.pickSize= 0;
 
   rfbLog("Client %s gone\n", "cl->host" );
 
@@ -434,9 +549,6 @@ void rfbClientConnectionGone( rfbClient * cl )
 #endif
 #endif
 
-  if (cl->screen->pointerClient == cl)
-    cl->screen->pointerClient = NULL;
-
   sraRgnDestroy(cl->modifiedRegion);
   sraRgnDestroy(cl->requestedRegion);
   sraRgnDestroy(cl->copyRegion);
@@ -448,6 +560,8 @@ void rfbClientConnectionGone( rfbClient * cl )
 
   cl->fd= -1;
 
+  cl->clientGoneHook(cl);           /* Last, the host may free cl there */
+
   //  fr ee(cl);  JACS, client owned
 }
 
@@ -465,6 +579,11 @@ void rfbProcessClientMessage( rfbClient * cl )
     default:                        rfbProcessClientNormalMessage  ( cl ); return;
 } }
 
+/**
+ *  Hands out the next sz bytes of the current input chunk. When the chunk
+ *  runs short the missing byte count is kept in recvShort, so the sinker
+ *  can rewind to the message start and wait for more data.
+ */
 void * getStreamBytes( rfbClient * cl, size_t sz )
 { if ( cl->recvPtr )
   { char * ptr= cl->recvPtr;
@@ -473,9 +592,12 @@ void * getStreamBytes( rfbClient * cl, size_t sz )
     { cl->bytesLeft -= sz;
       cl->recvPtr   += sz;
       return( ptr );
+    }
+
+    if ( !cl->recvShort )
+    { cl->recvShort= sz - cl->bytesLeft;
   } }
 
-  cl->recvPtr= NULL;
   cl->bytesLeft= 0;
   return( NULL );
 }
@@ -484,20 +606,212 @@ void rfbCloseClient( rfbClient * cl )  // JACS, client data sinker
 { fputs( "Close client", stderr );
 }
 
+/**
+ *  Size of the normal protocol message starting at ptr, as far as it can be
+ *  told from the avail bytes already there. A short header answers the
+ *  header size, so the caller just compares the result against avail.
+ *  Unknown (extension) messages and bogus lengths answer the bare header,
+ *  their handlers reject them on their own.
+ */
+static size_t rfbClientMessageSize( rfbClient * cl
+                                  , const uint8_t * ptr, size_t avail )
+{ uint32_t length;
+
+  switch( ptr[ 0 ] )
+  { case rfbSetPixelFormat:           return( sz_rfbSetPixelFormatMsg );
+    case rfbFixColourMapEntries:      return( sz_rfbFixColourMapEntriesMsg );
+    case rfbFramebufferUpdateRequest: return( sz_rfbFramebufferUpdateRequestMsg );
+    case rfbKeyEvent:                 return( sz_rfbKeyEventMsg );
+    case rfbPointerEvent:             return( sz_rfbPointerEventMsg );
+    case rfbSetSW:                    return( sz_rfbSetSWMsg );
+    case rfbSetServerInput:           return( sz_rfbSetServerInputMsg );
+    case rfbPalmVNCSetScaleFactor:
+    case rfbSetScale:                 return( sz_rfbSetScaleMsg );
+    case rfbXvp:                      return( sz_rfbXvpMsg );
+
+    case rfbSetEncodings:
+      if ( avail < sz_rfbSetEncodingsMsg ) return( sz_rfbSetEncodingsMsg );
+      return( sz_rfbSetEncodingsMsg + 4 * (( ptr[ 2 ] << 8 ) | ptr[ 3 ] ));
+
+    case rfbSetDesktopSize:
+      if ( avail < sz_rfbSetDesktopSizeMsg ) return( sz_rfbSetDesktopSizeMsg );
+      return( sz_rfbSetDesktopSizeMsg + ptr[ 6 ] * sz_rfbExtDesktopScreen );
+
+    case rfbTextChat:
+    case rfbClientCutText:    /* Both carry the text length at offset 4 */
+      if ( avail < sz_rfbTextChatMsg ) return( sz_rfbTextChatMsg );
+      length= ( ptr[ 4 ] << 24 ) | ( ptr[ 5 ] << 16 ) | ( ptr[ 6 ] << 8 ) | ptr[ 7 ];
+
+      if ( ptr[ 0 ] == rfbTextChat ? length >= rfbTextMaxSize
+                                   : length > 1<<20 )
+      { return( sz_rfbTextChatMsg );     /* Handler drops the client */
+      }
+      return( sz_rfbTextChatMsg + length );
+
+    case rfbFileTransfer:
+      if ( avail < sz_rfbFileTransferMsg ) return( sz_rfbFileTransferMsg );
+      length= ( ptr[ 8 ] << 24 ) | ( ptr[ 9 ] << 16 ) | ( ptr[ 10 ] << 8 ) | ptr[ 11 ];
+
+      if ( !length || length > INT_MAX )
+      { return( sz_rfbFileTransferMsg );
+      }
+
+      switch( ptr[ 1 ] )
+      { case rfbDirContentRequest:
+          return( ptr[ 2 ] == rfbRDirContent ? sz_rfbFileTransferMsg + length
+                                             : sz_rfbFileTransferMsg );
+
+        case rfbFileTransferOffer: return( sz_rfbFileTransferMsg + length + 4 ); /* + sizeH */
+        case rfbFileTransferRequest:
+        case rfbFilePacket:
+        case rfbCommand:           return( sz_rfbFileTransferMsg + length );
+        default:                   return( sz_rfbFileTransferMsg );
+      }
+
+    default:
+      return( 1 );
+} }
+
+/**
+ *  Parses whatever complete messages cl->recvPtr holds. Returns 0 when the
+ *  chunk is used up, or else the size the message left at cl->recvPtr needs
+ *  to be complete ( the unconsumed tail is cl->bytesLeft bytes long ).
+ */
+static size_t rfbParseClientStream( rfbClient * cl )
+{ while( cl->bytesLeft > 0 )
+  { char * start= cl->recvPtr;
+    int    avail= cl->bytesLeft;
+    size_t need = 0;
+
+    if ( cl->state == RFB_NORMAL )   /* Frame it first, handlers swap in place */
+    { need= rfbClientMessageSize( cl, (uint8_t *)start, avail );
+      if ( need > (size_t)avail )
+      { return( need );
+    } }
+
+    cl->recvShort= 0;
+    rfbProcessClientMessage( cl );
+    rfbClientReady( cl );            /* Requests and settings may let an update go */
+
+    if ( cl->recvShort )             /* Early states, fixed size reads */
+    { need= avail + cl->recvShort;
+      cl->recvPtr  = start;
+      cl->bytesLeft= avail;
+      return( need );
+    }
+
+    if ( cl->recvPtr == start )      /* Nothing eaten, give up on this chunk */
+    { cl->bytesLeft= 0;
+      break;
+    }
+
+    if ( need > (size_t)( cl->recvPtr - start ))   /* Skip payload left unread */
+    { cl->recvPtr  = start + need;
+      cl->bytesLeft= avail - need;
+  } }
+
+  return( 0 );
+}
+
+/**
+ *  Keeps the tail of a split message, need bytes are expected in total
+ */
+static rfbBool rfbKeepClientStream( rfbClient * cl, size_t need )
+{ char  * tail= cl->recvPtr;
+  rfbBool kept= tail == cl->recvBuf;   /* Resumed tail, already in place */
+
+  if ( need > RECV_BUF_MAX )
+  { rfbErr( "rfbSinkClientStream: %lu bytes message is too big\n", (rfbDword)need );
+    rfbCloseClient( cl );
+    return( FALSE );
+  }
+
+  if ( cl->recvSize < need )
+  { char * buf= (char *)realloc( cl->recvBuf, need );
+
+    if ( !buf )
+    { rfbErr( "rfbSinkClientStream: out of memory\n" );
+      rfbCloseClient( cl );
+      return( FALSE );
+    }
+    cl->recvBuf = buf;
+    cl->recvSize= need;
+  }
+
+  if ( !kept )
+  { memcpy( cl->recvBuf, tail, cl->bytesLeft );
+  }
+  cl->recvLen  = cl->bytesLeft;
+  cl->recvNeed = need;
+  cl->bytesLeft= 0;
+
+  return( TRUE );
+}
+
+/**
+ *   Complete messages are parsed straight from data. A message split between
+ * calls gets its tail copied aside, and only the missing bytes are appended
+ * to it on the next call, then parsing goes on zero-copy again.
+ */
+static int rfbSinkClientMessages( rfbClient * cl
+                                , void      * data
+                                , size_t      sz )
+{ char * src= (char *)data;
+  size_t need;
+
+  while( cl->recvLen )              /* Pending message first */
+  { size_t take= cl->recvNeed - cl->recvLen;
+
+    if ( take > sz )
+    { take= sz;
+    }
+
+    memcpy( cl->recvBuf + cl->recvLen, src, take );
+    cl->recvLen+= take;
+    src += take;
+    sz  -= take;
+
+    if ( cl->recvLen < cl->recvNeed )
+    { return( 0 );
+    }
+
+    cl->recvPtr  = cl->recvBuf;
+    cl->bytesLeft= cl->recvLen;
+    cl->recvLen  = 0;
+
+    if (( need= rfbParseClientStream( cl )))   /* Header told the real size */
+    { memmove( cl->recvBuf, cl->recvPtr, cl->bytesLeft );
+      cl->recvPtr= cl->recvBuf;
+
+      if ( !rfbKeepClientStream( cl, need ))
+      { return( 0 );
+  } } }
+
+  cl->recvPtr= src, cl->bytesLeft= sz;
+
+  if (( need= rfbParseClientStream( cl )))
+  { rfbKeepClientStream( cl, need );
+  }
+
+  return( cl->bytesLeft  );
+}
 
 /**
  * JACS, client data sinker
+ *
+ *   The client is held while its messages are handled, hooks hanging up on
+ * it leave the release to the next rfbReclaimClients().
  */
 int rfbSinkClientStream( rfbClient * cl
                        , void      * data
                        , size_t      sz )
-{ cl->recvPtr= (char*)data, cl->bytesLeft= sz;
+{ int left;
 
-  while( cl->bytesLeft > 0 )
-  { rfbProcessClientMessage( cl );
-  }
+  rfbIncrClientRef( cl );
+  left= rfbSinkClientMessages( cl, data, sz );
+  rfbDecrClientRef( cl );
 
-  return( cl->bytesLeft  );
+  return( left );
 }
 
 /**
@@ -507,8 +821,23 @@ int rfbPushClientStream( rfbClient * cl
                        , const void * data, size_t sz )
 { if ( cl )
   { if ( cl->screen )
-    { if ( cl->screen->streamPusher )
-      { return( cl->screen->streamPusher( cl->fd, NULL, NULL, data, sz ) != NULL );
+    { uint64_t start= rfbAdaptClock( cl );
+      int result;
+
+      if ( cl->screen->streamPusher )
+      { result= cl->screen->streamPusher( cl->fd, NULL, NULL, data, sz ) != NULL;
+        rfbAdaptPushed( cl, sz, start );
+        return( result );
+      }
+
+      if ( cl->screen->streamVecPusher )
+      { rfbSegment seg;
+
+        seg.base= data;
+        seg.sz  = sz;
+        result= cl->screen->streamVecPusher( cl->fd, &seg, 1 ) != NULL;
+        rfbAdaptPushed( cl, sz, start );
+        return( result );
   } } }
 
   return( -0x80000000 );
@@ -613,7 +942,7 @@ static void rfbProcessClientInitMessage( rfbClient * cl )
   } u;
 
   int len;
-  rfbClientIteratorPtr iterator;
+  rfbClientIteratorRec iterator;
   rfbClient * otherCl;
   rfbExtensionData* extension;
 
@@ -669,27 +998,22 @@ static void rfbProcessClientInitMessage( rfbClient * cl )
   {
 
     if (cl->screen->dontDisconnect)
-    { iterator = rfbGetClientIterator( &cl->screen->window);
-      while ((otherCl = rfbClientIteratorNext(iterator)) != NULL)
+    { rfbForEachClient( iterator, &cl->screen->window, otherCl )
       { if ((otherCl != cl) && (otherCl->state == RFB_NORMAL))
         { rfbLog("-dontdisconnect: Not shared & existing client\n");
           rfbLog("  refusing new client %s\n", "cl->host");
           rfbCloseClient(cl);
-          rfbReleaseClientIterator(iterator);
+          rfbFinishClientIterator(&iterator);
           return;
-      } }
+    } } }
 
-      rfbReleaseClientIterator(iterator);
-    }
     else
-    { iterator = rfbGetClientIterator( &cl->screen->window);
-      while ((otherCl = rfbClientIteratorNext(iterator)) != NULL)
+    { rfbForEachClient( iterator, &cl->screen->window, otherCl )
       { if ((otherCl != cl) && (otherCl->state == RFB_NORMAL))
         { rfbLog("Not shared - closing connection to client %s\n", "otherCl->host" );
           rfbCloseClient(otherCl);
         }
       }
-      rfbReleaseClientIterator(iterator);
 } } }
 
 /* The values come in based on the scaled screen, we need to convert them to
@@ -734,7 +1058,7 @@ rfbBool
 rfbSendKeyboardLedState(rfbClient * cl)
 { rfbFramebufferUpdateRectHeader rect;
 
-  if (cl->ublen + sz_rfbFramebufferUpdateRectHeader > UPDATE_BUF_SIZE)
+  if (cl->ublen + sz_rfbFramebufferUpdateRectHeader > cl->ubsize)
   { if (!rfbSendUpdateBuf(cl))
       return FALSE;
   }
@@ -770,7 +1094,7 @@ rfbSendSupportedMessages(rfbClient * cl)
   rfbSupportedMessages msgs;
 
   if (cl->ublen + sz_rfbFramebufferUpdateRectHeader
-      + sz_rfbSupportedMessages > UPDATE_BUF_SIZE)
+      + sz_rfbSupportedMessages > cl->ubsize)
   { if (!rfbSendUpdateBuf(cl))
       return FALSE;
   }
@@ -869,7 +1193,7 @@ rfbSendSupportedEncodings(rfbClient * cl)
   /* think rfbSetEncodingsMsg */
 
   if (cl->ublen + sz_rfbFramebufferUpdateRectHeader
-      + (nEncodings * sizeof(uint32_t)) > UPDATE_BUF_SIZE)
+      + (nEncodings * sizeof(uint32_t)) > cl->ubsize)
   { if (!rfbSendUpdateBuf(cl))
       return FALSE;
   }
@@ -931,7 +1255,7 @@ rfbBool rfbSendServerIdentity(rfbClient * cl)
            , PACKAGE_STRING);
 
   if (cl->ublen + sz_rfbFramebufferUpdateRectHeader
-      + (strlen(buffer)+1) > UPDATE_BUF_SIZE)
+      + (strlen(buffer)+1) > cl->ubsize)
   { if (!rfbSendUpdateBuf(cl))
       return FALSE;
   }
@@ -1003,7 +1327,7 @@ rfbBool rfbSendTextChatMessage(rfbClient * cl, uint32_t length, char *buffer)
         bytesToSend=rfbTextMaxSize;
   }
 
-  if (cl->ublen + sz_rfbTextChatMsg + bytesToSend > UPDATE_BUF_SIZE)
+  if (cl->ublen + sz_rfbTextChatMsg + bytesToSend > cl->ubsize)
   { if (!rfbSendUpdateBuf(cl))
       return FALSE;
   }
@@ -1019,6 +1343,7 @@ rfbBool rfbSendTextChatMessage(rfbClient * cl, uint32_t length, char *buffer)
   if (!rfbSendUpdateBuf(cl))
     return FALSE;
 
+  rfbReleaseUpdateBuf(cl);
   return TRUE;
 }
 
@@ -1793,7 +2118,7 @@ static void rfbProcessClientNormalMessage( rfbClient * cl )
   char encBuf[64];
   char encBuf2[64];
   rfbExtDesktopScreen *extDesktopScreens;
-  rfbClientIteratorPtr iterator;
+  rfbClientIteratorRec iterator;
   rfbClient * clp;
 
   //  rfbClientToServerMsg msg; JACS
@@ -1873,6 +2198,7 @@ static void rfbProcessClientNormalMessage( rfbClient * cl )
       cl->enableSupportedMessages  = FALSE;
       cl->enableSupportedEncodings = FALSE;
       cl->enableServerIdentity     = FALSE;
+      cl->adapt.encodings          = 0;
 
 #if defined(HAVE_LIBZ) || defined(HAVE_LIBPNG)
       cl->tightQualityLevel        = -1;
@@ -1918,7 +2244,7 @@ static void rfbProcessClientNormalMessage( rfbClient * cl )
             if (cl->preferredEncoding == -1)
               cl->preferredEncoding = enc;
 
-
+            rfbAdaptListEncoding( cl, enc );
           break;
 
           case rfbEncodingXCursor:
@@ -2445,8 +2771,7 @@ static void rfbProcessClientNormalMessage( rfbClient * cl )
                                        extDesktopScreens, cl);
 
       if ( cl->lastDesktopSizeChangeError == 0 )   /* Let other clients know it was this client that requested the change */
-      { iterator = rfbGetClientIterator(&cl->screen->window);
-        while ((clp = rfbClientIteratorNext(iterator)) != NULL)
+      { rfbForEachClient( iterator, &cl->screen->window, clp )
         { if (clp != cl)
             clp->requestedDesktopSizeChange = rfbExtDesktopSize_OtherClientRequestedChange;
       } }
@@ -2481,6 +2806,28 @@ static void rfbProcessClientNormalMessage( rfbClient * cl )
 
 
 
+/**
+ *  Rects sent for one update rect with the encoding currently set on the
+ * client, 0 when the encoder ends the update with a LastRect marker.
+ */
+static int rfbNumEncodedRects( rfbClient * cl, int x, int y, int w, int h )
+{ switch( cl->preferredEncoding )
+  { case rfbEncodingCoRRE:
+      return((( w - 1 ) / cl->correMaxWidth + 1 )
+           * (( h - 1 ) / cl->correMaxHeight + 1 ));
+
+    case rfbEncodingUltra:
+      return((( h - 1 ) / ( ULTRA_MAX_SIZE( w ) / w )) + 1 );
+
+#ifdef HAVE_LIBZ
+    case rfbEncodingZlib:
+      return((( h - 1 ) / ( ZLIB_MAX_SIZE( w ) / w )) + 1 );
+#endif
+  }
+
+  return( rfbNumTiledRects( cl, x, y, w, h ));     /* Big rects go out in bands */
+}
+
 /*
    rfbSendFramebufferUpdate - send the currently pending framebuffer update to
    the RFB client.
@@ -2492,7 +2839,7 @@ rfbBool rfbSendFramebufferUpdate( rfbClient * cl
 { sraRectangleIterator* i=NULL;
   sraRect rect;
   int nUpdateRegionRects;
-  rfbFramebufferUpdateMsg *fu = (rfbFramebufferUpdateMsg *)cl->updateBuf;
+  rfbFramebufferUpdateMsg *fu;
   sraRegionPtr updateRegion,updateCopyRegion,tmpRegion;
   int dx, dy;
 
@@ -2503,12 +2850,21 @@ rfbBool rfbSendFramebufferUpdate( rfbClient * cl
   rfbBool sendSupportedMessages= FALSE;
   rfbBool sendSupportedEncodings= FALSE;
 
+  rfbBool adapting;
+  int sent= 0;
   rfbBool result= TRUE;
 
   if ( cl->screen->displayHook )
   { cl->screen->displayHook(cl);
   }
 
+  if ( !rfbReserveUpdateBuf( cl, sz_rfbFramebufferUpdateMsg ))
+  { if(cl->screen->displayFinishedHook)
+      cl->screen->displayFinishedHook(cl, FALSE);
+    return FALSE;
+  }
+  fu = (rfbFramebufferUpdateMsg *)cl->updateBuf;
+
   /*
      If framebuffer size was changed and the client supports NewFBSize
      encoding, just send NewFBSize marker and return.
@@ -2517,25 +2873,33 @@ rfbBool rfbSendFramebufferUpdate( rfbClient * cl
   if ( cl->useNewFBSize && cl->newFBSizePending )
   { cl->newFBSizePending = FALSE;
     fu->type = rfbFramebufferUpdate;
+    fu->pad = 0;
     fu->nRects = Swap16IfLE(1);
     cl->ublen = sz_rfbFramebufferUpdateMsg;
 
     if (cl->useExtDesktopSize)
     { if (!rfbSendExtDesktopSize(cl, cl->scaledScreen->width, cl->scaledScreen->height))
-      { if(cl->screen->displayFinishedHook)
+      { rfbReleaseUpdateBuf(cl);
+        if(cl->screen->displayFinishedHook)
           cl->screen->displayFinishedHook(cl, FALSE);
         return FALSE;
       }
     }
     else if (!rfbSendNewFBSize(cl, cl->scaledScreen->width, cl->scaledScreen->height))
-    { if(cl->screen->displayFinishedHook)
+    { rfbReleaseUpdateBuf(cl);
+      if(cl->screen->displayFinishedHook)
         cl->screen->displayFinishedHook(cl, FALSE);
       return FALSE;
     }
 
     result = rfbSendUpdateBuf(cl);
+    rfbReleaseUpdateBuf(cl);
     if(cl->screen->displayFinishedHook)
       cl->screen->displayFinishedHook(cl, result);
+
+    if ( result && !sraRgnEmpty( cl->requestedRegion ))
+    { rfbClientReady( cl );          /* The pixels go on the next pass */
+    }
     return result;
   }
 
@@ -2600,6 +2964,8 @@ rfbBool rfbSendFramebufferUpdate( rfbClient * cl
     cl->enableServerIdentity = FALSE;
   }
 
+  rfbDamageCollect(cl);  /* Tiles marked since the last update */
+
   /*
      The modifiedRegion may overlap the destination copyRegion.  We remove
      any overlapping bits from the copyRegion (since they'd only be
@@ -2646,6 +3012,7 @@ rfbBool rfbSendFramebufferUpdate( rfbClient * cl
        && !sendCursorShape && !sendCursorPos && !sendKeyboardLedState &&
       !sendSupportedMessages && !sendSupportedEncodings && !sendServerIdentity)
   { sraRgnDestroy(updateRegion);
+    rfbReleaseUpdateBuf(cl);
     if(cl->screen->displayFinishedHook)
       cl->screen->displayFinishedHook(cl, TRUE);
     return TRUE;
@@ -2708,137 +3075,48 @@ rfbBool rfbSendFramebufferUpdate( rfbClient * cl
   */
 
   rfbStatRecordMessageSent(cl, rfbFramebufferUpdate, 0, 0);
-  if (cl->preferredEncoding == rfbEncodingCoRRE)
-  { nUpdateRegionRects = 0;
-
-    for(i = sraRgnGetIterator(updateRegion); sraRgnIteratorNext(i,&rect);)
-    { int x = rect.x1;
-      int y = rect.y1;
-      int w = rect.x2 - x;
-      int h = rect.y2 - y;
-      int rectsPerRow, rows;
-      /* We need to count the number of rects in the scaled screen */
-
-      if ( &cl->screen->window != cl->scaledScreen )
-      {  rfbScaledCorrection( &cl->screen->window
-                            , cl->scaledScreen
-                            , &x, &y, &w, &h, "rfbSendFramebufferUpdate");
-      }
 
-      rectsPerRow = (w-1)/cl->correMaxWidth+1;
-      rows = (h-1)/cl->correMaxHeight+1;
-      nUpdateRegionRects += rectsPerRow*rows;
-    }
-    sraRgnReleaseIterator(i);
-    i=NULL;
-  }
-  else if (cl->preferredEncoding == rfbEncodingUltra)
-  { nUpdateRegionRects = 0;
-
-    for(i = sraRgnGetIterator(updateRegion); sraRgnIteratorNext(i,&rect);)
-    { int x = rect.x1;
-      int y = rect.y1;
-      int w = rect.x2 - x;
-      int h = rect.y2 - y;
-      /* We need to count the number of rects in the scaled screen */
-      if ( &cl->screen->window !=cl->scaledScreen)
-      { rfbScaledCorrection( &cl->screen->window
-                           , cl->scaledScreen
-                           , &x, &y, &w, &h
-                           , "rfbSendFramebufferUpdate" );
-      }
+  cl->gathering= cl->screen->streamVecPusher  /* One push for the whole update */
+             && !cl->screen->streamPusher;
 
-      nUpdateRegionRects += (((h-1) / (ULTRA_MAX_SIZE( w ) / w)) + 1);
-    }
-    sraRgnReleaseIterator(i);
-    i=NULL;
-#ifdef HAVE_LIBZ
-  }
-  else if (cl->preferredEncoding == rfbEncodingZlib)
-  { nUpdateRegionRects = 0;
-
-    for(i = sraRgnGetIterator(updateRegion); sraRgnIteratorNext(i,&rect);)
-    { int x = rect.x1;
-      int y = rect.y1;
-      int w = rect.x2 - x;
-      int h = rect.y2 - y;
-      /* We need to count the number of rects in the scaled screen */
-      if ( &cl->screen->window !=cl->scaledScreen)
-      { rfbScaledCorrection( &cl->screen->window
-                           , cl->scaledScreen
-                           , &x, &y
-                           , &w, &h
-                           , "rfbSendFramebufferUpdate");
-      }
+  adapting= rfbAdaptBegin( cl, sraRgnCountRects( updateRegion ));
+  nUpdateRegionRects = 0;
 
-      nUpdateRegionRects += (((h-1) / (ZLIB_MAX_SIZE( w ) / w)) + 1);
+  for(i = sraRgnGetIterator(updateRegion); sraRgnIteratorNext(i,&rect);)
+  { int x = rect.x1;
+    int y = rect.y1;
+    int w = rect.x2 - x;
+    int h = rect.y2 - y;
+    int n;
+    /* We need to count the number of rects in the scaled screen */
+    if ( &cl->screen->window != cl->scaledScreen )
+    { rfbScaledCorrection( &cl->screen->window
+                         , cl->scaledScreen
+                         , &x, &y, &w, &h, "rfbSendFramebufferUpdate");
     }
-    sraRgnReleaseIterator(i);
-    i=NULL;
-#ifdef HAVE_LIBJPEG
-  }
-  else if (cl->preferredEncoding == rfbEncodingTight)
-  { nUpdateRegionRects = 0;
-
-    for(i = sraRgnGetIterator(updateRegion); sraRgnIteratorNext(i,&rect);)
-    { int x = rect.x1;
-      int y = rect.y1;
-      int w = rect.x2 - x;
-      int h = rect.y2 - y;
-      int n;
-      /* We need to count the number of rects in the scaled screen */
-      if ( &cl->screen->window !=cl->scaledScreen)
-      { rfbScaledCorrection( &cl->screen->window
-                           , cl->scaledScreen
-                           , &x, &y, &w, &h, "rfbSendFramebufferUpdate");
-      }
 
-      n = rfbNumCodedRectsTight(cl, x, y, w, h);
-      if (n == 0)
-      { nUpdateRegionRects = 0xFFFF;
-        break;
-      }
-      nUpdateRegionRects += n;
+    if ( adapting )               /* Picks are made in sending order */
+    { rfbAdaptRect( cl, x, y, w, h );
     }
-    sraRgnReleaseIterator(i);
-    i=NULL;
-#endif
-#endif
-#if defined(HAVE_LIBJPEG) && defined(HAVE_LIBPNG)
-  }
-  else if (cl->preferredEncoding == rfbEncodingTightPng)
-  { nUpdateRegionRects = 0;
-
-    for(i = sraRgnGetIterator(updateRegion); sraRgnIteratorNext(i,&rect);)
-    { int x = rect.x1;
-      int y = rect.y1;
-      int w = rect.x2 - x;
-      int h = rect.y2 - y;
-      int n;
-      /* We need to count the number of rects in the scaled screen */
-      if (&cl->screen->window !=cl->scaledScreen)
-      { rfbScaledCorrection( &cl->screen->window
-                           , cl->scaledScreen
-                           , &x, &y, &w, &h, "rfbSendFramebufferUpdate");
-      }
-      n = rfbNumCodedRectsTight(cl, x, y, w, h);
-      if (n == 0)
-      { nUpdateRegionRects = 0xFFFF;
+
+    n = rfbNumEncodedRects( cl, x, y, w, h );
+    if ( n == 0 || nUpdateRegionRects == 0xFFFF )
+    { nUpdateRegionRects = 0xFFFF;
+      if ( !adapting )
         break;
-      }
-      nUpdateRegionRects += n;
     }
-    sraRgnReleaseIterator(i);
-    i=NULL;
-#endif
-  }
-  else
-  { nUpdateRegionRects = sraRgnCountRects(updateRegion);
-  }
+    else
+    { nUpdateRegionRects += n;
+  } }
+  sraRgnReleaseIterator(i);
+  i=NULL;
 
   fu->type = rfbFramebufferUpdate;
+  fu->pad = 0;
   if (nUpdateRegionRects != 0xFFFF)
   { if(cl->screen->maxRectsPerUpdate>0
+        /* Picks were made for the rects as they are */
+        && !adapting
         /* CoRRE splits the screen into smaller squares */
         && cl->preferredEncoding != rfbEncodingCoRRE
         /* Ultra encoding splits rectangles up into smaller chunks */
@@ -2859,7 +3137,16 @@ rfbBool rfbSendFramebufferUpdate( rfbClient * cl
     { sraRegion* newUpdateRegion = sraRgnBBox(updateRegion);
       sraRgnDestroy(updateRegion);
       updateRegion = newUpdateRegion;
-      nUpdateRegionRects = sraRgnCountRects(updateRegion);
+      nUpdateRegionRects = 0;
+
+      i = sraRgnGetIterator(updateRegion);  /* The box may go out in bands */
+      while (sraRgnIteratorNext(i, &rect))
+      { nUpdateRegionRects += rfbNumEncodedRects(cl, rect.x1, rect.y1,
+                                                 rect.x2 - rect.x1,
+                                                 rect.y2 - rect.y1);
+      }
+      sraRgnReleaseIterator(i);
+      i = NULL;
     }
 
     fu->nRects = Swap16IfLE((uint16_t)(sraRgnCountRects(updateCopyRegion) +
@@ -2923,12 +3210,16 @@ rfbBool rfbSendFramebufferUpdate( rfbClient * cl
                          , &x, &y, &w, &h, "rfbSendFramebufferUpdate");
     }
 
+    if ( adapting )
+    { rfbAdaptApply( cl, sent++ );
+    }
+
     switch (cl->preferredEncoding)
     { case -1:
-      case rfbEncodingRaw    : if (!rfbSendRectEncodingRaw    ( cl, x, y, w, h)) { goto updateFailed; } break;
-      case rfbEncodingRRE    : if (!rfbSendRectEncodingRRE    ( cl, x, y, w, h)) { goto updateFailed; } break;
-      case rfbEncodingCoRRE  : if (!rfbSendRectEncodingCoRRE  ( cl, x, y, w, h)) { goto updateFailed; } break;
-      case rfbEncodingHextile: if (!rfbSendRectEncodingHextile( cl, x, y, w, h)) { goto updateFailed; } break;
+      case rfbEncodingRaw    : if (!rfbSendRectCached( cl, x, y, w, h, rfbSendRectEncodingRaw     )) { goto updateFailed; } break;
+      case rfbEncodingRRE    : if (!rfbSendRectCached( cl, x, y, w, h, rfbSendRectEncodingRRE     )) { goto updateFailed; } break;
+      case rfbEncodingCoRRE  : if (!rfbSendRectCached( cl, x, y, w, h, rfbSendRectEncodingCoRRE   )) { goto updateFailed; } break;
+      case rfbEncodingHextile: if (!rfbSendRectCached( cl, x, y, w, h, rfbSendRectEncodingHextile )) { goto updateFailed; } break;
       case rfbEncodingUltra  : if (!rfbSendRectEncodingUltra  ( cl, x, y, w, h)) { goto updateFailed; } break;
 
 #ifdef HAVE_LIBZ
@@ -2938,9 +3229,9 @@ rfbBool rfbSendFramebufferUpdate( rfbClient * cl
 #endif
 
 #if defined(HAVE_LIBJPEG) && (defined(HAVE_LIBZ) || defined(HAVE_LIBPNG))
-      case rfbEncodingTight:   if (!rfbSendRectEncodingTight   ( cl, x, y, w, h)) { goto updateFailed; } break;
+      case rfbEncodingTight:   if (!rfbSendRectTiled( cl, x, y, w, h, rfbSendRectEncodingTight    )) { goto updateFailed; } break;
 #ifdef HAVE_LIBPNG
-      case rfbEncodingTightPng:if (!rfbSendRectEncodingTightPng( cl, x, y, w, h)) { goto updateFailed; } break;
+      case rfbEncodingTightPng:if (!rfbSendRectTiled( cl, x, y, w, h, rfbSendRectEncodingTightPng )) { goto updateFailed; } break;
 #endif
 #endif
   }  }
@@ -2954,11 +3245,18 @@ rfbBool rfbSendFramebufferUpdate( rfbClient * cl
     && !rfbSendLastRectMarker(cl) )
     goto updateFailed;
 
-  if (!rfbSendUpdateBuf(cl))
+  if (!rfbSendUpdateBuf(cl) || !rfbFlushClientSegments(cl))
   { updateFailed:
     result = FALSE;
   }
 
+  rfbDropClientSegments( cl );    /* Failed midway, drop what was gathered */
+  rfbReleaseUpdateBuf( cl );
+
+  if ( adapting )
+  { rfbAdaptEnd( cl );
+  }
+
   if (!cl->enableCursorShapeUpdates)
   { rfbHideCursor(cl);
   }
@@ -3013,6 +3311,12 @@ rfbBool rfbSendCopyRegion( rfbClient * cl
     rect.r.h = Swap16IfLE(h);
     rect.encoding = Swap32IfLE(rfbEncodingCopyRect);
 
+    if (cl->ublen + sz_rfbFramebufferUpdateRectHeader + sz_rfbCopyRect > cl->ubsize)
+    { if (!rfbSendUpdateBuf(cl))
+      { sraRgnReleaseIterator(i);
+        return FALSE;
+    } }
+
     memcpy(&cl->updateBuf[cl->ublen], (char *)&rect,
            sz_rfbFramebufferUpdateRectHeader);
     cl->ublen += sz_rfbFramebufferUpdateRectHeader;
@@ -3032,6 +3336,46 @@ rfbBool rfbSendCopyRegion( rfbClient * cl
   return TRUE;
 }
 
+/**
+ *  Raw rects of at least this many bytes are not copied when the client
+ * has the server pixel format, smaller ones cost less than a segment.
+ * The rows stay in use until the update is pushed, so once a renderer
+ * thread has queued a rect (rfbQueueRectAsModified()) Raw copies again.
+ */
+#define RAW_REF_MIN_BYTES 4096
+#define RAW_REF_SEGS      64
+
+/**
+ *  Hands the rows of a rect to the pusher right from the framebuffer.
+ * Contiguous rows go out as a single segment.
+ */
+static rfbBool rfbSendRawRows( rfbClient * cl, char * fbptr
+                             , int bytesPerLine, int h )
+{ rfbSegment seg[ RAW_REF_SEGS ];
+  int stride= cl->scaledScreen->paddedWidthInBytes;
+  int n= 0;
+
+  if ( stride == bytesPerLine )
+  { seg[ 0 ].base= fbptr;
+    seg[ 0 ].sz  = (size_t)bytesPerLine * h;
+    return( rfbSendClientSegments( cl, seg, 1 ));
+  }
+
+  for( ; h > 0
+       ; h--, fbptr += stride )
+  { seg[ n ].base= fbptr;
+    seg[ n ].sz  = bytesPerLine;
+
+    if ( ++n == RAW_REF_SEGS )
+    { if ( !rfbSendClientSegments( cl, seg, n ))
+      { return( FALSE );
+      }
+      n= 0;
+  } }
+
+  return( n ? rfbSendClientSegments( cl, seg, n ) : TRUE );
+}
+
 /*
    Send a given rectangle in raw encoding (rfbEncodingRaw).
 */
@@ -3046,12 +3390,16 @@ rfbBool rfbSendRectEncodingRaw( rfbClient * cl
   char *fbptr= (cl->scaledScreen->frameBuffer + (cl->scaledScreen->paddedWidthInBytes * y)
              + (x * (cl->scaledScreen->bitsPerPixel / 8)));
 
-  /* Flush the buffer to guarantee correct alignment for translateFn(). */
-  if (cl->ublen > 0)
+  /* Flush the buffer to guarantee correct alignment for translateFn(),
+     chunk data is aligned so only a misaligned tail needs it. */
+  if (cl->ublen & 3)
   { if (!rfbSendUpdateBuf(cl))
       return FALSE;
   }
 
+  if (!rfbReserveUpdateBuf(cl, sz_rfbFramebufferUpdateRectHeader + bytesPerLine))
+    return FALSE;
+
   rect.r.x = Swap16IfLE( x );
   rect.r.y = Swap16IfLE( y );
   rect.r.w = Swap16IfLE( w );
@@ -3065,7 +3413,16 @@ rfbBool rfbSendRectEncodingRaw( rfbClient * cl
   rfbStatRecordEncodingSent(cl, rfbEncodingRaw, sz_rfbFramebufferUpdateRectHeader + bytesPerLine * h,
                             sz_rfbFramebufferUpdateRectHeader + bytesPerLine * h);
 
-  nlines = (UPDATE_BUF_SIZE - cl->ublen) / bytesPerLine;
+  /* Same pixel format and nobody drawing behind our back, the
+     framebuffer rows are the payload */
+  if ( cl->translateFn == rfbTranslateNone
+    && !cl->teeing
+    && !__atomic_load_n( &cl->screen->window.damageQueueHead, __ATOMIC_RELAXED )
+    && bytesPerLine * h >= RAW_REF_MIN_BYTES )
+  { return( rfbSendRawRows( cl, fbptr, bytesPerLine, h ));
+  }
+
+  nlines = (cl->ubsize - cl->ublen) / bytesPerLine;
 
   while (TRUE)
   { if (nlines > h)
@@ -3089,13 +3446,10 @@ rfbBool rfbSendRectEncodingRaw( rfbClient * cl
 
     fbptr += (cl->scaledScreen->paddedWidthInBytes * nlines);
 
-    nlines = (UPDATE_BUF_SIZE - cl->ublen) / bytesPerLine;
-    if (nlines == 0)
-    { rfbErr("rfbSendRectEncodingRaw: send buffer too small for %d "
-             "bytes per line\n", bytesPerLine);
-      rfbCloseClient(cl);
+    if (!rfbReserveUpdateBuf(cl, bytesPerLine))   /* Grows the chunk on wide lines */
       return FALSE;
-    }
+
+    nlines = (cl->ubsize - cl->ublen) / bytesPerLine;
   }
 }
 
@@ -3111,7 +3465,7 @@ rfbBool rfbSendRectEncodingRaw( rfbClient * cl
 rfbBool rfbSendLastRectMarker(rfbClient * cl)
 { rfbFramebufferUpdateRectHeader rect;
 
-  if (cl->ublen + sz_rfbFramebufferUpdateRectHeader > UPDATE_BUF_SIZE)
+  if (cl->ublen + sz_rfbFramebufferUpdateRectHeader > cl->ubsize)
   { if (!rfbSendUpdateBuf(cl))
       return FALSE;
   }
@@ -3141,7 +3495,7 @@ rfbBool rfbSendNewFBSize( rfbClient * cl
                           , int w,  int h)
 { rfbFramebufferUpdateRectHeader rect;
 
-  if (cl->ublen + sz_rfbFramebufferUpdateRectHeader > UPDATE_BUF_SIZE)
+  if (cl->ublen + sz_rfbFramebufferUpdateRectHeader > cl->ubsize)
   { if (!rfbSendUpdateBuf(cl))
       return FALSE;
   }
@@ -3184,7 +3538,7 @@ rfbBool rfbSendExtDesktopSize( rfbClient * cl
 
   if (cl->ublen + sz_rfbFramebufferUpdateRectHeader
       + sz_rfbExtDesktopSizeMsg
-      + sz_rfbExtDesktopScreen * numScreens > UPDATE_BUF_SIZE)
+      + sz_rfbExtDesktopScreen * numScreens > cl->ubsize)
   { if (!rfbSendUpdateBuf(cl))
       return FALSE;
   }
@@ -3247,22 +3601,323 @@ rfbBool rfbSendExtDesktopSize( rfbClient * cl
   return TRUE;
 }
 
+/**
+ *  Chunk pool. Clients take a chunk when they have something to say and
+ *  hand it back once the update went out, the screen keeps a few of each
+ *  class for the next one.
+ */
+static rfbBufChunk * rfbGetBufChunk( rfbScreenInfo * screen, int c )
+{ rfbBufChunk * chunk;
+
+  rfbLockBufPool( screen );    /* Encoding threads share it */
+  chunk= screen->bufPool[ c ];
+
+  if ( chunk )
+  { screen->bufPool[ c ]= chunk->next;
+    screen->bufPoolFree[ c ]--;
+    rfbUnlockBufPool( screen );
+    return( chunk );
+  }
+
+  rfbUnlockBufPool( screen );
+
+  if (( chunk= (rfbBufChunk *)malloc( offsetof( rfbBufChunk, data )
+                                    + RFB_BUF_CLASS_SIZE( c ))))
+  { chunk->size     = RFB_BUF_CLASS_SIZE( c );
+    chunk->sizeClass= c;
+  }
+
+  return( chunk );
+}
+
+static void rfbPutBufChunk( rfbScreenInfo * screen, rfbBufChunk * chunk )
+{ int c= chunk->sizeClass;
+
+  rfbLockBufPool( screen );
+
+  if ( screen->bufPoolFree[ c ] >= RFB_BUF_POOL_KEEP )
+  { rfbUnlockBufPool( screen );
+    free( chunk );
+    return;
+  }
+
+  chunk->next= screen->bufPool[ c ];
+  screen->bufPool[ c ]= chunk;
+  screen->bufPoolFree[ c ]++;
+  rfbUnlockBufPool( screen );
+}
+
+void rfbFreeBufPool( rfbScreenInfo * screen )
+{ int c;
+
+  for( c= 0
+     ; c < RFB_BUF_CLASSES
+     ; c++ )
+  { while( screen->bufPool[ c ] )
+    { rfbBufChunk * chunk= screen->bufPool[ c ];
+
+      screen->bufPool[ c ]= chunk->next;
+      free( chunk );
+    }
+    screen->bufPoolFree[ c ]= 0;
+} }
+
+/**
+ *  Size class for a chunk holding at least need bytes. Raw like encodings
+ *  get room for several lines per round, compressed ones stay small, and
+ *  gathering clients get bigger chunks to keep the segment list short.
+ */
+static int rfbUpdateBufClass( rfbClient * cl, int need )
+{ int c= 0;
+
+  switch( cl->preferredEncoding )
+  { case -1:
+    case rfbEncodingRaw:
+      need= rfbMax( need, 16 * cl->scaledScreen->width * ( cl->format.bitsPerPixel / 8 ));
+      break;
+
+    case rfbEncodingRRE:
+    case rfbEncodingCoRRE:
+    case rfbEncodingHextile:
+    case rfbEncodingUltra:
+      c= 1;
+      break;
+  }
+
+  if ( cl->screen->streamVecPusher && c < RFB_BUF_CLASSES - 1 )
+  { c++;
+  }
+
+  while( c < RFB_BUF_CLASSES - 1 && RFB_BUF_CLASS_SIZE( c ) < need )
+  { c++;
+  }
+
+  return( RFB_BUF_CLASS_SIZE( c ) < need ? -1 : c );
+}
+
+/**
+ *  Makes sure len more bytes fit at cl->updateBuf + cl->ublen, flushing the
+ *  pending output or moving to a bigger chunk as needed.
+ */
+rfbBool rfbReserveUpdateBuf( rfbClient * cl, int len )
+{ rfbBufChunk * chunk;
+  int c;
+
+  if ( cl->ubChunk && cl->ubsize - cl->ublen >= len )
+  { return( TRUE );
+  }
+
+  if ( cl->ublen && !rfbSendUpdateBuf( cl ))
+  { return( FALSE );
+  }
+
+  if ( cl->ubChunk && cl->ubsize >= len )
+  { return( TRUE );
+  }
+
+  if (( c= rfbUpdateBufClass( cl, len )) < 0 )
+  { rfbErr( "rfbReserveUpdateBuf: %d bytes do not fit any chunk\n", len );
+    rfbCloseClient( cl );
+    return( FALSE );
+  }
+
+  if ( !( chunk= rfbGetBufChunk( cl->screen, c )))
+  { rfbErr( "rfbReserveUpdateBuf: out of memory\n" );
+    rfbCloseClient( cl );
+    return( FALSE );
+  }
+
+  rfbReleaseUpdateBuf( cl );
+  cl->ubChunk  = chunk;
+  cl->updateBuf= chunk->data;
+  cl->ubsize   = chunk->size;
+
+  return( TRUE );
+}
+
+/**
+ *  Gives the chunk back to the pool, pending output is dropped
+ */
+void rfbReleaseUpdateBuf( rfbClient * cl )
+{ if ( cl->ubChunk )
+  { rfbPutBufChunk( cl->screen, cl->ubChunk );
+  }
+
+  cl->ubChunk  = NULL;
+  cl->updateBuf= NULL;
+  cl->ublen    = cl->ubsize= 0;
+}
+
+/**
+ *  Makes room for one more segment in the update being gathered
+ */
+static rfbBool rfbGrowClientSegments( rfbClient * cl )
+{ if ( cl->outSegs == cl->outSegSize )
+  { int size= cl->outSegSize ? cl->outSegSize << 1 : 16;
+    rfbSegment * seg= (rfbSegment *)realloc( cl->outSeg, size * sizeof( *seg ));
+
+    if ( !seg )
+    { rfbErr( "rfbSendUpdateBuf: out of memory gathering update\n" );
+      rfbCloseClient( cl );
+      return( FALSE );
+    }
+    cl->outSeg    = seg;
+    cl->outSegSize= size;
+  }
+
+  return( TRUE );
+}
+
+/**
+ *  Chains the current chunk to the update being gathered, no copy involved
+ */
+static rfbBool rfbChainUpdateBuf( rfbClient * cl )
+{ if ( !rfbGrowClientSegments( cl ))
+  { return( FALSE );
+  }
+
+  cl->outSeg[ cl->outSegs ].base= cl->updateBuf;
+  cl->outSeg[ cl->outSegs ].sz  = cl->ublen;
+  cl->outSegs++;
+
+  cl->ubChunk->next= cl->outChunks;
+  cl->outChunks    = cl->ubChunk;
+
+  cl->ubChunk  = NULL;
+  cl->updateBuf= NULL;
+  cl->ublen    = cl->ubsize= 0;
+
+  return( TRUE );
+}
+
+/**
+ *  Forgets the gathered update and gives its chunks back
+ */
+static void rfbDropClientSegments( rfbClient * cl )
+{ while( cl->outChunks )
+  { rfbBufChunk * chunk= cl->outChunks;
+
+    cl->outChunks= chunk->next;
+    rfbPutBufChunk( cl->screen, chunk );
+  }
+
+  cl->gathering= FALSE;
+  cl->outSegs  = 0;
+}
+
+/**
+ *  Sends segments encoded elsewhere after the pending output, chaining them
+ * when gathering. Whoever filled them keeps them alive until the update
+ * is flushed, see rfbTakeClientChunks.
+ */
+rfbBool rfbSendClientSegments( rfbClient * cl, const rfbSegment * seg, int count )
+{ if ( cl->ublen && !rfbSendUpdateBuf( cl ))
+  { return( FALSE );
+  }
+
+  for( ; count > 0 ; count--, seg++ )
+  { if ( cl->gathering )
+    { if ( !rfbGrowClientSegments( cl ))
+      { return( FALSE );
+      }
+      cl->outSeg[ cl->outSegs++ ]= *seg;
+    }
+
+    else if ( rfbPushClientStream( cl, seg->base, seg->sz ) < 0 )
+    { rfbLogPerror( "rfbSendClientSegments: write" );
+      rfbCloseClient( cl );
+      return( FALSE );
+  } }
+
+  return( TRUE );
+}
+
+/**
+ *  Takes over the chunks another client copy gathered, so they go back to
+ * the pool along with the update. Already pushed ones go back right now.
+ */
+void rfbTakeClientChunks( rfbClient * cl, rfbClient * from )
+{ while( from->outChunks )
+  { rfbBufChunk * chunk= from->outChunks;
+
+    from->outChunks= chunk->next;
+
+    if ( cl->gathering )
+    { chunk->next  = cl->outChunks;
+      cl->outChunks= chunk;
+    }
+    else
+    { rfbPutBufChunk( cl->screen, chunk );
+  } }
+
+  from->outSegs= 0;
+  rfbReleaseUpdateBuf( from );
+}
+
+/**
+ *  Ends gathering and hands every segment of the update to the vector
+ *  pusher in a single call.
+ */
+rfbBool rfbFlushClientSegments( rfbClient * cl )
+{ rfbBool result= TRUE;
+
+  if ( !cl->gathering )
+  { return( TRUE );
+  }
+
+  if ( cl->ublen )
+  { result= rfbChainUpdateBuf( cl );
+  }
+
+  if ( result && cl->outSegs )
+  { uint64_t start= rfbAdaptClock( cl );
+    size_t sz= 0;
+    int k;
+
+    result= cl->screen->streamVecPusher( cl->fd, cl->outSeg, cl->outSegs ) != NULL;
+
+    for( k= 0; start && k < cl->outSegs; k++ )
+    { sz += cl->outSeg[ k ].sz;
+    }
+    rfbAdaptPushed( cl, sz, start );
+
+    if ( !result )
+    { rfbLogPerror( "rfbFlushClientSegments: write" );
+      rfbCloseClient( cl );
+  } }
+
+  rfbDropClientSegments( cl );
+  return( result );
+}
+
 /*
    Send the contents of cl->updateBuf.  Returns 1 if successful, -1 if
-   not (errno should be set).
+   not (errno should be set). Leaves a chunk ready for more output.
 */
 
 rfbBool rfbSendUpdateBuf(rfbClient * cl)
 { // printf("UPDATE CLIENT %d\n", cl->ublen );
 
-  if (rfbPushClientStream( cl,  cl->updateBuf, cl->ublen) < 0)
-  { rfbLogPerror("rfbSendUpdateBuf: write");
-    rfbCloseClient(cl);
-    return FALSE;
+  if ( cl->ublen )
+  { if ( cl->teeing )
+    { rfbEncCacheTee( cl );
+    }
+
+    if ( cl->gathering )
+    { if ( !rfbChainUpdateBuf( cl ))
+      { return( FALSE );
+    } }
+
+    else if (rfbPushClientStream( cl,  cl->updateBuf, cl->ublen) < 0)
+    { rfbLogPerror("rfbSendUpdateBuf: write");
+      rfbCloseClient(cl);
+      return FALSE;
+    }
+
+    cl->ublen = 0;
   }
 
-  cl->ublen = 0;
-  return TRUE;
+  return( rfbReserveUpdateBuf( cl, 0 ));
 }
 
 /*
@@ -3329,13 +3984,11 @@ rfbBool rfbSendSetColourMapEntries( rfbClient * cl
 */
 
 void rfbSendBell(rfbScreenInfo * rfbScreen)
-{ rfbClientIteratorPtr i;
+{ rfbClientIteratorRec i;
   rfbClient * cl;
   rfbBellMsg b;
 
-  i = rfbGetClientIterator( &rfbScreen->window );
-
-  while((cl=rfbClientIteratorNext(i)))
+  rfbForEachClient( i, &rfbScreen->window, cl )
   { b.type = rfbBell;
     if (rfbPushClientStream( cl,  (char *)&b, sz_rfbBellMsg) < 0)
     { rfbLogPerror("rfbSendBell: write");
@@ -3343,7 +3996,6 @@ void rfbSendBell(rfbScreenInfo * rfbScreen)
   } }
 
   rfbStatRecordMessageSent(cl, rfbBell, sz_rfbBellMsg, sz_rfbBellMsg);
-  rfbReleaseClientIterator(i);
 }
 
 
@@ -3353,13 +4005,11 @@ void rfbSendBell(rfbScreenInfo * rfbScreen)
 void rfbSendServerCutText( ScreenAtom * rfbScreen,char *str, int len)
 { rfbClient * cl;
   rfbServerCutTextMsg sct;
-  rfbClientIteratorPtr iterator;
+  rfbClientIteratorRec iterator;
 
   memset((char *)&sct, 0, sizeof(sct));
 
-  iterator = rfbGetClientIterator(rfbScreen);
-
-  while ((cl = rfbClientIteratorNext(iterator)) != NULL)
+  rfbForEachClient( iterator, rfbScreen, cl )
   { sct.type = rfbServerCutText;
     sct.length = Swap32IfLE(len);
     if (rfbPushClientStream( cl,  (char *)&sct,
@@ -3373,9 +4023,7 @@ void rfbSendServerCutText( ScreenAtom * rfbScreen,char *str, int len)
       rfbCloseClient(cl);
     }
     rfbStatRecordMessageSent(cl, rfbServerCutText, sz_rfbServerCutTextMsg+len, sz_rfbServerCutTextMsg+len);
-  }
-  rfbReleaseClientIterator(iterator);
-}
+} }
 
 /*****************************************************************************
 
@@ -100,7 +100,7 @@ rfbBool rfbSendRectEncodingRRE( rfbClient * cl
                              sz_rfbFramebufferUpdateRectHeader + w * h * (cl->format.bitsPerPixel / 8));
 
    if (cl->ublen + sz_rfbFramebufferUpdateRectHeader + sz_rfbRREHeader
-         > UPDATE_BUF_SIZE)
+         > cl->ubsize)
    {  if (!rfbSendUpdateBuf(cl))
          return FALSE;
    }
@@ -123,7 +123,7 @@ rfbBool rfbSendRectEncodingRRE( rfbClient * cl
    for (i = 0; i < cl->afterEncBufLen;)
    {
 
-      int bytesToCopy = UPDATE_BUF_SIZE - cl->ublen;
+      int bytesToCopy = cl->ubsize - cl->ublen;
 
       if (i + bytesToCopy > cl->afterEncBufLen)
       {  bytesToCopy = cl->afterEncBufLen - i;
@@ -134,7 +134,7 @@ rfbBool rfbSendRectEncodingRRE( rfbClient * cl
       cl->ublen += bytesToCopy;
       i += bytesToCopy;
 
-      if (cl->ublen == UPDATE_BUF_SIZE)
+      if (cl->ublen == cl->ubsize)
       {  if (!rfbSendUpdateBuf(cl))
             return FALSE;
    }  }
@@ -0,0 +1,75 @@
+#ifndef RFB_SCANBUILD_H
+#define RFB_SCANBUILD_H
+
+/*
+ * Scans and kernels built from one template three ways: scalar, vectorized
+ * and, on x86, for AVX2. gcc only vectorizes loops that need no runtime
+ * checks at -O2, so SCAN_VECTORIZE asks for the rest and SCAN_SCALAR keeps
+ * the scalar build scalar. Other compilers take the builds as they come.
+ *
+ * A file builds a template with SCAN_SUFFIX naming the build and
+ * SCAN_TARGET carrying its attributes, then picks the build to run with
+ * rfbPickScanBuild().
+ */
+
+#ifndef CONCAT2E
+#define CONCAT2(a,b) a##b
+#define CONCAT2E(a,b) CONCAT2(a,b)
+#endif
+
+#ifndef CONCAT3E
+#define CONCAT3(a,b,c) a##b##c
+#define CONCAT3E(a,b,c) CONCAT3(a,b,c)
+#endif
+
+#if defined(__GNUC__) && !defined(__clang__)
+#define SCAN_VECTORIZE __attribute__(( optimize( "tree-vectorize"              \
+                                               , "vect-cost-model=dynamic" )))
+#define SCAN_SCALAR    __attribute__(( optimize( "no-tree-vectorize" )))
+#else
+#define SCAN_VECTORIZE
+#define SCAN_SCALAR
+#endif
+
+#if defined(__GNUC__) && ( defined(__x86_64__) || defined(__i386__) )
+#define SCAN_AVX2
+#define SCAN_AVX2_TARGET SCAN_VECTORIZE __attribute__(( target( "avx2" )))
+#endif
+
+typedef enum
+{ rfbScanScalar
+, rfbScanVec
+, rfbScanAvx2
+} rfbScanBuild;
+
+/**
+ *  Build to run, scalar unless vector is set and AVX2 when the CPU has
+ * it. The CPU is asked once.
+ */
+static inline rfbScanBuild rfbPickScanBuild( rfbBool vector )
+{
+#ifdef SCAN_AVX2
+  static int avx2= -1;
+  int has;
+#endif
+
+  if ( !vector )
+  { return( rfbScanScalar );
+  }
+
+#ifdef SCAN_AVX2
+  if (( has= __atomic_load_n( &avx2, __ATOMIC_RELAXED )) < 0)
+  { __builtin_cpu_init();
+    has= !!__builtin_cpu_supports( "avx2" );
+    __atomic_store_n( &avx2, has, __ATOMIC_RELAXED );
+  }
+
+  if ( has )
+  { return( rfbScanAvx2 );
+  }
+#endif
+
+  return( rfbScanVec );
+}
+
+#endif
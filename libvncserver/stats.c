@@ -372,6 +372,27 @@ void rfbResetStats( rfbClient * cl )
       FREE( ptr );
 } } }
 
+/**
+ *  Adds the counters of a client copy (see encpool.c) and frees them there
+ */
+void rfbStatMerge( rfbClient * cl, rfbClient * from )
+{ rfbStatList *ptr, *to;
+
+  while (from->statEncList!=NULL)
+  { ptr = from->statEncList;
+    from->statEncList = ptr->Next;
+
+    if (( to= rfbStatLookupEncoding( cl, ptr->type )))
+    { to->sentCount      += ptr->sentCount;
+      to->bytesSent      += ptr->bytesSent;
+      to->bytesSentIfRaw += ptr->bytesSentIfRaw;
+    }
+    FREE( ptr );
+  }
+
+  rfbResetStats( from );
+}
+
 
 void rfbPrintStats(rfbClient * cl)
 {
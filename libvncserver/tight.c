@@ -36,8 +36,10 @@
 */
 
 #include <string.h>
+#include <time.h>
 #include <rfb/rfbproto.h>
 #include "private.h"
+#include "scanbuild.h"
 
 #ifdef HAVE_LIBJPEG
 
@@ -56,22 +58,15 @@
 #define MIN_SOLID_SUBRECT_SIZE  2048
 #define MAX_SPLIT_TILE_SIZE       16
 
-/*
-   There is so much access of the Tight encoding static data buffers
-   that we resort to using thread local storage instead of having
-   per-client data.
-*/
-#if defined(__GNUC__)
-#define TLS __thread
-#elif defined(_MSC_VER)
-#define TLS __declspec(thread)
-#else
-#define TLS
-#endif
+/* JPEG and PNG payloads only depend on the server pixels, so they are
+   shared between clients under a blank pixel format. */
+#define TIGHT_CACHE_PARAM( type, a, b ) (( type ) << 16 | ( a ) << 8 | ( b ))
 
-/* This variable is set on every rfbSendRectEncodingTight() call. */
-static TLS rfbBool usePixelFormat24 = FALSE;
+static const rfbPixelFormat tightCacheFormat;
 
+/* Client copies encoding bands on other threads (see encpool.c) send all
+   their zlib data on the stream of their worker, streams stay per thread. */
+#define TIGHT_STREAM( cl, id ) (( cl )->tileOwner ? ( cl )->tileStream : ( id ))
 
 /* Compression level stuff. The following array contains various
    encoder parameters for each of 10 compression levels (0..9).
@@ -111,10 +106,6 @@ static TIGHT_PNG_CONF tightPngConf[10] =
 ,{ 9, PNG_ALL_FILTERS }};
 #endif
 
-static TLS int compressLevel = 1;
-static TLS int qualityLevel = 95;
-static TLS int subsampLevel = TJ_444;
-
 static const int subsampLevel2tjsubsamp[4] =
 { TJ_444, TJ_420, TJ_422, TJ_GRAYSCALE
 };
@@ -139,41 +130,176 @@ typedef struct PALETTE_s
   COLOR_LIST list[256];
 } PALETTE;
 
-/* TODO: move into rfbScreen struct */
-static TLS int paletteNumColors = 0;
-static TLS int paletteMaxColors = 0;
-static TLS uint32_t monoBackground = 0;
-static TLS uint32_t monoForeground = 0;
-static TLS PALETTE palette;
+/* Solid run and palette scans, built as scanbuild.h describes */
+
+rfbBool rfbTightVectorScan = TRUE;
+
+#define SCAN_SUFFIX Scalar
+#define SCAN_TARGET SCAN_SCALAR
+#define BPP 16
+#include "tightscantemplate.c"
+#undef BPP
+#define BPP 32
+#include "tightscantemplate.c"
+#undef BPP
+#undef SCAN_SUFFIX
+#undef SCAN_TARGET
+
+#define SCAN_SUFFIX Vec
+#define SCAN_TARGET SCAN_VECTORIZE
+#define BPP 16
+#include "tightscantemplate.c"
+#undef BPP
+#define BPP 32
+#include "tightscantemplate.c"
+#undef BPP
+#undef SCAN_SUFFIX
+#undef SCAN_TARGET
+
+#ifdef SCAN_AVX2
+#define SCAN_SUFFIX Avx2
+#define SCAN_TARGET SCAN_AVX2_TARGET
+#define BPP 16
+#include "tightscantemplate.c"
+#undef BPP
+#define BPP 32
+#include "tightscantemplate.c"
+#undef BPP
+#undef SCAN_SUFFIX
+#undef SCAN_TARGET
+#endif
 
-/* Pointers to dynamically-allocated buffers. */
+typedef struct TIGHT_SCAN_s
+{ int (*run16 )(const uint16_t *, int, uint16_t, uint16_t);
+  int (*back16)(const uint16_t *, int, uint16_t, uint16_t);
+  int (*two16 )(const uint16_t *, int, uint16_t, uint16_t, uint16_t, int *);
+  int (*rows16)(const uint16_t *, int, int, int, uint16_t, uint16_t);
+  int (*run32 )(const uint32_t *, int, uint32_t, uint32_t);
+  int (*back32)(const uint32_t *, int, uint32_t, uint32_t);
+  int (*two32 )(const uint32_t *, int, uint32_t, uint32_t, uint32_t, int *);
+  int (*rows32)(const uint32_t *, int, int, int, uint32_t, uint32_t);
+} TIGHT_SCAN;
+
+#define TIGHT_SCAN_SET( s ) { TightRun16##s, TightRunBack16##s, TightTwo16##s  \
+                            , TightRows16##s                                  \
+                            , TightRun32##s, TightRunBack32##s, TightTwo32##s \
+                            , TightRows32##s }
+
+static const TIGHT_SCAN tightScanScalar= TIGHT_SCAN_SET( Scalar );
+static const TIGHT_SCAN tightScanVec   = TIGHT_SCAN_SET( Vec );
+#ifdef SCAN_AVX2
+static const TIGHT_SCAN tightScanAvx2  = TIGHT_SCAN_SET( Avx2 );
+#endif
 
-static TLS int tightBeforeBufSize = 0;
-static TLS char *tightBeforeBuf = NULL;
+/* Everything a Tight call works on. Calls take a context from the screen
+   pool and give it back when done, so no client is tied to a thread and
+   buffers follow what is being encoded rather than who encoded last.
+   The zlib streams stay per client in zsStruct. */
+
+typedef struct _rfbTightContext
+{ struct _rfbTightContext * next;     /* Screen pool link */
+  time_t lastUse, periodStart;
+  int beforePeak, afterPeak;          /* Largest use since periodStart */
+
+  /* Set on every rfbSendRectEncodingTight() call */
+  rfbBool usePixelFormat24;
+  int compressLevel, qualityLevel, subsampLevel;
+  const TIGHT_SCAN * scan;
+
+  int paletteNumColors, paletteMaxColors;
+  uint32_t monoBackground, monoForeground;
+  PALETTE palette;
+
+  int tightBeforeBufSize;
+  char *tightBeforeBuf;
+  int tightAfterBufSize;
+  char *tightAfterBuf;
+
+  tjhandle j;
+  int pngDstDataLen;
+} rfbTightContext;
+
+#define TIGHT_SHRINK_PERIOD    5  /* Seconds the peak use is measured over */
+#define TIGHT_IDLE            30  /* Seconds a pooled context is kept unused */
+
+static const TIGHT_SCAN * PickTightScan(void)
+{ switch (rfbPickScanBuild(rfbTightVectorScan))
+  { case rfbScanScalar:
+      return &tightScanScalar;
+#ifdef SCAN_AVX2
+    case rfbScanAvx2:
+      return &tightScanAvx2;
+#endif
+    default:
+      return &tightScanVec;
+} }
 
-static TLS int tightAfterBufSize = 0;
-static TLS char *tightAfterBuf = NULL;
+static void TightFreeContext(rfbTightContext * tc)
+{ free(tc->tightBeforeBuf);
+  free(tc->tightAfterBuf);
+  if (tc->j)
+  { tjDestroy(tc->j);
+  }
+  free(tc);
+}
 
-static TLS tjhandle j = NULL;
+static rfbTightContext * TightAcquire(rfbScreenInfo * screen)
+{ rfbTightContext * tc;
 
-void rfbTightCleanup (rfbScreenInfo * screen)
-{ if (tightBeforeBufSize)
-  { free (tightBeforeBuf);
-    tightBeforeBufSize = 0;
-    tightBeforeBuf = NULL;
+  rfbLockScratchPools(screen);
+  if ((tc = screen->tightPool))
+  { screen->tightPool = tc->next;
   }
-  if (tightAfterBufSize)
-  { free (tightAfterBuf);
-    tightAfterBufSize = 0;
-    tightAfterBuf = NULL;
-  }
-  if (j)
-  { tjDestroy(j);
-    /* Set freed resource handle to 0! */
-    j = 0;
+  rfbUnlockScratchPools(screen);
+
+  if (!tc && (tc = (rfbTightContext *)calloc(1, sizeof(*tc))))
+  { tc->periodStart = time(NULL);
   }
+
+  return tc;
 }
 
+/* Pooled contexts are kept most recently used first, those left idle at
+   the tail are freed. */
+static void TightRelease(rfbScreenInfo * screen, rfbTightContext * tc)
+{ rfbTightContext * idle = NULL, ** link;
+  time_t now = time(NULL);
+
+  if (now - tc->periodStart >= TIGHT_SHRINK_PERIOD)
+  { rfbScratchShrink(&tc->tightBeforeBuf, &tc->tightBeforeBufSize, tc->beforePeak);
+    rfbScratchShrink(&tc->tightAfterBuf, &tc->tightAfterBufSize, tc->afterPeak);
+    tc->beforePeak = tc->afterPeak = 0;
+    tc->periodStart = now;
+  }
+  tc->lastUse = now;
+
+  rfbLockScratchPools(screen);
+  tc->next = screen->tightPool;
+  screen->tightPool = tc;
+
+  for (link = &tc->next; *link; )
+  { if (now - (*link)->lastUse > TIGHT_IDLE)
+    { idle = *link;
+      *link = NULL;
+      break;
+    }
+    link = &(*link)->next;
+  }
+  rfbUnlockScratchPools(screen);
+
+  while (idle)
+  { tc = idle;
+    idle = idle->next;
+    TightFreeContext(tc);
+} }
+
+void rfbTightCleanup (rfbScreenInfo * screen)
+{ while (screen->tightPool)
+  { rfbTightContext * tc = screen->tightPool;
+
+    screen->tightPool = tc->next;
+    TightFreeContext(tc);
+} }
 
 /* Prototypes for static functions. */
 
@@ -184,6 +310,10 @@ static void FindBestSolidArea (rfbClient * cl, int x, int y, int w, int h,
 static void ExtendSolidArea   (rfbClient * cl, int x, int y, int w, int h,
                                uint32_t colorValue,
                                int *x_ptr, int *y_ptr, int *w_ptr, int *h_ptr);
+static int     SolidRows         (rfbClient * cl, int x, int y, int w, int h,
+                                   uint32_t colorValue, rfbBool up);
+static int     SolidRunRow       (rfbClient * cl, int x, int y, int n,
+                                   uint32_t colorValue, rfbBool back);
 static rfbBool CheckSolidTile    (rfbClient * cl, int x, int y, int w, int h,
                                   uint32_t *colorPtr, rfbBool needSameColor);
 static rfbBool CheckSolidTile8   (rfbClient * cl, int x, int y, int w, int h,
@@ -197,31 +327,37 @@ static rfbBool SendSubrect       (rfbClient *, int x, int y, int w, int h);
 static rfbBool SendSolidRect     (rfbClient *);
 static rfbBool SendMonoRect      (rfbClient *, int x, int y, int w, int h);
 static rfbBool SendIndexedRect   (rfbClient *, int x, int y, int w, int h);
-static rfbBool SendFullColorRect (rfbClient *, int x, int y, int w, int h);
+static rfbBool SendFullColorRect (rfbClient *, int x, int y, int w, int h, char * rows);
 
 static rfbBool CompressData (rfbClient * cl, int streamId, int dataLen,
                              int zlibLevel, int zlibStrategy);
+static rfbBool CompressRows (rfbClient * cl, int streamId, const char * rows,
+                             int bytesPerLine, int pitch, int h,
+                             int zlibLevel, int zlibStrategy);
 
-static void FillPalette8 (int count);
-static void FillPalette16 (int count);
-static void FillPalette32 (int count);
+static void FillPalette8 (rfbTightContext * tc, int count);
+static void FillPalette16 (rfbTightContext * tc, int count);
+static void FillPalette32 (rfbTightContext * tc, int count);
 static void FastFillPalette16 (rfbClient * cl, uint16_t *data, int w,
                                int pitch, int h);
 static void FastFillPalette32 (rfbClient * cl, uint32_t *data, int w,
                                int pitch, int h);
 
-static void PaletteReset (void);
-static int PaletteInsert (uint32_t rgb, int numPixels, int bpp);
+static void PaletteReset (rfbTightContext * tc);
+static int PaletteInsert (rfbTightContext * tc, uint32_t rgb, int numPixels,
+                          int bpp);
 
 static void Pack24 (rfbClient * cl, char *buf, rfbPixelFormat *fmt,
                     int count);
+static void Pack24Rows (rfbClient * cl, char *dst, const char *rows,
+                        int pitch, int w, int h, rfbPixelFormat *fmt);
 
-static void EncodeIndexedRect16 (uint8_t *buf, int count);
-static void EncodeIndexedRect32 (uint8_t *buf, int count);
+static void EncodeIndexedRect16 (rfbTightContext * tc, uint8_t *buf, int count);
+static void EncodeIndexedRect32 (rfbTightContext * tc, uint8_t *buf, int count);
 
-static void EncodeMonoRect8 (uint8_t *buf, int w, int h);
-static void EncodeMonoRect16 (uint8_t *buf, int w, int h);
-static void EncodeMonoRect32 (uint8_t *buf, int w, int h);
+static void EncodeMonoRect8 (rfbTightContext * tc, uint8_t *buf, int w, int h);
+static void EncodeMonoRect16 (rfbTightContext * tc, uint8_t *buf, int w, int h);
+static void EncodeMonoRect32 (rfbTightContext * tc, uint8_t *buf, int w, int h);
 
 static rfbBool SendJpegRect (   rfbClient *, int x, int y, int w, int h, int quality );
 static void PrepareRowForImg(   rfbClient *, uint8_t *dst, int x, int y, int count);
@@ -237,6 +373,46 @@ static rfbBool CanSendPngRect(rfbClient * cl, int w, int h);
 /**
  *  Tight encoding implementation.
  */
+/**
+ * We only allow compression levels that have a demonstrable performance
+ *    benefit.  CL 0 with JPEG reduces CPU usage for workloads that have low
+ *    numbers of unique colors, but the same thing can be accomplished by
+ *    using CL 0 without JPEG (AKA "Lossless Tight.")  For those same
+ *    low-color workloads, CL 2 can provide typically 20-40% better
+ *    compression than CL 1 (with a commensurate increase in CPU usage.)  For
+ *    high-color workloads, CL 1 should always be used, as higher compression
+ *    levels increase CPU usage for these workloads without providing any
+ *    significant reduction in bandwidth.
+ */
+static int TightCompressLevel(rfbClient * cl)
+{ int compressLevel = cl->tightCompressLevel;
+
+/** CL 9 (which maps internally to CL 3) is included mainly for backward
+ *    compatibility with TightVNC Compression Levels 5-9.  It should be used
+ *    only in extremely low-bandwidth cases in which it can be shown to have a
+ *    benefit.  For low-color workloads, it provides typically only 10-20%
+ *    better compression than CL 2 with JPEG and CL 1 without JPEG, and it
+ *    uses, on average, twice as much CPU time.
+ */
+  if (compressLevel == 9)
+  { return 3;
+  }
+
+  if (cl->turboQualityLevel != -1)
+  { if (compressLevel < 1) { compressLevel = 1; }
+    if (compressLevel > 2) { compressLevel = 2; }
+  }
+
+/** With JPEG disabled, CL 2 offers no significant bandwidth savings over
+ *    CL 1, so we don't include it.
+ */
+  else if (compressLevel > 1)
+  { compressLevel = 1;
+  }
+
+  return compressLevel;
+}
+
 int rfbNumCodedRectsTight( rfbClient * cl
                          , int x, int y
                          , int w, int h )
@@ -248,8 +424,8 @@ int rfbNumCodedRectsTight( rfbClient * cl
   if (cl->enableLastRectEncoding && w * h >= MIN_SPLIT_RECT_SIZE)
   { return 0; }
 
-  maxRectSize = tightConf[compressLevel].maxRectSize;
-  maxRectWidth = tightConf[compressLevel].maxRectWidth;
+  maxRectSize = tightConf[TightCompressLevel(cl)].maxRectSize;
+  maxRectWidth = tightConf[TightCompressLevel(cl)].maxRectWidth;
 
   if (w > maxRectWidth || w * h > maxRectSize)
   { subrectMaxWidth = (w > maxRectWidth) ? maxRectWidth : w;
@@ -262,25 +438,60 @@ int rfbNumCodedRectsTight( rfbClient * cl
   { return 1;
 } }
 
+/* Runs the whole rect, splits included, on a context of the screen pool */
+static rfbBool SendRectWithContext( rfbClient * cl, int encoding
+                                  , int x, int y
+                                  , int w, int h )
+{ rfbTightContext * tc;
+  rfbBool result;
+
+  if (!(tc = TightAcquire(cl->screen)))
+  { rfbLog("Memory allocation failure!\n");
+    return FALSE;
+  }
+
+  cl->tightEncoding = encoding;
+  cl->tightCtx = tc;
+
+  tc->compressLevel = TightCompressLevel(cl);
+  tc->qualityLevel = cl->turboQualityLevel;
+  tc->subsampLevel = cl->turboSubsampLevel;
+  tc->scan = PickTightScan();
+
+  if ( cl->format.depth    ==   24 && cl->format.redMax  == 0xFF
+    && cl->format.greenMax == 0xFF && cl->format.blueMax == 0xFF )
+  { tc->usePixelFormat24 = TRUE;
+  }
+  else
+  { tc->usePixelFormat24 = FALSE;
+  }
+
+  result = SendRectEncodingTight(cl, x, y, w, h);
+
+  cl->tightCtx = NULL;
+  TightRelease(cl->screen, tc);
+
+  return result;
+}
+
 rfbBool rfbSendRectEncodingTight( rfbClient * cl
                                 , int x, int y
                                 , int w, int h )
-{ cl->tightEncoding = rfbEncodingTight;
-  return SendRectEncodingTight(cl, x, y, w, h);
+{ return SendRectWithContext(cl, rfbEncodingTight, x, y, w, h);
 }
 
 rfbBool rfbSendRectEncodingTightPng( rfbClient * cl
                                    , int x, int y
                                    , int w, int h )
-{ cl->tightEncoding = rfbEncodingTightPng;
-  return SendRectEncodingTight(cl, x, y, w, h);
+{ return SendRectWithContext(cl, rfbEncodingTightPng, x, y, w, h);
 }
 
 
 rfbBool SendRectEncodingTight( rfbClient * cl
                              , int x, int y
                              , int w, int h )
-{ int nMaxRows;
+{ rfbTightContext * tc = cl->tightCtx;
+  int nMaxRows;
   uint32_t colorValue;
   int dx, dy, dw, dh;
   int x_best, y_best, w_best, h_best;
@@ -288,54 +499,6 @@ rfbBool SendRectEncodingTight( rfbClient * cl
 
   rfbSendUpdateBuf(cl);
 
-  compressLevel = cl->tightCompressLevel;
-  qualityLevel = cl->turboQualityLevel;
-  subsampLevel = cl->turboSubsampLevel;
-
-/**
- * We only allow compression levels that have a demonstrable performance
- *    benefit.  CL 0 with JPEG reduces CPU usage for workloads that have low
- *    numbers of unique colors, but the same thing can be accomplished by
- *    using CL 0 without JPEG (AKA "Lossless Tight.")  For those same
- *    low-color workloads, CL 2 can provide typically 20-40% better
- *    compression than CL 1 (with a commensurate increase in CPU usage.)  For
- *    high-color workloads, CL 1 should always be used, as higher compression
- *    levels increase CPU usage for these workloads without providing any
- *    significant reduction in bandwidth.
- */
-
-  if (qualityLevel != -1)
-  { if (compressLevel < 1) { compressLevel = 1; }
-    if (compressLevel > 2) { compressLevel = 2; }
-  }
-
-/** With JPEG disabled, CL 2 offers no significant bandwidth savings over
- *    CL 1, so we don't include it.
- */
-  else if (compressLevel > 1)
-  { compressLevel = 1;
-  }
-
-/** CL 9 (which maps internally to CL 3) is included mainly for backward
- *    compatibility with TightVNC Compression Levels 5-9.  It should be used
- *    only in extremely low-bandwidth cases in which it can be shown to have a
- *    benefit.  For low-color workloads, it provides typically only 10-20%
- *    better compression than CL 2 with JPEG and CL 1 without JPEG, and it
- *    uses, on average, twice as much CPU time.
- */
-
-  if (cl->tightCompressLevel == 9)
-  { compressLevel = 3;
-  }
-
-  if ( cl->format.depth    ==   24 && cl->format.redMax  == 0xFF
-    && cl->format.greenMax == 0xFF && cl->format.blueMax == 0xFF )
-  { usePixelFormat24 = TRUE;
-  }
-  else
-  { usePixelFormat24 = FALSE;
-  }
-
   if (!cl->enableLastRectEncoding
     || w * h < MIN_SPLIT_RECT_SIZE )
   { return SendRectSimple(cl, x, y, w, h);
@@ -343,23 +506,17 @@ rfbBool SendRectEncodingTight( rfbClient * cl
 
   /* Make sure we can write at least one pixel into tightBeforeBuf. */
 
-  if (tightBeforeBufSize < 4)
-  { tightBeforeBufSize = 4;
-
-    if (tightBeforeBuf == NULL)
-    { tightBeforeBuf = (char *)malloc(tightBeforeBufSize);
-    }
-    else
-      tightBeforeBuf = (char *)realloc(tightBeforeBuf,
-                                       tightBeforeBufSize);
+  if (!rfbScratchReserve(&tc->tightBeforeBuf, &tc->tightBeforeBufSize,
+                    4, &tc->beforePeak))
+  { return FALSE;
   }
 
   /* Calculate maximum number of rows in one non-solid rectangle. */
 
   { int maxRectSize, maxRectWidth, nMaxWidth;
 
-    maxRectSize = tightConf[compressLevel].maxRectSize;
-    maxRectWidth = tightConf[compressLevel].maxRectWidth;
+    maxRectSize = tightConf[tc->compressLevel].maxRectSize;
+    maxRectWidth = tightConf[tc->compressLevel].maxRectWidth;
     nMaxWidth = (w > maxRectWidth) ? maxRectWidth : w;
     nMaxRows = maxRectSize / nMaxWidth;
   }
@@ -389,7 +546,7 @@ rfbBool SendRectEncodingTight( rfbClient * cl
            ? MAX_SPLIT_TILE_SIZE : (x + w - dx);
 
       if (CheckSolidTile(cl, dx, dy, dw, dh, &colorValue, FALSE))
-      { if (subsampLevel == TJ_GRAYSCALE && qualityLevel != -1)
+      { if (tc->subsampLevel == TJ_GRAYSCALE && tc->qualityLevel != -1)
         { uint32_t r = (colorValue >> 16) & 0xFF;
           uint32_t g = (colorValue >> 8) & 0xFF;
           uint32_t b = (colorValue) & 0xFF;
@@ -440,7 +597,7 @@ rfbBool SendRectEncodingTight( rfbClient * cl
              + ( x_best * (cl->scaledScreen->bitsPerPixel / 8)));
 
         (*cl->translateFn)(cl->translateLookupTable, &cl->screen->window.serverFormat,
-                           &cl->format, fbptr, tightBeforeBuf,
+                           &cl->format, fbptr, tc->tightBeforeBuf,
                            cl->scaledScreen->paddedWidthInBytes, 1, 1);
 
         if (!SendSolidRect(cl))
@@ -518,35 +675,109 @@ static void ExtendSolidArea( rfbClient * cl
                              , uint32_t colorValue
                              , int * x_ptr, int * y_ptr
                              , int * w_ptr, int * h_ptr )
-{ int cx, cy;
+{ int cx, cy, n;
 
   /* Try to extend the area upwards. */
-  for ( cy = *y_ptr - 1;
-        cy >= y && CheckSolidTile(cl, *x_ptr, cy, *w_ptr, 1, &colorValue, TRUE);
-        cy-- );
-  *h_ptr += *y_ptr - (cy + 1);
-  *y_ptr = cy + 1;
+  n = SolidRows(cl, *x_ptr, *y_ptr - 1, *w_ptr, *y_ptr - y, colorValue, TRUE);
+  *h_ptr += n;
+  *y_ptr -= n;
 
   /* ... downwards. */
-  for ( cy = *y_ptr + *h_ptr;
-        cy < y + h &&
-        CheckSolidTile(cl, *x_ptr, cy, *w_ptr, 1, &colorValue, TRUE);
-        cy++ );
-  *h_ptr += cy - (*y_ptr + *h_ptr);
-
-  /* ... to the left. */
-  for ( cx = *x_ptr - 1;
-        cx >= x && CheckSolidTile(cl, cx, *y_ptr, 1, *h_ptr, &colorValue, TRUE);
-        cx-- );
-  *w_ptr += *x_ptr - (cx + 1);
-  *x_ptr = cx + 1;
+  cy = *y_ptr + *h_ptr;
+  *h_ptr += SolidRows(cl, *x_ptr, cy, *w_ptr, y + h - cy, colorValue, FALSE);
+
+  /* ... to the left, as far as every row of the area goes. The rows are
+     scanned rather than the columns, which keeps the reads contiguous. */
+  n = *x_ptr - x;
+  for ( cy = *y_ptr; n && cy < *y_ptr + *h_ptr; cy++ )
+  { n = SolidRunRow(cl, *x_ptr, cy, n, colorValue, TRUE);
+  }
+  *w_ptr += n;
+  *x_ptr -= n;
 
   /* ... to the right. */
-  for ( cx = *x_ptr + *w_ptr;
-        cx < x + w &&
-        CheckSolidTile(cl, cx, *y_ptr, 1, *h_ptr, &colorValue, TRUE);
-        cx++ );
-  *w_ptr += cx - (*x_ptr + *w_ptr);
+  cx = *x_ptr + *w_ptr;
+  n = x + w - cx;
+  for ( cy = *y_ptr; n && cy < *y_ptr + *h_ptr; cy++ )
+  { n = SolidRunRow(cl, cx, cy, n, colorValue, FALSE);
+  }
+  *w_ptr += n;
+}
+
+
+/**
+ *  Rows of w pixels all equal to colorValue, at most h of them, from row y
+ * going down or, when up is set, going up.
+ */
+static int SolidRows( rfbClient * cl
+                    , int x, int y, int w, int h
+                    , uint32_t colorValue
+                    , rfbBool up )
+{ rfbTightContext * tc = cl->tightCtx;
+  int bpp = cl->screen->window.serverFormat.bitsPerPixel;
+  int pitch = cl->scaledScreen->paddedWidthInBytes / (bpp / 8);
+  char * row = &cl->scaledScreen->frameBuffer
+               [y * cl->scaledScreen->paddedWidthInBytes + x * (bpp / 8)];
+  int i, j;
+
+  if (up)
+  { pitch = -pitch;
+  }
+
+  switch(bpp)
+  { case 32:
+      return tc->scan->rows32((uint32_t *)row, w, h, pitch, colorValue, ~0U);
+
+    case 16:
+      if (colorValue > 0xFFFF)
+      { return 0; }
+      return tc->scan->rows16((uint16_t *)row, w, h, pitch, colorValue, 0xFFFF);
+  }
+
+  for (j = 0; j < h; j++, row += pitch)
+  { for (i = 0; i < w; i++)
+    { if ((uint8_t)row[i] != colorValue)
+      { return j; }
+  } }
+
+  return j;
+}
+
+
+/**
+ *  Pixels equal to colorValue in row y, at most n of them, going right from
+ * x or, when back is set, left from the pixel before x.
+ */
+static int SolidRunRow( rfbClient * cl
+                      , int x, int y, int n
+                      , uint32_t colorValue
+                      , rfbBool back )
+{ rfbTightContext * tc = cl->tightCtx;
+  char * row = &cl->scaledScreen->frameBuffer
+               [y * cl->scaledScreen->paddedWidthInBytes
+               + x * (cl->screen->window.serverFormat.bitsPerPixel / 8)];
+  int i;
+
+  switch(cl->screen->window.serverFormat.bitsPerPixel)
+  { case 32:
+      return back ? tc->scan->back32((uint32_t *)row, n, colorValue, ~0U)
+                  : tc->scan->run32 ((uint32_t *)row, n, colorValue, ~0U);
+
+    case 16:
+      if (colorValue > 0xFFFF)
+      { return 0; }
+      return back ? tc->scan->back16((uint16_t *)row, n, colorValue, 0xFFFF)
+                  : tc->scan->run16 ((uint16_t *)row, n, colorValue, 0xFFFF);
+  }
+
+  if (back)
+  { for (i = 0; i < n && (uint8_t)row[-1 - i] == colorValue; i++);
+  }
+  else
+  { for (i = 0; i < n && (uint8_t)row[i] == colorValue; i++);
+  }
+
+  return i;
 }
 
 
@@ -598,80 +829,65 @@ CheckSolidTile##bpp( rfbClient * cl, int x, int y, int w, int h,              \
     return TRUE;                                                              \
 }
 
-static rfbBool CheckSolidTile32( rfbClient * cl
-                               , int x, int y
-                               , int w, int h
-                               ,  uint32_t* colorPtr
-                               , rfbBool needSameColor )
-{ uint32_t *fbptr;
-  uint32_t colorValue;
-  int dx, dy;
-
-  if ( ! cl->scaledScreen->frameBuffer )
-  { return( FALSE );
-  }
-
-  fbptr= (uint32_t *)&cl->scaledScreen->frameBuffer
-         [y * cl->scaledScreen->paddedWidthInBytes + x * (32/8)];
-
-  colorValue = *fbptr;
-  if (needSameColor && (uint32_t)colorValue != *colorPtr)
-  { return FALSE; }
-
-  for (dy = 0; dy < h; dy++)
-  { for (dx = 0; dx < w; dx++)
-    { if (colorValue != fbptr[dx])
-      { return FALSE;
-    } }
-
-    fbptr= (uint32_t *)((uint8_t *)fbptr
-                        + cl->scaledScreen->paddedWidthInBytes);
-  }
+/* 16 and 32 bpp rows go through the run scans */
 
-  *colorPtr = (uint32_t)colorValue;
-
-  return TRUE;
+#define DEFINE_CHECK_SOLID_SCAN_FUNCTION( bpp )                               \
+                                                                              \
+static rfbBool                                                                \
+CheckSolidTile##bpp( rfbClient * cl, int x, int y, int w, int h,              \
+    uint32_t* colorPtr, rfbBool needSameColor)                                \
+{                                                                             \
+    rfbTightContext * tc = cl->tightCtx;                                      \
+    uint##bpp##_t *fbptr;                                                     \
+    uint##bpp##_t colorValue;                                                 \
+                                                                              \
+    if ( ! cl->scaledScreen->frameBuffer )                                    \
+        return FALSE;                                                         \
+                                                                              \
+    fbptr = (uint##bpp##_t *)&cl->scaledScreen->frameBuffer                   \
+        [y * cl->scaledScreen->paddedWidthInBytes + x * (bpp/8)];             \
+                                                                              \
+    colorValue = *fbptr;                                                      \
+    if (needSameColor && (uint32_t)colorValue != *colorPtr)                   \
+        return FALSE;                                                         \
+                                                                              \
+    if (tc->scan->rows##bpp(fbptr, w, h,                                      \
+                        cl->scaledScreen->paddedWidthInBytes / (bpp/8),       \
+                        colorValue, (uint##bpp##_t)~0U) < h)                  \
+        return FALSE;                                                         \
+                                                                              \
+    *colorPtr = (uint32_t)colorValue;                                         \
+    return TRUE;                                                              \
 }
 
 DEFINE_CHECK_SOLID_FUNCTION( 8  )
-DEFINE_CHECK_SOLID_FUNCTION( 16 )
-// DEFINE_CHECK_SOLID_FUNCTION( 32 )
+DEFINE_CHECK_SOLID_SCAN_FUNCTION( 16 )
+DEFINE_CHECK_SOLID_SCAN_FUNCTION( 32 )
 
 static rfbBool SendRectSimple( rfbClient * cl
                                , int x, int y
                                , int w, int h )
-{ int maxBeforeSize, maxAfterSize;
+{ rfbTightContext * tc = cl->tightCtx;
+  int maxBeforeSize, maxAfterSize;
   int maxRectSize, maxRectWidth;
   int subrectMaxWidth, subrectMaxHeight;
   int dx, dy;
   int rw, rh;
 
-  maxRectSize = tightConf[compressLevel].maxRectSize;
-  maxRectWidth = tightConf[compressLevel].maxRectWidth;
+  maxRectSize = tightConf[tc->compressLevel].maxRectSize;
+  maxRectWidth = tightConf[tc->compressLevel].maxRectWidth;
 
-  maxBeforeSize = maxRectSize * (cl->format.bitsPerPixel / 8);
+  /* Buffers are sized for the largest subrect of this rect only. */
+  maxBeforeSize = (w * h < maxRectSize ? w * h : maxRectSize)
+                * (cl->format.bitsPerPixel / 8);
   maxAfterSize = maxBeforeSize + (maxBeforeSize + 99) / 100 + 12;
 
-  if (tightBeforeBufSize < maxBeforeSize)
-  { tightBeforeBufSize = maxBeforeSize;
-
-    if ( tightBeforeBuf )
-    { tightBeforeBuf = (char *)realloc( tightBeforeBuf
-                                        , tightBeforeBufSize );
-    }
-    else
-    { tightBeforeBuf = (char *)malloc(tightBeforeBufSize );
-  } }
-
-  if (tightAfterBufSize < maxAfterSize)
-  { tightAfterBufSize = maxAfterSize;
-
-    if ( tightAfterBuf )
-      tightAfterBuf = (char *)realloc(tightAfterBuf,
-                                      tightAfterBufSize);
-    else
-    { tightAfterBuf = (char *)malloc(tightAfterBufSize);
-  } }
+  if ( !rfbScratchReserve(&tc->tightBeforeBuf, &tc->tightBeforeBufSize,
+                     maxBeforeSize, &tc->beforePeak)
+    || !rfbScratchReserve(&tc->tightAfterBuf, &tc->tightAfterBufSize,
+                     maxAfterSize, &tc->afterPeak))
+  { return FALSE;
+  }
 
   if ( w     > maxRectWidth
        || w * h > maxRectSize )
@@ -697,7 +913,9 @@ static rfbBool SendRectSimple( rfbClient * cl
 static rfbBool SendSubrect( rfbClient * cl
                             , int x, int y
                             , int w, int h )
-{ char * fbptr;
+{ rfbTightContext * tc = cl->tightCtx;
+  char * fbptr;
+  char * rows= NULL;                   /* Full colour pixels left in place */
   rfbBool success = FALSE;
 
   if ( !cl->scaledScreen->frameBuffer )
@@ -717,17 +935,17 @@ static rfbBool SendSubrect( rfbClient * cl
        + ( cl->scaledScreen->paddedWidthInBytes * y)
        + ( x * (cl->scaledScreen->bitsPerPixel / 8)));
 
-  if (subsampLevel == TJ_GRAYSCALE && qualityLevel != -1)
-  { return SendJpegRect(cl, x, y, w, h, qualityLevel); }
+  if (tc->subsampLevel == TJ_GRAYSCALE && tc->qualityLevel != -1)
+  { return SendJpegRect(cl, x, y, w, h, tc->qualityLevel); }
 
-  paletteMaxColors = w * h / tightConf[compressLevel].idxMaxColorsDivisor;
+  tc->paletteMaxColors = w * h / tightConf[tc->compressLevel].idxMaxColorsDivisor;
 
-  if(qualityLevel != -1)
-  { paletteMaxColors = tightConf[compressLevel].palMaxColorsWithJPEG; }
+  if(tc->qualityLevel != -1)
+  { tc->paletteMaxColors = tightConf[tc->compressLevel].palMaxColorsWithJPEG; }
 
-  if ( paletteMaxColors < 2 &&
-       w * h >= tightConf[compressLevel].monoMinRectSize )
-  { paletteMaxColors = 2;
+  if ( tc->paletteMaxColors < 2 &&
+       w * h >= tightConf[tc->compressLevel].monoMinRectSize )
+  { tc->paletteMaxColors = 2;
   }
 
 
@@ -750,33 +968,37 @@ static rfbBool SendSubrect( rfbClient * cl
                            , h );
     }
 
-    if(paletteNumColors != 0 || qualityLevel == -1)
+    if ( tc->paletteNumColors == 0 && tc->qualityLevel == -1
+      && cl->translateFn == rfbTranslateNone )
+    { rows= fbptr;
+    }
+    else if(tc->paletteNumColors != 0 || tc->qualityLevel == -1)
     { (*cl->translateFn)(cl->translateLookupTable,
                          &cl->screen->window.serverFormat, &cl->format, fbptr,
-                         tightBeforeBuf,
+                         tc->tightBeforeBuf,
                          cl->scaledScreen->paddedWidthInBytes, w, h);
     }
   }
   else
   { (*cl->translateFn)(cl->translateLookupTable, &cl->screen->window.serverFormat,
-                       &cl->format, fbptr, tightBeforeBuf,
+                       &cl->format, fbptr, tc->tightBeforeBuf,
                        cl->scaledScreen->paddedWidthInBytes, w, h);
 
     switch (cl->format.bitsPerPixel)
-    { case  8:        FillPalette8( w * h);        break;
-      case 16:        FillPalette16(w * h);        break;
-      default:        FillPalette32(w * h);
+    { case  8:        FillPalette8( tc, w * h);    break;
+      case 16:        FillPalette16(tc, w * h);    break;
+      default:        FillPalette32(tc, w * h);
     }
   }
 
-  switch (paletteNumColors)
+  switch (tc->paletteNumColors)
   { case 0:
       /* Truecolor image */
-      if (qualityLevel != -1)
-      { success = SendJpegRect(cl, x, y, w, h, qualityLevel);
+      if (tc->qualityLevel != -1)
+      { success = SendJpegRect(cl, x, y, w, h, tc->qualityLevel);
       }
       else
-      { success = SendFullColorRect(cl, x, y, w, h);
+      { success = SendFullColorRect(cl, x, y, w, h, rows);
       }
       break;
 
@@ -801,7 +1023,7 @@ rfbBool rfbSendTightHeader( rfbClient * cl
                             , int w, int h)
 { rfbFramebufferUpdateRectHeader rect;
 
-  if (cl->ublen + sz_rfbFramebufferUpdateRectHeader > UPDATE_BUF_SIZE)
+  if (cl->ublen + sz_rfbFramebufferUpdateRectHeader > cl->ubsize)
   { if (!rfbSendUpdateBuf(cl))
     { return FALSE; }
   }
@@ -829,22 +1051,23 @@ rfbBool rfbSendTightHeader( rfbClient * cl
  */
 
 static rfbBool SendSolidRect( rfbClient * cl )
-{ int len;
+{ rfbTightContext * tc = cl->tightCtx;
+  int len;
 
-  if (usePixelFormat24)
-  { Pack24(cl, tightBeforeBuf, &cl->format, 1);
+  if (tc->usePixelFormat24)
+  { Pack24(cl, tc->tightBeforeBuf, &cl->format, 1);
     len = 3;
   }
   else
   { len = cl->format.bitsPerPixel / 8; }
 
-  if (cl->ublen + 1 + len > UPDATE_BUF_SIZE)
+  if (cl->ublen + 1 + len > cl->ubsize)
   { if (!rfbSendUpdateBuf(cl))
     { return FALSE;
   } }
 
   cl->updateBuf[cl->ublen++] = (char)(rfbTightFill << 4);
-  memcpy (&cl->updateBuf[cl->ublen], tightBeforeBuf, len);
+  memcpy (&cl->updateBuf[cl->ublen], tc->tightBeforeBuf, len);
   cl->ublen += len;
 
   rfbStatRecordEncodingSentAdd(cl, cl->tightEncoding, len + 1);
@@ -855,7 +1078,8 @@ static rfbBool SendSolidRect( rfbClient * cl )
 static rfbBool SendMonoRect( rfbClient * cl
                              , int x, int y
                              , int w, int h )
-{ int streamId = 1;
+{ rfbTightContext * tc = cl->tightCtx;
+  int streamId = TIGHT_STREAM( cl, 1 );
   int paletteLen, dataLen;
 
 #ifdef HAVE_LIBPNG
@@ -867,7 +1091,7 @@ static rfbBool SendMonoRect( rfbClient * cl
 #endif
 
   if ( cl->ublen + TIGHT_MIN_TO_COMPRESS + 6
-       + 2 * cl->format.bitsPerPixel / 8 > UPDATE_BUF_SIZE )
+       + 2 * cl->format.bitsPerPixel / 8 > cl->ubsize )
   { if (!rfbSendUpdateBuf(cl))
     { return FALSE; }
   }
@@ -876,7 +1100,7 @@ static rfbBool SendMonoRect( rfbClient * cl
   dataLen = (w + 7) / 8;
   dataLen *= h;
 
-  if (tightConf[compressLevel].monoZlibLevel == 0
+  if (tightConf[tc->compressLevel].monoZlibLevel == 0
    && cl->tightEncoding != rfbEncodingTightPng)
     cl->updateBuf[cl->ublen++] =
       (char)((rfbTightNoZlib | rfbTightExplicitFilter) << 4);
@@ -889,50 +1113,51 @@ static rfbBool SendMonoRect( rfbClient * cl
 
   switch (cl->format.bitsPerPixel) /** Prepare palette, convert image. */
   { case 32:
-      EncodeMonoRect32((uint8_t *)tightBeforeBuf, w, h);
+      EncodeMonoRect32(tc, (uint8_t *)tc->tightBeforeBuf, w, h);
 
-      ((uint32_t *)tightAfterBuf)[0] = monoBackground;
-      ((uint32_t *)tightAfterBuf)[1] = monoForeground;
-      if (usePixelFormat24)
-      { Pack24(cl, tightAfterBuf, &cl->format, 2);
+      ((uint32_t *)tc->tightAfterBuf)[0] = tc->monoBackground;
+      ((uint32_t *)tc->tightAfterBuf)[1] = tc->monoForeground;
+      if (tc->usePixelFormat24)
+      { Pack24(cl, tc->tightAfterBuf, &cl->format, 2);
         paletteLen = 6;
       }
       else
       { paletteLen = 8; }
 
-      memcpy(&cl->updateBuf[cl->ublen], tightAfterBuf, paletteLen);
+      memcpy(&cl->updateBuf[cl->ublen], tc->tightAfterBuf, paletteLen);
       cl->ublen += paletteLen;
       rfbStatRecordEncodingSentAdd(cl, cl->tightEncoding, 3 + paletteLen);
       break;
 
     case 16:
-      EncodeMonoRect16((uint8_t *)tightBeforeBuf, w, h);
+      EncodeMonoRect16(tc, (uint8_t *)tc->tightBeforeBuf, w, h);
 
-      ((uint16_t *)tightAfterBuf)[0] = (uint16_t)monoBackground;
-      ((uint16_t *)tightAfterBuf)[1] = (uint16_t)monoForeground;
+      ((uint16_t *)tc->tightAfterBuf)[0] = (uint16_t)tc->monoBackground;
+      ((uint16_t *)tc->tightAfterBuf)[1] = (uint16_t)tc->monoForeground;
 
-      memcpy(&cl->updateBuf[cl->ublen], tightAfterBuf, 4);
+      memcpy(&cl->updateBuf[cl->ublen], tc->tightAfterBuf, 4);
       cl->ublen += 4;
       rfbStatRecordEncodingSentAdd(cl, cl->tightEncoding, 7);
       break;
 
     default:
-      EncodeMonoRect8((uint8_t *)tightBeforeBuf, w, h);
+      EncodeMonoRect8(tc, (uint8_t *)tc->tightBeforeBuf, w, h);
 
-      cl->updateBuf[cl->ublen++] = (char)monoBackground;
-      cl->updateBuf[cl->ublen++] = (char)monoForeground;
+      cl->updateBuf[cl->ublen++] = (char)tc->monoBackground;
+      cl->updateBuf[cl->ublen++] = (char)tc->monoForeground;
       rfbStatRecordEncodingSentAdd(cl, cl->tightEncoding, 5);
   }
 
   return CompressData(cl, streamId, dataLen,
-                      tightConf[compressLevel].monoZlibLevel,
+                      tightConf[tc->compressLevel].monoZlibLevel,
                       Z_DEFAULT_STRATEGY);
 }
 
 static rfbBool SendIndexedRect( rfbClient * cl
                                 , int x, int y
                                 , int w, int h )
-{ int streamId = 2;
+{ rfbTightContext * tc = cl->tightCtx;
+  int streamId = TIGHT_STREAM( cl, 2 );
   int i, entryLen;
 
 #ifdef HAVE_LIBPNG
@@ -942,14 +1167,14 @@ static rfbBool SendIndexedRect( rfbClient * cl
 #endif
 
   if ( cl->ublen + TIGHT_MIN_TO_COMPRESS + 6 +
-       paletteNumColors * cl->format.bitsPerPixel / 8 >
-       UPDATE_BUF_SIZE )
+       tc->paletteNumColors * cl->format.bitsPerPixel / 8 >
+       cl->ubsize )
   { if (!rfbSendUpdateBuf(cl))
     { return FALSE;
   } }
 
   /* Prepare tight encoding header. */
-  if ( tightConf[compressLevel].idxZlibLevel == 0
+  if ( tightConf[tc->compressLevel].idxZlibLevel == 0
        && cl->tightEncoding != rfbEncodingTightPng )
     cl->updateBuf[cl->ublen++] =
       (char)((rfbTightNoZlib | rfbTightExplicitFilter) << 4);
@@ -957,45 +1182,45 @@ static rfbBool SendIndexedRect( rfbClient * cl
   { cl->updateBuf[cl->ublen++] = (streamId | rfbTightExplicitFilter) << 4;
   }
   cl->updateBuf[cl->ublen++] = rfbTightFilterPalette;
-  cl->updateBuf[cl->ublen++] = (char)(paletteNumColors - 1);
+  cl->updateBuf[cl->ublen++] = (char)(tc->paletteNumColors - 1);
 
   /* Prepare palette, convert image. */
   switch (cl->format.bitsPerPixel)
   {
 
     case 32:
-      EncodeIndexedRect32((uint8_t *)tightBeforeBuf, w * h);
+      EncodeIndexedRect32(tc, (uint8_t *)tc->tightBeforeBuf, w * h);
 
-      for (i = 0; i < paletteNumColors; i++)
-      { ((uint32_t *)tightAfterBuf)[i] =
-          palette.entry[i].listNode->rgb;
+      for (i = 0; i < tc->paletteNumColors; i++)
+      { ((uint32_t *)tc->tightAfterBuf)[i] =
+          tc->palette.entry[i].listNode->rgb;
       }
-      if (usePixelFormat24)
-      { Pack24(cl, tightAfterBuf, &cl->format, paletteNumColors);
+      if (tc->usePixelFormat24)
+      { Pack24(cl, tc->tightAfterBuf, &cl->format, tc->paletteNumColors);
         entryLen = 3;
       }
       else
       { entryLen = 4; }
 
-      memcpy(&cl->updateBuf[cl->ublen], tightAfterBuf,
-             paletteNumColors * entryLen);
-      cl->ublen += paletteNumColors * entryLen;
+      memcpy(&cl->updateBuf[cl->ublen], tc->tightAfterBuf,
+             tc->paletteNumColors * entryLen);
+      cl->ublen += tc->paletteNumColors * entryLen;
       rfbStatRecordEncodingSentAdd(cl, cl->tightEncoding,
-                                   3 + paletteNumColors * entryLen);
+                                   3 + tc->paletteNumColors * entryLen);
       break;
 
     case 16:
-      EncodeIndexedRect16((uint8_t *)tightBeforeBuf, w * h);
+      EncodeIndexedRect16(tc, (uint8_t *)tc->tightBeforeBuf, w * h);
 
-      for (i = 0; i < paletteNumColors; i++)
-      { ((uint16_t *)tightAfterBuf)[i] =
-          (uint16_t)palette.entry[i].listNode->rgb;
+      for (i = 0; i < tc->paletteNumColors; i++)
+      { ((uint16_t *)tc->tightAfterBuf)[i] =
+          (uint16_t)tc->palette.entry[i].listNode->rgb;
       }
 
-      memcpy(&cl->updateBuf[cl->ublen], tightAfterBuf, paletteNumColors * 2);
-      cl->ublen += paletteNumColors * 2;
+      memcpy(&cl->updateBuf[cl->ublen], tc->tightAfterBuf, tc->paletteNumColors * 2);
+      cl->ublen += tc->paletteNumColors * 2;
       rfbStatRecordEncodingSentAdd(cl, cl->tightEncoding,
-                                   3 + paletteNumColors * 2);
+                                   3 + tc->paletteNumColors * 2);
       break;
 
     default:
@@ -1003,14 +1228,21 @@ static rfbBool SendIndexedRect( rfbClient * cl
   }
 
   return CompressData( cl, streamId
-                       , w * h, tightConf[compressLevel].idxZlibLevel
+                       , w * h, tightConf[tc->compressLevel].idxZlibLevel
                        , Z_DEFAULT_STRATEGY );
 }
 
+/**
+ *  rows, when not NULL, are the untranslated framebuffer pixels of a client
+ * with the server format. They are packed or deflated from there.
+ */
 static rfbBool SendFullColorRect( rfbClient * cl
                                   , int x, int y
-                                  , int w, int h )
-{ int streamId = 0;
+                                  , int w, int h
+                                  , char * rows )
+{ rfbTightContext * tc = cl->tightCtx;
+  int streamId = TIGHT_STREAM( cl, 0 );
+  int pitch    = cl->scaledScreen->paddedWidthInBytes;
   int len;
 
 #ifdef HAVE_LIBPNG
@@ -1019,27 +1251,43 @@ static rfbBool SendFullColorRect( rfbClient * cl
   }
 #endif
 
-  if (cl->ublen + TIGHT_MIN_TO_COMPRESS + 1 > UPDATE_BUF_SIZE)
+  if (cl->ublen + TIGHT_MIN_TO_COMPRESS + 1 > cl->ubsize)
   { if (!rfbSendUpdateBuf(cl))
     { return FALSE; }
   }
 
-  if ( tightConf[compressLevel].rawZlibLevel == 0
+  if ( tightConf[tc->compressLevel].rawZlibLevel == 0
        && cl->tightEncoding != rfbEncodingTightPng )
   { cl->updateBuf[cl->ublen++] = (char)(rfbTightNoZlib << 4); }
   else
-  { cl->updateBuf[cl->ublen++] = 0x00; }  /* stream id = 0, no flushing, no filter */
+  { cl->updateBuf[cl->ublen++] = (char)(streamId << 4); }  /* no flushing, no filter */
   rfbStatRecordEncodingSentAdd(cl, cl->tightEncoding, 1);
 
-  if (usePixelFormat24)
-  { Pack24(cl, tightBeforeBuf, &cl->format, w * h);
+  if (tc->usePixelFormat24)
+  { if ( rows )
+    { Pack24Rows(cl, tc->tightBeforeBuf, rows, pitch, w, h, &cl->format); }
+    else
+    { Pack24(cl, tc->tightBeforeBuf, &cl->format, w * h); }
     len = 3;
   }
   else
-  { len = cl->format.bitsPerPixel / 8; }
+  { len = cl->format.bitsPerPixel / 8;
+
+    if ( rows )
+    { if ( tightConf[tc->compressLevel].rawZlibLevel != 0
+        && w * h * len >= TIGHT_MIN_TO_COMPRESS )
+      { return CompressRows(cl, streamId, rows, w * len, pitch, h,
+                            tightConf[tc->compressLevel].rawZlibLevel,
+                            Z_DEFAULT_STRATEGY);
+      }
+
+      (*cl->translateFn)(cl->translateLookupTable,
+                         &cl->screen->window.serverFormat, &cl->format, rows,
+                         tc->tightBeforeBuf, pitch, w, h);
+  } }
 
   return CompressData(cl, streamId, w * h * len,
-                      tightConf[compressLevel].rawZlibLevel,
+                      tightConf[tc->compressLevel].rawZlibLevel,
                       Z_DEFAULT_STRATEGY);
 }
 
@@ -1047,23 +1295,40 @@ static rfbBool CompressData( rfbClient * cl
                              , int streamId
                              , int dataLen
                              , int zlibLevel, int zlibStrategy )
-{ z_streamp pz;
-  int err;
+{ rfbTightContext * tc = cl->tightCtx;
 
   if (dataLen < TIGHT_MIN_TO_COMPRESS)
-  { memcpy(&cl->updateBuf[cl->ublen], tightBeforeBuf, dataLen);
+  { memcpy(&cl->updateBuf[cl->ublen], tc->tightBeforeBuf, dataLen);
     cl->ublen += dataLen;
     rfbStatRecordEncodingSentAdd(cl, cl->tightEncoding, dataLen);
     return TRUE;
   }
 
   if (zlibLevel == 0)
-  { return rfbSendCompressedDataTight(cl, tightBeforeBuf, dataLen); }
+  { return rfbSendCompressedDataTight(cl, tc->tightBeforeBuf, dataLen); }
 
-  pz = &cl->zsStruct[streamId];
+  return CompressRows( cl, streamId, tc->tightBeforeBuf, dataLen, dataLen, 1
+                     , zlibLevel, zlibStrategy );
+}
+
+/**
+ *  Deflates h rows pitch bytes apart on a zlib stream, the caller has
+ * checked there is enough to compress.
+ */
+static rfbBool CompressRows( rfbClient * cl
+                             , int streamId
+                             , const char * rows
+                             , int bytesPerLine, int pitch, int h
+                             , int zlibLevel, int zlibStrategy )
+{ rfbTightContext * tc = cl->tightCtx;
+  rfbClient * zcl = cl->tileOwner ? cl->tileOwner : cl;  /* Streams owner */
+  z_streamp pz;
+  int err;
+
+  pz = &zcl->zsStruct[streamId];
 
   /* Initialize compression stream if needed. */
-  if (!cl->zsActive[streamId])
+  if (!zcl->zsActive[streamId])
   { pz->zalloc = Z_NULL;
     pz->zfree = Z_NULL;
     pz->opaque = Z_NULL;
@@ -1073,34 +1338,32 @@ static rfbBool CompressData( rfbClient * cl
     if (err != Z_OK)
     { return FALSE; }
 
-    cl->zsActive[streamId] = TRUE;
-    cl->zsLevel[streamId] = zlibLevel;
+    zcl->zsActive[streamId] = TRUE;
+    zcl->zsLevel[streamId] = zlibLevel;
   }
 
-  /* Prepare buffer pointers.
+  /* Prepare buffer pointers, input is given row by row.
   */
-  pz->next_in  = (Bytef *)tightBeforeBuf;
-  pz->avail_in = dataLen;
-  pz->next_out = (Bytef *)tightAfterBuf;
-  pz->avail_out= tightAfterBufSize;
+  pz->next_out = (Bytef *)tc->tightAfterBuf;
+  pz->avail_out= tc->tightAfterBufSize;
 
   /* Change compression parameters if needed.
   */
-  if (zlibLevel != cl->zsLevel[streamId])
+  if (zlibLevel != zcl->zsLevel[streamId])
   { if (deflateParams (pz, zlibLevel, zlibStrategy) != Z_OK)
     { return FALSE;
     }
-    cl->zsLevel[streamId] = zlibLevel;
+    zcl->zsLevel[streamId] = zlibLevel;
   }
 
   /* Actual compression. */
-  if ( deflate(pz, Z_SYNC_FLUSH) != Z_OK
+  if ( rfbZlibDeflateRows(pz, rows, bytesPerLine, pitch, h) != Z_OK
        || pz->avail_in != 0 || pz->avail_out == 0)
   { return FALSE;
   }
 
-  return rfbSendCompressedDataTight( cl, tightAfterBuf
-                                     , tightAfterBufSize - pz->avail_out );
+  return rfbSendCompressedDataTight( cl, tc->tightAfterBuf
+                                     , tc->tightAfterBufSize - pz->avail_out );
 }
 
 rfbBool rfbSendCompressedDataTight( rfbClient * cl, char *buf,
@@ -1121,15 +1384,15 @@ rfbBool rfbSendCompressedDataTight( rfbClient * cl, char *buf,
     }
   }
 
-  portionLen = UPDATE_BUF_SIZE;
   for (i = 0; i < compressedLen; i += portionLen)
-  { if (i + portionLen > compressedLen)
-    { portionLen = compressedLen - i;
-    }
-    if (cl->ublen + portionLen > UPDATE_BUF_SIZE)
+  { if (cl->ublen == cl->ubsize)
     { if (!rfbSendUpdateBuf(cl))
       { return FALSE; }
     }
+    portionLen = cl->ubsize - cl->ublen;   /* Chunks may differ in size */
+    if (i + portionLen > compressedLen)
+    { portionLen = compressedLen - i;
+    }
     memcpy(&cl->updateBuf[cl->ublen], &buf[i], portionLen);
     cl->ublen += portionLen;
   }
@@ -1143,21 +1406,21 @@ rfbBool rfbSendCompressedDataTight( rfbClient * cl, char *buf,
    Code to determine how many different colors used in rectangle.
 */
 
-static void FillPalette8(int count)
-{ uint8_t *data = (uint8_t *)tightBeforeBuf;
+static void FillPalette8(rfbTightContext * tc, int count)
+{ uint8_t *data = (uint8_t *)tc->tightBeforeBuf;
   uint8_t c0, c1;
   int i, n0, n1;
 
-  paletteNumColors = 0;
+  tc->paletteNumColors = 0;
 
   c0 = data[0];
   for (i = 1; i < count && data[i] == c0; i++);
   if (i == count)
-  { paletteNumColors = 1;
+  { tc->paletteNumColors = 1;
     return;                 /* Solid rectangle */
   }
 
-  if (paletteMaxColors < 2)
+  if (tc->paletteMaxColors < 2)
   { return; }
 
   n0 = i;
@@ -1175,78 +1438,79 @@ static void FillPalette8(int count)
   }
   if (i == count)
   { if (n0 > n1)
-    { monoBackground = (uint32_t)c0;
-      monoForeground = (uint32_t)c1;
+    { tc->monoBackground = (uint32_t)c0;
+      tc->monoForeground = (uint32_t)c1;
     }
     else
-    { monoBackground = (uint32_t)c1;
-      monoForeground = (uint32_t)c0;
+    { tc->monoBackground = (uint32_t)c1;
+      tc->monoForeground = (uint32_t)c0;
     }
-    paletteNumColors = 2;   /* Two colors */
+    tc->paletteNumColors = 2;   /* Two colors */
   }
 }
 
 
+/* The runs of each colour are found with the scans, so a small palette
+   costs a few vector compares per run instead of a hash lookup per pixel,
+   and busy content still leaves at paletteMaxColors. */
+
 #define DEFINE_FILL_PALETTE_FUNCTION(bpp)                               \
                                                                         \
 static void                                                             \
-FillPalette##bpp(int count) {                                           \
-    uint##bpp##_t *data = (uint##bpp##_t *)tightBeforeBuf;              \
+FillPalette##bpp(rfbTightContext * tc, int count) {                     \
+    const TIGHT_SCAN *scan = tc->scan;                                  \
+    uint##bpp##_t *data = (uint##bpp##_t *)tc->tightBeforeBuf;          \
+    const uint##bpp##_t all = (uint##bpp##_t)~0U;                       \
     uint##bpp##_t c0, c1, ci;                                           \
-    int i, n0, n1, ni;                                                  \
+    int i, n0, n1, ni, k;                                               \
                                                                         \
     c0 = data[0];                                                       \
-    for (i = 1; i < count && data[i] == c0; i++);                       \
+    i = 1 + scan->run##bpp(data + 1, count - 1, c0, all);               \
     if (i >= count) {                                                   \
-        paletteNumColors = 1;   /* Solid rectangle */                   \
+        tc->paletteNumColors = 1;   /* Solid rectangle */               \
         return;                                                         \
     }                                                                   \
                                                                         \
-    if (paletteMaxColors < 2) {                                         \
-        paletteNumColors = 0;   /* Full-color encoding preferred */     \
+    if (tc->paletteMaxColors < 2) {                                     \
+        tc->paletteNumColors = 0;   /* Full-color encoding preferred */ \
         return;                                                         \
     }                                                                   \
                                                                         \
     n0 = i;                                                             \
     c1 = data[i];                                                       \
-    n1 = 0;                                                             \
-    for (i++; i < count; i++) {                                         \
-        ci = data[i];                                                   \
-        if (ci == c0) {                                                 \
-            n0++;                                                       \
-        } else if (ci == c1) {                                          \
-            n1++;                                                       \
-        } else                                                          \
-            break;                                                      \
-    }                                                                   \
+    k = scan->two##bpp(data + i + 1, count - i - 1, c0, c1, all, &n0);  \
+    n1 = k - (n0 - i);                                                  \
+    i += 1 + k;                                                         \
     if (i >= count) {                                                   \
         if (n0 > n1) {                                                  \
-            monoBackground = (uint32_t)c0;                              \
-            monoForeground = (uint32_t)c1;                              \
+            tc->monoBackground = (uint32_t)c0;                          \
+            tc->monoForeground = (uint32_t)c1;                          \
         } else {                                                        \
-            monoBackground = (uint32_t)c1;                              \
-            monoForeground = (uint32_t)c0;                              \
+            tc->monoBackground = (uint32_t)c1;                          \
+            tc->monoForeground = (uint32_t)c0;                          \
         }                                                               \
-        paletteNumColors = 2;   /* Two colors */                        \
+        tc->paletteNumColors = 2;   /* Two colors */                    \
         return;                                                         \
     }                                                                   \
                                                                         \
-    PaletteReset();                                                     \
-    PaletteInsert (c0, (uint32_t)n0, bpp);                              \
-    PaletteInsert (c1, (uint32_t)n1, bpp);                              \
+    PaletteReset(tc);                                                   \
+    PaletteInsert (tc, c0, (uint32_t)n0, bpp);                          \
+    PaletteInsert (tc, c1, (uint32_t)n1, bpp);                          \
                                                                         \
+    ci = data[i];                                                       \
     ni = 1;                                                             \
-    for (i++; i < count; i++) {                                         \
-        if (data[i] == ci) {                                            \
-            ni++;                                                       \
-        } else {                                                        \
-            if (!PaletteInsert (ci, (uint32_t)ni, bpp))                 \
+    for (i++; i < count; ) {                                            \
+        k = data[i] == ci ? scan->run##bpp(data + i, count - i, ci, all) : 0; \
+        ni += k;                                                        \
+        i += k;                                                         \
+        if (i < count) {                                                \
+            if (!PaletteInsert (tc, ci, (uint32_t)ni, bpp))             \
                 return;                                                 \
-            ci = data[i];                                               \
+            ci = data[i++];                                             \
             ni = 1;                                                     \
         }                                                               \
     }                                                                   \
-    PaletteInsert (ci, (uint32_t)ni, bpp);                              \
+    PaletteInsert (tc, ci, (uint32_t)ni, bpp);                          \
 }
 
 DEFINE_FILL_PALETTE_FUNCTION(16)
@@ -1258,98 +1522,92 @@ static void                                                             \
 FastFillPalette##bpp(rfbClient * cl, uint##bpp##_t *data, int w,       \
                      int pitch, int h)                                  \
 {                                                                       \
+    rfbTightContext * tc = cl->tightCtx;                                \
+    const TIGHT_SCAN *scan = tc->scan;                                  \
     uint##bpp##_t c0, c1, ci, mask, c0t, c1t, cit;                      \
-    int i, j, i2 = 0, j2, n0, n1, ni;                                   \
+    uint##bpp##_t *row;                                                 \
+    int i, j, n0, n1, ni, k, m;                                         \
                                                                         \
     if (cl->translateFn != rfbTranslateNone) {                          \
-        mask = cl->screen->window.serverFormat.redMax                          \
-            << cl->screen->window.serverFormat.redShift;                       \
-        mask |= cl->screen->window.serverFormat.greenMax                       \
-             << cl->screen->window.serverFormat.greenShift;                    \
-        mask |= cl->screen->window.serverFormat.blueMax                        \
-             << cl->screen->window.serverFormat.blueShift;                     \
+        mask = cl->screen->window.serverFormat.redMax                   \
+            << cl->screen->window.serverFormat.redShift;                \
+        mask |= cl->screen->window.serverFormat.greenMax                \
+             << cl->screen->window.serverFormat.greenShift;             \
+        mask |= cl->screen->window.serverFormat.blueMax                 \
+             << cl->screen->window.serverFormat.blueShift;              \
     } else mask = ~0;                                                   \
                                                                         \
     c0 = data[0] & mask;                                                \
-    for (j = 0; j < h; j++) {                                           \
-        for (i = 0; i < w; i++) {                                       \
-            if ((data[j * pitch + i] & mask) != c0)                     \
-                goto done;                                              \
-        }                                                               \
+    for (j = 0, i = w; j < h; j++) {                                    \
+        if ((i = scan->run##bpp(data + j * pitch, w, c0, mask)) < w)    \
+            break;                                                      \
     }                                                                   \
-    done:                                                               \
     if (j >= h) {                                                       \
-        paletteNumColors = 1;   /* Solid rectangle */                   \
+        tc->paletteNumColors = 1;   /* Solid rectangle */               \
         return;                                                         \
     }                                                                   \
-    if (paletteMaxColors < 2) {                                         \
-        paletteNumColors = 0;   /* Full-color encoding preferred */     \
+    if (tc->paletteMaxColors < 2) {                                     \
+        tc->paletteNumColors = 0;   /* Full-color encoding preferred */ \
         return;                                                         \
     }                                                                   \
                                                                         \
     n0 = j * w + i;                                                     \
     c1 = data[j * pitch + i] & mask;                                    \
     n1 = 0;                                                             \
-    i++;  if (i >= w) {i = 0;  j++;}                                    \
-    for (j2 = j; j2 < h; j2++) {                                        \
-        for (i2 = i; i2 < w; i2++) {                                    \
-            ci = data[j2 * pitch + i2] & mask;                          \
-            if (ci == c0) {                                             \
-                n0++;                                                   \
-            } else if (ci == c1) {                                      \
-                n1++;                                                   \
-            } else                                                      \
-                goto done2;                                             \
-        }                                                               \
-        i = 0;                                                          \
+    for (i++; j < h; j++, i = 0) {                                      \
+        m = n0;                                                         \
+        k = scan->two##bpp(data + j * pitch + i, w - i, c0, c1, mask, &n0); \
+        n1 += k - (n0 - m);                                             \
+        if ((i += k) < w)                                               \
+            break;                                                      \
     }                                                                   \
-    done2:                                                              \
     (*cl->translateFn)(cl->translateLookupTable,                        \
-                       &cl->screen->window.serverFormat, &cl->format,          \
+                       &cl->screen->window.serverFormat, &cl->format,   \
                        (char *)&c0, (char *)&c0t, bpp/8, 1, 1);         \
     (*cl->translateFn)(cl->translateLookupTable,                        \
-                       &cl->screen->window.serverFormat, &cl->format,          \
+                       &cl->screen->window.serverFormat, &cl->format,   \
                        (char *)&c1, (char *)&c1t, bpp/8, 1, 1);         \
-    if (j2 >= h) {                                                      \
+    if (j >= h) {                                                       \
         if (n0 > n1) {                                                  \
-            monoBackground = (uint32_t)c0t;                             \
-            monoForeground = (uint32_t)c1t;                             \
+            tc->monoBackground = (uint32_t)c0t;                         \
+            tc->monoForeground = (uint32_t)c1t;                         \
         } else {                                                        \
-            monoBackground = (uint32_t)c1t;                             \
-            monoForeground = (uint32_t)c0t;                             \
+            tc->monoBackground = (uint32_t)c1t;                         \
+            tc->monoForeground = (uint32_t)c0t;                         \
         }                                                               \
-        paletteNumColors = 2;   /* Two colors */                        \
+        tc->paletteNumColors = 2;   /* Two colors */                    \
         return;                                                         \
     }                                                                   \
                                                                         \
-    PaletteReset();                                                     \
-    PaletteInsert (c0t, (uint32_t)n0, bpp);                             \
-    PaletteInsert (c1t, (uint32_t)n1, bpp);                             \
+    PaletteReset(tc);                                                   \
+    PaletteInsert (tc, c0t, (uint32_t)n0, bpp);                         \
+    PaletteInsert (tc, c1t, (uint32_t)n1, bpp);                         \
                                                                         \
+    ci = data[j * pitch + i] & mask;                                    \
     ni = 1;                                                             \
-    i2++;  if (i2 >= w) {i2 = 0;  j2++;}                                \
-    for (j = j2; j < h; j++) {                                          \
-        for (i = i2; i < w; i++) {                                      \
-            if ((data[j * pitch + i] & mask) == ci) {                   \
-                ni++;                                                   \
-            } else {                                                    \
+    for (i++; j < h; j++, i = 0) {                                      \
+        row = data + j * pitch;                                         \
+        while (i < w) {                                                 \
+            k = (row[i] & mask) == ci                                   \
+                ? scan->run##bpp(row + i, w - i, ci, mask) : 0;         \
+            ni += k;                                                    \
+            if ((i += k) < w) {                                         \
                 (*cl->translateFn)(cl->translateLookupTable,            \
-                                   &cl->screen->window.serverFormat,           \
+                                   &cl->screen->window.serverFormat,    \
                                    &cl->format, (char *)&ci,            \
                                    (char *)&cit, bpp/8, 1, 1);          \
-                if (!PaletteInsert (cit, (uint32_t)ni, bpp))            \
+                if (!PaletteInsert (tc, cit, (uint32_t)ni, bpp))        \
                     return;                                             \
-                ci = data[j * pitch + i] & mask;                        \
+                ci = row[i++] & mask;                                   \
                 ni = 1;                                                 \
             }                                                           \
         }                                                               \
-        i2 = 0;                                                         \
     }                                                                   \
                                                                         \
     (*cl->translateFn)(cl->translateLookupTable,                        \
-                       &cl->screen->window.serverFormat, &cl->format,          \
+                       &cl->screen->window.serverFormat, &cl->format,   \
                        (char *)&ci, (char *)&cit, bpp/8, 1, 1);         \
-    PaletteInsert (cit, (uint32_t)ni, bpp);                             \
+    PaletteInsert (tc, cit, (uint32_t)ni, bpp);                         \
 }
 
 DEFINE_FAST_FILL_PALETTE_FUNCTION( 16 )
@@ -1365,14 +1623,15 @@ DEFINE_FAST_FILL_PALETTE_FUNCTION( 32 )
 
 
 static void
-PaletteReset(void)
-{ paletteNumColors = 0;
-  memset(palette.hash, 0, 256 * sizeof(COLOR_LIST *));
+PaletteReset(rfbTightContext * tc)
+{ tc->paletteNumColors = 0;
+  memset(tc->palette.hash, 0, 256 * sizeof(COLOR_LIST *));
 }
 
 
 static int
-PaletteInsert(uint32_t rgb,
+PaletteInsert(rfbTightContext * tc,
+              uint32_t rgb,
               int numPixels,
               int bpp)
 { COLOR_LIST *pnode;
@@ -1381,59 +1640,59 @@ PaletteInsert(uint32_t rgb,
 
   hash_key = (bpp == 16) ? HASH_FUNC16(rgb) : HASH_FUNC32(rgb);
 
-  pnode = palette.hash[hash_key];
+  pnode = tc->palette.hash[hash_key];
 
   while (pnode != NULL)
   { if (pnode->rgb == rgb)
     { /* Such palette entry already exists. */
       new_idx = idx = pnode->idx;
-      count = palette.entry[idx].numPixels + numPixels;
-      if (new_idx && palette.entry[new_idx-1].numPixels < count)
+      count = tc->palette.entry[idx].numPixels + numPixels;
+      if (new_idx && tc->palette.entry[new_idx-1].numPixels < count)
       { do
-        { palette.entry[new_idx] = palette.entry[new_idx-1];
-          palette.entry[new_idx].listNode->idx = new_idx;
+        { tc->palette.entry[new_idx] = tc->palette.entry[new_idx-1];
+          tc->palette.entry[new_idx].listNode->idx = new_idx;
           new_idx--;
         }
-        while (new_idx && palette.entry[new_idx-1].numPixels < count);
-        palette.entry[new_idx].listNode = pnode;
+        while (new_idx && tc->palette.entry[new_idx-1].numPixels < count);
+        tc->palette.entry[new_idx].listNode = pnode;
         pnode->idx = new_idx;
       }
-      palette.entry[new_idx].numPixels = count;
-      return paletteNumColors;
+      tc->palette.entry[new_idx].numPixels = count;
+      return tc->paletteNumColors;
     }
     prev_pnode = pnode;
     pnode = pnode->next;
   }
 
   /* Check if palette is full. */
-  if (paletteNumColors == 256 || paletteNumColors == paletteMaxColors)
-  { paletteNumColors = 0;
+  if (tc->paletteNumColors == 256 || tc->paletteNumColors == tc->paletteMaxColors)
+  { tc->paletteNumColors = 0;
     return 0;
   }
 
   /* Move palette entries with lesser pixel counts. */
-  for ( idx = paletteNumColors;
-        idx > 0 && palette.entry[idx-1].numPixels < numPixels;
+  for ( idx = tc->paletteNumColors;
+        idx > 0 && tc->palette.entry[idx-1].numPixels < numPixels;
         idx-- )
-  { palette.entry[idx] = palette.entry[idx-1];
-    palette.entry[idx].listNode->idx = idx;
+  { tc->palette.entry[idx] = tc->palette.entry[idx-1];
+    tc->palette.entry[idx].listNode->idx = idx;
   }
 
   /* Add new palette entry into the freed slot. */
-  pnode = &palette.list[paletteNumColors];
+  pnode = &tc->palette.list[tc->paletteNumColors];
   if (prev_pnode != NULL)
   { prev_pnode->next = pnode;
   }
   else
-  { palette.hash[hash_key] = pnode;
+  { tc->palette.hash[hash_key] = pnode;
   }
   pnode->next = NULL;
   pnode->idx = idx;
   pnode->rgb = rgb;
-  palette.entry[idx].listNode = pnode;
-  palette.entry[idx].numPixels = numPixels;
+  tc->palette.entry[idx].listNode = pnode;
+  tc->palette.entry[idx].numPixels = numPixels;
 
-  return (++paletteNumColors);
+  return (++tc->paletteNumColors);
 }
 
 
@@ -1447,11 +1706,23 @@ static void Pack24(rfbClient * cl,
                    char *buf,
                    rfbPixelFormat *fmt,
                    int count)
-{ uint32_t *buf32;
+{ Pack24Rows(cl, buf, buf, count * 4, count, 1, fmt);  /* Never overtakes */
+}
+
+/*
+   Same, reading h rows of w pixels pitch bytes apart, straight from the
+   framebuffer when the client has the server format.
+*/
+
+static void Pack24Rows(rfbClient * cl,
+                       char *dst,
+                       const char *rows,
+                       int pitch, int w, int h,
+                       rfbPixelFormat *fmt)
+{ const uint32_t *buf32;
   uint32_t pix;
   int r_shift, g_shift, b_shift;
-
-  buf32 = (uint32_t *)buf;
+  int count;
 
   if (!cl->screen->window.serverFormat.bigEndian == !fmt->bigEndian)
   { r_shift = fmt->redShift;
@@ -1464,12 +1735,15 @@ static void Pack24(rfbClient * cl,
     b_shift = 24 - fmt->blueShift;
   }
 
-  while (count--)
-  { pix = *buf32++;
-    *buf++ = (char)(pix >> r_shift);
-    *buf++ = (char)(pix >> g_shift);
-    *buf++ = (char)(pix >> b_shift);
-  }
+  for ( ; h > 0; h--, rows += pitch )
+  { buf32 = (const uint32_t *)rows;
+
+    for ( count= w; count > 0; count-- )
+    { pix = *buf32++;
+      *dst++ = (char)(pix >> r_shift);
+      *dst++ = (char)(pix >> g_shift);
+      *dst++ = (char)(pix >> b_shift);
+  } }
 }
 
 
@@ -1480,7 +1754,7 @@ static void Pack24(rfbClient * cl,
 #define DEFINE_IDX_ENCODE_FUNCTION(bpp)                                 \
                                                                         \
 static void                                                             \
-EncodeIndexedRect##bpp(uint8_t *buf, int count) {                       \
+EncodeIndexedRect##bpp(rfbTightContext * tc, uint8_t *buf, int count) { \
     COLOR_LIST *pnode;                                                  \
     uint##bpp##_t *src;                                                 \
     uint##bpp##_t rgb;                                                  \
@@ -1493,7 +1767,7 @@ EncodeIndexedRect##bpp(uint8_t *buf, int count) {                       \
         while (count && *src == rgb) {                                  \
             rep++, src++, count--;                                      \
         }                                                               \
-        pnode = palette.hash[HASH_FUNC##bpp(rgb)];                      \
+        pnode = tc->palette.hash[HASH_FUNC##bpp(rgb)];                  \
         while (pnode != NULL) {                                         \
             if ((uint##bpp##_t)pnode->rgb == rgb) {                     \
                 *buf++ = (uint8_t)pnode->idx;                           \
@@ -1515,7 +1789,7 @@ DEFINE_IDX_ENCODE_FUNCTION(32)
 #define DEFINE_MONO_ENCODE_FUNCTION(bpp)                                \
                                                                         \
 static void                                                             \
-EncodeMonoRect##bpp(uint8_t *buf, int w, int h) {                       \
+EncodeMonoRect##bpp(rfbTightContext * tc, uint8_t *buf, int w, int h) { \
     uint##bpp##_t *ptr;                                                 \
     uint##bpp##_t bg;                                                   \
     unsigned int value, mask;                                           \
@@ -1523,7 +1797,7 @@ EncodeMonoRect##bpp(uint8_t *buf, int w, int h) {                       \
     int x, y, bg_bits;                                                  \
                                                                         \
     ptr = (uint##bpp##_t *) buf;                                        \
-    bg = (uint##bpp##_t) monoBackground;                                \
+    bg = (uint##bpp##_t) tc->monoBackground;                            \
     aligned_width = w - w % 8;                                          \
                                                                         \
     for (y = 0; y < h; y++) {                                           \
@@ -1573,38 +1847,42 @@ DEFINE_MONO_ENCODE_FUNCTION( 32 )
 
 static rfbBool
 SendJpegRect(rfbClient * cl, int x, int y, int w, int h, int quality)
-{ unsigned char *srcbuf;
+{ rfbTightContext * tc = cl->tightCtx;
+  unsigned char *srcbuf;
   int ps = cl->screen->window.serverFormat.bitsPerPixel / 8;
-  int subsamp = subsampLevel2tjsubsamp[subsampLevel];
+  int subsamp = subsampLevel2tjsubsamp[tc->subsampLevel];
   unsigned long size = 0;
   int flags = 0, pitch;
   unsigned char *tmpbuf = NULL;
+  rfbBool shared = rfbEncCacheUsable(cl);
+  rfbEncCacheEntry * cached = NULL;
 
   if (cl->screen->window.serverFormat.bitsPerPixel == 8)
-  { return SendFullColorRect(cl, x, y, w, h); }
+  { return SendFullColorRect(cl, x, y, w, h, NULL); }
 
   if (ps < 2)
   { rfbLog("Error: JPEG requires 16-bit, 24-bit, or 32-bit pixel format.\n");
     return 0;
   }
-  if (!j)
-  { if ((j = tjInitCompress()) == NULL)
+
+  if ( shared
+    && ( cached= rfbEncCacheLookup( cl, rfbEncodingTight
+                                  , TIGHT_CACHE_PARAM( rfbTightJpeg, subsamp, quality )
+                                  , &tightCacheFormat, x, y, w, h )))
+  { size = cached->len;
+    goto sendJpeg;
+  }
+
+  if (!tc->j)
+  { if ((tc->j = tjInitCompress()) == NULL)
     { rfbLog("JPEG Error: %s\n", tjGetErrorStr());
       return 0;
     }
   }
 
-  if (tightAfterBufSize < TJBUFSIZE(w, h))
-  { if (tightAfterBuf == NULL)
-    { tightAfterBuf = (char *)malloc(TJBUFSIZE(w, h)); }
-    else
-      tightAfterBuf = (char *)realloc(tightAfterBuf,
-                                      TJBUFSIZE(w, h));
-    if (!tightAfterBuf)
-    { rfbLog("Memory allocation failure!\n");
-      return 0;
-    }
-    tightAfterBufSize = TJBUFSIZE(w, h);
+  if (!rfbScratchReserve(&tc->tightAfterBuf, &tc->tightAfterBufSize,
+                    TJBUFSIZE(w, h), &tc->afterPeak))
+  { return 0;
   }
 
   if (ps == 2)
@@ -1653,7 +1931,8 @@ SendJpegRect(rfbClient * cl, int x, int y, int w, int h, int quality)
              [y * pitch + x * ps];
   }
 
-  if (tjCompress(j, srcbuf, w, pitch, h, ps, (unsigned char *)tightAfterBuf,
+  if (tjCompress(tc->j, srcbuf, w, pitch, h, ps,
+                 (unsigned char *)tc->tightAfterBuf,
                  &size, subsamp, quality, flags) == -1)
   { rfbLog( "JPEG Error: %s\n", tjGetErrorStr() );
     if (tmpbuf)
@@ -1666,7 +1945,15 @@ SendJpegRect(rfbClient * cl, int x, int y, int w, int h, int quality)
   { tmpbuf = NULL;
   }
 
-  if (cl->ublen + TIGHT_MIN_TO_COMPRESS + 1 > UPDATE_BUF_SIZE)
+  if ( shared )
+  { rfbEncCacheInsert( cl, rfbEncodingTight
+                     , TIGHT_CACHE_PARAM( rfbTightJpeg, subsamp, quality )
+                     , &tightCacheFormat, x, y, w, h
+                     , tc->tightAfterBuf, (int)size );
+  }
+
+sendJpeg:
+  if (cl->ublen + TIGHT_MIN_TO_COMPRESS + 1 > cl->ubsize)
   { if (!rfbSendUpdateBuf(cl))
     { return FALSE;
   } }
@@ -1674,7 +1961,7 @@ SendJpegRect(rfbClient * cl, int x, int y, int w, int h, int quality)
   cl->updateBuf[cl->ublen++] = (char)(rfbTightJpeg << 4);
   rfbStatRecordEncodingSentAdd(cl, cl->tightEncoding, 1);
 
-  return rfbSendCompressedDataTight(cl, tightAfterBuf, (int)size);
+  return rfbSendCompressedDataTight(cl, cached ? cached->data : tc->tightAfterBuf, (int)size);
 }
 
 static void
@@ -1755,8 +2042,6 @@ DEFINE_JPEG_GET_ROW_FUNCTION(32)
 
 #ifdef HAVE_LIBPNG
 
-static TLS int pngDstDataLen = 0;
-
 static rfbBool CanSendPngRect(rfbClient * cl, int w, int h)
 { if (cl->tightEncoding != rfbEncodingTightPng)
   { return FALSE;
@@ -1773,16 +2058,17 @@ static rfbBool CanSendPngRect(rfbClient * cl, int w, int h)
 static void pngWriteData( png_structp png_ptr
                           , png_bytep   data
                           , png_size_t  length )
-{
-#if 0
-  rfbClient * cl = png_get_io_ptr(png_ptr);
+{ rfbClient * cl = png_get_io_ptr(png_ptr);
+  rfbTightContext * tc = cl->tightCtx;
 
-  buffer_reserve(&vs->tight.png, vs->tight.png.offset + length);
-  memcpy(vs->tight.png.buffer + vs->tight.png.offset, data, length);
-#endif
-  memcpy(tightAfterBuf + pngDstDataLen, data, length);
+  /* PNG output is not bounded by the raw size, the buffer follows it */
+  if (!rfbScratchReserve(&tc->tightAfterBuf, &tc->tightAfterBufSize,
+                    tc->pngDstDataLen + (int)length, &tc->afterPeak))
+  { png_error(png_ptr, "Memory allocation failure");
+  }
 
-  pngDstDataLen += length;
+  memcpy(tc->tightAfterBuf + tc->pngDstDataLen, data, length);
+  tc->pngDstDataLen += length;
 }
 
 static void pngFlushData(png_structp png_ptr)
@@ -1801,6 +2087,7 @@ static void pngFree( png_structp png_ptr, png_voidp ptr )
 static rfbBool SendPngRect(rfbClient * cl, int x, int y, int w, int h)
 { /* rfbLog(">> SendPngRect x:%d, y:%d, w:%d, h:%d\n", x, y, w, h); */
 
+  rfbTightContext * tc = cl->tightCtx;
   png_byte color_type;
   png_structp png_ptr;
   png_infop info_ptr;
@@ -1809,8 +2096,18 @@ static rfbBool SendPngRect(rfbClient * cl, int x, int y, int w, int h)
   int filters = tightPngConf[cl->tightCompressLevel].png_filters;
   uint8_t *buf;
   int dy;
+  rfbBool shared = rfbEncCacheUsable(cl);
+  rfbEncCacheEntry * cached = NULL;
+
+  if ( shared
+    && ( cached= rfbEncCacheLookup( cl, rfbEncodingTightPng
+                                  , TIGHT_CACHE_PARAM( rfbTightPng, level, filters )
+                                  , &tightCacheFormat, x, y, w, h )))
+  { tc->pngDstDataLen = cached->len;
+    goto sendPng;
+  }
 
-  pngDstDataLen = 0;
+  tc->pngDstDataLen = 0;
 
   png_ptr = png_create_write_struct_2(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL,
                                       NULL, pngMalloc, pngFree);
@@ -1825,6 +2122,11 @@ static rfbBool SendPngRect(rfbClient * cl, int x, int y, int w, int h)
     return FALSE;
   }
 
+  if (setjmp(png_jmpbuf(png_ptr)))     /* tightAfterBuf could not grow */
+  { png_destroy_write_struct(&png_ptr, &info_ptr);
+    return FALSE;
+  }
+
   png_set_write_fn(png_ptr, (void *) cl, pngWriteData, pngFlushData);
   png_set_compression_level(png_ptr, level);
   png_set_filter(png_ptr, PNG_FILTER_TYPE_DEFAULT, filters);
@@ -1896,7 +2198,15 @@ static rfbBool SendPngRect(rfbClient * cl, int x, int y, int w, int h)
 
   /* done v */
 
-  if (cl->ublen + TIGHT_MIN_TO_COMPRESS + 1 > UPDATE_BUF_SIZE)
+  if ( shared )
+  { rfbEncCacheInsert( cl, rfbEncodingTightPng
+                     , TIGHT_CACHE_PARAM( rfbTightPng, level, filters )
+                     , &tightCacheFormat, x, y, w, h
+                     , tc->tightAfterBuf, tc->pngDstDataLen );
+  }
+
+sendPng:
+  if (cl->ublen + TIGHT_MIN_TO_COMPRESS + 1 > cl->ubsize)
   { if (!rfbSendUpdateBuf(cl))
     { return FALSE; }
   }
@@ -1905,7 +2215,7 @@ static rfbBool SendPngRect(rfbClient * cl, int x, int y, int w, int h)
   rfbStatRecordEncodingSentAdd(cl, cl->tightEncoding, 1);
 
   /* rfbLog("<< SendPngRect\n"); */
-  return rfbSendCompressedDataTight(cl, tightAfterBuf, pngDstDataLen);
+  return rfbSendCompressedDataTight(cl, cached ? cached->data : tc->tightAfterBuf, tc->pngDstDataLen);
 }
 #endif
 
@@ -0,0 +1,176 @@
+/*
+ * tightscantemplate.c - template for the pixel scans of the Tight encoder.
+ *
+ * This file shouldn't be compiled.  It is included multiple times by
+ * tight.c, each time with a different definition of the macro BPP and of
+ * SCAN_SUFFIX / SCAN_TARGET, which name the build: plain scalar code, code
+ * the compiler is asked to vectorize, and on x86 the same for AVX2.
+ *
+ * The scans compare whole blocks of pixels with no early exit inside a
+ * block, so the inner loops reduce to vector compares and ors. Only the
+ * block that ends a run is looked at pixel by pixel.
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#if !defined(BPP) || !defined(SCAN_SUFFIX) || !defined(SCAN_TARGET)
+#error "This file shouldn't be compiled."
+#error "It is included as part of tight.c"
+#endif
+
+#ifndef SCAN_BLOCK
+#define SCAN_BLOCK ( 256 / BPP )    /* Pixels compared before testing */
+#endif
+
+#define PIX_T CONCAT3E(uint,BPP,_t)
+#define TightRunBPP     CONCAT3E(TightRun,BPP,SCAN_SUFFIX)
+#define TightRunBackBPP CONCAT3E(TightRunBack,BPP,SCAN_SUFFIX)
+#define TightTwoBPP     CONCAT3E(TightTwo,BPP,SCAN_SUFFIX)
+#define TightRowsBPP    CONCAT3E(TightRows,BPP,SCAN_SUFFIX)
+
+/*
+   TightRunBPP returns how many of the n pixels at p equal c once masked.
+*/
+
+SCAN_TARGET static int
+TightRunBPP( const PIX_T * p, int n, PIX_T c, PIX_T mask )
+{ int i= 0, k;
+
+  if ( n && ( p[ 0 ] & mask ) != c )    /* Busy content, no run at all */
+  { return( 0 );
+  }
+
+  for( ; i + SCAN_BLOCK <= n
+       ; i += SCAN_BLOCK )
+  { PIX_T diff= 0;
+
+    for( k= 0; k < SCAN_BLOCK; k++ )
+    { diff |= ( p[ i + k ] & mask ) ^ c;
+    }
+
+    if ( diff )
+    { break;
+  } }
+
+  while ( i < n && ( p[ i ] & mask ) == c )
+  { i++;
+  }
+
+  return( i );
+}
+
+/*
+   TightRunBackBPP is the same going left from the pixel before end.
+*/
+
+SCAN_TARGET static int
+TightRunBackBPP( const PIX_T * end, int n, PIX_T c, PIX_T mask )
+{ int i= 0, k;
+
+  for( ; i + SCAN_BLOCK <= n
+       ; i += SCAN_BLOCK )
+  { const PIX_T * q= end - i - SCAN_BLOCK;
+    PIX_T diff= 0;
+
+    for( k= 0; k < SCAN_BLOCK; k++ )
+    { diff |= ( q[ k ] & mask ) ^ c;
+    }
+
+    if ( diff )
+    { break;
+  } }
+
+  while ( i < n && ( end[ -1 - i ] & mask ) == c )
+  { i++;
+  }
+
+  return( i );
+}
+
+/*
+   TightRowsBPP returns how many of the h rows of w pixels from p on are
+   all c once masked, pitch is in pixels and is negative to go upwards.
+   Rows are short for the split search, so each row is compared whole.
+*/
+
+SCAN_TARGET static int
+TightRowsBPP( const PIX_T * p, int w, int h, int pitch, PIX_T c, PIX_T mask )
+{ int j, k;
+
+  for( j= 0
+     ; j < h
+     ; j++, p += pitch )
+  { PIX_T diff= 0;
+
+    for( k= 0; k < w; k++ )
+    { diff |= ( p[ k ] & mask ) ^ c;
+    }
+
+    if ( diff )
+    { break;
+  } }
+
+  return( j );
+}
+
+/*
+   TightTwoBPP returns how many of the n pixels at p are c0 or c1 once
+   masked, those equal to c0 are added to *n0.
+*/
+
+SCAN_TARGET static int
+TightTwoBPP( const PIX_T * p, int n, PIX_T c0, PIX_T c1, PIX_T mask, int * n0 )
+{ int i= 0, k, count= 0;
+
+  for( ; i + SCAN_BLOCK <= n
+       ; i += SCAN_BLOCK )
+  { PIX_T other= 0, same= 0;
+
+    for( k= 0; k < SCAN_BLOCK; k++ )
+    { PIX_T q= p[ i + k ] & mask;
+
+      other |= ( q != c0 ) & ( q != c1 );
+      same  += q == c0;
+    }
+
+    if ( other )
+    { break;
+    }
+    count += same;
+  }
+
+  for( ; i < n
+       ; i++ )
+  { PIX_T q= p[ i ] & mask;
+
+    if ( q == c0 )
+    { count++;
+    }
+    else if ( q != c1 )
+    { break;
+  } }
+
+  *n0 += count;
+  return( i );
+}
+
+#undef TightRowsBPP
+#undef TightTwoBPP
+#undef TightRunBackBPP
+#undef TightRunBPP
+#undef PIX_T
@@ -0,0 +1,172 @@
+/*
+ * timer.c
+ *
+ * Timers of a screen, on CLOCK_MONOTONIC so nothing jumps when the wall
+ * clock is set. They are hashed by deadline into a wheel of
+ * RFB_TIMER_SLOTS slots RFB_TIMER_TICK apart, starting and stopping one is
+ * a list insert or unlink and expiring only visits the slots of the ticks
+ * gone by. Deadlines more than a turn away just stay in their slot until
+ * the wheel comes round to them again.
+ *
+ * rfbTimerNext() tells how long it is to the earliest deadline, so a host
+ * loop can sleep exactly until then, see rfbNextDeadline().
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#include <time.h>
+#include <rfb/rfbproto.h>
+
+#define TIMER_SLOT( w, tick ) ( (w)->slot + ( (tick) & ( RFB_TIMER_SLOTS - 1 )))
+
+/**
+ *  Microseconds on the monotonic clock
+ */
+uint64_t rfbTimerNow( void )
+{ struct timespec ts;
+
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return( (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000 );
+}
+
+static void rfbTimerLink( rfbTimer * t, rfbTimer ** head )
+{ t->next= *head;
+  if ( t->next )
+  { t->next->link= &t->next;
+  }
+  *head  = t;
+  t->link= head;
+}
+
+static void rfbTimerUnlink( rfbTimer * t )
+{ *t->link= t->next;
+  if ( t->next )
+  { t->next->link= t->link;
+  }
+  t->link= NULL;
+}
+
+/**
+ *  Sets up a stopped timer calling fire( t, data ) when it expires
+ */
+void rfbTimerInit( rfbTimer * t, void (* fire )( rfbTimer *, void * ), void * data )
+{ t->next    = NULL;
+  t->link    = NULL;
+  t->deadline= 0;
+  t->fire    = fire;
+  t->data    = data;
+}
+
+/**
+ *  (Re)starts t to expire at deadline, one already past expires on the
+ * next rfbTimerExpire()
+ */
+void rfbTimerStart( rfbTimerWheel * w, rfbTimer * t, uint64_t deadline )
+{ uint64_t tick= deadline / RFB_TIMER_TICK;
+
+  rfbTimerStop( w, t );
+
+  if ( tick < w->tick )
+  { tick= w->tick;
+  }
+
+  t->deadline= deadline;
+  rfbTimerLink( t, TIMER_SLOT( w, tick ));
+  w->running++;
+}
+
+void rfbTimerStop( rfbTimerWheel * w, rfbTimer * t )
+{ if ( t->link )
+  { rfbTimerUnlink( t );
+    w->running--;
+} }
+
+/**
+ *  Fires the timers due by now. Due ones are gathered first, so fire may
+ * start or stop any timer, those still gathered included.
+ */
+void rfbTimerExpire( rfbTimerWheel * w, uint64_t now )
+{ uint64_t last= now / RFB_TIMER_TICK;
+  uint64_t tick= w->tick;
+  uint64_t n;
+  rfbTimer * due= NULL;
+  rfbTimer * t;
+
+  w->tick= last;
+
+  if ( !w->running || last < tick )
+  { return;
+  }
+
+  n= last - tick + 1;
+  if ( n > RFB_TIMER_SLOTS )
+  { n= RFB_TIMER_SLOTS;
+  }
+
+  for( ; n--; tick++ )
+  { rfbTimer ** link= TIMER_SLOT( w, tick );
+
+    while(( t= *link ))
+    { if ( t->deadline > now )      /* A later turn, or later this tick */
+      { link= &t->next;
+        continue;
+      }
+
+      rfbTimerUnlink( t );
+      rfbTimerLink( t, &due );
+  } }
+
+  while(( t= due ))
+  { rfbTimerStop( w, t );
+    t->fire( t, t->data );
+} }
+
+/**
+ *  Microseconds from now to the earliest deadline, 0 when one is due and
+ * -1 without any timer running
+ */
+rfbLong rfbTimerNext( rfbTimerWheel * w, uint64_t now )
+{ uint64_t best= 0;
+  uint64_t tick;
+  rfbTimer * t;
+  int k;
+
+  if ( !w->running )
+  { return( -1 );
+  }
+
+  for( k= 0, tick= w->tick; k < RFB_TIMER_SLOTS && !best; k++, tick++ )
+  { for( t= *TIMER_SLOT( w, tick ); t; t= t->next )
+    { if ( t->deadline / RFB_TIMER_TICK <= tick
+        && ( !best || t->deadline < best ))
+      { best= t->deadline;
+  } } }
+
+  if ( !best )                       /* Everything is more than a turn away */
+  { for( k= 0; k < RFB_TIMER_SLOTS; k++ )
+    { for( t= w->slot[ k ]; t; t= t->next )
+      { if ( !best || t->deadline < best )
+        { best= t->deadline;
+  } } } }
+
+  if ( best <= now )
+  { return( 0 );
+  }
+
+  return( best - now > 0x7FFFFFFF ? 0x7FFFFFFF : (rfbLong)( best - now ));
+}
@@ -26,11 +26,13 @@
 #include <string.h>
 #include <rfb/rfbproto.h>
 #include <rfb/rfbregion.h>
+#include "scanbuild.h"
 
 static void PrintPixelFormat(               rfbPixelFormat * );
 static rfbBool rfbSetClientColourMapBGR233( rfbClient      * );
 
 rfbBool rfbEconomicTranslate = FALSE;
+rfbBool rfbVectorTranslate   = TRUE;
 
 /*
    Some standard pixel formats.
@@ -113,6 +115,55 @@ static const rfbPixelFormat BGR233Format =
 #undef IN
 #undef OUT
 
+/*
+   Table free translation from 32 bpp truecolour, see vectranstemplate.c.
+   Each output channel is (( in * mul + add ) >> 16 ) << outShift, with mul
+   and add picked so it matches the RGB tables for every input value.
+*/
+
+typedef struct
+{ uint32_t inShift [ 3 ], inMax[ 3 ];
+  uint32_t mul     [ 3 ], add  [ 3 ];
+  uint32_t outShift[ 3 ];
+  rfbBool  swap;
+} rfbVecTranslate;
+
+/* Built vectorized and for AVX2 as scanbuild.h describes */
+
+#define VEC_SUFFIX
+#define VEC_TARGET SCAN_VECTORIZE
+
+#define OUT 8
+#include "vectranstemplate.c"
+#undef OUT
+#define OUT 16
+#include "vectranstemplate.c"
+#undef OUT
+#define OUT 32
+#include "vectranstemplate.c"
+#undef OUT
+
+#undef VEC_SUFFIX
+#undef VEC_TARGET
+
+#ifdef SCAN_AVX2
+#define VEC_SUFFIX Avx2
+#define VEC_TARGET SCAN_AVX2_TARGET
+
+#define OUT 8
+#include "vectranstemplate.c"
+#undef OUT
+#define OUT 16
+#include "vectranstemplate.c"
+#undef OUT
+#define OUT 32
+#include "vectranstemplate.c"
+#undef OUT
+
+#undef VEC_SUFFIX
+#undef VEC_TARGET
+#endif
+
 #ifdef ALLOW24BPP
 #define COUNT_OFFSETS 4
 #define BPP2OFFSET(bpp) ((bpp)/8-1)
@@ -250,6 +301,113 @@ void rfbTranslateNone( char *table
 }
 
 
+/*
+   rfbInitVecScale finds mul and add so that (( i * mul + add ) >> 16 )
+   equals the rounded ( i * outMax + inMax / 2 ) / inMax of the tables for
+   every i up to inMax. Returns FALSE if there are none near outMax / inMax.
+*/
+
+static rfbBool rfbInitVecScale( int inMax, int outMax
+                              , uint32_t * mul, uint32_t * add )
+{ long long base= ((long long)outMax * 65536 + inMax / 2 ) / inMax;
+  int d, i;
+
+  for( d= 0; d < 1024; d++ )
+  { long long m= base + (( d & 1 ) ? -( d + 1 ) / 2 : d / 2 );
+    long long lo= 0, hi= 65536;
+
+    for( i= 0; i <= inMax && lo < hi; i++ )
+    { long long want= ((long long)i * outMax + inMax / 2 ) / inMax;
+
+      if ( want * 65536 - i * m > lo )
+      { lo= want * 65536 - i * m;
+      }
+      if (( want + 1 ) * 65536 - i * m < hi )
+      { hi= ( want + 1 ) * 65536 - i * m;
+    } }
+
+    if ( m > 0 && lo < hi )
+    { *mul= (uint32_t)m;
+      *add= (uint32_t)lo;
+      return( TRUE );
+  } }
+
+  return( FALSE );
+}
+
+/*
+   rfbInitVecTranslate sets up the rfbVecTranslate the table free kernels
+   use instead of the RGB tables. Only for 32 bpp truecolour servers with
+   channels up to 8 bits, going to 8, 16 or 32 bpp with the same limit.
+*/
+
+static rfbBool rfbInitVecTranslate( char           ** table
+                                  , rfbPixelFormat  * in
+                                  , rfbPixelFormat  * out )
+{ rfbVecTranslate * v;
+  int inMax [ 3 ]= { in->redMax,    in->greenMax,    in->blueMax    };
+  int inSh  [ 3 ]= { in->redShift,  in->greenShift,  in->blueShift  };
+  int outMax[ 3 ]= { out->redMax,   out->greenMax,   out->blueMax   };
+  int outSh [ 3 ]= { out->redShift, out->greenShift, out->blueShift };
+  int c;
+
+  if ( !rfbVectorTranslate
+    || !in->trueColour || !out->trueColour
+    || in->bitsPerPixel != 32
+    || ( out->bitsPerPixel != 8
+      && out->bitsPerPixel != 16
+      && out->bitsPerPixel != 32 ))
+  { return( FALSE );
+  }
+
+  v= (rfbVecTranslate *)calloc( 1, sizeof( rfbVecTranslate ));
+  if ( !v )
+  { return( FALSE );
+  }
+
+  for( c= 0; c < 3; c++ )
+  { if ( inMax [ c ] < 1 || inMax [ c ] > 255 || inSh [ c ] > 31
+      || outMax[ c ] < 1 || outMax[ c ] > 255
+      || outSh [ c ] > out->bitsPerPixel - 1
+      || !rfbInitVecScale( inMax[ c ], outMax[ c ], v->mul + c, v->add + c ))
+    { free( v );
+      return( FALSE );
+    }
+
+    v->inShift [ c ]= inSh [ c ];
+    v->inMax   [ c ]= inMax[ c ];
+    v->outShift[ c ]= outSh[ c ];
+  }
+
+  v->swap= out->bitsPerPixel != 8 && out->bigEndian != in->bigEndian;
+
+  FREE( *table ); *table= (char *)v;
+  return( TRUE );
+}
+
+/*
+   rfbPickVecTranslate returns the kernel for the output size, the AVX2
+   build of it when the CPU has that.
+*/
+
+static rfbTranslateFnType rfbPickVecTranslate( int outBitsPerPixel )
+{
+#ifdef SCAN_AVX2
+  if ( rfbPickScanBuild( TRUE ) == rfbScanAvx2 )
+  { switch( outBitsPerPixel )
+    { case  8: return( rfbTranslateVec32to8Avx2  );
+      case 16: return( rfbTranslateVec32to16Avx2 );
+      default: return( rfbTranslateVec32to32Avx2 );
+  } }
+#endif
+
+  switch( outBitsPerPixel )
+  { case  8: return( rfbTranslateVec32to8  );
+    case 16: return( rfbTranslateVec32to16 );
+    default: return( rfbTranslateVec32to32 );
+} }
+
+
 /*
    rfbSetTranslateFunction sets the translation function.
 */
@@ -352,6 +510,15 @@ rfbBool rfbSetTranslateFunction( rfbClient * cl )
   else
   {
 
+    /* 32 bpp truecolour is scaled in place, no tables needed */
+
+    if ( rfbInitVecTranslate( &cl->translateLookupTable
+                            , &cl->screen->window.serverFormat
+                            , &cl->format ))
+    { cl->translateFn= rfbPickVecTranslate( cl->format.bitsPerPixel );
+      return TRUE;
+    }
+
     /* otherwise we use three separate tables for red, green and blue */
 
     cl->translateFn = rfbTranslateWithRGBTablesFns
@@ -463,14 +630,11 @@ rfbBool rfbSetClientColourMap( rfbClient * cl
 void rfbSetClientColourMaps( ScreenAtom * rfbScreen
                            , int firstColour
                            , int nColours )
-{ rfbClientIteratorPtr i;
+{ rfbClientIteratorRec i;
   rfbClient * cl;
 
-  i = rfbGetClientIterator(rfbScreen);
-
-  while((cl = rfbClientIteratorNext(i)))
+  rfbForEachClient( i, rfbScreen, cl )
     rfbSetClientColourMap(cl, firstColour, nColours);
-  rfbReleaseClientIterator(i);
 }
 
 static void PrintPixelFormat(rfbPixelFormat *pf)
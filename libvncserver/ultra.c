@@ -115,7 +115,7 @@ static rfbBool rfbSendOneRectEncodingUltra( rfbClient * cl
   rfbStatRecordEncodingSent(cl, rfbEncodingUltra, sz_rfbFramebufferUpdateRectHeader + sz_rfbZlibHeader + cl->afterEncBufLen, maxRawSize);
 
   if (cl->ublen + sz_rfbFramebufferUpdateRectHeader + sz_rfbZlibHeader
-      > UPDATE_BUF_SIZE)
+      > cl->ubsize)
   { if (!rfbSendUpdateBuf(cl))
     { return FALSE; }
   }
@@ -139,7 +139,7 @@ static rfbBool rfbSendOneRectEncodingUltra( rfbClient * cl
   for (i = 0; i < cl->afterEncBufLen;)
   {
 
-    int bytesToCopy = UPDATE_BUF_SIZE - cl->ublen;
+    int bytesToCopy = cl->ubsize - cl->ublen;
 
     if (i + bytesToCopy > cl->afterEncBufLen)
     { bytesToCopy = cl->afterEncBufLen - i;
@@ -150,7 +150,7 @@ static rfbBool rfbSendOneRectEncodingUltra( rfbClient * cl
     cl->ublen += bytesToCopy;
     i += bytesToCopy;
 
-    if (cl->ublen == UPDATE_BUF_SIZE)
+    if (cl->ublen == cl->ubsize)
     { if (!rfbSendUpdateBuf(cl))
       { return FALSE; }
   } }
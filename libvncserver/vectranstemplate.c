@@ -0,0 +1,100 @@
+/*
+ * vectranstemplate.c - template for translation from a 32 bpp truecolour
+ * framebuffer without lookup tables.
+ *
+ * This file shouldn't be compiled.  It is included multiple times by
+ * translate.c, each time with a different definition of the macro OUT and,
+ * on x86, once more per output size with VEC_SUFFIX and VEC_TARGET naming
+ * an instruction set the running CPU is checked for.
+ *
+ * Each channel is scaled with one multiply, an add and a shift worked out
+ * by rfbInitVecTranslate, so the inner loop has no loads other than the
+ * pixels and the compiler turns it into SSE2, AVX2 or NEON code.
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#if !defined(OUT) || !defined(VEC_SUFFIX) || !defined(VEC_TARGET)
+#error "This file shouldn't be compiled."
+#error "It is included as part of translate.c"
+#endif
+
+#define OUT_T CONCAT3E(uint,OUT,_t)
+#define rfbTranslateVec32toOUT CONCAT3E(rfbTranslateVec32to,OUT,VEC_SUFFIX)
+
+#define VEC_CHANNEL( p, c )                                               \
+        ((((( p ) >> c##In ) & c##Max ) * c##Mul + c##Add ) >> 16 ) << c##Out
+
+#define VEC_PIXEL( p )                                                    \
+        ( VEC_CHANNEL( p, r ) | VEC_CHANNEL( p, g ) | VEC_CHANNEL( p, b ))
+
+/*
+   rfbTranslateVec32toOUT translates a rectangle of 32 bpp pixel data,
+   table points to the rfbVecTranslate set up by rfbInitVecTranslate.
+*/
+
+VEC_TARGET static void
+rfbTranslateVec32toOUT( char *table, rfbPixelFormat *in
+                      , rfbPixelFormat *out
+                      , char *iptr, char *optr
+                      , int bytesBetweenInputLines
+                      , int width, int height )
+{ const rfbVecTranslate * v= (const rfbVecTranslate *)table;
+
+/* Locals, the output may alias the parameters as far as the compiler knows */
+
+  const uint32_t rIn = v->inShift[ 0 ], rMax= v->inMax[ 0 ]
+               , rMul= v->mul[ 0 ], rAdd= v->add[ 0 ], rOut= v->outShift[ 0 ];
+  const uint32_t gIn = v->inShift[ 1 ], gMax= v->inMax[ 1 ]
+               , gMul= v->mul[ 1 ], gAdd= v->add[ 1 ], gOut= v->outShift[ 1 ];
+  const uint32_t bIn = v->inShift[ 2 ], bMax= v->inMax[ 2 ]
+               , bMul= v->mul[ 2 ], bAdd= v->add[ 2 ], bOut= v->outShift[ 2 ];
+#if (OUT != 8)
+  const rfbBool swap= v->swap;
+#endif
+  OUT_T * op= (OUT_T *)optr;
+  int x;
+
+  while ( height > 0 )
+  { const uint32_t * ip= (const uint32_t *)iptr;
+
+#if (OUT != 8)
+    if ( swap )
+    { for( x= 0; x < width; x++ )
+      { uint32_t p= ip[ x ];
+        OUT_T o= (OUT_T)VEC_PIXEL( p );
+
+        op[ x ]= CONCAT2E(Swap,OUT)( o );
+    } }
+    else
+#endif
+    { for( x= 0; x < width; x++ )
+      { uint32_t p= ip[ x ];
+
+        op[ x ]= (OUT_T)VEC_PIXEL( p );
+    } }
+
+    iptr += bytesBetweenInputLines;
+    op   += width;
+    height--;
+} }
+
+#undef VEC_PIXEL
+#undef VEC_CHANNEL
+#undef rfbTranslateVec32toOUT
+#undef OUT_T
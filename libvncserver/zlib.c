@@ -31,48 +31,320 @@
 */
 
 #include <string.h>
+#include <time.h>
 #include <rfb/rfbproto.h>
+#include "private.h"
 
 /*
    zlibBeforeBuf contains pixel data in the client's format.
    zlibAfterBuf contains the zlib (deflated) encoding version.
-   If the zlib compressed/encoded version is
-   larger than the raw data or if it exceeds zlibAfterBufSize then
-   raw encoding is used instead.
+   Both live in a context taken from the screen pool for the call and are
+   sized to the rects being encoded, as for tight.c.
+
+   Big rects go out as several Zlib rects of at most ZLIB_MAX_SIZE pixels.
+   With encoding threads up to ZLIB_BATCH of those are deflated at once:
+   the first goes on with the client stream, every other one on a raw
+   deflate stream of its own primed with the ZLIB_WINDOW bytes before it,
+   which is what the viewer has seen by then. Each ends on a sync flush, so
+   they simply follow each other in the one zlib stream of the client. The
+   client stream is then primed with the tail of the batch in turn. It is
+   raw deflate for that, the zlib header is written here.
 */
 
-/*
-   Out of lazyiness, we use thread local storage for zlib as we did for
-   tight.  N.B. ZRLE does it the traditional way with per-client storage
-   (and so at least ZRLE will work threaded on older systems.)
-*/
-#if defined(__GNUC__)
-#define TLS __thread
-#elif defined(_MSC_VER)
-#define TLS __declspec(thread)
-#else
-#define TLS
-#endif
-
-static TLS int zlibBeforeBufSize = 0;
-static TLS char *zlibBeforeBuf = NULL;
-
-static TLS int zlibAfterBufSize = 0;
-static TLS char *zlibAfterBuf = NULL;
-static TLS int zlibAfterBufLen = 0;
-
-void rfbZlibCleanup(rfbScreenInfo * screen)
-{ if (zlibBeforeBufSize)
-  { FREE(zlibBeforeBuf);
-    zlibBeforeBufSize=0;
+#define ZLIB_BATCH           16    /* Zlib rects deflated at once */
+#define ZLIB_WINDOW          ( 1 << MAX_WBITS )
+#define ZLIB_SHRINK_PERIOD    5    /* Seconds the peak use is measured over */
+#define ZLIB_IDLE            30    /* Seconds a pooled context is kept unused */
+
+/* zlib may need a little more room than the input, in the worst case */
+#define ZLIB_BOUND( n )      (( n ) + (( n ) + 99 ) / 100 + 12 )
+#define ZLIB_HEADER_SIZE      2
+
+typedef struct _rfbZlibContext
+{ struct _rfbZlibContext * next;     /* Screen pool link */
+  time_t lastUse, periodStart;
+  int beforePeak, afterPeak;          /* Largest use since periodStart */
+
+  int zlibBeforeBufSize;
+  char *zlibBeforeBuf;
+  int zlibAfterBufSize;
+  char *zlibAfterBuf;
+
+  z_stream zs;                        /* Batch rects not on the client stream */
+  rfbBool zsInited;
+  int zsLevel;
+} rfbZlibContext;
+
+/**
+ *  Makes *buf hold at least need bytes, the peak of the period follows
+ */
+rfbBool rfbScratchReserve( char ** buf, int * size
+                         , int need, int * peak )
+{ char * grown;
+
+  if ( need > *peak )
+  { *peak= need;
+  }
+
+  if ( *size >= need )
+  { return( TRUE );
+  }
+
+  need= ( need + RFB_SCRATCH_ROUND - 1 ) / RFB_SCRATCH_ROUND * RFB_SCRATCH_ROUND;
+  if ( !( grown= (char *)realloc( *buf, need )))
+  { rfbLog( "Memory allocation failure!\n" );
+    return( FALSE );
+  }
+
+  *buf = grown;
+  *size= need;
+  return( TRUE );
+}
+
+/**
+ *  Gives back what a buffer holds beyond twice the peak of the period
+ */
+void rfbScratchShrink( char ** buf, int * size, int peak )
+{ char * shrunk;
+
+  if ( *size <= 2 * peak || *size <= RFB_SCRATCH_ROUND )
+  { return;
+  }
+
+  if ( !peak )
+  { free( *buf );
+    *buf = NULL;
+    *size= 0;
+    return;
   }
 
-  if (zlibAfterBufSize)
-  { zlibAfterBufSize=0;
-    FREE(zlibAfterBuf);
+  peak= ( peak + RFB_SCRATCH_ROUND - 1 ) / RFB_SCRATCH_ROUND * RFB_SCRATCH_ROUND;
+  if (( shrunk= (char *)realloc( *buf, peak )))
+  { *buf = shrunk;
+    *size= peak;
+} }
+
+static void ZlibFreeContext( rfbZlibContext * zc )
+{ free( zc->zlibBeforeBuf );
+  free( zc->zlibAfterBuf );
+  if ( zc->zsInited )
+  { deflateEnd( &zc->zs );
   }
+  free( zc );
+}
+
+static rfbZlibContext * ZlibAcquire( rfbScreenInfo * screen )
+{ rfbZlibContext * zc;
+
+  rfbLockScratchPools( screen );
+  if (( zc= screen->zlibPool ))
+  { screen->zlibPool= zc->next;
+  }
+  rfbUnlockScratchPools( screen );
+
+  if ( !zc && ( zc= (rfbZlibContext *)calloc( 1, sizeof( *zc ))))
+  { zc->periodStart= time( NULL );
+  }
+
+  return( zc );
 }
 
+/**
+ *  Pooled contexts are kept most recently used first, those left idle at
+ * the tail are freed
+ */
+static void ZlibRelease( rfbScreenInfo * screen, rfbZlibContext * zc )
+{ rfbZlibContext * idle= NULL, ** link;
+  time_t now= time( NULL );
+
+  if ( now - zc->periodStart >= ZLIB_SHRINK_PERIOD )
+  { rfbScratchShrink( &zc->zlibBeforeBuf, &zc->zlibBeforeBufSize, zc->beforePeak );
+    rfbScratchShrink( &zc->zlibAfterBuf,  &zc->zlibAfterBufSize,  zc->afterPeak  );
+    zc->beforePeak= zc->afterPeak= 0;
+    zc->periodStart= now;
+  }
+  zc->lastUse= now;
+
+  rfbLockScratchPools( screen );
+  zc->next= screen->zlibPool;
+  screen->zlibPool= zc;
+
+  for( link= &zc->next
+     ; *link
+     ; link= &( *link )->next )
+  { if ( now - ( *link )->lastUse > ZLIB_IDLE )
+    { idle = *link;
+      *link= NULL;
+      break;
+  } }
+  rfbUnlockScratchPools( screen );
+
+  while(( zc= idle ))
+  { idle= zc->next;
+    ZlibFreeContext( zc );
+} }
+
+void rfbZlibCleanup( rfbScreenInfo * screen )
+{ rfbZlibContext * zc;
+
+  while(( zc= screen->zlibPool ))
+  { screen->zlibPool= zc->next;
+    ZlibFreeContext( zc );
+} }
+
+/**
+ *  The two byte zlib header deflate would write for a stream at level
+ */
+static int ZlibHeader( char * out, int level )
+{ int flags= level < 2 ? 0 : level < 6 ? 1 : level == 6 ? 2 : 3;
+  int header= ( Z_DEFLATED + (( MAX_WBITS - 8 ) << 4 )) << 8 | flags << 6;
+
+  header += 31 - header % 31;
+  out[ 0 ]= header >> 8;
+  out[ 1 ]= header & 0xFF;
+
+  return( ZLIB_HEADER_SIZE );
+}
+
+/**
+ *  Gets the client stream going at the level asked for, with its output
+ * going to the size bytes at out. When it starts here the zlib header is
+ * written first. FALSE on errors.
+ */
+static rfbBool ZlibStreamStart( rfbClient * cl, char * out, int size )
+{ int header= 0;
+
+  if ( cl->compStreamInited == FALSE )
+  { cl->compStream.total_in = 0;
+    cl->compStream.total_out= 0;
+    cl->compStream.zalloc   = Z_NULL;
+    cl->compStream.zfree    = Z_NULL;
+    cl->compStream.opaque   = Z_NULL;
+
+    if ( deflateInit2( &(cl->compStream),
+                       cl->zlibCompressLevel,
+                       Z_DEFLATED,
+                       -MAX_WBITS,
+                       MAX_MEM_LEVEL,
+                       Z_DEFAULT_STRATEGY ) != Z_OK )
+    { return( FALSE );
+    }
+
+    cl->compStreamInited= TRUE;
+    cl->zlibStreamLevel = cl->zlibCompressLevel;
+    header= ZlibHeader( out, cl->zlibCompressLevel );
+  }
+
+  cl->compStream.next_out = ( Bytef * )out + header;
+  cl->compStream.avail_out= size - header;
+  cl->compStream.data_type= Z_BINARY;
+
+  /* The level may change between rects, see adapt.c. Anything flushed
+     at the old level goes out with this rect.
+  */
+  if ( cl->zlibStreamLevel != cl->zlibCompressLevel )
+  { if ( deflateParams( &(cl->compStream), cl->zlibCompressLevel
+                      , Z_DEFAULT_STRATEGY ) != Z_OK )
+    { return( FALSE );
+    }
+    cl->zlibStreamLevel = cl->zlibCompressLevel;
+  }
+
+  return( TRUE );
+}
+
+/**
+ *  Deflates h rows of a rect in place, for clients with the server pixel
+ * format. The stream output is the same as for the translated copy, only
+ * the last row is flushed.
+ */
+int rfbZlibDeflateRows( z_stream * zs, const char * rows
+                      , int bytesPerLine, int stride, int h )
+{ int result;
+
+  if ( stride == bytesPerLine )
+  { zs->next_in = ( Bytef * )rows;
+    zs->avail_in= bytesPerLine * h;
+    return( deflate( zs, Z_SYNC_FLUSH ));
+  }
+
+  for( ; h > 0
+       ; h--, rows += stride )
+  { zs->next_in = ( Bytef * )rows;
+    zs->avail_in= bytesPerLine;
+
+    if (( result= deflate( zs, h == 1 ? Z_SYNC_FLUSH : Z_NO_FLUSH )) != Z_OK )
+    { return( result );
+  } }
+
+  return( Z_OK );
+}
+
+/**
+ *  Sends the header of a Zlib rect and len bytes of deflated data
+ */
+static rfbBool ZlibPutRect( rfbClient * cl
+                          , int x, int y, int w, int h
+                          , const char * data, int len )
+{ rfbFramebufferUpdateRectHeader rect;
+  rfbZlibHeader hdr;
+  int i;
+
+  /* Update statics */
+  rfbStatRecordEncodingSent(cl, rfbEncodingZlib, sz_rfbFramebufferUpdateRectHeader + sz_rfbZlibHeader + len,
+                            + w * (cl->format.bitsPerPixel / 8) * h);
+
+  if (cl->ublen + sz_rfbFramebufferUpdateRectHeader + sz_rfbZlibHeader
+      > cl->ubsize)
+  { if (!rfbSendUpdateBuf(cl))
+    { return FALSE;
+  } }
+
+  rect.r.x = Swap16IfLE( x );
+  rect.r.y = Swap16IfLE( y );
+  rect.r.w = Swap16IfLE( w );
+  rect.r.h = Swap16IfLE( h );
+  rect.encoding = Swap32IfLE(rfbEncodingZlib);
+
+  memcpy(&cl->updateBuf[cl->ublen], (char *)&rect,
+         sz_rfbFramebufferUpdateRectHeader);
+  cl->ublen += sz_rfbFramebufferUpdateRectHeader;
+
+  hdr.nBytes = Swap32IfLE(len);
+
+  memcpy(&cl->updateBuf[cl->ublen], (char *)&hdr, sz_rfbZlibHeader);
+  cl->ublen += sz_rfbZlibHeader;
+
+  for (i = 0; i < len;)
+  {
+
+    int bytesToCopy = cl->ubsize - cl->ublen;
+
+    if (i + bytesToCopy > len)
+    { bytesToCopy = len - i;
+    }
+
+    memcpy(&cl->updateBuf[cl->ublen], &data[i], bytesToCopy);
+
+    cl->ublen += bytesToCopy;
+    i += bytesToCopy;
+
+    if (cl->ublen == cl->ubsize)
+    { if (!rfbSendUpdateBuf(cl))
+      { return FALSE;
+  } } }
+
+  return TRUE;
+}
+
+/**
+ *  zlib compression is not useful for very small data sets, these are sent
+ * raw without any compression.
+ */
+static rfbBool ZlibTooSmall( rfbClient * cl, int w, int h )
+{ return( w * h * (cl->scaledScreen->bitsPerPixel / 8)
+        < VNC_ENCODE_ZLIB_MIN_COMP_SIZE );
+}
 
 /*
    rfbSendOneRectEncodingZlib - send a given rectangle using one Zlib
@@ -80,39 +352,19 @@ void rfbZlibCleanup(rfbScreenInfo * screen)
 */
 
 static rfbBool rfbSendOneRectEncodingZlib( rfbClient * cl
+    , rfbZlibContext * zc
     , int x, int y
     , int w, int h )
-{ rfbFramebufferUpdateRectHeader rect;
-  rfbZlibHeader hdr;
-  int deflateResult;
-  int previousOut;
-  int i;
+{ int deflateResult;
 
   char *fbptr= (cl->scaledScreen->frameBuffer
              + (cl->scaledScreen->paddedWidthInBytes * y)
              + (x * (cl->scaledScreen->bitsPerPixel / 8)));
 
-  int maxRawSize;
-  int maxCompSize;
-
-  maxRawSize = (cl->scaledScreen->width * cl->scaledScreen->height
-                * (cl->format.bitsPerPixel / 8));
-
-  if (zlibBeforeBufSize < maxRawSize)
-  { zlibBeforeBufSize = maxRawSize;
-
-    if (zlibBeforeBuf == NULL)
-    { zlibBeforeBuf = (char *)malloc(zlibBeforeBufSize);
-    }
-    else
-    { zlibBeforeBuf = (char *)realloc(zlibBeforeBuf, zlibBeforeBufSize);
-  } }
+  int rawSize = w * h * (cl->format.bitsPerPixel / 8);
+  int maxCompSize = ZLIB_HEADER_SIZE + ZLIB_BOUND( rawSize );
 
-  /* zlib compression is not useful for very small data sets.
-     So, we just send these raw without any compression.
-  */
-  if (( w * h * (cl->scaledScreen->bitsPerPixel / 8))
-     < VNC_ENCODE_ZLIB_MIN_COMP_SIZE )
+  if ( ZlibTooSmall( cl, w, h ))
   { int result;
 
     /* The translation function (used also by the in raw encoding)
@@ -133,64 +385,39 @@ static rfbBool rfbSendOneRectEncodingZlib( rfbClient * cl
 
   }
 
-  /*
-     zlib requires output buffer to be slightly larger than the input
-     buffer, in the worst case.
-  */
-  maxCompSize = maxRawSize + (( maxRawSize + 99 ) / 100 ) + 12;
-
-  if (zlibAfterBufSize < maxCompSize)
-  { zlibAfterBufSize = maxCompSize;
-    if (zlibAfterBuf == NULL)
-    { zlibAfterBuf = (char *)malloc(zlibAfterBufSize); }
-    else
-    { zlibAfterBuf = (char *)realloc(zlibAfterBuf, zlibAfterBufSize);
-  } }
-
-
-  /*
-     Convert pixel data to client format.
-  */
-  (*cl->translateFn)(cl->translateLookupTable
-                    , &cl->screen->window.serverFormat
-                    , &cl->format
-                    , fbptr, zlibBeforeBuf
-                    , cl->scaledScreen->paddedWidthInBytes, w, h);
-
-  cl->compStream.next_in   = ( Bytef * )zlibBeforeBuf;
-  cl->compStream.avail_in  = w * h * (cl->format.bitsPerPixel / 8);
-  cl->compStream.next_out  = ( Bytef * )zlibAfterBuf;
-  cl->compStream.avail_out = maxCompSize;
-  cl->compStream.data_type = Z_BINARY;
-
-  /* Initialize the deflation state.
-  */
-  if ( cl->compStreamInited == FALSE )
-  { cl->compStream.total_in = 0;
-    cl->compStream.total_out = 0;
-    cl->compStream.zalloc = Z_NULL;
-    cl->compStream.zfree = Z_NULL;
-    cl->compStream.opaque = Z_NULL;
-
-    deflateInit2( &(cl->compStream),
-                  cl->zlibCompressLevel,
-                  Z_DEFLATED,
-                  MAX_WBITS,
-                  MAX_MEM_LEVEL,
-                  Z_DEFAULT_STRATEGY );
-    /* deflateInit( &(cl->compStream), Z_BEST_COMPRESSION ); */
-    /* deflateInit( &(cl->compStream), Z_BEST_SPEED ); */
-    cl->compStreamInited = TRUE;
-
+  if (( cl->translateFn != rfbTranslateNone   /* Else deflated from the framebuffer */
+     && !rfbScratchReserve( &zc->zlibBeforeBuf, &zc->zlibBeforeBufSize
+                          , rawSize, &zc->beforePeak ))
+    || !rfbScratchReserve( &zc->zlibAfterBuf, &zc->zlibAfterBufSize
+                         , maxCompSize, &zc->afterPeak ))
+  { return FALSE;
   }
 
-  previousOut = cl->compStream.total_out;
+  if ( !ZlibStreamStart( cl, zc->zlibAfterBuf, maxCompSize ))
+  { rfbErr("zlib deflation error: %s\n", cl->compStream.msg);
+    return FALSE;
+  }
 
   /* Perform the compression here. */
-  deflateResult = deflate( &(cl->compStream), Z_SYNC_FLUSH );
-
-  /* Find the total size of the resulting compressed data. */
-  zlibAfterBufLen = cl->compStream.total_out - previousOut;
+  if ( cl->translateFn == rfbTranslateNone )
+  { deflateResult = rfbZlibDeflateRows( &cl->compStream, fbptr
+                                      , w * (cl->format.bitsPerPixel / 8)
+                                      , cl->scaledScreen->paddedWidthInBytes, h );
+  }
+  else
+  { /*
+       Convert pixel data to client format.
+    */
+    (*cl->translateFn)(cl->translateLookupTable
+                      , &cl->screen->window.serverFormat
+                      , &cl->format
+                      , fbptr, zc->zlibBeforeBuf
+                      , cl->scaledScreen->paddedWidthInBytes, w, h);
+
+    cl->compStream.next_in   = ( Bytef * )zc->zlibBeforeBuf;
+    cl->compStream.avail_in  = rawSize;
+    deflateResult = deflate( &(cl->compStream), Z_SYNC_FLUSH );
+  }
 
   if ( deflateResult != Z_OK )
   { rfbErr("zlib deflation error: %s\n", cl->compStream.msg);
@@ -204,51 +431,250 @@ static rfbBool rfbSendOneRectEncodingZlib( rfbClient * cl
      cause lose of synchronization.
   */
 
-  /* Update statics */
-  rfbStatRecordEncodingSent(cl, rfbEncodingZlib, sz_rfbFramebufferUpdateRectHeader + sz_rfbZlibHeader + zlibAfterBufLen,
-                            + w * (cl->format.bitsPerPixel / 8) * h);
+  return( ZlibPutRect( cl, x, y, w, h, zc->zlibAfterBuf
+                     , (char *)cl->compStream.next_out - zc->zlibAfterBuf ));
+}
 
-  if (cl->ublen + sz_rfbFramebufferUpdateRectHeader + sz_rfbZlibHeader
-      > UPDATE_BUF_SIZE)
-  { if (!rfbSendUpdateBuf(cl))
-    { return FALSE;
-  } }
+/**
+ *  Zlib rects deflated at once, rect k is in[ from[ k ]] up to
+ * in[ from[ k + 1 ]]. zc[ t ] is the context of worker t, zc[ 0 ] holds
+ * the buffers.
+ */
+typedef struct
+{ rfbClient * cl;
+  rfbZlibContext ** zc;
+  const char * in;
+  int from[ ZLIB_BATCH + 1 ];
+  char * out[ ZLIB_BATCH ];
+  int outLen[ ZLIB_BATCH ];           /* -1 when deflate failed */
+} rfbZlibBatch;
 
-  rect.r.x = Swap16IfLE( x );
-  rect.r.y = Swap16IfLE( y );
-  rect.r.w = Swap16IfLE( w );
-  rect.r.h = Swap16IfLE( h );
-  rect.encoding = Swap32IfLE(rfbEncodingZlib);
+/**
+ *  A raw deflate stream at level for the batch rects of a worker
+ */
+static rfbBool ZlibBatchStream( rfbZlibContext * zc, int level )
+{ if ( zc->zsInited && zc->zsLevel != level )
+  { deflateEnd( &zc->zs );
+    zc->zsInited= FALSE;
+  }
 
-  memcpy(&cl->updateBuf[cl->ublen], (char *)&rect,
-         sz_rfbFramebufferUpdateRectHeader);
-  cl->ublen += sz_rfbFramebufferUpdateRectHeader;
+  if ( !zc->zsInited )
+  { zc->zs.zalloc= Z_NULL;
+    zc->zs.zfree = Z_NULL;
+    zc->zs.opaque= Z_NULL;
 
-  hdr.nBytes = Swap32IfLE(zlibAfterBufLen);
+    if ( deflateInit2( &zc->zs, level, Z_DEFLATED, -MAX_WBITS
+                     , MAX_MEM_LEVEL, Z_DEFAULT_STRATEGY ) != Z_OK )
+    { return( FALSE );
+    }
+    zc->zsInited= TRUE;
+    zc->zsLevel = level;
+  }
 
-  memcpy(&cl->updateBuf[cl->ublen], (char *)&hdr, sz_rfbZlibHeader);
-  cl->ublen += sz_rfbZlibHeader;
+  return( TRUE );
+}
 
-  for (i = 0; i < zlibAfterBufLen;)
-  {
+/**
+ *  Deflates batch rect k on worker t, the first one on the client stream
+ * and the others primed with the window before them
+ */
+static void ZlibDeflateJob( void * arg, int k, int t )
+{ rfbZlibBatch * batch= (rfbZlibBatch *)arg;
+  z_stream * zs= &batch->zc[ t ]->zs;
+  int len= batch->from[ k + 1 ] - batch->from[ k ];
+  int dict= batch->from[ k ] < ZLIB_WINDOW ? batch->from[ k ] : ZLIB_WINDOW;
+
+  if ( !k )                           /* Output set up by ZlibStreamStart() */
+  { zs= &batch->cl->compStream;
+  }
+
+  else if ( deflateReset( zs ) != Z_OK
+         || deflateSetDictionary( zs, ( const Bytef * )batch->in + batch->from[ k ] - dict
+                                , dict ) != Z_OK )
+  { batch->outLen[ k ]= -1;
+    return;
+  }
 
-    int bytesToCopy = UPDATE_BUF_SIZE - cl->ublen;
+  else
+  { zs->next_out = ( Bytef * )batch->out[ k ];
+    zs->avail_out= ZLIB_BOUND( len );
+    zs->data_type= Z_BINARY;
+  }
+
+  zs->next_in = ( Bytef * )batch->in + batch->from[ k ];
+  zs->avail_in= len;
+
+  batch->outLen[ k ]= deflate( zs, Z_SYNC_FLUSH ) == Z_OK
+                    ? (int)(( char * )zs->next_out - batch->out[ k ])
+                    : -1;
+}
+
+/**
+ *  Sends h lines from y on in Zlib rects of maxLines lines, deflating up to
+ * ZLIB_BATCH of them at once on the encoding threads
+ */
+static rfbBool ZlibSendBatches( rfbClient * cl, rfbZlibContext * main
+                              , int x, int y, int w, int h
+                              , int maxLines, int workers )
+{ rfbZlibContext * zc[ ZLIB_BATCH ];
+  rfbZlibBatch batch;
+  int lineBytes= w * (cl->format.bitsPerPixel / 8);
+  int contexts= 1;
+  rfbBool serial= FALSE;              /* Helper contexts ran out */
+  rfbBool result= TRUE;
+  int k, t;
+
+  zc[ 0 ]  = main;
+  batch.cl = cl;
+  batch.zc = zc;
+
+  if ( workers > ZLIB_BATCH )
+  { workers= ZLIB_BATCH;
+  }
 
-    if (i + bytesToCopy > zlibAfterBufLen)
-    { bytesToCopy = zlibAfterBufLen - i;
+  while( h > 0 && result )
+  { int rects= ( h + maxLines - 1 ) / maxLines;
+    int lines, size, afterSize;
+    char * fbptr;
+
+    if ( rects > ZLIB_BATCH )
+    { rects= ZLIB_BATCH;
     }
 
-    memcpy(&cl->updateBuf[cl->ublen], &zlibAfterBuf[i], bytesToCopy);
+    lines= rects * maxLines < h ? rects * maxLines : h;
 
-    cl->ublen += bytesToCopy;
-    i += bytesToCopy;
+    if ( lines == h                   /* A small tail goes raw, on its own */
+      && rects > 1
+      && ZlibTooSmall( cl, w, h - ( rects - 1 ) * maxLines ))
+    { rects--;
+      lines= rects * maxLines;
+    }
 
-    if (cl->ublen == UPDATE_BUF_SIZE)
-    { if (!rfbSendUpdateBuf(cl))
-      { return FALSE;
-  } } }
+    if ( !serial && rects > 1 )
+    { for( ; contexts < rects && contexts < workers
+           ; contexts++ )
+      { if ( !( zc[ contexts ]= ZlibAcquire( cl->screen )))
+        { break;
+      } }
 
-  return TRUE;
+      serial= contexts < ( rects < workers ? rects : workers );
+    }
+
+    if ( rects < 2 || serial )        /* As rfbSendRectEncodingZlib does */
+    { lines= h < maxLines ? h : maxLines;
+      result= rfbSendOneRectEncodingZlib( cl, main, x, y, w, lines );
+
+      if ( result && cl->ublen > 0 && lines == maxLines )
+      { result= rfbSendUpdateBuf( cl );
+      }
+
+      y += lines;
+      h -= lines;
+      continue;
+    }
+
+    size= lines * lineBytes;
+    afterSize= ZLIB_HEADER_SIZE;
+    for( k= 0
+       ; k < rects
+       ; k++ )
+    { batch.from[ k ]= k * maxLines * lineBytes;
+      afterSize += ZLIB_BOUND( k == rects - 1 ? size - batch.from[ k ]
+                                              : maxLines * lineBytes );
+    }
+    batch.from[ rects ]= size;
+
+    if ( !rfbScratchReserve( &main->zlibBeforeBuf, &main->zlibBeforeBufSize
+                           , size, &main->beforePeak )
+      || !rfbScratchReserve( &main->zlibAfterBuf, &main->zlibAfterBufSize
+                           , afterSize, &main->afterPeak ))
+    { result= FALSE;
+      break;
+    }
+
+    for( t= 0
+       ; t < contexts
+       ; t++ )
+    { if ( !ZlibBatchStream( zc[ t ], cl->zlibCompressLevel ))
+      { result= FALSE;
+    } }
+
+    batch.in = main->zlibBeforeBuf;
+    batch.out[ 0 ]= main->zlibAfterBuf;
+    for( k= 1
+       ; k < rects
+       ; k++ )
+    { batch.out[ k ]= batch.out[ k - 1 ]
+                    + ZLIB_BOUND( batch.from[ k ] - batch.from[ k - 1 ])
+                    + ( k == 1 ? ZLIB_HEADER_SIZE : 0 );
+    }
+
+    if ( !result
+      || !ZlibStreamStart( cl, batch.out[ 0 ]
+                         , ZLIB_HEADER_SIZE + ZLIB_BOUND( batch.from[ 1 ] )))
+    { rfbErr( "zlib deflation error: %s\n", cl->compStream.msg );
+      result= FALSE;
+      break;
+    }
+
+    fbptr= cl->scaledScreen->frameBuffer
+         + cl->scaledScreen->paddedWidthInBytes * y
+         + x * (cl->scaledScreen->bitsPerPixel / 8);
+
+    (*cl->translateFn)(cl->translateLookupTable
+                      , &cl->screen->window.serverFormat
+                      , &cl->format
+                      , fbptr, main->zlibBeforeBuf
+                      , cl->scaledScreen->paddedWidthInBytes, w, lines);
+
+    rfbRunEncodeJobs( cl, rects, ZlibDeflateJob, &batch );
+
+    for( k= 0
+       ; k < rects
+       ; k++ )
+    { if ( batch.outLen[ k ] < 0 )
+      { rfbErr( "zlib deflation error in batch rect %d\n", k );
+        result= FALSE;
+    } }
+
+    /* The client stream goes on from the end of the batch */
+    if ( !result
+      || deflateReset( &cl->compStream ) != Z_OK
+      || deflateSetDictionary( &cl->compStream
+                             , ( const Bytef * )main->zlibBeforeBuf + size
+                               - ( size < ZLIB_WINDOW ? size : ZLIB_WINDOW )
+                             , size < ZLIB_WINDOW ? size : ZLIB_WINDOW ) != Z_OK )
+    { result= FALSE;
+      break;
+    }
+
+    for( k= 0
+       ; k < rects && result
+       ; k++ )
+    { int rectLines= ( batch.from[ k + 1 ] - batch.from[ k ] ) / lineBytes;
+
+      result= ZlibPutRect( cl, x, y, w, rectLines
+                         , batch.out[ k ], batch.outLen[ k ] );
+
+      /* Flushed with every maximum size rect, as rfbSendRectEncodingZlib
+         does. */
+      if ( result && cl->ublen > 0 && rectLines == maxLines )
+      { result= rfbSendUpdateBuf( cl );
+      }
+
+      y += rectLines;
+    }
+
+    h -= lines;
+  }
+
+  for( t= 1
+     ; t < contexts
+     ; t++ )
+  { ZlibRelease( cl->screen, zc[ t ] );
+  }
+
+  return( result );
 }
 
 
@@ -262,6 +688,9 @@ rfbBool rfbSendRectEncodingZlib( rfbClient * cl
                                , int w, int h )
 { int  maxLines;
   int  linesRemaining;
+  int  workers= rfbEncodeJobWorkers( cl );
+  rfbZlibContext * zc;
+  rfbBool result= TRUE;
   rfbRectangle partialRect;
 
   partialRect.x = x;
@@ -272,6 +701,17 @@ rfbBool rfbSendRectEncodingZlib( rfbClient * cl
   /* Determine maximum pixel/scan lines allowed per rectangle. */
   maxLines = ( ZLIB_MAX_SIZE(w) / w );
 
+  if ( !( zc= ZlibAcquire( cl->screen )))
+  { rfbLog( "Memory allocation failure!\n" );
+    return FALSE;
+  }
+
+  if ( workers > 1 && h > maxLines )
+  { result= ZlibSendBatches( cl, zc, x, y, w, h, maxLines, workers );
+    ZlibRelease( cl->screen, zc );
+    return result;
+  }
+
   /* Initialize number of scan lines left to do. */
   linesRemaining = h;
 
@@ -290,12 +730,13 @@ rfbBool rfbSendRectEncodingZlib( rfbClient * cl
     partialRect.h = linesToComp;
 
     /* Encode (compress) and send the next rectangle. */
-    if ( ! rfbSendOneRectEncodingZlib( cl
+    if ( ! rfbSendOneRectEncodingZlib( cl, zc
                                      , partialRect.x
                                      , partialRect.y
                                      , partialRect.w
                                      , partialRect.h ))
-    { return FALSE;
+    { result = FALSE;
+      break;
     }
 
     /* Technically, flushing the buffer here is not extremely
@@ -312,7 +753,8 @@ rfbBool rfbSendRectEncodingZlib( rfbClient * cl
     if (( cl->ublen > 0 ) &&
         ( linesToComp == maxLines ))
     { if (!rfbSendUpdateBuf(cl))
-      { return FALSE;
+      { result = FALSE;
+        break;
     } }
 
     /* Update remaining and incremental rectangle location. */
@@ -320,6 +762,7 @@ rfbBool rfbSendRectEncodingZlib( rfbClient * cl
     partialRect.y += linesToComp;
   }
 
-  return TRUE;
-}
+  ZlibRelease( cl->screen, zc );
 
+  return result;
+}
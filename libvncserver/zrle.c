@@ -28,6 +28,167 @@
 #include "rfb/rfbproto.h"
 #include "private.h"
 #include "zrleoutstream.h"
+#include "zrlepalettehelper.h"
+#include "scanbuild.h"
+
+/* __RFB_CONCAT2E and __RFB_CONCAT3E as zrleencodetemplate.c has them */
+
+#ifndef __RFB_CONCAT2E
+#define __RFB_CONCAT2(a,b) a##b
+#define __RFB_CONCAT2E(a,b) __RFB_CONCAT2(a,b)
+#endif
+
+#ifndef __RFB_CONCAT3E
+#define __RFB_CONCAT3(a,b,c) a##b##c
+#define __RFB_CONCAT3E(a,b,c) __RFB_CONCAT3(a,b,c)
+#endif
+
+/* Tile scans and the ZYWRLE transform, built as scanbuild.h describes */
+
+rfbBool rfbZrleVectorScan = TRUE;
+
+#define SCAN_SUFFIX Scalar
+#define SCAN_TARGET SCAN_SCALAR
+#define BPP 8
+#include "zrlescantemplate.c"
+#undef BPP
+#define BPP 16
+#include "zrlescantemplate.c"
+#undef BPP
+#define BPP 32
+#include "zrlescantemplate.c"
+#undef BPP
+#include "zywrlescantemplate.c"
+#undef SCAN_SUFFIX
+#undef SCAN_TARGET
+
+#define SCAN_SUFFIX Vec
+#define SCAN_TARGET SCAN_VECTORIZE
+#define BPP 8
+#include "zrlescantemplate.c"
+#undef BPP
+#define BPP 16
+#include "zrlescantemplate.c"
+#undef BPP
+#define BPP 32
+#include "zrlescantemplate.c"
+#undef BPP
+#include "zywrlescantemplate.c"
+#undef SCAN_SUFFIX
+#undef SCAN_TARGET
+
+#ifdef SCAN_AVX2
+#define SCAN_SUFFIX Avx2
+#define SCAN_TARGET SCAN_AVX2_TARGET
+#define BPP 8
+#include "zrlescantemplate.c"
+#undef BPP
+#define BPP 16
+#include "zrlescantemplate.c"
+#undef BPP
+#define BPP 32
+#include "zrlescantemplate.c"
+#undef BPP
+#include "zywrlescantemplate.c"
+#undef SCAN_SUFFIX
+#undef SCAN_TARGET
+#endif
+
+typedef struct ZRLE_SCAN_s
+{ int (*runs8 )(const zrle_U8 *,  int, int *);
+  int (*runs16)(const zrle_U16 *, int, int *);
+  int (*runs32)(const zrle_U32 *, int, int *);
+  void (*wavelet)(int *, int, int, int, const signed char *(*)[ 3 ]);
+} ZRLE_SCAN;
+
+#define ZRLE_SCAN_SET( s ) { ZrleRuns8##s, ZrleRuns16##s, ZrleRuns32##s      \
+                           , ZywrleWavelet##s }
+
+static const ZRLE_SCAN zrleScanScalar= ZRLE_SCAN_SET( Scalar );
+static const ZRLE_SCAN zrleScanVec   = ZRLE_SCAN_SET( Vec );
+#ifdef SCAN_AVX2
+static const ZRLE_SCAN zrleScanAvx2  = ZRLE_SCAN_SET( Avx2 );
+#endif
+
+static const ZRLE_SCAN * PickZrleScan( void )
+{ switch( rfbPickScanBuild( rfbZrleVectorScan ))
+  { case rfbScanScalar:
+      return( &zrleScanScalar );
+#ifdef SCAN_AVX2
+    case rfbScanAvx2:
+      return( &zrleScanAvx2 );
+#endif
+    default:
+      return( &zrleScanVec );
+} }
+
+/* Scratch of one encoding thread, as the client has it for itself */
+
+typedef struct rfbZrleWorker_s
+{ char beforeBuf[ rfbZRLETileWidth * rfbZRLETileHeight * 4 + 4 ];
+  zrlePaletteHelper paletteHelper;
+  int zywrleBuf[ rfbZRLETileWidth * rfbZRLETileHeight ];
+} rfbZrleWorker;
+
+/* Tile rows of a rect encoded as jobs, kept with the client */
+
+typedef struct rfbZrleJobs_s
+{ rfbClient * cl;
+  const ZRLE_SCAN * scan;
+  int x, y, w, h;               /* Rect being encoded */
+  rfbZrleWorker * worker;
+  int workers;
+  zrleOutStream ** out;         /* Tile data of each row, not deflated */
+  int outs;
+} rfbZrleJobs;
+
+/**
+   Jobs of the client for a rect of rows tile rows, NULL when it encodes
+   on the calling thread only
+*/
+static rfbZrleJobs * rfbZrleJobsFor( rfbClient * cl, int rows )
+{ rfbZrleJobs * zj= (rfbZrleJobs *)cl->zrleJobs;
+  int workers= rfbEncodeJobWorkers( cl );
+
+  if ( workers < 2 )
+  { return( NULL );
+  }
+
+  if ( !zj )
+  { if ( !( zj= (rfbZrleJobs *)calloc( 1, sizeof( *zj ))))
+    { return( NULL );
+    }
+    zj->cl= cl;
+    cl->zrleJobs= zj;
+  }
+
+  if ( zj->workers < workers )
+  { rfbZrleWorker * worker= (rfbZrleWorker *)malloc( workers * sizeof( *worker ));
+
+    if ( !worker )
+    { return( NULL );
+    }
+
+    FREE( zj->worker );
+    zj->worker = worker;
+    zj->workers= workers;
+  }
+
+  if ( zj->outs < rows )
+  { zrleOutStream ** out= (zrleOutStream **)realloc( zj->out, rows * sizeof( *out ));
+
+    if ( !out )
+    { return( NULL );
+    }
+
+    zj->out= out;
+    for( ; zj->outs < rows; zj->outs++ )
+    { if ( !( out[ zj->outs ]= zrleOutStreamNewCollector()))
+      { return( NULL );
+  } } }
+
+  return( zj );
+}
 
 
 #define GET_IMAGE_INTO_BUF(tx,ty,tw,th,buf)                              \
@@ -110,6 +271,8 @@ rfbBool rfbSendRectEncodingZRLE(rfbClient * cl, int x, int y, int w, int h)
   rfbZRLEHeader hdr;
   int i;
   char *zrleBeforeBuf;
+  const ZRLE_SCAN *scan = PickZrleScan();
+  rfbBool ok = FALSE;
 
   if ( cl->zrleBeforeBuf == NULL )
   { size_t szBuff= rfbZRLETileWidth * rfbZRLETileHeight * 4 + 4 ;
@@ -144,26 +307,28 @@ rfbBool rfbSendRectEncodingZRLE(rfbClient * cl, int x, int y, int w, int h)
   }
 
   zos = cl->zrleData;
-  zos->in.ptr = zos->in.start;
-  zos->out.ptr = zos->out.start;
+  if (!zos)
+  { return FALSE;
+  }
+  zrleOutStreamReset(zos);
 
   switch (cl->format.bitsPerPixel)
   { case 8:
-      zrleEncode8NE(x, y, w, h, zos, zrleBeforeBuf, cl);
+      ok = zrleEncode8NE(x, y, w, h, zos, zrleBeforeBuf, scan, cl);
     break;
 
     case 16:
       if (cl->format.greenMax > 0x1F)
       { if (cl->format.bigEndian)
-        { zrleEncode16BE(x, y, w, h, zos, zrleBeforeBuf, cl); }
+        { ok = zrleEncode16BE(x, y, w, h, zos, zrleBeforeBuf, scan, cl); }
         else
-        { zrleEncode16LE(x, y, w, h, zos, zrleBeforeBuf, cl); }
+        { ok = zrleEncode16LE(x, y, w, h, zos, zrleBeforeBuf, scan, cl); }
       }
       else
       { if (cl->format.bigEndian)
-        { zrleEncode15BE(x, y, w, h, zos, zrleBeforeBuf, cl); }
+        { ok = zrleEncode15BE(x, y, w, h, zos, zrleBeforeBuf, scan, cl); }
         else
-        { zrleEncode15LE(x, y, w, h, zos, zrleBeforeBuf, cl); }
+        { ok = zrleEncode15LE(x, y, w, h, zos, zrleBeforeBuf, scan, cl); }
       }
     break;
 
@@ -180,31 +345,36 @@ rfbBool rfbSendRectEncodingZRLE(rfbClient * cl, int x, int y, int w, int h)
       if ((fitsInLS3Bytes && !cl->format.bigEndian) ||
           (fitsInMS3Bytes && cl->format.bigEndian))
       { if (cl->format.bigEndian)
-        { zrleEncode24ABE(x, y, w, h, zos, zrleBeforeBuf, cl); }
+        { ok = zrleEncode24ABE(x, y, w, h, zos, zrleBeforeBuf, scan, cl); }
         else
-        { zrleEncode24ALE(x, y, w, h, zos, zrleBeforeBuf, cl); }
+        { ok = zrleEncode24ALE(x, y, w, h, zos, zrleBeforeBuf, scan, cl); }
       }
       else if ((fitsInLS3Bytes && cl->format.bigEndian) ||
                (fitsInMS3Bytes && !cl->format.bigEndian))
       { if (cl->format.bigEndian)
-        { zrleEncode24BBE(x, y, w, h, zos, zrleBeforeBuf, cl); }
+        { ok = zrleEncode24BBE(x, y, w, h, zos, zrleBeforeBuf, scan, cl); }
         else
-        { zrleEncode24BLE(x, y, w, h, zos, zrleBeforeBuf, cl); }
+        { ok = zrleEncode24BLE(x, y, w, h, zos, zrleBeforeBuf, scan, cl); }
       }
       else
       { if (cl->format.bigEndian)
-        { zrleEncode32BE(x, y, w, h, zos, zrleBeforeBuf, cl); }
+        { ok = zrleEncode32BE(x, y, w, h, zos, zrleBeforeBuf, scan, cl); }
         else
-        { zrleEncode32LE(x, y, w, h, zos, zrleBeforeBuf, cl); }
+        { ok = zrleEncode32LE(x, y, w, h, zos, zrleBeforeBuf, scan, cl); }
     } }
     break;
   }
 
+  if (!ok)
+  { rfbLog("rfbSendRectEncodingZRLE: encoding failed\n");
+    return FALSE;
+  }
+
   rfbStatRecordEncodingSent(cl, rfbEncodingZRLE, sz_rfbFramebufferUpdateRectHeader + sz_rfbZRLEHeader + ZRLE_BUFFER_LENGTH(&zos->out),
                             + w * (cl->format.bitsPerPixel / 8) * h);
 
   if (cl->ublen + sz_rfbFramebufferUpdateRectHeader + sz_rfbZRLEHeader
-      > UPDATE_BUF_SIZE)
+      > cl->ubsize)
   { if (!rfbSendUpdateBuf(cl))
     { return FALSE;
   } }
@@ -227,7 +397,7 @@ rfbBool rfbSendRectEncodingZRLE(rfbClient * cl, int x, int y, int w, int h)
   /* copy into updateBuf and send from there.  Maybe should send directly? */
 
   for (i = 0; i < ZRLE_BUFFER_LENGTH(&zos->out);)
-  { int bytesToCopy = UPDATE_BUF_SIZE - cl->ublen;
+  { int bytesToCopy = cl->ubsize - cl->ublen;
 
     if (i + bytesToCopy > ZRLE_BUFFER_LENGTH(&zos->out))
     { bytesToCopy = ZRLE_BUFFER_LENGTH(&zos->out) - i;
@@ -240,7 +410,7 @@ rfbBool rfbSendRectEncodingZRLE(rfbClient * cl, int x, int y, int w, int h)
     cl->ublen += bytesToCopy;
     i += bytesToCopy;
 
-    if (cl->ublen == UPDATE_BUF_SIZE)
+    if (cl->ublen == cl->ubsize)
     { if (!rfbSendUpdateBuf(cl))
       { return FALSE; }
   } }
@@ -251,7 +421,22 @@ rfbBool rfbSendRectEncodingZRLE(rfbClient * cl, int x, int y, int w, int h)
 
 void rfbFreeZrleData(rfbClient * cl)
 { if ( cl )
-  { FREE( cl->zrleData      );
+  { rfbZrleJobs * zj= (rfbZrleJobs *)cl->zrleJobs;
+
+    if ( zj )
+    { while( zj->outs )
+      { zrleOutStreamFree( zj->out[ --zj->outs ] );
+      }
+      FREE( zj->out    );
+      FREE( zj->worker );
+      FREE( cl->zrleJobs );
+    }
+
+    if ( cl->zrleData )
+    { zrleOutStreamFree( (zrleOutStream *)cl->zrleData );
+      cl->zrleData= NULL;
+    }
+
     FREE( cl->zrleBeforeBuf );
     FREE( cl->paletteHelper );
 } }
@@ -59,21 +59,30 @@
 
 #ifdef CPIXEL
 #define PIXEL_T __RFB_CONCAT2E(zrle_U,BPP)
-#define zrleOutStreamWRITE_PIXEL __RFB_CONCAT2E(zrleOutStreamWriteOpaque,CPIXEL)
+#define zrleOutStreamPUT_PIXEL __RFB_CONCAT2E(zrleOutStreamPutOpaque,CPIXEL)
 #define ZRLE_ENCODE __RFB_CONCAT3E(zrleEncode,CPIXEL,END_FIX)
 #define ZRLE_ENCODE_TILE __RFB_CONCAT3E(zrleEncodeTile,CPIXEL,END_FIX)
+#define ZRLE_ENCODE_ROWS __RFB_CONCAT3E(zrleEncodeRows,CPIXEL,END_FIX)
+#define ZRLE_ENCODE_JOB __RFB_CONCAT3E(zrleEncodeJob,CPIXEL,END_FIX)
+#define ZRLE_RUNS __RFB_CONCAT2E(runs,BPP)
 #define BPPOUT 24
 #elif BPP==15
 #define PIXEL_T __RFB_CONCAT2E(zrle_U,16)
-#define zrleOutStreamWRITE_PIXEL __RFB_CONCAT2E(zrleOutStreamWriteOpaque,16)
+#define zrleOutStreamPUT_PIXEL __RFB_CONCAT2E(zrleOutStreamPutOpaque,16)
 #define ZRLE_ENCODE __RFB_CONCAT3E(zrleEncode,BPP,END_FIX)
 #define ZRLE_ENCODE_TILE __RFB_CONCAT3E(zrleEncodeTile,BPP,END_FIX)
+#define ZRLE_ENCODE_ROWS __RFB_CONCAT3E(zrleEncodeRows,BPP,END_FIX)
+#define ZRLE_ENCODE_JOB __RFB_CONCAT3E(zrleEncodeJob,BPP,END_FIX)
+#define ZRLE_RUNS runs16
 #define BPPOUT 16
 #else
 #define PIXEL_T __RFB_CONCAT2E(zrle_U,BPP)
-#define zrleOutStreamWRITE_PIXEL __RFB_CONCAT2E(zrleOutStreamWriteOpaque,BPP)
+#define zrleOutStreamPUT_PIXEL __RFB_CONCAT2E(zrleOutStreamPutOpaque,BPP)
 #define ZRLE_ENCODE __RFB_CONCAT3E(zrleEncode,BPP,END_FIX)
 #define ZRLE_ENCODE_TILE __RFB_CONCAT3E(zrleEncodeTile,BPP,END_FIX)
+#define ZRLE_ENCODE_ROWS __RFB_CONCAT3E(zrleEncodeRows,BPP,END_FIX)
+#define ZRLE_ENCODE_JOB __RFB_CONCAT3E(zrleEncodeJob,BPP,END_FIX)
+#define ZRLE_RUNS __RFB_CONCAT2E(runs,BPP)
 #define BPPOUT BPP
 #endif
 
@@ -84,20 +93,33 @@ static const int bitsPerPackedPixel[] =
 { 0, 1, 2, 2, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4
 };
 
+/* A tile of n pixels never needs more: the subencoding, a full palette and
+   plain RLE of single pixels, which is the worst of them */
+
+#define ZRLE_TILE_MAX(n, cpix) (1 + ZRLE_PALETTE_MAX_SIZE * (cpix) + (n) * ((cpix) + 1))
+
 #endif /* ZRLE_ONCE */
 
 void ZRLE_ENCODE_TILE (PIXEL_T* data, int w, int h, zrleOutStream* os,
-                       int zywrle_level, int *zywrleBuf, void *paletteHelper);
+                       int zywrle_level, int *zywrleBuf, void *paletteHelper,
+                       const ZRLE_SCAN *scan);
 
 #if BPP!=8
 #define ZYWRLE_ENCODE
 #include "zywrletemplate.c"
 #endif
 
-static void ZRLE_ENCODE( int x, int y, int w, int h
-                         , zrleOutStream* os, void* buf
-                         EXTRA_ARGS
-                       )
+/*
+   ZRLE_ENCODE_ROWS writes the tiles of a rect to os, taking each through
+   buf, with the ZYWRLE and palette scratch given.
+*/
+
+static void ZRLE_ENCODE_ROWS( int x, int y, int w, int h
+                              , zrleOutStream* os, void* buf
+                              , int *zywrleBuf, void *paletteHelper
+                              , const ZRLE_SCAN *scan
+                              EXTRA_ARGS
+                            )
 { int ty;
   for (ty = y; ty < y+h; ty += rfbZRLETileHeight)
   { int tx, th = rfbZRLETileHeight;
@@ -108,26 +130,88 @@ static void ZRLE_ENCODE( int x, int y, int w, int h
 
       GET_IMAGE_INTO_BUF(tx,ty,tw,th,buf);
 
-      if (cl->paletteHelper == NULL)
-      { cl->paletteHelper = (void *) calloc(sizeof(zrlePaletteHelper), 1);
-      }
-
       ZRLE_ENCODE_TILE((PIXEL_T*)buf, tw, th, os,
-                       cl->zywrleLevel, cl->zywrleBuf, cl->paletteHelper);
+                       cl->zywrleLevel, zywrleBuf, paletteHelper, scan);
     }
   }
-  zrleOutStreamFlush(os);
+}
+
+/*
+   ZRLE_ENCODE_JOB encodes tile row job of the rect in arg into the job's
+   own stream, with the scratch of the worker running it.
+*/
+
+static void ZRLE_ENCODE_JOB(void *arg, int job, int worker)
+{ rfbZrleJobs *zj = (rfbZrleJobs *)arg;
+  rfbZrleWorker *zw = &zj->worker[worker];
+  zrleOutStream *out = zj->out[job];
+  int ty = zj->y + job * rfbZRLETileHeight;
+  int th = rfbZRLETileHeight;
+
+  if (th > zj->y+zj->h-ty) { th = zj->y+zj->h-ty; }
+
+  zrleOutStreamReset(out);
+  ZRLE_ENCODE_ROWS(zj->x, ty, zj->w, th, out, zw->beforeBuf,
+                   zw->zywrleBuf, &zw->paletteHelper, zj->scan, zj->cl);
+}
+
+/*
+   ZRLE_ENCODE sends a rect to os. Rects of several tile rows have their
+   rows encoded as jobs on the encoding threads when the client may use
+   them; the rows are then written to os in order, so os deflates the same
+   bytes either way.
+*/
+
+static rfbBool ZRLE_ENCODE( int x, int y, int w, int h
+                            , zrleOutStream* os, void* buf
+                            , const ZRLE_SCAN *scan
+                            EXTRA_ARGS
+                          )
+{ int rows = (h + rfbZRLETileHeight - 1) / rfbZRLETileHeight;
+  rfbZrleJobs *zj;
+  int k;
+
+  if (rows > 1 && (zj = rfbZrleJobsFor(cl, rows)))
+  { zj->x = x;
+    zj->y = y;
+    zj->w = w;
+    zj->h = h;
+    zj->scan = scan;
+
+    rfbRunEncodeJobs(cl, rows, ZRLE_ENCODE_JOB, zj);
+
+    for (k = 0; k < rows; k++)
+    { zrleOutStream *row = zj->out[k];
+      int len = ZRLE_BUFFER_LENGTH(&row->in);
+
+      if (row->failed || !zrleOutStreamReserve(os, len))
+      { return FALSE;
+      }
+      zrleOutStreamPutBytes(os, row->in.start, len);
+    }
+  }
+  else
+  { if (cl->paletteHelper == NULL)
+    { cl->paletteHelper = (void *) calloc(sizeof(zrlePaletteHelper), 1);
+    }
+
+    ZRLE_ENCODE_ROWS(x, y, w, h, os, buf, cl->zywrleBuf,
+                     cl->paletteHelper, scan, cl);
+  }
+
+  return zrleOutStreamFlush(os);
 }
 
 
 void ZRLE_ENCODE_TILE(PIXEL_T* data, int w, int h, zrleOutStream* os,
-                      int zywrle_level, int *zywrleBuf,  void *paletteHelper)
-{ /* First find the palette and the number of runs */
+                      int zywrle_level, int *zywrleBuf,  void *paletteHelper,
+                      const ZRLE_SCAN *scan)
+{ /* First find the number of runs, then the palette */
 
   zrlePaletteHelper *ph;
 
-  int runs = 0;
-  int singlePixels = 0;
+  int runs;
+  int singlePixels;
 
   rfbBool useRle;
   rfbBool usePalette;
@@ -140,29 +224,36 @@ void ZRLE_ENCODE_TILE(PIXEL_T* data, int w, int h, zrleOutStream* os,
   PIXEL_T* end = ptr + h * w;
   *end = ~*(end-1); /* one past the end is different so the while loop ends */
 
-  ph = (zrlePaletteHelper *) paletteHelper;
-  zrlePaletteHelperInit(ph);
+  /* Room for the most any subencoding takes, written unchecked below */
 
-  while (ptr < end)
-  { PIXEL_T pix = *ptr;
-    if (*++ptr != pix)
-    { singlePixels++;
-    }
-    else
-    { while (*++ptr == pix) {};
-      runs++;
-    }
-    zrlePaletteHelperInsert(ph, pix);
+  if (!zrleOutStreamReserve(os, ZRLE_TILE_MAX(w * h, BPPOUT/8)))
+  { return;
   }
 
+  runs = scan->ZRLE_RUNS(data, h * w, &singlePixels);
+
   /* Solid tile is a special case */
 
-  if (ph->size == 1)
-  { zrleOutStreamWriteU8(os, 1);
-    zrleOutStreamWRITE_PIXEL(os, ph->palette[0]);
+  if (runs == 1)
+  { zrleOutStreamPutU8(os, 1);
+    zrleOutStreamPUT_PIXEL(os, *data);
     return;
   }
 
+  runs -= singlePixels;     /* Only those longer than one pixel count */
+
+  /* A run adds its colour to the palette at most once, so only the first
+     pixel of each is looked up. The palette is no use past the limit. */
+
+  ph = (zrlePaletteHelper *) paletteHelper;
+  zrlePaletteHelperInit(ph);
+
+  while (ptr < end && ph->size <= ZRLE_PALETTE_MAX_SIZE)
+  { PIXEL_T pix = *ptr;
+    while (*++ptr == pix) {};
+    zrlePaletteHelperInsert(ph, pix);
+  }
+
   /* Try to work out whether to use RLE and/or a palette.  We do this by
      estimating the number of bytes which will be generated and picking the
      method which results in the fewest bytes.  Of course this may not result
@@ -208,10 +299,10 @@ void ZRLE_ENCODE_TILE(PIXEL_T* data, int w, int h, zrleOutStream* os,
 
   if (!usePalette) { ph->size = 0; }
 
-  zrleOutStreamWriteU8(os, (useRle ? 128 : 0) | ph->size);
+  zrleOutStreamPutU8(os, (useRle ? 128 : 0) | ph->size);
 
   for (i = 0; i < ph->size; i++)
-  { zrleOutStreamWRITE_PIXEL(os, ph->palette[i]);
+  { zrleOutStreamPUT_PIXEL(os, ph->palette[i]);
   }
 
   if (useRle)
@@ -231,23 +322,23 @@ void ZRLE_ENCODE_TILE(PIXEL_T* data, int w, int h, zrleOutStream* os,
       if (len <= 2 && usePalette)
       { int index = zrlePaletteHelperLookup(ph, pix);
         if (len == 2)
-        { zrleOutStreamWriteU8(os, index); }
-        zrleOutStreamWriteU8(os, index);
+        { zrleOutStreamPutU8(os, index); }
+        zrleOutStreamPutU8(os, index);
         continue;
       }
       if (usePalette)
       { int index = zrlePaletteHelperLookup(ph, pix);
-        zrleOutStreamWriteU8(os, index | 128);
+        zrleOutStreamPutU8(os, index | 128);
       }
       else
-      { zrleOutStreamWRITE_PIXEL(os, pix);
+      { zrleOutStreamPUT_PIXEL(os, pix);
       }
       len -= 1;
       while (len >= 255)
-      { zrleOutStreamWriteU8(os, 255);
+      { zrleOutStreamPutU8(os, 255);
         len -= 255;
       }
-      zrleOutStreamWriteU8(os, len);
+      zrleOutStreamPutU8(os, len);
     }
 
   }
@@ -259,6 +350,8 @@ void ZRLE_ENCODE_TILE(PIXEL_T* data, int w, int h, zrleOutStream* os,
     if (usePalette)
     { int bppp;
       PIXEL_T* ptr = data;
+      PIXEL_T last = ph->palette[0];  /* Neighbours mostly share the index */
+      zrle_U8 lastIndex = 0;
 
       /* packed pixels */
 
@@ -274,17 +367,24 @@ void ZRLE_ENCODE_TILE(PIXEL_T* data, int w, int h, zrleOutStream* os,
 
         while (ptr < eol)
         { PIXEL_T pix = *ptr++;
-          zrle_U8 index = zrlePaletteHelperLookup(ph, pix);
+          zrle_U8 index;
+
+          if (pix != last)
+          { last = pix;
+            lastIndex = zrlePaletteHelperLookup(ph, pix);
+          }
+          index = lastIndex;
+
           byte = (byte << bppp) | index;
           nbits += bppp;
           if (nbits >= 8)
-          { zrleOutStreamWriteU8(os, byte);
+          { zrleOutStreamPutU8(os, byte);
             nbits = 0;
           }
         }
         if (nbits > 0)
         { byte <<= 8 - nbits;
-          zrleOutStreamWriteU8(os, byte);
+          zrleOutStreamPutU8(os, byte);
         }
       }
     }
@@ -295,8 +395,8 @@ void ZRLE_ENCODE_TILE(PIXEL_T* data, int w, int h, zrleOutStream* os,
 
 #if BPP!=8
       if (zywrle_level > 0 && !(zywrle_level & 0x80))
-      { ZYWRLE_ANALYZE(data, data, w, h, w, zywrle_level, zywrleBuf);
-        ZRLE_ENCODE_TILE(data, w, h, os, zywrle_level | 0x80, zywrleBuf, paletteHelper);
+      { ZYWRLE_ANALYZE(data, data, w, h, w, zywrle_level, zywrleBuf, scan->wavelet);
+        ZRLE_ENCODE_TILE(data, w, h, os, zywrle_level | 0x80, zywrleBuf, paletteHelper, scan);
       }
       else
 #endif
@@ -304,15 +404,18 @@ void ZRLE_ENCODE_TILE(PIXEL_T* data, int w, int h, zrleOutStream* os,
 #ifdef CPIXEL
         PIXEL_T *ptr;
         for (ptr = data; ptr < data+w*h; ptr++)
-        { zrleOutStreamWRITE_PIXEL(os, *ptr); }
+        { zrleOutStreamPUT_PIXEL(os, *ptr); }
 #else
-        zrleOutStreamWriteBytes(os, (zrle_U8 *)data, w*h*(BPP/8));
+        zrleOutStreamPutBytes(os, (zrle_U8 *)data, w*h*(BPP/8));
 #endif
 } } } }
 
 #undef PIXEL_T
-#undef zrleOutStreamWRITE_PIXEL
+#undef zrleOutStreamPUT_PIXEL
 #undef ZRLE_ENCODE
 #undef ZRLE_ENCODE_TILE
+#undef ZRLE_ENCODE_ROWS
+#undef ZRLE_ENCODE_JOB
+#undef ZRLE_RUNS
 #undef ZYWRLE_ENCODE_TILE
 #undef BPPOUT
@@ -22,11 +22,16 @@
 #include <stdlib.h>
 
 #include "zrleoutstream.h"
+#include "private.h"
 
 #define ZRLE_IN_BUFFER_SIZE  16384
 #define ZRLE_OUT_BUFFER_SIZE 1024
+#define ZRLE_SHRINK_PERIOD   5      /* Seconds the peak use is measured over */
 #undef  ZRLE_DEBUG
 
+/* A sync flush may add a little past deflateBound() */
+#define ZRLE_FLUSH_SLACK     16
+
 static rfbBool zrleBufferAlloc(zrleBuffer *buffer, int size)
 {
   buffer->ptr = buffer->start = malloc(size);
@@ -45,28 +50,65 @@ static void zrleBufferFree(zrleBuffer *buffer)
   buffer->start = buffer->ptr = buffer->end = NULL;
 }
 
-static rfbBool zrleBufferGrow(zrleBuffer *buffer, int size)
-{
-  int offset;
+/**
+   Makes room for size more bytes past ptr, noting the peak use
+*/
+static rfbBool zrleBufferReserve(zrleBuffer *buffer, int size, int *peak)
+{ int offset = ZRLE_BUFFER_LENGTH(buffer);
+  int need   = offset + size;
+  zrle_U8 *grown;
+
+  if (need > *peak)
+  { *peak = need;
+  }
+
+  if (buffer->end - buffer->ptr >= size)
+  { return TRUE;
+  }
 
-  size  += buffer->end - buffer->start;
-  offset = ZRLE_BUFFER_LENGTH (buffer);
+  if (need < 2 * (buffer->end - buffer->start))
+  { need = 2 * (buffer->end - buffer->start);
+  }
 
-  buffer->start = realloc(buffer->start, size);
-  if (!buffer->start) {
+  need = (need + RFB_SCRATCH_ROUND - 1) / RFB_SCRATCH_ROUND * RFB_SCRATCH_ROUND;
+  if (!(grown = realloc(buffer->start, need)))
+  { rfbLog("zrleBufferReserve: failed to grow buffer to %d\n", need);
     return FALSE;
   }
 
-  buffer->end = buffer->start + size;
-  buffer->ptr = buffer->start + offset;
+  buffer->start = grown;
+  buffer->end   = grown + need;
+  buffer->ptr   = grown + offset;
 
   return TRUE;
 }
 
+/**
+   Gives back what an emptied buffer holds beyond twice the peak, keeping
+   at least its first size
+*/
+static void zrleBufferShrink(zrleBuffer *buffer, int peak, int least)
+{ zrle_U8 *shrunk;
+  int size = buffer->end - buffer->start;
+
+  peak = (2 * peak + RFB_SCRATCH_ROUND - 1) / RFB_SCRATCH_ROUND * RFB_SCRATCH_ROUND;
+  if (peak < least)
+  { peak = least;
+  }
+
+  if (size <= peak)
+  { return;
+  }
+
+  if ((shrunk = realloc(buffer->start, peak)))
+  { buffer->start = buffer->ptr = shrunk;
+    buffer->end = shrunk + peak;
+} }
+
 zrleOutStream *zrleOutStreamNew(void)
 { zrleOutStream *os;
 
-  os = malloc(sizeof(zrleOutStream));
+  os = calloc(1, sizeof(zrleOutStream));
   if ( ! os )
   { return NULL;
   }
@@ -90,188 +132,128 @@ zrleOutStream *zrleOutStreamNew(void)
 
   if (deflateInit(&os->zs, Z_DEFAULT_COMPRESSION) != Z_OK)
   { zrleBufferFree(&os->in);
+    zrleBufferFree(&os->out);
     FREE( os );
     return NULL;
   }
 
-  return os;
-}
+  os->collect = FALSE;
+  os->periodStart = time(NULL);
 
-void zrleOutStreamFree (zrleOutStream *os)
-{ deflateEnd(&os->zs);
-  zrleBufferFree(&os->in);
-  zrleBufferFree(&os->out);
-  FREE( os );
+  return os;
 }
 
-rfbBool zrleOutStreamFlush(zrleOutStream *os)
-{
-  os->zs.next_in = os->in.start;
-  os->zs.avail_in = ZRLE_BUFFER_LENGTH (&os->in);
-
-#ifdef ZRLE_DEBUG
-  rfbLog("zrleOutStreamFlush: avail_in %d\n", os->zs.avail_in);
-#endif
-
-  while (os->zs.avail_in != 0) {
-    do {
-      int ret;
-
-      if (os->out.ptr >= os->out.end &&
-	  !zrleBufferGrow(&os->out, os->out.end - os->out.start)) {
-	rfbLog("zrleOutStreamFlush: failed to grow output buffer\n");
-	return FALSE;
-      }
+/**
+   A stream that deflates nothing: in just grows to take all the tile
+   data written, for it to be copied into a real stream later.
+*/
+zrleOutStream *zrleOutStreamNewCollector(void)
+{ zrleOutStream *os;
 
-      os->zs.next_out = os->out.ptr;
-      os->zs.avail_out = os->out.end - os->out.ptr;
+  os = calloc(1, sizeof(zrleOutStream));
+  if ( ! os )
+  { return NULL;
+  }
 
-#ifdef ZRLE_DEBUG
-      rfbLog("zrleOutStreamFlush: calling deflate, avail_in %d, avail_out %d\n",
-	     os->zs.avail_in, os->zs.avail_out);
-#endif
+  if (!zrleBufferAlloc(&os->in, ZRLE_IN_BUFFER_SIZE))
+  { FREE( os );
+    return NULL;
+  }
 
-      if ((ret = deflate(&os->zs, Z_SYNC_FLUSH)) != Z_OK) {
-	rfbLog("zrleOutStreamFlush: deflate failed with error code %d\n", ret);
-	return FALSE;
-      }
+  os->collect = TRUE;
+  os->periodStart = time(NULL);
 
-#ifdef ZRLE_DEBUG
-      rfbLog("zrleOutStreamFlush: after deflate: %d bytes\n",
-	     os->zs.next_out - os->out.ptr);
-#endif
+  return os;
+}
 
-      os->out.ptr = os->zs.next_out;
-    } while (os->zs.avail_out == 0);
+void zrleOutStreamFree (zrleOutStream *os)
+{ if (!os->collect)
+  { deflateEnd(&os->zs);
   }
+  zrleBufferFree(&os->in);
+  zrleBufferFree(&os->out);
+  FREE( os );
+}
 
-  os->in.ptr = os->in.start;
-
+/**
+   Empties the stream for the next rect. Once a period is over the buffers
+   are cut back to twice what the period needed at most.
+*/
+void zrleOutStreamReset(zrleOutStream *os)
+{ time_t now;
+
+  os->in.ptr  = os->in.start;
+  os->out.ptr = os->out.start;
+  os->failed  = FALSE;
+
+  if ((now = time(NULL)) - os->periodStart >= ZRLE_SHRINK_PERIOD)
+  { zrleBufferShrink(&os->in,  os->inPeak,  ZRLE_IN_BUFFER_SIZE);
+    zrleBufferShrink(&os->out, os->outPeak, ZRLE_OUT_BUFFER_SIZE);
+    os->inPeak = os->outPeak = 0;
+    os->periodStart = now;
+} }
+
+/**
+   The slow path of zrleOutStreamReserve(). A stream that can not grow is
+   marked failed, zrleOutStreamFlush() then fails too.
+*/
+rfbBool zrleOutStreamGrow(zrleOutStream *os, int size)
+{ if (!zrleBufferReserve(&os->in, size, &os->inPeak))
+  { os->failed = TRUE;
+    return FALSE;
+  }
   return TRUE;
 }
 
-static int zrleOutStreamOverrun(zrleOutStream *os,
-				int            size)
-{
-#ifdef ZRLE_DEBUG
-  rfbLog("zrleOutStreamOverrun\n");
-#endif
-
-  while (os->in.end - os->in.ptr < size && os->in.ptr > os->in.start) {
-    os->zs.next_in = os->in.start;
-    os->zs.avail_in = ZRLE_BUFFER_LENGTH (&os->in);
-
-    do {
-      int ret;
-
-      if (os->out.ptr >= os->out.end &&
-	  !zrleBufferGrow(&os->out, os->out.end - os->out.start)) {
-	rfbLog("zrleOutStreamOverrun: failed to grow output buffer\n");
-	return FALSE;
-      }
+/**
+   Deflates all that was written since the last flush, in one call as out
+   is first made big enough for the worst case, and ends on a sync flush.
+*/
+rfbBool zrleOutStreamFlush(zrleOutStream *os)
+{ int ret;
+  uLong bound;
 
-      os->zs.next_out = os->out.ptr;
-      os->zs.avail_out = os->out.end - os->out.ptr;
+  if (os->failed)
+  { return FALSE;
+  }
 
-#ifdef ZRLE_DEBUG
-      rfbLog("zrleOutStreamOverrun: calling deflate, avail_in %d, avail_out %d\n",
-	     os->zs.avail_in, os->zs.avail_out);
-#endif
+  if (os->in.ptr == os->in.start)
+  { return TRUE;
+  }
 
-      if ((ret = deflate(&os->zs, 0)) != Z_OK) {
-	rfbLog("zrleOutStreamOverrun: deflate failed with error code %d\n", ret);
-	return 0;
-      }
+  os->zs.next_in = os->in.start;
+  os->zs.avail_in = ZRLE_BUFFER_LENGTH (&os->in);
 
 #ifdef ZRLE_DEBUG
-      rfbLog("zrleOutStreamOverrun: after deflate: %d bytes\n",
-	     os->zs.next_out - os->out.ptr);
+  rfbLog("zrleOutStreamFlush: avail_in %d\n", os->zs.avail_in);
 #endif
 
-      os->out.ptr = os->zs.next_out;
-    } while (os->zs.avail_out == 0);
+  bound = deflateBound(&os->zs, os->zs.avail_in) + ZRLE_FLUSH_SLACK;
 
-    /* output buffer not full */
-
-    if (os->zs.avail_in == 0) {
-      os->in.ptr = os->in.start;
-    } else {
-      /* but didn't consume all the data?  try shifting what's left to the
-       * start of the buffer.
-       */
-      rfbLog("zrleOutStreamOverrun: out buf not full, but in data not consumed\n");
-      memmove(os->in.start, os->zs.next_in, os->in.ptr - os->zs.next_in);
-      os->in.ptr -= os->zs.next_in - os->in.start;
+  do {
+    if (!zrleBufferReserve(&os->out, (int)bound, &os->outPeak)) {
+      rfbLog("zrleOutStreamFlush: failed to grow output buffer\n");
+      return FALSE;
     }
-  }
-
-  if (size > os->in.end - os->in.ptr)
-    size = os->in.end - os->in.ptr;
 
-  return size;
-}
+    os->zs.next_out = os->out.ptr;
+    os->zs.avail_out = os->out.end - os->out.ptr;
 
-static int zrleOutStreamCheck(zrleOutStream *os, int size)
-{
-  if (os->in.ptr + size > os->in.end) {
-    return zrleOutStreamOverrun(os, size);
-  }
-  return size;
-}
-
-void zrleOutStreamWriteBytes(zrleOutStream *os,
-			     const zrle_U8 *data,
-			     int            length)
-{
-  const zrle_U8* dataEnd = data + length;
-  while (data < dataEnd) {
-    int n = zrleOutStreamCheck(os, dataEnd - data);
-    memcpy(os->in.ptr, data, n);
-    os->in.ptr += n;
-    data += n;
-  }
-}
-
-void zrleOutStreamWriteU8(zrleOutStream *os, zrle_U8 u)
-{
-  zrleOutStreamCheck(os, 1);
-  *os->in.ptr++ = u;
-}
-
-void zrleOutStreamWriteOpaque8(zrleOutStream *os, zrle_U8 u)
-{
-  zrleOutStreamCheck(os, 1);
-  *os->in.ptr++ = u;
-}
+    if ((ret = deflate(&os->zs, Z_SYNC_FLUSH)) != Z_OK) {
+      rfbLog("zrleOutStreamFlush: deflate failed with error code %d\n", ret);
+      return FALSE;
+    }
 
-void zrleOutStreamWriteOpaque16 (zrleOutStream *os, zrle_U16 u)
-{
-  zrleOutStreamCheck(os, 2);
-  *os->in.ptr++ = ((zrle_U8*)&u)[0];
-  *os->in.ptr++ = ((zrle_U8*)&u)[1];
-}
+#ifdef ZRLE_DEBUG
+    rfbLog("zrleOutStreamFlush: after deflate: %d bytes\n",
+	   os->zs.next_out - os->out.ptr);
+#endif
 
-void zrleOutStreamWriteOpaque32 (zrleOutStream *os, zrle_U32 u)
-{
-  zrleOutStreamCheck(os, 4);
-  *os->in.ptr++ = ((zrle_U8*)&u)[0];
-  *os->in.ptr++ = ((zrle_U8*)&u)[1];
-  *os->in.ptr++ = ((zrle_U8*)&u)[2];
-  *os->in.ptr++ = ((zrle_U8*)&u)[3];
-}
+    os->out.ptr = os->zs.next_out;
+    bound = ZRLE_FLUSH_SLACK;
+  } while (os->zs.avail_out == 0);   /* Not expected past the bound */
 
-void zrleOutStreamWriteOpaque24A(zrleOutStream *os, zrle_U32 u)
-{
-  zrleOutStreamCheck(os, 3);
-  *os->in.ptr++ = ((zrle_U8*)&u)[0];
-  *os->in.ptr++ = ((zrle_U8*)&u)[1];
-  *os->in.ptr++ = ((zrle_U8*)&u)[2];
-}
+  os->in.ptr = os->in.start;
 
-void zrleOutStreamWriteOpaque24B(zrleOutStream *os, zrle_U32 u)
-{
-  zrleOutStreamCheck(os, 3);
-  *os->in.ptr++ = ((zrle_U8*)&u)[1];
-  *os->in.ptr++ = ((zrle_U8*)&u)[2];
-  *os->in.ptr++ = ((zrle_U8*)&u)[3];
+  return TRUE;
 }
@@ -21,6 +21,8 @@
 #ifndef __ZRLE_OUT_STREAM_H__
 #define __ZRLE_OUT_STREAM_H__
 
+#include <string.h>
+#include <time.h>
 #include <zlib.h>
 #include "zrletypes.h"
 #include "rfb/rfbproto.h"
@@ -36,19 +38,70 @@ typedef struct
   zrleBuffer out;
 
   z_stream   zs;
+  rfbBool    collect;     /* Only gathers in, see zrleOutStreamNewCollector */
+  rfbBool    failed;      /* A reserve failed, in misses data */
+  int        inPeak, outPeak;   /* Largest use since periodStart */
+  time_t     periodStart;
 } zrleOutStream;
 
 #define ZRLE_BUFFER_LENGTH(b) ((b)->ptr - (b)->start)
 
+/*
+   Tile data is written in two steps: zrleOutStreamReserve() makes room
+   for the most a tile can take, then the zrleOutStreamPut functions write
+   without any check. Everything written stays in in until
+   zrleOutStreamFlush() deflates it at once.
+*/
+
+#define zrleOutStreamReserve(os, size)                                        \
+        ((os)->in.end - (os)->in.ptr >= (size) || zrleOutStreamGrow((os), (size)))
+
 zrleOutStream *zrleOutStreamNew           (void);
+zrleOutStream *zrleOutStreamNewCollector  (void);
 void           zrleOutStreamFree          (zrleOutStream * );
+void           zrleOutStreamReset         (zrleOutStream * );
+rfbBool        zrleOutStreamGrow          (zrleOutStream *, int size);
 rfbBool        zrleOutStreamFlush         (zrleOutStream * );
-void           zrleOutStreamWriteBytes    (zrleOutStream *, const zrle_U8 *data,					   int            length);
-void           zrleOutStreamWriteU8       (zrleOutStream *, zrle_U8        u);
-void           zrleOutStreamWriteOpaque8  (zrleOutStream *, zrle_U8        u);
-void           zrleOutStreamWriteOpaque16 (zrleOutStream *, zrle_U16       u);
-void           zrleOutStreamWriteOpaque32 (zrleOutStream *, zrle_U32       u);
-void           zrleOutStreamWriteOpaque24A(zrleOutStream *, zrle_U32       u);
-void           zrleOutStreamWriteOpaque24B(zrleOutStream *, zrle_U32       u);
+
+#ifndef InlineX
+#ifdef WIN32
+  #define InlineX __inline
+#else
+  #define InlineX inline
+#endif
+#endif
+
+static InlineX void zrleOutStreamPutBytes(zrleOutStream *os, const zrle_U8 *data, int length)
+{ memcpy(os->in.ptr, data, length);
+  os->in.ptr += length;
+}
+
+static InlineX void zrleOutStreamPutU8(zrleOutStream *os, zrle_U8 u)
+{ *os->in.ptr++ = u;
+}
+
+static InlineX void zrleOutStreamPutOpaque8(zrleOutStream *os, zrle_U8 u)
+{ *os->in.ptr++ = u;
+}
+
+static InlineX void zrleOutStreamPutOpaque16(zrleOutStream *os, zrle_U16 u)
+{ memcpy(os->in.ptr, &u, 2);
+  os->in.ptr += 2;
+}
+
+static InlineX void zrleOutStreamPutOpaque32(zrleOutStream *os, zrle_U32 u)
+{ memcpy(os->in.ptr, &u, 4);
+  os->in.ptr += 4;
+}
+
+static InlineX void zrleOutStreamPutOpaque24A(zrleOutStream *os, zrle_U32 u)
+{ memcpy(os->in.ptr, (zrle_U8 *)&u, 3);
+  os->in.ptr += 3;
+}
+
+static InlineX void zrleOutStreamPutOpaque24B(zrleOutStream *os, zrle_U32 u)
+{ memcpy(os->in.ptr, (zrle_U8 *)&u + 1, 3);
+  os->in.ptr += 3;
+}
 
 #endif /* __ZRLE_OUT_STREAM_H__ */
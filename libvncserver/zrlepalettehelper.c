@@ -24,11 +24,11 @@
 
 #define ZRLE_HASH(pix) (((pix) ^ ((pix) >> 17)) & 4095)
 
+/* Only index needs clearing, key and palette are read where index is set */
+
 void zrlePaletteHelperInit(zrlePaletteHelper *helper)
 {
-  memset(helper->palette, 0, sizeof(helper->palette));
   memset(helper->index, 255, sizeof(helper->index));
-  memset(helper->key, 0, sizeof(helper->key));
   helper->size = 0;
 }
 
@@ -0,0 +1,62 @@
+/*
+ * zrlescantemplate.c - template for the tile scan of the ZRLE encoder.
+ *
+ * This file shouldn't be compiled.  It is included multiple times by
+ * zrle.c, each time with a different definition of the macro BPP and of
+ * SCAN_SUFFIX / SCAN_TARGET, which name the build as in tightscantemplate.c.
+ *
+ * The scan looks at every pixel with its neighbours and never branches on
+ * the data, so the compiler can run it over whole vectors of pixels.
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#if !defined(BPP) || !defined(SCAN_SUFFIX) || !defined(SCAN_TARGET)
+#error "This file shouldn't be compiled."
+#error "It is included as part of zrle.c"
+#endif
+
+#define PIX_T __RFB_CONCAT2E(zrle_U,BPP)
+#define ZrleRunsBPP __RFB_CONCAT3E(ZrleRuns,BPP,SCAN_SUFFIX)
+
+/*
+   ZrleRunsBPP returns the number of runs in the n pixels at p, and in
+   singles how many of them are one pixel long. p[ n ] must differ from
+   p[ n - 1 ], as ZRLE_ENCODE_TILE makes it.
+*/
+
+SCAN_TARGET static int
+ZrleRunsBPP( const PIX_T * p, int n, int * singles )
+{ int starts= 1;
+  int single= p[ 1 ] != p[ 0 ];
+  int k;
+
+  for( k= 1; k < n; k++ )
+  { int s= p[ k ] != p[ k - 1 ];
+    int e= p[ k + 1 ] != p[ k ];
+
+    starts += s;
+    single += s & e;
+  }
+
+  *singles= single;
+  return( starts );
+}
+
+#undef ZrleRunsBPP
+#undef PIX_T
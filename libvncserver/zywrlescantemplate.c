@@ -0,0 +1,135 @@
+/*
+ * zywrlescantemplate.c - template for the forward transform of ZYWRLE.
+ *
+ * This file shouldn't be compiled.  It is included multiple times by
+ * zrle.c, each time with a different definition of SCAN_SUFFIX /
+ * SCAN_TARGET, which name the build as in tightscantemplate.c.
+ *
+ * The transform works on the coefficient buffer, one int per pixel with
+ * Y, U and V in its low bytes, so one build serves every pixel format and
+ * byte order. It gives the bytes Wavelet() of common/zywrletemplate.c
+ * gives, only the pairs of a pass go in another order, and each pair of
+ * rows is quantised as soon as the column pass is done with it.
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#if !defined(SCAN_SUFFIX) || !defined(SCAN_TARGET)
+#error "This file shouldn't be compiled."
+#error "It is included as part of zrle.c"
+#endif
+
+#ifndef ZYWRLE_SCAN_ONCE
+#define ZYWRLE_SCAN_ONCE
+
+/*
+   ZYWRLE_HARR is Harr() of zywrletemplate.c on the bytes at a and b,
+   selecting instead of branching. Bytes wrap as the casts there do, so
+   only bit 7 of a sum tells its sign.
+*/
+
+#define ZYWRLE_HARR( a, b )                                              \
+{ unsigned char hx0= (unsigned char)( a ), hx1= (unsigned char)( b );   \
+  unsigned char hs = (unsigned char)( hx0 + hx1 );                      \
+  unsigned char hd = (unsigned char)( hx0 - hx1 );                      \
+  int hdiffer= ( hx0 ^ hx1 ) & 0x80;                                    \
+                                                                        \
+  ( a )= (signed char)( hdiffer ? hs                                    \
+                      : ( hd ^ hx0 ) & 0x80 ? hx1 : hx0 );              \
+  ( b )= (signed char)( !hdiffer ? hd                                   \
+                      : ( hs ^ hx1 ) & 0x80 ? hx0 : -hx1 );             \
+}
+
+#define ZYWRLE_HARR3( a, b )                                             \
+{ ZYWRLE_HARR(( a )[ 0 ], ( b )[ 0 ]);                                   \
+  ZYWRLE_HARR(( a )[ 1 ], ( b )[ 1 ]);                                   \
+  ZYWRLE_HARR(( a )[ 2 ], ( b )[ 2 ]);                                   \
+}
+
+#define ZYWRLE_QUANT3( p, pM )                                           \
+{ ( p )[ 0 ]= ( pM )[ 0 ][ (unsigned char)( p )[ 0 ]];                   \
+  ( p )[ 1 ]= ( pM )[ 1 ][ (unsigned char)( p )[ 1 ]];                   \
+  ( p )[ 2 ]= ( pM )[ 2 ][ (unsigned char)( p )[ 2 ]];                   \
+}
+
+#endif /* ZYWRLE_SCAN_ONCE */
+
+#define ZywrleHarrRows __RFB_CONCAT2E(ZywrleHarrRows,SCAN_SUFFIX)
+#define ZywrleWavelet  __RFB_CONCAT2E(ZywrleWavelet,SCAN_SUFFIX)
+
+/*
+   ZywrleHarrRows transforms the n bytes at a with those at b, a whole row
+   with the next at level 0. The fourth byte of each pixel goes along,
+   nothing reads it.
+*/
+
+SCAN_TARGET static void
+ZywrleHarrRows( signed char * a, signed char * b, int n )
+{ int k;
+
+  for( k= 0; k < n; k++ )
+  { ZYWRLE_HARR( a[ k ], b[ k ]);
+} }
+
+/*
+   ZywrleWavelet is Wavelet() for level levels of the width x height
+   coefficients at pBuf, param the quantiser tables zywrleParam[ level - 1 ]
+*/
+
+SCAN_TARGET static void
+ZywrleWavelet( int * pBuf, int width, int height, int level
+             , const signed char * (* param)[ 3 ] )
+{ int l;
+
+  for( l= 0; l < level; l++ )
+  { const signed char ** pM= param[ l ];
+    int s    = 1 << l;            /* Pixels between the two of a pair */
+    int pairs= height >> ( l + 1 );
+    int span = ( width >> ( l + 1 )) << ( l + 1 );
+    int x, y, k;
+
+    for( y= 0; y < height; y += s )
+    { signed char * row= (signed char *)( pBuf + y * width );
+
+      for( x= 0; x < span; x += 2 * s )
+      { ZYWRLE_HARR3( row + x * 4, row + ( x + s ) * 4 );
+    } }
+
+    for( k= 0; k < pairs; k++ )
+    { signed char * a= (signed char *)( pBuf + ( 2 * k << l ) * width );
+      signed char * b= a + s * width * 4;
+
+      if ( !l )
+      { ZywrleHarrRows( a, b, width * 4 );
+      }
+      else
+      { for( x= 0; x < width; x += s )
+        { ZYWRLE_HARR3( a + x * 4, b + x * 4 );
+      } }
+
+      /* Hx of the upper row, Hy and Hxy of the lower one are final now */
+
+      for( x= 0; x < span; x += 2 * s )
+      { ZYWRLE_QUANT3( a + ( x + s ) * 4, pM );
+        ZYWRLE_QUANT3( b + x * 4, pM );
+        ZYWRLE_QUANT3( b + ( x + s ) * 4, pM );
+  } } }
+}
+
+#undef ZywrleWavelet
+#undef ZywrleHarrRows
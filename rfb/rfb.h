@@ -67,6 +67,23 @@ typedef void * (* VncPushFun   ) ( int sk
                                  , void * userData
                                  , const void * src, size_t sz );
 
+/**
+ *  Scatter-gather pusher, gets a whole FramebufferUpdate in one call.
+ * rfbSegment has the layout of struct iovec, so the list can be handed
+ * to writev() / sendmsg() as is.
+ *  The segments are only valid during the call: they point into pooled
+ * output chunks and straight into framebuffer rows, which are reused or
+ * freed (rfbNewFramebuffer()) afterwards. Write them, or copy them, before
+ * returning, never keep the list for a later writev().
+ */
+typedef struct
+{ const void * base;
+  size_t       sz;
+} rfbSegment;
+
+typedef void * (* VncPushVecFun) ( int sk
+                                 , const rfbSegment * seg, int count );
+
 typedef void   (* VncPopPtrFun ) ( int    b, int x, int y , struct _rfbClient * cl );
 typedef void   (* VncPopKeyFun ) ( int attr, rfbKeySym key, struct _rfbClient * cl );
 
@@ -85,6 +102,15 @@ void rfbMarkRectAsModified( struct _ScreenAtom *
                           , int x1, int y1
                           , int x2, int y2 );
 
+/**
+ *  Raw sends large rects straight from the framebuffer rows, which stay in
+ * use until the update is pushed. Once a rect is queued here Raw copies the
+ * rows instead, so renderer threads may draw at any time.
+ */
+void rfbQueueRectAsModified( struct _ScreenAtom *     // any thread, lock-free,
+                           , int x1, int y1           // merged on the next
+                           , int x2, int y2 );        // rfbProcessEvents()
+
 
 struct _rfbScreenInfo * rfbGetScreen( void * frameBuffer
                                     , int width, int height
@@ -96,6 +122,9 @@ int      setVncEvents( struct _rfbScreenInfo *
                      , VncPopPtrFun
                      , VncPopKeyFun );
 
+int      setVncVecPusher( struct _rfbScreenInfo *
+                        , VncPushVecFun );       // opt-in, one push per update
+
 int      setVncAuth  ( struct _rfbScreenInfo *
                      , const char * name             // desktop name
                      , const char * pass
@@ -117,6 +146,9 @@ struct _rfbClient * rfbNewStreamClient( struct _rfbScreenInfo *
 void    rfbCloseClient(   struct _rfbClient     * );  // JACS, client data sinker
 rfbBool rfbUpdateClient(  struct _rfbClient     * );
 rfbBool rfbUpdateClients( struct _rfbScreenInfo * ); // JACS
+void    rfbClientBacklog( struct _rfbClient     *, size_t queued ); // Bytes still queued by the host
+rfbLong rfbNextDeadline(  struct _rfbScreenInfo * ); // Microseconds to the next deferred update, -1 for none
+void    rfbClientReady(   struct _rfbClient     * ); // Client state changed outside the library, check it
 
 
 
@@ -252,7 +284,8 @@ rfbBool rfbUpdateClients( struct _rfbScreenInfo * ); // JACS
   rfbClientIteratorNext()
  and
   rfbReleaseClientIterator()
- to prevent thread clashes.
+ to prevent thread clashes. rfbForEachClient() does the same with an
+ iterator on the stack, rfbClientCount() tells how many clients there are.
 
  @section example_code Example Code
 
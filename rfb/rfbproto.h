@@ -1609,12 +1609,25 @@ typedef struct _rfbExtensionData
  * rfbProcessEvents for each of these.
  */
 
+/**
+ *  Slot of the damage queue, see rfbQueueRectAsModified(). seq is kept
+ * relative to the slot index so a zeroed queue is an empty one.
+ */
+#define RFB_DAMAGE_QUEUE   256     /* Power of two */
+
+typedef struct
+{ uint32_t seq;
+  int x1, y1, x2, y2;
+} rfbDamageCell;
+
 typedef struct _ScreenAtom
 { struct _rfbScreenInfo * owner;
   struct _ScreenAtom    * scaledScreenNext;  /** this structure has children that are scaled versions of this screen */
   int scaledScreenRefCount;
 
   struct _rfbClient * clientHead;
+  int goneClients;        /* Gone but still referenced, see rfbReclaimClients() */
+  int liveClients;        /* Linked and not gone, see rfbClientCount() */
 
 
   int width;
@@ -1640,8 +1653,82 @@ typedef struct _ScreenAtom
 
   rfbPixelFormat serverFormat;
 
+  uint32_t fbGeneration;  /* Bumped on every change, that of the window invalidates encCache */
+
+  /* Tiled damage tracking, see damage.c */
+  int damageTileShift;    /* log2 of the tile size, 0 marks the clients' regions directly */
+  uint64_t * damageTiles; /* Generation each tile was last marked at */
+  int damageCols, damageRows;
+  uint64_t damageGeneration, damageMarked;   /* 64 bits never wrap */
+  rfbBool damageDiff;     /* Compare marked tiles with a shadow copy, needs damageTileShift */
+  char * damageShadow;    /* Framebuffer as the clients were last told */
+  unsigned char * damageSuspect;   /* Tiles marked but not compared yet */
+  rfbBool damageSuspects;
+  rfbBool damageScroll;   /* Turn rows that moved into CopyRects, needs damageDiff */
+
+  /* Damage queued from any thread, merged on the next pass */
+  rfbDamageCell damageQueue[ RFB_DAMAGE_QUEUE ];
+  uint32_t damageQueueHead;       /* Next slot to fill */
+  uint32_t damageQueueTail;       /* Next slot to merge */
+  int damageQueueLost;            /* Queue ran full, everything counts as damaged */
+
+  /* Clients with a request out, see rfbClientReady() */
+  struct _rfbClient * readyHead;  /* May have something to send */
+  struct _rfbClient * waitHead;   /* Nothing to send until damage comes */
+
 } ScreenAtom;
 
+/**
+ *  Output buffer chunks. UPDATE_BUF_SIZE is the smallest class and must be
+ * big enough for the biggest fixed size write of any encoder, each class
+ * is four times the previous one.
+ */
+#define UPDATE_BUF_SIZE    30000
+#define RFB_BUF_CLASSES    4
+#define RFB_BUF_POOL_KEEP  8       /* Free chunks kept per class */
+#define RFB_BUF_CLASS_SIZE( c ) ( UPDATE_BUF_SIZE << ( 2 * ( c )))
+
+typedef struct _rfbBufChunk
+{ struct _rfbBufChunk * next;
+  int size, sizeClass;
+  char data[ 1 ];
+} rfbBufChunk;
+
+/**
+ *  Rects already encoded for one client, handed as they are to the next
+ * client asking for the same rect in the same format and encoding.
+ */
+typedef struct _rfbEncCacheEntry
+{ struct _rfbEncCacheEntry * next;
+  ScreenAtom * atom;
+  int x, y, w, h;
+  int encoding, param;
+  rfbPixelFormat format;
+  int len;
+  char data[ 1 ];
+} rfbEncCacheEntry;
+
+/**
+ *  Timers on CLOCK_MONOTONIC microseconds, hashed into a wheel of
+ * RFB_TIMER_SLOTS slots of RFB_TIMER_TICK each, see timer.c.
+ */
+#define RFB_TIMER_SLOTS    256     /* Power of two */
+#define RFB_TIMER_TICK     1000    /* Microseconds per slot */
+
+typedef struct _rfbTimer
+{ struct _rfbTimer *  next;
+  struct _rfbTimer ** link;        /* Where this one is linked from, NULL while stopped */
+  uint64_t deadline;
+  void (* fire )( struct _rfbTimer *, void * data );
+  void * data;
+} rfbTimer;
+
+typedef struct
+{ rfbTimer * slot[ RFB_TIMER_SLOTS ];
+  uint64_t tick;                   /* First tick not expired yet */
+  int running;
+} rfbTimerWheel;
+
 typedef struct _rfbScreenInfo
 { ScreenAtom window;
 
@@ -1653,6 +1740,29 @@ typedef struct _rfbScreenInfo
 /**  JACS, async stuff
   */
   VncPushFun streamPusher;
+  VncPushVecFun streamVecPusher;   /* Gathers whole updates when set */
+
+  rfbBufChunk * bufPool[ RFB_BUF_CLASSES ];   /* Output chunks shared by clients */
+  int bufPoolFree[ RFB_BUF_CLASSES ];
+
+  rfbEncCacheEntry * encCache;     /* Most recently used first */
+  uint32_t encCacheGeneration;     /* window.fbGeneration the entries belong to */
+  size_t encCacheBytes;
+  size_t encCacheLimit;            /* 0 disables encoding sharing */
+
+  int encodeThreads;               /* Threads splitting big rects, 0 or 1 keeps it serial */
+  struct _rfbEncodePool * encodePool;
+
+  struct _rfbTightContext * tightPool;   /* Tight scratch state, see tight.c */
+  struct _rfbZlibContext  * zlibPool;    /* Zlib scratch state, see zlib.c */
+  struct _rfbScratchLock  * scratchLock; /* Guards both pools, see encpool.c */
+
+  rfbBool adaptEncoding;           /* Pick encoding and levels per rect, see adapt.c */
+  unsigned long adaptRateLimit;    /* Bytes per second a client link is meant to carry, 0 for no limit */
+
+  size_t maxClientBacklog;         /* Hold updates while a client has more bytes queued, 0 never holds */
+
+  rfbTimerWheel timers;            /* Deferred updates and pointer events */
 
 /**
   *  some screen specific data can be put into a struct where screenData points to.
@@ -1798,6 +1908,39 @@ typedef struct _rfbStatList
   struct _rfbStatList *Next;
 } rfbStatList;
 
+/**
+ *  Encoding and levels the controller of adapt.c chose for one rect
+ */
+typedef struct
+{ int encoding;
+  int compressLevel;
+  int qualityLevel;       /* JPEG quality, -1 when the client did not allow JPEG */
+} rfbAdaptPick;
+
+/**
+ *  What the controller measured on one client, along with the client
+ * settings it overrides during an update and puts back afterwards.
+ */
+#define RFB_ADAPT_LEVELS 4
+
+typedef struct
+{ uint32_t encodings;           /* Bit per encoding listed in SetEncodings */
+  int pressure;                 /* 0 the link keeps up, RFB_ADAPT_LEVELS - 1 congested */
+  int calm;                     /* Periods in a row without pressure */
+  unsigned long rate;           /* Bytes per second pushed, smoothed */
+  int blocked;                  /* Per mille of the time spent in the pusher, smoothed */
+  uint64_t periodStart;         /* usec */
+  unsigned long periodBytes;
+  uint64_t periodBlocked;       /* usec */
+
+  rfbBool active;               /* Within an update */
+  int preferredEncoding;
+  int compressLevel, zlibCompressLevel, qualityLevel;
+
+  rfbAdaptPick * pick;          /* One per rect of the update being sent */
+  int picks, pickSize;
+} rfbAdaptState;
+
 typedef struct _rfbSslCtx rfbSslCtx;
 typedef struct _wsCtx wsCtx;
 
@@ -1811,6 +1954,11 @@ typedef struct _rfbClient
   int fd;
   char * recvPtr; int bytesLeft;   /* JACS, jun 2017, async reads */
 
+#define RECV_BUF_MAX ( 2 << 20 )  /* biggest split message kept, cut text tops at 1 MB */
+
+  char * recvBuf;                  /* tail of a message split between sink calls */
+  size_t recvLen, recvNeed, recvSize, recvShort;
+
   ScreenAtom * scaledScreen; /** points to a scaled version of the screen buffer in cl->scaledScreenList */
   rfbBool PalmVNC; /** how did the client tell us it wanted the screen changed?  Ultra style or palm style? */
 
@@ -1909,6 +2057,7 @@ typedef struct _rfbClient
     int copyDX, copyDY;		/**< the translation by which the copy happens */
 
     sraRegionPtr modifiedRegion;
+    uint64_t damageSeen;        /**< last damage generation collected, see damage.c */
 
     /** As part of the FramebufferUpdateRequest, a client can express interest
        in a subrectangle of the whole framebuffer.  This is stored in the
@@ -1923,8 +2072,20 @@ typedef struct _rfbClient
        milliseconds so that several changes to the framebuffer can be combined
        into a single update. */
 
-      struct timeval startDeferring;
-      struct timeval startPtrDeferring;
+      rfbTimer deferTimer;
+      rfbTimer ptrTimer;
+
+    /** Place on the ready or waiting list of the screen, see main.c */
+
+      struct _rfbClient *  readyNext;
+      struct _rfbClient ** readyLink;   /* NULL while on neither */
+      int readyState;
+
+    /** Bytes the host still has queued for the client, see rfbClientBacklog().
+       While over rfbScreenInfo.maxClientBacklog no update is sent, damage
+       keeps piling up in modifiedRegion and goes out as one once it drains. */
+
+      size_t backlog;
 
       int lastPtrX;
       int lastPtrY;
@@ -1938,15 +2099,35 @@ typedef struct _rfbClient
     rfbPixelFormat format;
 
     /**
-     * UPDATE_BUF_SIZE must be big enough to send at least one whole line of the
-     * framebuffer.  So for a max screen width of say 2K with 32-bit pixels this
-     * means 8K minimum.
+     *  Output goes to a chunk taken from the screen pool, updateBuf points
+     * into it and ubsize tells its size. Idle clients hold no chunk at all.
      */
 
-#define UPDATE_BUF_SIZE 30000
+    rfbBufChunk * ubChunk;
+    char * updateBuf;
+    int ublen, ubsize;
+
+    /* FramebufferUpdate being gathered for streamVecPusher. Full chunks are
+     * chained to outChunks untouched, outSeg lists them in sending order. */
+    rfbBool gathering;
+    rfbSegment * outSeg;
+    int outSegs, outSegSize;
+    rfbBufChunk * outChunks;
+
+    /* Copy of the rect being encoded, kept for the other clients */
+    rfbBool teeing;
+    char * teeBuf;
+    int teeFrom, teeLen, teeSize;
 
-    char updateBuf[UPDATE_BUF_SIZE];
-    int ublen;
+    /* Set on the copies encoding bands for another client, see encpool.c */
+    struct _rfbClient * tileOwner;
+    int tileStream;
+
+    /* Tight scratch state, held for the duration of one Tight rect */
+    struct _rfbTightContext * tightCtx;
+
+    /* Throughput and per rect choices of the encoding controller */
+    rfbAdaptState adapt;
 
     /* statistics */
     struct _rfbStatList *statEncList;
@@ -1960,6 +2141,7 @@ typedef struct _rfbClient
     struct z_stream_s compStream;
     rfbBool compStreamInited;
     uint32_t zlibCompressLevel;
+    uint32_t zlibStreamLevel;   /* Level compStream runs at */
 #endif
 
 #if defined(HAVE_LIBZ) || defined(HAVE_LIBPNG)
@@ -2003,6 +2185,12 @@ typedef struct _rfbClient
     struct _rfbClient *prev;
     struct _rfbClient *next;
 
+    /** References held besides the thread running the library, see
+       rfbIncrClientRef(). A gone client stays linked, skipped by the
+       iterators, until the last one is dropped. */
+    int refCount;
+    rfbBool gone;
+
 
 #ifdef HAVE_LIBZ
     void* zrleData;
@@ -2019,6 +2207,7 @@ typedef struct _rfbClient
     /** for threaded zrle */
     char *zrleBeforeBuf;
     void *paletteHelper;
+    void *zrleJobs;             /* Tile rows encoded on the encoding threads */
 
     /** for thread safety for rfbSendFBUpdate() */
 
@@ -2063,7 +2252,12 @@ typedef struct _rfbClient
 	(cl)->cursorY != (cl)->screen->window.cursorY))) ||                       \
      ((cl)->useNewFBSize && (cl)->newFBSizePending) ||                     \
      ((cl)->enableCursorPosUpdates && (cl)->cursorWasMoved) ||             \
-     !sraRgnEmpty((cl)->copyRegion) || !sraRgnEmpty((cl)->modifiedRegion))
+     !sraRgnEmpty((cl)->copyRegion) || !sraRgnEmpty((cl)->modifiedRegion) || \
+     RFB_DAMAGE_PENDING(cl))
+
+#define RFB_DAMAGE_PENDING(cl)                                             \
+     ((cl)->screen->window.damageMarked > (cl)->damageSeen ||              \
+      (cl)->screen->window.damageSuspects)
 
 /*
  * Macros for endian swapping.
@@ -2096,16 +2290,34 @@ int rfbPushClientStream( rfbClient * cl, const void * data, size_t sz );  // JAC
 
 /* rfbserver.c */
 
-/* Routines to iterate over the client list in a thread-safe way.
-   Only a single iterator can be in use at a time process-wide. */
-typedef struct rfbClientIterator *rfbClientIteratorPtr;
+/* Routines to iterate over the client list. Iterators, like everything
+   touching the list, belong to the thread running the library; the
+   client they stand on holds a reference so it can go meanwhile.
+   Other threads keep clients alive with rfbIncrClientRef().
+   An iterator may live on the stack, set up by rfbInitClientIterator();
+   one left before rfbClientIteratorNext() returned NULL has to be let go
+   with rfbFinishClientIterator(). rfbGetClientIterator() allocates one
+   for rfbReleaseClientIterator() to free. */
+typedef struct rfbClientIterator
+{ struct _rfbClient * next;
+  ScreenAtom * screen;
+  rfbBool closedToo;
+} rfbClientIteratorRec, *rfbClientIteratorPtr;
+
+#define rfbForEachClient( i, rfbScreen, cl )                    \
+  for( rfbInitClientIterator( &(i), (rfbScreen), FALSE )        \
+     ; (( cl )= rfbClientIteratorNext( &(i) )); )
 
 extern void                 rfbClientListInit       ( ScreenAtom * rfbScreen );
+extern void                 rfbInitClientIterator   ( rfbClientIteratorPtr iterator, ScreenAtom * rfbScreen, rfbBool closedToo );
+extern void                 rfbFinishClientIterator ( rfbClientIteratorPtr iterator);
+extern int                  rfbClientCount          ( ScreenAtom * rfbScreen );
 extern rfbClientIteratorPtr rfbGetClientIterator    ( ScreenAtom * rfbScreen );
 extern rfbClient          * rfbClientIteratorNext   ( rfbClientIteratorPtr iterator);
 extern void                 rfbReleaseClientIterator( rfbClientIteratorPtr iterator);
 extern void                 rfbIncrClientRef( rfbClient * cl);
 extern void                 rfbDecrClientRef( rfbClient * cl);
+extern void                 rfbReclaimClients( ScreenAtom * rfbScreen );
 
 extern void rfbNewClientConnection(rfbScreenInfo * rfbScreen,int sock);
 
@@ -2118,6 +2330,12 @@ extern void    rfbClientConnFailed(        rfbClient *, const char *reason);
 extern rfbBool rfbSendFramebufferUpdate(   rfbClient *, sraRegionPtr updateRegion);
 extern rfbBool rfbSendRectEncodingRaw(     rfbClient *, int x,int y,int w,int h);
 extern rfbBool rfbSendUpdateBuf(           rfbClient *);
+extern rfbBool rfbFlushClientSegments(     rfbClient *);
+extern rfbBool rfbSendClientSegments(      rfbClient *, const rfbSegment *, int count );
+extern void    rfbTakeClientChunks(        rfbClient *, rfbClient * from );
+extern rfbBool rfbReserveUpdateBuf(        rfbClient *, int len );
+extern void    rfbReleaseUpdateBuf(        rfbClient *);
+extern void    rfbFreeBufPool(             rfbScreenInfo *);
 extern rfbBool rfbSendCopyRegion(          rfbClient *,sraRegionPtr reg,int dx,int dy);
 extern rfbBool rfbSendLastRectMarker(      rfbClient *);
 extern rfbBool rfbSendNewFBSize(           rfbClient *, int w, int h);
@@ -2138,6 +2356,7 @@ extern void rfbSendServerCutText( ScreenAtom * ,char *str, int len);
 /* translate.c */
 
 extern rfbBool rfbEconomicTranslate;
+extern rfbBool rfbVectorTranslate;
 
 extern void rfbTranslateNone(char *table, rfbPixelFormat *in,
                              rfbPixelFormat *out,
@@ -2170,6 +2389,7 @@ extern rfbBool rfbSendRectEncodingCoRRE(rfbClient * cl, int x,int y,int w,int h)
 
 /* hextile.c */
 
+extern rfbBool rfbHextileVectorScan;
 extern rfbBool rfbSendRectEncodingHextile(rfbClient * cl, int x, int y, int w, int h);
 
 /* ultra.c */
@@ -2206,6 +2426,7 @@ extern rfbBool rfbSendRectEncodingZlib(rfbClient * cl, int x, int y, int w,
 #define TURBO_DEFAULT_SUBSAMP 0
 
 extern rfbBool rfbTightDisableGradient;
+extern rfbBool rfbTightVectorScan;
 extern int rfbNumCodedRectsTight(rfbClient * cl, int x,int y,int w,int h);
 
  rfbBool rfbSendRectEncodingTight(rfbClient * cl, int x,int y,int w,int h);
@@ -2254,12 +2475,90 @@ extern void rfbDefaultPtrAddEvent(int buttonMask,int x,int y,rfbClient * cl);
 
 /* zrle.c */
 #ifdef HAVE_LIBZ
+extern rfbBool rfbZrleVectorScan;
 extern rfbBool rfbSendRectEncodingZRLE(rfbClient * cl, int x, int y, int w,int h);
 #endif
 
+/* enccache.c */
+
+typedef rfbBool ( * rfbSendRectProcPtr )( rfbClient *, int x, int y, int w, int h );
+
+extern rfbBool rfbEncCacheUsable( rfbClient * );
+extern rfbEncCacheEntry * rfbEncCacheLookup( rfbClient *, int encoding, int param
+                                           , const rfbPixelFormat *
+                                           , int x, int y, int w, int h );
+extern void    rfbEncCacheInsert( rfbClient *, int encoding, int param
+                                , const rfbPixelFormat *
+                                , int x, int y, int w, int h
+                                , const char * data, int len );
+extern void    rfbEncCacheTee(    rfbClient * );
+extern rfbBool rfbSendRectCached( rfbClient *, int x, int y, int w, int h
+                                , rfbSendRectProcPtr );
+extern void    rfbEncCacheFlush(  rfbScreenInfo * );
+
+/* encpool.c */
+
+extern int     rfbNumTiledRects(  rfbClient *, int x, int y, int w, int h );
+extern rfbBool rfbSendRectTiled(  rfbClient *, int x, int y, int w, int h
+                                , rfbSendRectProcPtr );
+typedef void ( * rfbEncodeJobProcPtr )( void * arg, int job, int worker );
+
+extern int     rfbEncodeJobWorkers( rfbClient * );
+extern void    rfbRunEncodeJobs(  rfbClient *, int jobs, rfbEncodeJobProcPtr, void * arg );
+extern void    rfbLockBufPool(    rfbScreenInfo * );
+extern void    rfbUnlockBufPool(  rfbScreenInfo * );
+extern void    rfbFreeEncodePool( rfbScreenInfo * );
+extern rfbBool rfbInitScratchLock(   rfbScreenInfo * );
+extern void    rfbFreeScratchLock(   rfbScreenInfo * );
+extern void    rfbLockScratchPools(  rfbScreenInfo * );
+extern void    rfbUnlockScratchPools( rfbScreenInfo * );
+
+/* damage.c */
+
+extern rfbBool rfbDamageMarkRect(   ScreenAtom *, int x1, int y1, int x2, int y2 );
+extern rfbBool rfbDamageMarkRegion( ScreenAtom *, sraRegionPtr );
+extern void    rfbDamageStart(      rfbClient * );
+extern void    rfbDamageCollect(    rfbClient * );
+extern void    rfbDamageSync(       ScreenAtom *, sraRegionPtr );
+extern void    rfbDamageFree(       ScreenAtom * );
+extern rfbBool rfbDamageQueued(     ScreenAtom * );
+extern void    rfbDamageDrain(      ScreenAtom * );
+
+/* adapt.c */
+
+extern void     rfbAdaptStart(        rfbClient * );
+extern void     rfbAdaptListEncoding( rfbClient *, int encoding );
+extern uint64_t rfbAdaptClock(        rfbClient * );
+extern void     rfbAdaptPushed(       rfbClient *, size_t sz, uint64_t start );
+extern rfbBool  rfbAdaptBegin(        rfbClient *, int rects );
+extern void     rfbAdaptRect(         rfbClient *, int x, int y, int w, int h );
+extern void     rfbAdaptApply(        rfbClient *, int n );
+extern void     rfbAdaptEnd(          rfbClient * );
+
+/* timer.c */
+
+extern uint64_t rfbTimerNow(    void );
+extern void     rfbTimerInit(   rfbTimer *, void (* fire )( rfbTimer *, void * ), void * data );
+extern void     rfbTimerStart(  rfbTimerWheel *, rfbTimer *, uint64_t deadline );
+extern void     rfbTimerStop(   rfbTimerWheel *, rfbTimer * );
+extern void     rfbTimerExpire( rfbTimerWheel *, uint64_t now );
+extern rfbLong  rfbTimerNext(   rfbTimerWheel *, uint64_t now );
+
+#define rfbTimerRunning( t ) ( (t)->link != NULL )
+
+/* main.c */
+
+#define RFB_READY_IDLE     0       /* No request, or a deferred one timed */
+#define RFB_READY_WAITING  1
+#define RFB_READY_LISTED   2
+#define RFB_READY_GONE    -1
+
+extern void rfbWakeClients( ScreenAtom * );
+
 /* stats.c */
 
 extern void rfbResetStats(rfbClient * cl);
+extern void rfbStatMerge(rfbClient * cl, rfbClient * from);
 extern void rfbPrintStats(rfbClient * cl);
 
 /* font.c */
@@ -42,8 +42,8 @@ extern sraRegion *sraRgnBBox(const sraRegion *src);
 
 typedef struct sraRectangleIterator
 { rfbBool reverseX,reverseY;
-  int ptrSize,ptrPos;
-  struct sraSpan** sPtrs;
+  const sraRegion * rgn;
+  int band,span;                   /* Counted in iteration order */
 } sraRectangleIterator;
 
 extern sraRectangleIterator *sraRgnGetIterator(sraRegion *s);
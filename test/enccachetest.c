@@ -0,0 +1,204 @@
+/*
+ * enccachetest.c
+ *
+ * Runs the same damage through viewers sharing encoded rects, in Hextile
+ * and RRE with cursor shape updates, once with the encoding cache on and
+ * once with it off. Sharing must not change a byte any viewer gets. The
+ * viewers all watch at half scale first, then some of them whole.
+ *
+ *   enccachetest [rounds]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <rfb/rfbproto.h>
+#include <rfb/rfbregion.h>
+
+#define WIDTH   256
+#define HEIGHT  192
+#define VIEWERS 6
+#define SETS    2
+
+typedef struct
+{ int encoding;
+  int scale;
+} Viewer;
+
+static const Viewer sets[ SETS ][ VIEWERS ]=
+{ { { rfbEncodingHextile, 2 }, { rfbEncodingHextile, 2 }, { rfbEncodingHextile, 2 }
+  , { rfbEncodingRRE,     2 }, { rfbEncodingRRE,     2 }, { rfbEncodingRRE,     2 }
+  }
+, { { rfbEncodingHextile, 1 }, { rfbEncodingHextile, 1 }
+  , { rfbEncodingHextile, 2 }, { rfbEncodingHextile, 2 }
+  , { rfbEncodingRRE,     2 }, { rfbEncodingRRE,     2 }
+} };
+
+static const Viewer * viewers;
+
+/* Where the damage goes, widgets redrawn over and over */
+static const sraRect widgets[]=
+{ {   0,   0, 256,  16 }, {   8,  24, 120,  88 }, { 136,  24, 248,  56 }
+, { 136,  64, 248, 120 }, {   8, 120,  64, 184 }, {  72, 128, 200, 160 }
+, { 208, 128, 248, 184 }, {  96, 168, 104, 184 }
+};
+
+static uint32_t fb[ WIDTH * HEIGHT ];
+static uint64_t hash[ VIEWERS ];
+static size_t sent[ VIEWERS ];
+
+static unsigned seed;
+
+static int rnd( int n )
+{ seed= seed * 1103515245 + 12345;
+  return( (int)(( seed >> 8 ) % n ));
+}
+
+/**
+ *  Pusher, hashes what each viewer gets, fd is the viewer index
+ */
+static void * push( int fd, int (*f)( int, void *, time_t, void *, int ), void * u
+                  , const void * data, size_t sz )
+{ const unsigned char * p= (const unsigned char *)data;
+  size_t i;
+
+  for( i= 0; i < sz; i++ )
+  { hash[ fd ]= ( hash[ fd ] ^ p[ i ] ) * 1099511628211ULL;
+  }
+  sent[ fd ] += sz;
+
+  return( NULL );
+}
+
+static void fill( int x, int y, int w, int h, uint32_t c )
+{ int i, j;
+
+  for( j= y; j < y + h && j < HEIGHT; j++ )
+  { for( i= x; i < x + w && i < WIDTH; i++ )
+    { fb[ j * WIDTH + i ]= c;
+} } }
+
+static void sink( rfbClient * cl, const void * msg, size_t sz )
+{ rfbSinkClientStream( cl, (void *)msg, sz );
+}
+
+/**
+ *  Handshake, encodings and scale, as a viewer sends them
+ */
+static void greet( rfbClient * cl, const Viewer * v )
+{ static const char version[]= "RFB 003.008\n";
+  unsigned char none= rfbSecTypeNone, shared= 1;
+  unsigned char enc[ 4 + 3 * 4 ]= { rfbSetEncodings, 0, 0, 3 };
+  int32_t codes[ 3 ];
+  unsigned char scale[ 4 ]= { rfbSetScale, 0, 0, 0 };
+  int k;
+
+  codes[ 0 ]= v->encoding;
+  codes[ 1 ]= rfbEncodingRichCursor;
+  codes[ 2 ]= rfbEncodingXCursor;
+  for( k= 0; k < 3; k++ )
+  { enc[ 4 + 4 * k ]= (unsigned char)( codes[ k ] >> 24 );
+    enc[ 5 + 4 * k ]= (unsigned char)( codes[ k ] >> 16 );
+    enc[ 6 + 4 * k ]= (unsigned char)( codes[ k ] >> 8 );
+    enc[ 7 + 4 * k ]= (unsigned char)( codes[ k ] );
+  }
+  scale[ 1 ]= (unsigned char)v->scale;
+
+  sink( cl, version, 12 );
+  sink( cl, &none, 1 );
+  sink( cl, &shared, 1 );
+  sink( cl, enc, sizeof( enc ));
+  sink( cl, scale, sizeof( scale ));
+}
+
+static void request( rfbClient * cl, const Viewer * v, int incremental )
+{ int w= WIDTH / v->scale, h= HEIGHT / v->scale;
+  unsigned char msg[ 10 ]= { rfbFramebufferUpdateRequest, (unsigned char)incremental
+                           , 0, 0, 0, 0
+                           , (unsigned char)( w >> 8 ), (unsigned char)w
+                           , (unsigned char)( h >> 8 ), (unsigned char)h };
+
+  sink( cl, msg, sizeof( msg ));
+}
+
+/**
+ *  One run over rounds of damage, the hashes end up in hash[]
+ */
+static void run( int rounds, size_t cacheLimit )
+{ rfbScreenInfo * screen= rfbGetScreen( fb, WIDTH, HEIGHT, 8, 3, 4 );
+  rfbClient * cl[ VIEWERS ];
+  int r, k, n;
+
+  seed= 11;
+  fill( 0, 0, WIDTH, HEIGHT, 0xFF3A6EA5 );
+  memset( hash, 0, sizeof( hash ));
+  memset( sent, 0, sizeof( sent ));
+
+  setVncEvents( screen, push, NULL, NULL );
+  screen->deferUpdateTime= 0;
+  screen->encCacheLimit= cacheLimit;
+
+  for( k= 0; k < VIEWERS; k++ )
+  { cl[ k ]= (rfbClient *)calloc( getVncHandler( NULL ), 1 );
+    rfbNewStreamClient( screen, cl[ k ], k );
+    greet( cl[ k ], viewers + k );
+    request( cl[ k ], viewers + k, 0 );
+  }
+  rfbProcessEvents( screen, 0 );
+
+  for( r= 0; r < rounds; r++ )
+  { for( n= 1 + rnd( 6 ); n; n-- )
+    { const sraRect * d= widgets + rnd( sizeof( widgets ) / sizeof( *widgets ));
+      int i, j;
+
+      fill( d->x1, d->y1, d->x2 - d->x1, d->y2 - d->y1
+          , (uint32_t)rnd( 8 ) * 0x203040 );
+
+      for( j= d->y1; j < d->y2; j++ )        /* Some text on it */
+      { for( i= d->x1; i < d->x2; i++ )
+        { if ( !rnd( 5 ))
+          { fb[ j * WIDTH + i ]= (uint32_t)rnd( 1 << 24 );
+      } } }
+
+      rfbMarkRectAsModified( &screen->window, d->x1, d->y1, d->x2, d->y2 );
+    }
+
+    for( k= 0; k < VIEWERS; k++ )
+    { request( cl[ k ], viewers + k, 1 );
+    }
+    rfbProcessEvents( screen, 0 );
+  }
+
+  for( k= 0; k < VIEWERS; k++ )
+  { rfbClientConnectionGone( cl[ k ] );
+  }
+  rfbScreenCleanup( screen );
+}
+
+int main( int argc, char ** argv )
+{ int rounds= argc > 1 ? atoi( argv[ 1 ] ) : 40;
+  uint64_t shared[ VIEWERS ];
+  size_t bytes[ VIEWERS ];
+  int set, k, fails= 0;
+
+  for( set= 0; set < SETS; set++ )
+  { viewers= sets[ set ];
+
+    run( rounds, 8 << 20 );
+    memcpy( shared, hash, sizeof( hash ));
+    memcpy( bytes, sent, sizeof( sent ));
+
+    run( rounds, 0 );
+
+    for( k= 0; k < VIEWERS; k++ )
+    { rfbBool same= shared[ k ] == hash[ k ] && bytes[ k ] == sent[ k ];
+
+      printf("set %d viewer %d %-7s 1/%d %8lu bytes %s\n", set, k
+            , viewers[ k ].encoding == rfbEncodingHextile ? "hextile" : "rre"
+            , viewers[ k ].scale, (unsigned long)sent[ k ]
+            , same ? "ok" : "MISMATCH" );
+      fails += !same;
+  } }
+
+  return( fails ? 1 : 0 );
+}
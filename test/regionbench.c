@@ -0,0 +1,307 @@
+/*
+ * regionbench.c
+ *
+ * Replays synthetic damage traces through the region calls
+ * rfbSendFramebufferUpdate makes for each client and times the band array
+ * engine in libvncserver/rfbregion.c against the old linked list one kept
+ * in regionlist.c. Both must end up with the same pixels in every update,
+ * that is checked before timing.
+ *
+ *   regionbench [frames]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <rfb/rfbproto.h>
+#include <rfb/rfbregion.h>
+#include "regionlist.c"
+
+#define WIDTH   1920
+#define HEIGHT  1080
+#define CLIENTS 2
+#define MAXDAMAGE 256
+
+typedef struct
+{ int n;
+  sraRect r[ MAXDAMAGE ];
+} Frame;
+
+typedef struct
+{ const char * name;
+  void (*make)( Frame *, int );
+} Trace;
+
+static unsigned seed= 1;
+
+static int rnd( int n )
+{ seed= seed * 1103515245 + 12345;
+  return( (int)(( seed >> 8 ) % n ));
+}
+
+static void addRect( Frame * f, int x, int y, int w, int h )
+{ if ( f->n < MAXDAMAGE )
+  { sraRect * r= f->r + f->n++;
+
+    r->x1= x;     r->y1= y;
+    r->x2= x + w; r->y2= y + h;
+} }
+
+/* A terminal: a few glyphs and the cursor per frame */
+static void traceTyping( Frame * f, int frame )
+{ int col= frame % 160, row= ( frame / 160 ) % 60;
+
+  addRect( f, 40 + col * 8, 100 + row * 16, 8, 16 );
+  addRect( f, 48 + col * 8, 100 + row * 16, 2, 16 );
+  if ( !( frame % 7 ))
+  { addRect( f, 1800, 1060, 120, 20 );         /* Clock */
+} }
+
+/* A busy desktop, many small rects all over */
+static void traceScatter( Frame * f, int frame )
+{ int i;
+
+  for( i= 0; i < 48; i++ )
+  { addRect( f, rnd( WIDTH - 64 ), rnd( HEIGHT - 64 )
+           , 4 + rnd( 60 ), 4 + rnd( 60 ));
+} }
+
+/* Video in a window plus a progress bar and a mouse trail */
+static void traceVideo( Frame * f, int frame )
+{ addRect( f, 320, 200, 640, 360 );
+  addRect( f, 320, 570, ( frame * 3 ) % 640, 6 );
+  addRect( f, 200 + frame % 800, 700, 16, 16 );
+}
+
+/* What a tile based diff would hand over, a third of 64x64 tiles */
+static void traceTiles( Frame * f, int frame )
+{ int x, y;
+
+  for( y= 0; y < HEIGHT; y += 64 )
+  { for( x= 0; x < WIDTH; x += 64 )
+    { if ( !rnd( 3 ) && f->n < MAXDAMAGE )
+      { addRect( f, x, y, 64, 64 );
+} } } }
+
+static const Trace traces[]=
+{ { "typing",  traceTyping  }
+, { "scatter", traceScatter }
+, { "video",   traceVideo   }
+, { "tiles",   traceTiles   }
+};
+
+/**
+ *  One client update, the same calls rfbSendFramebufferUpdate makes.
+ * Returns the rects sent and leaves the update region in *sent.
+ */
+#define DEFINE_UPDATE( P, RGN, ITER )                                         \
+static unsigned long P##Update( RGN * modified, RGN * copy, RGN * requested  \
+                              , RGN ** sent )                                \
+{ RGN * update, * updateCopy, * tmp;                                         \
+  ITER * i;                                                                  \
+  sraRect rect;                                                              \
+  unsigned long n= 0;                                                        \
+                                                                             \
+  P##RgnSubtract( copy, modified );                                          \
+  update= P##RgnCreateRgn( modified );                                       \
+  P##RgnOr( update, copy );                                                  \
+  P##RgnAnd( update, requested );                                            \
+                                                                             \
+  updateCopy= P##RgnCreateRgn( copy );                                       \
+  P##RgnAnd( updateCopy, requested );                                        \
+  tmp= P##RgnCreateRgn( requested );                                         \
+  P##RgnOffset( tmp, 0, 0 );                                                 \
+  P##RgnAnd( updateCopy, tmp );                                              \
+  P##RgnDestroy( tmp );                                                      \
+  P##RgnSubtract( update, updateCopy );                                      \
+                                                                             \
+  P##RgnOr( modified, copy );                                                \
+  P##RgnSubtract( modified, update );                                        \
+  P##RgnSubtract( modified, updateCopy );                                    \
+  P##RgnMakeEmpty( copy );                                                   \
+                                                                             \
+  n += P##RgnCountRects( update );                                           \
+  for( i= P##RgnGetIterator( update ); P##RgnIteratorNext( i, &rect ); )     \
+  { n += rect.x2 - rect.x1 > 0;                                              \
+  }                                                                          \
+  P##RgnReleaseIterator( i );                                                \
+                                                                             \
+  P##RgnDestroy( updateCopy );                                               \
+  if ( sent )                                                                \
+  { *sent= update;                                                           \
+  }                                                                          \
+  else                                                                       \
+  { P##RgnDestroy( update );                                                 \
+  }                                                                          \
+  return( n );                                                               \
+}                                                                            \
+                                                                             \
+static void P##Damage( RGN ** modified, const Frame * f )                    \
+{ int c, r;                                                                  \
+                                                                             \
+  for( r= 0; r < f->n; r++ )                                                 \
+  { RGN * rgn= P##RgnCreateRect( f->r[ r ].x1, f->r[ r ].y1                  \
+                               , f->r[ r ].x2, f->r[ r ].y2 );               \
+    for( c= 0; c < CLIENTS; c++ )                                            \
+    { P##RgnOr( modified[ c ], rgn );                                        \
+    }                                                                        \
+    P##RgnDestroy( rgn );                                                    \
+} }
+
+DEFINE_UPDATE( sra,  sraRegion,  sraRectangleIterator )
+DEFINE_UPDATE( list, listRegion, listIterator )
+
+/**
+ *  Both engines must cover the same pixels
+ */
+static rfbBool sameUpdate( sraRegion * a, listRegion * b )
+{ sraRegion * copy= sraRgnCreate(), * tmp;
+  listIterator * i;
+  sraRect rect;
+  rfbBool same;
+
+  for( i= listRgnGetIterator( b ); listRgnIteratorNext( i, &rect ); )
+  { tmp= sraRgnCreateRect( rect.x1, rect.y1, rect.x2, rect.y2 );
+    sraRgnOr( copy, tmp );
+    sraRgnDestroy( tmp );
+  }
+  listRgnReleaseIterator( i );
+
+  tmp= sraRgnCreateRgn( a );
+  same= !sraRgnSubtract( tmp, copy );
+  sraRgnDestroy( tmp );
+
+  if ( same )
+  { same= !sraRgnSubtract( copy, a );
+  }
+
+  sraRgnDestroy( copy );
+  return( same );
+}
+
+static double now( void )
+{ struct timespec ts;
+
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return( ts.tv_sec + ts.tv_nsec / 1e9 );
+}
+
+static Frame * makeFrames( const Trace * trace, int frames )
+{ Frame * f= (Frame *)calloc( frames, sizeof( Frame ));
+  int i;
+
+  seed= 1;
+  for( i= 0; i < frames; i++ )
+  { trace->make( f + i, i );
+  }
+
+  return( f );
+}
+
+static rfbBool checkTrace( const Frame * f, int frames )
+{ sraRegion  * sraMod [ CLIENTS ], * sraCopy,  * sraReq,  * sraSent;
+  listRegion * listMod[ CLIENTS ], * listCopy, * listReq, * listSent;
+  rfbBool ok= TRUE;
+  int i, c;
+
+  sraReq = sraRgnCreateRect ( 0, 0, WIDTH, HEIGHT );
+  listReq= listRgnCreateRect( 0, 0, WIDTH, HEIGHT );
+  sraCopy = sraRgnCreate();
+  listCopy= listRgnCreate();
+
+  for( c= 0; c < CLIENTS; c++ )
+  { sraMod [ c ]= sraRgnCreate();
+    listMod[ c ]= listRgnCreate();
+  }
+
+  for( i= 0; i < frames && ok; i++ )
+  { sraDamage ( sraMod,  f + i );
+    listDamage( listMod, f + i );
+
+    sraUpdate ( sraMod [ 0 ], sraCopy,  sraReq,  &sraSent );
+    listUpdate( listMod[ 0 ], listCopy, listReq, &listSent );
+
+    if ( !sameUpdate( sraSent, listSent ))
+    { printf("frame %d differs\n  bands ", i );
+      sraRgnPrint( sraSent );
+      printf("\n  list  ");
+      listRgnPrint( listSent );
+      printf("\n");
+      ok= FALSE;
+    }
+
+    sraRgnDestroy( sraSent );
+    listRgnDestroy( listSent );
+  }
+
+  for( c= 0; c < CLIENTS; c++ )
+  { sraRgnDestroy ( sraMod [ c ] );
+    listRgnDestroy( listMod[ c ] );
+  }
+
+  sraRgnDestroy ( sraReq );  sraRgnDestroy ( sraCopy );
+  listRgnDestroy( listReq ); listRgnDestroy( listCopy );
+  return( ok );
+}
+
+#define DEFINE_RUN( P, RGN )                                                 \
+static double P##Run( const Frame * f, int frames, unsigned long * rects )   \
+{ RGN * mod[ CLIENTS ], * copy, * req;                                       \
+  double start= now();                                                       \
+  int i, c;                                                                  \
+                                                                             \
+  req = P##RgnCreateRect( 0, 0, WIDTH, HEIGHT );                             \
+  copy= P##RgnCreate();                                                      \
+  for( c= 0; c < CLIENTS; c++ )                                              \
+  { mod[ c ]= P##RgnCreate();                                                \
+  }                                                                          \
+                                                                             \
+  *rects= 0;                                                                 \
+  for( i= 0; i < frames; i++ )                                               \
+  { P##Damage( mod, f + i );                                                 \
+    for( c= 0; c < CLIENTS; c++ )                                            \
+    { *rects += P##Update( mod[ c ], copy, req, NULL );                      \
+  } }                                                                        \
+                                                                             \
+  for( c= 0; c < CLIENTS; c++ )                                              \
+  { P##RgnDestroy( mod[ c ] );                                               \
+  }                                                                          \
+  P##RgnDestroy( req );                                                      \
+  P##RgnDestroy( copy );                                                     \
+  return( now() - start );                                                   \
+}
+
+DEFINE_RUN( sra,  sraRegion  )
+DEFINE_RUN( list, listRegion )
+
+int main( int argc, char ** argv )
+{ int frames= argc > 1 ? atoi( argv[ 1 ] ) : 2000;
+  int t, fails= 0;
+
+  printf("%-8s %12s %12s %8s\n", "trace", "list (ms)", "bands (ms)", "speedup" );
+
+  for( t= 0; t < (int)( sizeof( traces ) / sizeof( *traces )); t++ )
+  { Frame * f= makeFrames( traces + t, frames );
+    unsigned long sraRects, listRects;
+    double sraTime, listTime;
+
+    if ( !checkTrace( f, frames ))
+    { printf("%-8s MISMATCH\n", traces[ t ].name );
+      fails++;
+      free( f );
+      continue;
+    }
+
+    listTime= listRun( f, frames, &listRects );
+    sraTime = sraRun ( f, frames, &sraRects );
+
+    printf("%-8s %12.2f %12.2f %7.2fx   (%lu / %lu rects)\n"
+          , traces[ t ].name
+          , listTime * 1e3, sraTime * 1e3, listTime / sraTime
+          , listRects, sraRects );
+    free( f );
+  }
+
+  return( fails ? 1 : 0 );
+}
@@ -0,0 +1,817 @@
+/* -=- regionlist.c
+   The linked list region engine libvncserver used before the band arrays
+   in libvncserver/rfbregion.c, with the names changed from sra* to list*.
+   It is only kept so regionbench can compare both.
+
+   Copyright (c) 2001 James "Wez" Weatherall, Johannes E. Schindelin
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <rfb/rfbproto.h>
+#include <rfb/rfbregion.h>
+
+typedef struct listRegion listRegion;
+
+typedef struct listIterator
+{ rfbBool reverseX,reverseY;
+  int ptrSize,ptrPos;
+  struct listSpan** sPtrs;
+} listIterator;
+
+/* -=- Internal Span structure */
+
+struct listRegion;
+
+typedef struct listSpan
+{ struct listSpan *_next;
+  struct listSpan *_prev;
+  int start;
+  int end;
+  struct listRegion *subspan;
+} listSpan;
+
+typedef struct listRegion
+{ listSpan front;
+  listSpan back;
+} listSpanList;
+
+/* -=- Span routines */
+
+listSpanList *listSpanListDup(const listSpanList *src);
+void listSpanListDestroy(listSpanList *list);
+
+static listSpan *
+listSpanCreate(int start, int end, const listSpanList *subspan)
+{ listSpan *item = (listSpan*)malloc(sizeof(listSpan));
+  item->_next = item->_prev = NULL;
+  item->start = start;
+  item->end = end;
+  item->subspan = listSpanListDup(subspan);
+  return item;
+}
+
+static listSpan *
+listSpanDup(const listSpan *src)
+{ listSpan *span;
+  if (!src) return NULL;
+  span = listSpanCreate(src->start, src->end, src->subspan);
+  return span;
+}
+
+static void listSpanInsertAfter(listSpan *newspan, listSpan *after)
+{ newspan->_next = after->_next;
+  newspan->_prev = after;
+  after->_next->_prev = newspan;
+  after->_next = newspan;
+}
+
+static void listSpanInsertBefore(listSpan *newspan, listSpan *before)
+{ newspan->_next = before;
+  newspan->_prev = before->_prev;
+  before->_prev->_next = newspan;
+  before->_prev = newspan;
+}
+
+static void listSpanRemove(listSpan *span)
+{ span->_prev->_next = span->_next;
+  span->_next->_prev = span->_prev;
+}
+
+static void listSpanDestroy(listSpan *span)
+{ if ( span )
+  { if ( span->subspan )
+    { listSpanListDestroy(span->subspan);
+    }
+    FREE( span );
+  }
+}
+
+#ifdef DEBUG
+static void
+listSpanCheck(const listSpan *span, const char *text)
+{ /* Check the span is valid! */
+  if (span->start == span->end)
+  { printf(text);
+    printf(":%d-%d\n", span->start, span->end);
+  }
+}
+#endif
+
+/* -=- SpanList routines */
+
+static void listSpanPrint(const listSpan *s);
+
+static void
+listSpanListPrint(const listSpanList *l)
+{ listSpan *curr;
+  if (!l)
+  { printf("NULL");
+    return;
+  }
+  curr = l->front._next;
+  printf("[");
+  while (curr != &(l->back))
+  { listSpanPrint(curr);
+    curr = curr->_next;
+  }
+  printf("]");
+}
+
+void
+listSpanPrint(const listSpan *s)
+{ printf("(%d-%d)", (s->start), (s->end));
+  if (s->subspan)
+    listSpanListPrint(s->subspan);
+}
+
+static listSpanList *
+listSpanListCreate(void)
+{ listSpanList *item = (listSpanList*)malloc(sizeof(listSpanList));
+  item->front._next = &(item->back);
+  item->front._prev = NULL;
+  item->back._prev = &(item->front);
+  item->back._next = NULL;
+  return item;
+}
+
+listSpanList *
+listSpanListDup(const listSpanList *src)
+{ listSpanList *newlist;
+  listSpan *newspan, *curr;
+
+  if (!src) return NULL;
+  newlist = listSpanListCreate();
+  curr = src->front._next;
+  while (curr != &(src->back))
+  { newspan = listSpanDup(curr);
+    listSpanInsertBefore(newspan, &(newlist->back));
+    curr = curr->_next;
+  }
+
+  return newlist;
+}
+
+void listSpanListDestroy(listSpanList *list)
+{ listSpan *curr, *next;
+
+  while (list->front._next != &(list->back))
+  { curr = list->front._next;
+    next = curr->_next;
+    listSpanRemove(curr);
+    listSpanDestroy(curr);
+    curr = next;
+  }
+
+  FREE( list );
+}
+
+static void
+listSpanListMakeEmpty(listSpanList *list)
+{ listSpan *curr, *next;
+  while (list->front._next != &(list->back))
+  { curr = list->front._next;
+    next = curr->_next;
+    listSpanRemove(curr);
+    listSpanDestroy(curr);
+    curr = next;
+  }
+  list->front._next = &(list->back);
+  list->front._prev = NULL;
+  list->back._prev = &(list->front);
+  list->back._next = NULL;
+}
+
+static rfbBool
+listSpanListEqual(const listSpanList *s1, const listSpanList *s2)
+{ listSpan *sp1, *sp2;
+
+  if (!s1)
+  { if (!s2)
+    { return 1;
+    }
+    else
+    { rfbErr("listSpanListEqual:incompatible spans (only one NULL!)\n");
+      return FALSE;
+    }
+  }
+
+  sp1 = s1->front._next;
+  sp2 = s2->front._next;
+  while ((sp1 != &(s1->back)) &&
+         (sp2 != &(s2->back)))
+  { if ((sp1->start != sp2->start) ||
+        (sp1->end != sp2->end) ||
+        (!listSpanListEqual(sp1->subspan, sp2->subspan)))
+    { return 0;
+    }
+    sp1 = sp1->_next;
+    sp2 = sp2->_next;
+  }
+
+  if ((sp1 == &(s1->back)) && (sp2 == &(s2->back)))
+  { return 1;
+  }
+  else
+  { return 0;
+  }
+}
+
+static rfbBool
+listSpanListEmpty(const listSpanList *list)
+{ return (list->front._next == &(list->back));
+}
+
+static rfbDword
+listSpanListCount(const listSpanList *list)
+{ listSpan *curr = list->front._next;
+
+  rfbDword count = 0;
+  while (curr != &(list->back))
+  { if (curr->subspan)
+    { count += listSpanListCount(curr->subspan);
+    }
+    else
+    { count += 1;
+    }
+    curr = curr->_next;
+  }
+  return count;
+}
+
+static void
+listSpanMergePrevious(listSpan *dest)
+{ listSpan *prev = dest->_prev;
+
+  while ((prev->_prev) &&
+         (prev->end == dest->start) &&
+         (listSpanListEqual(prev->subspan, dest->subspan)))
+  { /*
+      printf("merge_prev:");
+      listSpanPrint(prev);
+      printf(" & ");
+      listSpanPrint(dest);
+      printf("\n");
+    */
+    dest->start = prev->start;
+    listSpanRemove(prev);
+    listSpanDestroy(prev);
+    prev = dest->_prev;
+  }
+}
+
+static void
+listSpanMergeNext(listSpan *dest)
+{ listSpan *next = dest->_next;
+  while ((next->_next) &&
+         (next->start == dest->end) &&
+         (listSpanListEqual(next->subspan, dest->subspan)))
+  { /*
+        printf("merge_next:");
+        listSpanPrint(dest);
+        printf(" & ");
+        listSpanPrint(next);
+        printf("\n");
+    */
+    dest->end = next->end;
+    listSpanRemove(next);
+    listSpanDestroy(next);
+    next = dest->_next;
+  }
+}
+
+static void
+listSpanListOr(listSpanList *dest, const listSpanList *src)
+{ listSpan *d_curr, *s_curr;
+  int s_start, s_end;
+
+  if (!dest)
+  { if (!src)
+    { return;
+    }
+    else
+    { rfbErr("listSpanListOr:incompatible spans (only one NULL!)\n");
+      return;
+    }
+  }
+
+  d_curr = dest->front._next;
+  s_curr = src->front._next;
+  s_start = s_curr->start;
+  s_end = s_curr->end;
+  while (s_curr != &(src->back))
+  {
+
+    /* - If we are at end of destination list OR
+       If the new span comes before the next destination one */
+    if ((d_curr == &(dest->back)) ||
+        (d_curr->start >= s_end))
+    { /* - Add the span */
+      listSpanInsertBefore(listSpanCreate(s_start, s_end,
+                                        s_curr->subspan),
+                          d_curr);
+      if (d_curr != &(dest->back))
+        listSpanMergePrevious(d_curr);
+      s_curr = s_curr->_next;
+      s_start = s_curr->start;
+      s_end = s_curr->end;
+    }
+    else
+    {
+
+      /* - If the new span overlaps the existing one */
+      if ((s_start < d_curr->end) &&
+          (s_end > d_curr->start))
+      {
+
+        /* - Insert new span before the existing destination one? */
+        if (s_start < d_curr->start)
+        { listSpanInsertBefore(listSpanCreate(s_start,
+                                            d_curr->start,
+                                            s_curr->subspan),
+                              d_curr);
+          listSpanMergePrevious(d_curr);
+        }
+
+        /* Split the existing span if necessary */
+        if (s_end < d_curr->end)
+        { listSpanInsertAfter(listSpanCreate(s_end,
+                                           d_curr->end,
+                                           d_curr->subspan),
+                             d_curr);
+          d_curr->end = s_end;
+        }
+        if (s_start > d_curr->start)
+        { listSpanInsertBefore(listSpanCreate(d_curr->start,
+                                            s_start,
+                                            d_curr->subspan),
+                              d_curr);
+          d_curr->start = s_start;
+        }
+
+        /* Recursively OR subspans */
+        listSpanListOr(d_curr->subspan, s_curr->subspan);
+
+        /* Merge this span with previous or next? */
+        if (d_curr->_prev != &(dest->front))
+          listSpanMergePrevious(d_curr);
+        if (d_curr->_next != &(dest->back))
+          listSpanMergeNext(d_curr);
+
+        /* Move onto the next pair to compare */
+        if (s_end > d_curr->end)
+        { s_start = d_curr->end;
+          d_curr = d_curr->_next;
+        }
+        else
+        { s_curr = s_curr->_next;
+          s_start = s_curr->start;
+          s_end = s_curr->end;
+        }
+      }
+      else
+      { /* - No overlap.  Move to the next destination span */
+        d_curr = d_curr->_next;
+      }
+    }
+  }
+}
+
+static rfbBool
+listSpanListAnd(listSpanList *dest, const listSpanList *src)
+{ listSpan *d_curr, *s_curr, *d_next;
+
+  if (!dest)
+  { if (!src)
+    { return 1;
+    }
+    else
+    { rfbErr("listSpanListAnd:incompatible spans (only one NULL!)\n");
+      return FALSE;
+    }
+  }
+
+  d_curr = dest->front._next;
+  s_curr = src->front._next;
+  while ((s_curr != &(src->back)) && (d_curr != &(dest->back)))
+  {
+
+    /* - If we haven't reached a destination span yet then move on */
+    if (d_curr->start >= s_curr->end)
+    { s_curr = s_curr->_next;
+      continue;
+    }
+
+    /* - If we are beyond the current destination span then remove it */
+    if (d_curr->end <= s_curr->start)
+    { listSpan *next = d_curr->_next;
+      listSpanRemove(d_curr);
+      listSpanDestroy(d_curr);
+      d_curr = next;
+      continue;
+    }
+
+    /* - If we partially overlap a span then split it up or remove bits */
+    if (s_curr->start > d_curr->start)
+    { /* - The top bit of the span does not match */
+      d_curr->start = s_curr->start;
+    }
+    if (s_curr->end < d_curr->end)
+    { /* - The end of the span does not match */
+      listSpanInsertAfter(listSpanCreate(s_curr->end,
+                                       d_curr->end,
+                                       d_curr->subspan),
+                         d_curr);
+      d_curr->end = s_curr->end;
+    }
+
+    /* - Now recursively process the affected span */
+    if (!listSpanListAnd(d_curr->subspan, s_curr->subspan))
+    { /* - The destination subspan is now empty, so we should remove it */
+      listSpan *next = d_curr->_next;
+      listSpanRemove(d_curr);
+      listSpanDestroy(d_curr);
+      d_curr = next;
+    }
+    else
+    { /* Merge this span with previous or next? */
+      if (d_curr->_prev != &(dest->front))
+        listSpanMergePrevious(d_curr);
+
+      /* - Move on to the next span */
+      d_next = d_curr;
+      if (s_curr->end >= d_curr->end)
+      { d_next = d_curr->_next;
+      }
+      if (s_curr->end <= d_curr->end)
+      { s_curr = s_curr->_next;
+      }
+      d_curr = d_next;
+    }
+  }
+
+  while (d_curr != &(dest->back))
+  { listSpan *next = d_curr->_next;
+    listSpanRemove(d_curr);
+    listSpanDestroy(d_curr);
+    d_curr=next;
+  }
+
+  return !listSpanListEmpty(dest);
+}
+
+static rfbBool
+listSpanListSubtract(listSpanList *dest, const listSpanList *src)
+{ listSpan *d_curr, *s_curr;
+
+  if (!dest)
+  { if (!src)
+    { return 1;
+    }
+    else
+    { rfbErr("listSpanListSubtract:incompatible spans (only one NULL!)\n");
+      return FALSE;
+    }
+  }
+
+  d_curr = dest->front._next;
+  s_curr = src->front._next;
+  while ((s_curr != &(src->back)) && (d_curr != &(dest->back)))
+  {
+
+    /* - If we haven't reached a destination span yet then move on */
+    if (d_curr->start >= s_curr->end)
+    { s_curr = s_curr->_next;
+      continue;
+    }
+
+    /* - If we are beyond the current destination span then skip it */
+    if (d_curr->end <= s_curr->start)
+    { d_curr = d_curr->_next;
+      continue;
+    }
+
+    /* - If we partially overlap the current span then split it up */
+    if (s_curr->start > d_curr->start)
+    { listSpanInsertBefore(listSpanCreate(d_curr->start,
+                                        s_curr->start,
+                                        d_curr->subspan),
+                          d_curr);
+      d_curr->start = s_curr->start;
+    }
+    if (s_curr->end < d_curr->end)
+    { listSpanInsertAfter(listSpanCreate(s_curr->end,
+                                       d_curr->end,
+                                       d_curr->subspan),
+                         d_curr);
+      d_curr->end = s_curr->end;
+    }
+
+    /* - Now recursively process the affected span */
+    if ((!d_curr->subspan) || !listSpanListSubtract(d_curr->subspan, s_curr->subspan))
+    { /* - The destination subspan is now empty, so we should remove it */
+      listSpan *next = d_curr->_next;
+      listSpanRemove(d_curr);
+      listSpanDestroy(d_curr);
+      d_curr = next;
+    }
+    else
+    { /* Merge this span with previous or next? */
+      if (d_curr->_prev != &(dest->front))
+        listSpanMergePrevious(d_curr);
+      if (d_curr->_next != &(dest->back))
+        listSpanMergeNext(d_curr);
+
+      /* - Move on to the next span */
+      if (s_curr->end > d_curr->end)
+      { d_curr = d_curr->_next;
+      }
+      else
+      { s_curr = s_curr->_next;
+      }
+    }
+  }
+
+  return !listSpanListEmpty(dest);
+}
+
+/* -=- Region routines */
+
+listRegion *
+listRgnCreate(void)
+{ return (listRegion*)listSpanListCreate();
+}
+
+listRegion *
+listRgnCreateRect(int x1, int y1, int x2, int y2)
+{ listSpanList *vlist, *hlist;
+  listSpan *vspan, *hspan;
+
+  /* - Build the horizontal portion of the span */
+  hlist = listSpanListCreate();
+  hspan = listSpanCreate(x1, x2, NULL);
+  listSpanInsertAfter(hspan, &(hlist->front));
+
+  /* - Build the vertical portion of the span */
+  vlist = listSpanListCreate();
+  vspan = listSpanCreate(y1, y2, hlist);
+  listSpanInsertAfter(vspan, &(vlist->front));
+
+  listSpanListDestroy(hlist);
+
+  return (listRegion*)vlist;
+}
+
+listRegion *
+listRgnCreateRgn(const listRegion *src)
+{ return (listRegion*)listSpanListDup((listSpanList*)src);
+}
+
+void
+listRgnDestroy(listRegion *rgn)
+{ listSpanListDestroy((listSpanList*)rgn);
+}
+
+void
+listRgnMakeEmpty(listRegion *rgn)
+{ listSpanListMakeEmpty((listSpanList*)rgn);
+}
+
+/* -=- Boolean Region ops */
+
+rfbBool
+listRgnAnd(listRegion *dst, const listRegion *src)
+{ return listSpanListAnd((listSpanList*)dst, (listSpanList*)src);
+}
+
+void
+listRgnOr(listRegion *dst, const listRegion *src)
+{ listSpanListOr((listSpanList*)dst, (listSpanList*)src);
+}
+
+rfbBool
+listRgnSubtract(listRegion *dst, const listRegion *src)
+{ return listSpanListSubtract((listSpanList*)dst, (listSpanList*)src);
+}
+
+void
+listRgnOffset(listRegion *dst, int dx, int dy)
+{ listSpan *vcurr, *hcurr;
+
+  vcurr = ((listSpanList*)dst)->front._next;
+  while (vcurr != &(((listSpanList*)dst)->back))
+  { vcurr->start += dy;
+    vcurr->end += dy;
+
+    hcurr = vcurr->subspan->front._next;
+    while (hcurr != &(vcurr->subspan->back))
+    { hcurr->start += dx;
+      hcurr->end += dx;
+      hcurr = hcurr->_next;
+    }
+
+    vcurr = vcurr->_next;
+  }
+}
+
+listRegion *listRgnBBox(const listRegion *src)
+{ int xmin=((unsigned int)(int)-1)>>1,ymin=xmin,xmax=1-xmin,ymax=xmax;
+  listSpan *vcurr, *hcurr;
+
+  if(!src)
+    return listRgnCreate();
+
+  vcurr = ((listSpanList*)src)->front._next;
+  while (vcurr != &(((listSpanList*)src)->back))
+  { if(vcurr->start<ymin)
+      ymin=vcurr->start;
+    if(vcurr->end>ymax)
+      ymax=vcurr->end;
+
+    hcurr = vcurr->subspan->front._next;
+    while (hcurr != &(vcurr->subspan->back))
+    { if(hcurr->start<xmin)
+        xmin=hcurr->start;
+      if(hcurr->end>xmax)
+        xmax=hcurr->end;
+      hcurr = hcurr->_next;
+    }
+
+    vcurr = vcurr->_next;
+  }
+
+  if(xmax<xmin || ymax<ymin)
+    return listRgnCreate();
+
+  return listRgnCreateRect(xmin,ymin,xmax,ymax);
+}
+
+rfbBool
+listRgnPopRect( listRegion *rgn
+             , sraRect   *rect
+             , rfbDword flags)
+{ listSpan *vcurr, *hcurr;
+  listSpan *vend, *hend;
+  rfbBool right2left = (flags & 2) == 2;
+  rfbBool bottom2top = (flags & 1) == 1;
+
+  /* - Pick correct order */
+  if (bottom2top)
+  { vcurr = ((listSpanList*)rgn)->back._prev;
+    vend = &(((listSpanList*)rgn)->front);
+  }
+  else
+  { vcurr = ((listSpanList*)rgn)->front._next;
+    vend = &(((listSpanList*)rgn)->back);
+  }
+
+  if (vcurr != vend)
+  { rect->y1 = vcurr->start;
+    rect->y2 = vcurr->end;
+
+    /* - Pick correct order */
+    if (right2left)
+    { hcurr = vcurr->subspan->back._prev;
+      hend = &(vcurr->subspan->front);
+    }
+    else
+    { hcurr = vcurr->subspan->front._next;
+      hend = &(vcurr->subspan->back);
+    }
+
+    if (hcurr != hend)
+    { rect->x1 = hcurr->start;
+      rect->x2 = hcurr->end;
+
+      listSpanRemove(hcurr);
+      listSpanDestroy(hcurr);
+
+      if (listSpanListEmpty(vcurr->subspan))
+      { listSpanRemove(vcurr);
+        listSpanDestroy(vcurr);
+      }
+
+#if 0
+      printf("poprect:(%dx%d)-(%dx%d)\n",
+             rect->x1, rect->y1, rect->x2, rect->y2);
+#endif
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+rfbDword
+listRgnCountRects(const listRegion *rgn)
+{ rfbDword count = listSpanListCount((listSpanList*)rgn);
+  return count;
+}
+
+rfbBool
+listRgnEmpty(const listRegion *rgn)
+{ return listSpanListEmpty((listSpanList*)rgn);
+}
+
+/* iterator stuff */
+listIterator *listRgnGetIterator(listRegion *s)
+{ /* these values have to be multiples of 4 */
+#define DEFSIZE 4
+#define DEFSTEP 8
+  listIterator *i =
+    (listIterator*)malloc(sizeof(listIterator));
+  if(!i)
+    return NULL;
+
+  /* we have to recurse eventually. So, the first sPtr is the pointer to
+     the listSpan in the first level. the second sPtr is the pointer to
+     the listRegion.back. The third and fourth sPtr are for the second
+     recursion level and so on. */
+  i->sPtrs = (listSpan**)malloc(sizeof(listSpan*)*DEFSIZE);
+
+  if( !i->sPtrs )
+  { FREE( i );
+    return NULL;
+  }
+
+  i->ptrSize = DEFSIZE;
+  i->sPtrs[0] = &(s->front);
+  i->sPtrs[1] = &(s->back);
+  i->ptrPos = 0;
+  i->reverseX = 0;
+  i->reverseY = 0;
+  return i;
+}
+
+listIterator *listRgnGetReverseIterator(listRegion *s,rfbBool reverseX,rfbBool reverseY)
+{ listIterator *i = listRgnGetIterator(s);
+  if(reverseY)
+  { i->sPtrs[1] = &(s->front);
+    i->sPtrs[0] = &(s->back);
+  }
+  i->reverseX = reverseX;
+  i->reverseY = reverseY;
+  return(i);
+}
+
+static rfbBool listReverse(listIterator *i)
+{ return( ((i->ptrPos&2) && i->reverseX) ||
+          (!(i->ptrPos&2) && i->reverseY));
+}
+
+static listSpan* listNextSpan(listIterator *i)
+{ if(listReverse(i))
+    return(i->sPtrs[i->ptrPos]->_prev);
+  else
+    return(i->sPtrs[i->ptrPos]->_next);
+}
+
+rfbBool listRgnIteratorNext(listIterator* i,sraRect* r)
+{ /* is the subspan finished? */
+  while(listNextSpan(i) == i->sPtrs[i->ptrPos+1])
+  { i->ptrPos -= 2;
+    if(i->ptrPos < 0) /* the end */
+      return(0);
+  }
+
+  i->sPtrs[i->ptrPos] = listNextSpan(i);
+
+  /* is this a new subspan? */
+  while(i->sPtrs[i->ptrPos]->subspan)
+  { if(i->ptrPos+2 > i->ptrSize)   /* array is too small */
+    { i->ptrSize += DEFSTEP;
+      i->sPtrs = (listSpan**)realloc(i->sPtrs, sizeof(listSpan*)*i->ptrSize);
+    }
+    i->ptrPos += 2;
+    if(listReverse(i))
+    { i->sPtrs[i->ptrPos]   =   i->sPtrs[i->ptrPos-2]->subspan->back._prev;
+      i->sPtrs[i->ptrPos+1] = &(i->sPtrs[i->ptrPos-2]->subspan->front);
+    }
+    else
+    { i->sPtrs[i->ptrPos]   =   i->sPtrs[i->ptrPos-2]->subspan->front._next;
+      i->sPtrs[i->ptrPos+1] = &(i->sPtrs[i->ptrPos-2]->subspan->back);
+  } }
+
+  if((i->ptrPos%4)!=2)
+  { rfbErr("listRgnIteratorNext: offset is wrong (%d%%4!=2)\n",i->ptrPos);
+    return FALSE;
+  }
+
+  r->y1 = i->sPtrs[i->ptrPos-2]->start;
+  r->y2 = i->sPtrs[i->ptrPos-2]->end;
+  r->x1 = i->sPtrs[i->ptrPos]->start;
+  r->x2 = i->sPtrs[i->ptrPos]->end;
+
+  return(-1);
+}
+
+void listRgnReleaseIterator(listIterator* i)
+{ if ( i )
+  { FREE( i->sPtrs );
+    FREE( i        );
+} }
+
+void
+listRgnPrint(const listRegion *rgn)
+{ listSpanListPrint((listSpanList*)rgn);
+}
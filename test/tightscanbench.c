@@ -0,0 +1,323 @@
+/*
+ * tightscanbench.c
+ *
+ * Times the pixel scans of the Tight encoder, libvncserver/tightscantemplate.c,
+ * in each of its builds on a synthetic office screen: the solid tile checks
+ * of the 16x16 split search, the run walk of the palette fill and the two
+ * colour scan of text. Every build must give the same answers as plain
+ * per pixel loops, that is checked before timing.
+ *
+ *   tightscanbench [passes]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <rfb/rfbproto.h>
+
+#define CONCAT2(a,b) a##b
+#define CONCAT2E(a,b) CONCAT2(a,b)
+#define CONCAT3(a,b,c) a##b##c
+#define CONCAT3E(a,b,c) CONCAT3(a,b,c)
+
+#if defined(__GNUC__) && !defined(__clang__)
+#define SCAN_VECTORIZE __attribute__(( optimize( "tree-vectorize"              \
+                                               , "vect-cost-model=dynamic" )))
+#define SCAN_SCALAR    __attribute__(( optimize( "no-tree-vectorize" )))
+#else
+#define SCAN_VECTORIZE
+#define SCAN_SCALAR
+#endif
+
+#define BPP 32
+
+#define SCAN_SUFFIX Scalar
+#define SCAN_TARGET SCAN_SCALAR
+#include "tightscantemplate.c"
+#undef SCAN_SUFFIX
+#undef SCAN_TARGET
+
+#define SCAN_SUFFIX Vec
+#define SCAN_TARGET SCAN_VECTORIZE
+#include "tightscantemplate.c"
+#undef SCAN_SUFFIX
+#undef SCAN_TARGET
+
+#if defined(__GNUC__) && ( defined(__x86_64__) || defined(__i386__) )
+#define SCAN_AVX2
+#define SCAN_SUFFIX Avx2
+#define SCAN_TARGET SCAN_VECTORIZE __attribute__(( target( "avx2" )))
+#include "tightscantemplate.c"
+#undef SCAN_SUFFIX
+#undef SCAN_TARGET
+#endif
+
+#define WIDTH  1920
+#define HEIGHT 1080
+#define TILE   16
+#define BAND   32
+
+typedef struct
+{ const char * name;
+  int (*run )( const uint32_t *, int, uint32_t, uint32_t );
+  int (*back)( const uint32_t *, int, uint32_t, uint32_t );
+  int (*two )( const uint32_t *, int, uint32_t, uint32_t, uint32_t, int * );
+  int (*rows)( const uint32_t *, int, int, int, uint32_t, uint32_t );
+  int  (*usable)( void );
+} Scan;
+
+typedef struct
+{ unsigned long solid, runs, two, n0;
+} Result;
+
+static uint32_t * fb;
+
+static unsigned seed= 1;
+
+static int rnd( int n )
+{ seed= seed * 1103515245 + 12345;
+  return( (int)(( seed >> 8 ) % n ));
+}
+
+static double now( void )
+{ struct timespec ts;
+
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return( ts.tv_sec + ts.tv_nsec / 1e9 );
+}
+
+static void fill( int x, int y, int w, int h, uint32_t c )
+{ int i, j;
+
+  for( j= y; j < y + h && j < HEIGHT; j++ )
+  { for( i= x; i < x + w && i < WIDTH; i++ )
+    { fb[ j * WIDTH + i ]= c;
+} } }
+
+/* Windows, title bars, lines of text and a small photo */
+static void makeScreen( void )
+{ int i, j, l;
+
+  fill( 0, 0, WIDTH, HEIGHT, 0xFF3A6EA5 );
+  fill( 0, HEIGHT - 40, WIDTH, 40, 0xFF202020 );
+
+  for( i= 0; i < 4; i++ )
+  { int x= 60 + i * 420, y= 40 + i * 90;
+
+    fill( x, y, 900, 700, 0xFFFFFFFF );
+    fill( x, y, 900, 28, 0xFF2B579A );
+
+    for( l= 0; l < 40; l++ )                /* Glyphs, black on white */
+    { for( j= 0; j < 110; j++ )
+      { if ( rnd( 5 ))
+        { fill( x + 20 + j * 7 + rnd( 3 ), y + 50 + l * 16 + rnd( 4 )
+              , 1 + rnd( 4 ), 2 + rnd( 9 ), 0xFF000000 );
+  } } } }
+
+  for( j= 600; j < 720; j++ )              /* A picture in a document */
+  { for( i= 1300; i < 1460; i++ )
+    { fb[ j * WIDTH + i ]= 0xFF000000 | (uint32_t)rnd( 1 << 24 );
+} } }
+
+static int refRun( const uint32_t * p, int n, uint32_t c )
+{ int i;
+
+  for( i= 0; i < n && p[ i ] == c; i++ );
+  return( i );
+}
+
+static int refBack( const uint32_t * end, int n, uint32_t c )
+{ int i;
+
+  for( i= 0; i < n && end[ -1 - i ] == c; i++ );
+  return( i );
+}
+
+static int refTwo( const uint32_t * p, int n, uint32_t c0, uint32_t c1, int * n0 )
+{ int i;
+
+  for( i= 0; i < n && ( p[ i ] == c0 || p[ i ] == c1 ); i++ )
+  { *n0 += p[ i ] == c0;
+  }
+  return( i );
+}
+
+static int refRows( const uint32_t * p, int w, int h, int pitch, uint32_t c )
+{ int i, j;
+
+  for( j= 0; j < h; j++, p += pitch )
+  { i= refRun( p, w, c );
+    if ( i < w )
+    { break;
+  } }
+  return( j );
+}
+
+static int refRunMask( const uint32_t * p, int n, uint32_t c, uint32_t m )
+{ return( refRun( p, n, c ));
+}
+
+static int refBackMask( const uint32_t * end, int n, uint32_t c, uint32_t m )
+{ return( refBack( end, n, c ));
+}
+
+static int refTwoMask( const uint32_t * p, int n, uint32_t c0, uint32_t c1
+                     , uint32_t m, int * n0 )
+{ return( refTwo( p, n, c0, c1, n0 ));
+}
+
+static int refRowsMask( const uint32_t * p, int w, int h, int pitch
+                      , uint32_t c, uint32_t m )
+{ return( refRows( p, w, h, pitch, c ));
+}
+
+static int always( void )
+{ return( 1 );
+}
+
+#ifdef SCAN_AVX2
+static int haveAvx2( void )
+{ __builtin_cpu_init();
+  return( __builtin_cpu_supports( "avx2" ));
+}
+#endif
+
+static const Scan scans[]=
+{{ "loop",   refRunMask,       refBackMask,          refTwoMask
+           , refRowsMask,       always   }
+,{ "scalar", TightRun32Scalar, TightRunBack32Scalar, TightTwo32Scalar
+           , TightRows32Scalar, always   }
+,{ "vector", TightRun32Vec,    TightRunBack32Vec,    TightTwo32Vec
+           , TightRows32Vec,    always   }
+#ifdef SCAN_AVX2
+,{ "avx2",   TightRun32Avx2,   TightRunBack32Avx2,   TightTwo32Avx2
+           , TightRows32Avx2,   haveAvx2 }
+#endif
+};
+
+/* Solid checks as the split search makes them, tile by tile and row by row */
+static unsigned long benchSolid( const Scan * s )
+{ unsigned long solid= 0;
+  int x, y;
+
+  for( y= 0; y + TILE <= HEIGHT; y += TILE )
+  { for( x= 0; x + TILE <= WIDTH; x += TILE )
+    { const uint32_t * p= fb + y * WIDTH + x;
+
+      solid += s->rows( p, TILE, TILE, WIDTH, *p, ~0U ) == TILE;
+  } }
+
+  return( solid );
+}
+
+/* The run walk of the palette fill over bands of whole rows, which are
+   contiguous as in tightBeforeBuf. As there, runs of one pixel are told
+   apart before calling the scan. */
+static unsigned long benchRuns( const Scan * s )
+{ unsigned long runs= 0;
+  int y, i, n= WIDTH * BAND;
+
+  for( y= 0; y + BAND <= HEIGHT; y += BAND )
+  { const uint32_t * p= fb + y * WIDTH;
+
+    for( i= 0; i < n; runs++ )
+    { if ( ++i < n && p[ i ] == p[ i - 1 ] )
+      { i += s->run( p + i, n - i, p[ i - 1 ], ~0U );
+  } } }
+
+  return( runs );
+}
+
+/* Two colour scan of whole rows, as for text rects */
+static unsigned long benchTwo( const Scan * s, unsigned long * n0 )
+{ unsigned long covered= 0;
+  int y, count= 0;
+
+  for( y= 0; y < HEIGHT; y++ )
+  { const uint32_t * p= fb + y * WIDTH;
+
+    covered += s->two( p, WIDTH, 0xFFFFFFFF, 0xFF000000, ~0U, &count );
+    covered += s->two( p, WIDTH, 0xFF3A6EA5, 0xFF000000, ~0U, &count );
+  }
+
+  *n0= count;
+  return( covered );
+}
+
+static void runScan( const Scan * s, Result * r )
+{ r->solid= benchSolid( s );
+  r->runs = benchRuns ( s );
+  r->two  = benchTwo  ( s, &r->n0 );
+}
+
+/* Random runs checked against the loops, edges of the blocks included */
+static int checkScan( const Scan * s )
+{ uint32_t row[ 300 ];
+  int t, i, n0a, n0b;
+
+  for( t= 0; t < 20000; t++ )
+  { int n= rnd( 300 ), cut= rnd( 300 );
+    uint32_t c0= rnd( 3 ), c1= 1 + rnd( 3 );
+
+    for( i= 0; i < 300; i++ )
+    { row[ i ]= i < cut ? ( rnd( 4 ) ? c0 : c1 ) : (uint32_t)rnd( 8 );
+    }
+
+    n0a= n0b= 0;
+    if ( s->run( row, n, c0, ~0U ) != refRun( row, n, c0 )
+      || s->back( row + 300, n, row[ 299 ], ~0U ) != refBack( row + 300, n, row[ 299 ] )
+      || s->two( row, n, c0, c1, ~0U, &n0a ) != refTwo( row, n, c0, c1, &n0b )
+      || s->rows( row + 150, 10, 15, -10, c0, ~0U ) != refRows( row + 150, 10, 15, -10, c0 )
+      || n0a != n0b )
+    { return( 0 );
+  } }
+
+  return( 1 );
+}
+
+int main( int argc, char ** argv )
+{ int passes= argc > 1 ? atoi( argv[ 1 ] ) : 20;
+  int n= (int)( sizeof( scans ) / sizeof( *scans ));
+  double base= 0;
+  Result ref;
+  int s, p, fails= 0;
+
+  fb= (uint32_t *)malloc( WIDTH * HEIGHT * 4 );
+  makeScreen();
+  runScan( scans, &ref );
+
+  printf("%-8s %12s %8s\n", "scan", "pass (ms)", "speedup" );
+
+  for( s= 0; s < n; s++ )
+  { Result r;
+    double t;
+
+    if ( !scans[ s ].usable())
+    { continue;
+    }
+
+    runScan( scans + s, &r );
+    if ( memcmp( &r, &ref, sizeof( r )) || !checkScan( scans + s ))
+    { printf("%-8s MISMATCH\n", scans[ s ].name );
+      fails++;
+      continue;
+    }
+
+    t= now();
+    for( p= 0; p < passes; p++ )
+    { runScan( scans + s, &r );
+    }
+    t= ( now() - t ) / passes;
+
+    if ( !s )
+    { base= t;
+    }
+
+    printf("%-8s %12.3f %7.2fx   (%lu solid tiles, %lu runs)\n"
+          , scans[ s ].name, t * 1e3, base / t, r.solid, r.runs );
+  }
+
+  free( fb );
+  return( fails ? 1 : 0 );
+}
@@ -0,0 +1,159 @@
+/*
+ * zywrletest.c
+ *
+ * Checks the ZYWRLE forward transform of libvncserver/zywrlescantemplate.c,
+ * in each of its builds, against Wavelet() of common/zywrletemplate.c:
+ * every pair of bytes through ZYWRLE_HARR, then random coefficient blocks
+ * at every level. Only the Y, U and V bytes have to match, the fourth one
+ * is left as it comes.
+ *
+ *   zywrletest [trials]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <rfb/rfbproto.h>
+#include "scanbuild.h"
+
+#define __RFB_CONCAT2(a,b) a##b
+#define __RFB_CONCAT2E(a,b) __RFB_CONCAT2(a,b)
+#define __RFB_CONCAT3(a,b,c) a##b##c
+#define __RFB_CONCAT3E(a,b,c) __RFB_CONCAT3(a,b,c)
+
+#define ENDIAN_LITTLE 0
+#define ZYWRLE_ENDIAN ENDIAN_LITTLE
+#define END_FIX LE
+#define BPP 32
+#define PIXEL_T uint32_t
+#define ZYWRLE_ENCODE
+#include "zywrletemplate.c"
+
+#define SCAN_SUFFIX Scalar
+#define SCAN_TARGET SCAN_SCALAR
+#include "zywrlescantemplate.c"
+#undef SCAN_SUFFIX
+#undef SCAN_TARGET
+
+#define SCAN_SUFFIX Vec
+#define SCAN_TARGET SCAN_VECTORIZE
+#include "zywrlescantemplate.c"
+#undef SCAN_SUFFIX
+#undef SCAN_TARGET
+
+#ifdef SCAN_AVX2
+#define SCAN_SUFFIX Avx2
+#define SCAN_TARGET SCAN_AVX2_TARGET
+#include "zywrlescantemplate.c"
+#undef SCAN_SUFFIX
+#undef SCAN_TARGET
+#endif
+
+#define MAXSIDE 64
+
+typedef struct
+{ const char * name;
+  void (*wavelet)( int *, int, int, int, const signed char *(*)[ 3 ] );
+  rfbScanBuild build;
+} Build;
+
+static const Build builds[]=
+{ { "scalar", ZywrleWaveletScalar, rfbScanScalar }
+, { "vec",    ZywrleWaveletVec,    rfbScanVec    }
+#ifdef SCAN_AVX2
+, { "avx2",   ZywrleWaveletAvx2,   rfbScanAvx2   }
+#endif
+};
+
+static int in [ MAXSIDE * MAXSIDE ];
+static int ref[ MAXSIDE * MAXSIDE ];
+static int got[ MAXSIDE * MAXSIDE ];
+
+static unsigned seed= 1;
+
+static int rnd( int n )
+{ seed= seed * 1103515245 + 12345;
+  return( (int)(( seed >> 8 ) % n ));
+}
+
+/**
+ *  Random coefficients, now and then few enough values to give runs
+ */
+static void fill( int n, int t )
+{ int i;
+
+  for( i= 0; i < n; i++ )
+  { in[ i ]= t % 5 ? rnd( 1 << 24 )
+                   : ( rnd( 1 << 24 ) & 0x0F0F0F ) * ( 1 + t % 3 );
+} }
+
+/**
+ *  Every byte pair through ZYWRLE_HARR and Harr()
+ */
+static int checkHarr( void )
+{ int a, b, fails= 0;
+
+  for( a= 0; a < 256; a++ )
+  { for( b= 0; b < 256; b++ )
+    { signed char r0= (signed char)a, r1= (signed char)b;
+      signed char g0= (signed char)a, g1= (signed char)b;
+
+      Harr( &r0, &r1 );
+      ZYWRLE_HARR( g0, g1 );
+
+      if ( r0 != g0 || r1 != g1 )
+      { printf("harr     %d %d MISMATCH\n", a, b );
+        fails++;
+  } } }
+
+  return( fails );
+}
+
+int main( int argc, char ** argv )
+{ int trials= argc > 1 ? atoi( argv[ 1 ] ) : 3000;
+  int n= (int)( sizeof( builds ) / sizeof( *builds ));
+  int fails= checkHarr();
+  int t, s, i;
+
+  for( s= 0; s < n; s++ )
+  { int runs= 0, bad= 0;
+
+    if ( builds[ s ].build == rfbScanAvx2
+      && rfbPickScanBuild( TRUE ) != rfbScanAvx2 )
+    { printf("%-8s not on this CPU\n", builds[ s ].name );
+      continue;
+    }
+
+    seed= 5;
+
+    for( t= 0; t < trials; t++ )
+    { int level= 1 + t % 3;
+      int w= (( 1 + rnd( MAXSIDE )) >> level ) << level;
+      int h= (( 1 + rnd( MAXSIDE )) >> level ) << level;
+
+      if ( !w || !h )
+      { continue;
+      }
+
+      fill( w * h, t );
+      memcpy( ref, in, w * h * sizeof( int ));
+      memcpy( got, in, w * h * sizeof( int ));
+
+      Wavelet( ref, w, h, level );
+      builds[ s ].wavelet( got, w, h, level, zywrleParam[ level - 1 ] );
+      runs++;
+
+      for( i= 0; i < w * h; i++ )
+      { if (( got[ i ] ^ ref[ i ] ) & 0xFFFFFF )
+        { printf("%-8s %dx%d level %d at %d MISMATCH\n"
+                , builds[ s ].name, w, h, level, i );
+          bad++;
+          break;
+    } } }
+
+    printf("%-8s %d blocks, %d mismatches\n", builds[ s ].name, runs, bad );
+    fails += bad;
+  }
+
+  return( fails ? 1 : 0 );
+}